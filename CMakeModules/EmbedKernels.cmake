@@ -0,0 +1,54 @@
+#===============================================================================
+# Embeds OpenCL kernel sources into a C++ translation unit
+#
+# Run in script mode:
+#   cmake -DKERNEL_SOURCES="a.cl.c|b.cl.c" -DOUTPUT=file.cpp -P EmbedKernels.cmake
+#
+# Each source becomes a NUL-terminated char array, registered in the
+# OpenCL::embeddedKernels table under its file name (see Kernel_Sources.hpp).
+#===============================================================================
+
+string(REPLACE "|" ";" KERNEL_SOURCES "${KERNEL_SOURCES}")
+set(EMBED_BODY "")
+set(EMBED_TABLE "")
+set(EMBED_INDEX 0)
+
+foreach(KERNEL_FILE ${KERNEL_SOURCES})
+    get_filename_component(KERNEL_NAME ${KERNEL_FILE} NAME)
+    file(READ ${KERNEL_FILE} KERNEL_HEX HEX)
+    string(LENGTH "${KERNEL_HEX}" KERNEL_HEX_LENGTH)
+    math(EXPR KERNEL_LENGTH "${KERNEL_HEX_LENGTH} / 2")
+
+    # Sixteen bytes per line keeps the generated file readable
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," KERNEL_BYTES
+           "${KERNEL_HEX}")
+    # CMake regular expressions have no {n} repetition
+    set(EMBED_LINE "")
+    foreach(i RANGE 15)
+        set(EMBED_LINE "${EMBED_LINE}0x..,")
+    endforeach()
+    string(REGEX REPLACE "(${EMBED_LINE})" "\\1\n\t" KERNEL_BYTES
+           "${KERNEL_BYTES}")
+
+    set(EMBED_BODY "${EMBED_BODY}\n// ${KERNEL_NAME}\n")
+    set(EMBED_BODY
+        "${EMBED_BODY}static const unsigned char kernel${EMBED_INDEX}[] = {\n\t${KERNEL_BYTES}0x00\n};\n")
+    set(EMBED_TABLE
+        "${EMBED_TABLE}\t{ \"${KERNEL_NAME}\", (const char *)kernel${EMBED_INDEX}, ${KERNEL_LENGTH} },\n")
+    math(EXPR EMBED_INDEX "${EMBED_INDEX} + 1")
+endforeach()
+
+set(EMBED_SOURCE "// Generated by EmbedKernels.cmake. Do not edit.\n")
+set(EMBED_SOURCE "${EMBED_SOURCE}#include \"Kernel_Sources.hpp\"\n")
+set(EMBED_SOURCE "${EMBED_SOURCE}${EMBED_BODY}\n")
+set(EMBED_SOURCE
+    "${EMBED_SOURCE}const OpenCL::EmbeddedKernel OpenCL::embeddedKernels[] = {\n")
+set(EMBED_SOURCE "${EMBED_SOURCE}${EMBED_TABLE}\t{ 0, 0, 0 }\n};\n")
+
+# Only touch the output if it changed, to avoid needless rebuilds
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} EMBED_OLD)
+endif()
+if(NOT "${EMBED_OLD}" STREQUAL "${EMBED_SOURCE}")
+    file(WRITE ${OUTPUT} "${EMBED_SOURCE}")
+endif()
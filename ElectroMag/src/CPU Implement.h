@@ -22,6 +22,8 @@
 #include"SOA_utils.hpp"
 #include "Electrostatics.h"
 
+template<class T> class StaticFieldGrid;
+
 template<class T>
 int CalcField_CPU(
     Vector3<Array<T> >& fieldLines,
@@ -29,5 +31,33 @@ int CalcField_CPU(
     const size_t n, T resolution, perfPacket& perfData,
     bool useCurvature = false);
 
+/**
+ * \brief Computes field lines [start, start + count) on the calling thread
+ *
+ * Unlike CalcField_CPU, no threads are created and no performance information
+ * is recorded. This is the building block for threaded back ends, which hand
+ * out line ranges to their own workers. SIMD kernels are used wherever the
+ * range is suitably aligned, and scalar kernels everywhere else.
+ */
+template<class T>
+int CalcField_CPU_Range(
+    Vector3<Array<T> >& fieldLines,
+    Array<electro::pointCharge<T> >& pointCharges,
+    const size_t n, const size_t start, const size_t count,
+    T resolution, bool useCurvature = false);
+
+/**
+ * \brief Computes field lines [start, start + count) on the calling thread,
+ * \brief with the field interpolated from 'grid'
+ *
+ * Lines are stepped as in CalcField_CPU_Range, but each step costs the same
+ * however many charges the grid was built from.
+ */
+template<class T>
+int CalcField_CPU_Grid_Range(
+    Vector3<Array<T> >& fieldLines, const StaticFieldGrid<T>& grid,
+    const size_t n, const size_t start, const size_t count,
+    T resolution, bool useCurvature = false);
+
 #endif//_CPU_IMPLEMENT_H
 
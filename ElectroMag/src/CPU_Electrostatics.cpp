@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "CPU_Electrostatics.hpp"
+#include "CPU Implement.h"
+#include <X-Compat/HPC Timing.h>
+#include <iostream>
+#include <sstream>
+
+/*
+ * Lines handed to a pool thread at a time. Must be a multiple of the widest
+ * SIMD block in CalcField_CPU_Range so that every chunk starts aligned.
+ */
+#define CPU_LINES_PER_TASK 16
+/// Alignment of the first line assigned to each functor
+#define CPU_LINE_ALIGN 64
+
+using std::cerr;
+using std::endl;
+
+/**=============================================================================
+ * \brief Electrostatics functor constructor
+ *
+ * Initializes critical variables. The thread pool is not touched until
+ * resources are allocated
+ * ===========================================================================*/
+template <class T>
+CPUElectrosFunctor<T>::CPUElectrosFunctor()
+	: m_lastOpErrCode(0), m_pool(NULL), m_grid(NULL)
+{
+	this->m_nDevices = 0;
+	this->m_dataBound = false;
+	this->m_resourcesAllocated = false;
+}
+
+template <class T> CPUElectrosFunctor<T>::~CPUElectrosFunctor()
+{
+	ReleaseResources();
+}
+
+/**=============================================================================
+ * \brief Object-global error accessor
+ *
+ * @return True if the previous global operation returned an error
+ * @see CLElectrosFunctor::Fail()
+ * ===========================================================================*/
+template <class T> bool CPUElectrosFunctor<T>::Fail()
+{
+	return (m_lastOpErrCode != 0);
+}
+
+/**=============================================================================
+ * \brief Functor-specific error accessor
+ *
+ * @param functorIndex Index of the functor where an error is suspected
+ * @return True if the previous operation on functorIndex returned an error,
+ * or if functorIndex is out of bounds
+ * ===========================================================================*/
+template <class T>
+bool CPUElectrosFunctor<T>::FailOnFunctor(size_t functorIndex)
+{
+	if (functorIndex >= m_functors.size())
+		return true;
+	return (m_functors[functorIndex].lastOpErrCode != 0);
+}
+
+/**=============================================================================
+ * \brief Distributes the lines among functors
+ *
+ * The host is a single device; intra-device parallelism is handled by the
+ * thread pool. Each functor starts on a multiple of CPU_LINE_ALIGN lines, so
+ * that the SIMD kernels see aligned rows.
+ * ===========================================================================*/
+template <class T> void CPUElectrosFunctor<T>::PartitionData()
+{
+	m_functors.clear();
+	this->m_nDevices = 1;
+
+	const size_t steps = this->m_pFieldLinesData->GetSize() / this->m_nLines;
+	size_t remainingLines = this->m_nLines;
+	const size_t perDevice = (this->m_nLines + this->m_nDevices - 1) /
+				 this->m_nDevices;
+	for (size_t i = 0; i < this->m_nDevices; i++) {
+		FunctorData dataParams = FunctorData();
+		size_t devWidth = ((perDevice + CPU_LINE_ALIGN - 1) /
+				   CPU_LINE_ALIGN) * CPU_LINE_ALIGN;
+		if (devWidth > remainingLines)
+			devWidth = remainingLines;
+
+		dataParams.startIndex = this->m_nLines - remainingLines;
+		dataParams.elements = devWidth;
+		dataParams.steps = steps;
+		dataParams.lastOpErrCode = 0;
+		dataParams.kernelTime = 0;
+		remainingLines -= devWidth;
+		m_functors.push_back(dataParams);
+	}
+}
+
+template <class T>
+void CPUElectrosFunctor<T>::GenerateParameterList(size_t *nDevices)
+{
+	*nDevices = m_functors.size();
+}
+
+/**=============================================================================
+ * \brief Binds the data pointed by dataParams to the object, then distributes
+ * \brief the workload among functors
+ * ===========================================================================*/
+template <class T>
+void CPUElectrosFunctor<T>::BindData(
+	/// [in] Pointer to a structure of type BindDataParams
+	void *aDataParameters)
+{
+	typename ElectrostaticFunctor<T>::BindDataParams *params =
+		(typename ElectrostaticFunctor<T>::BindDataParams *)
+			aDataParameters;
+	if (params->nLines == 0 || params->resolution == 0 ||
+	    params->pFieldLineData == 0 || params->pPointChargeData == 0 ||
+	    params->pFieldLineData->GetSize() < 2 * params->nLines) {
+		cerr << "CPUElectrosFunctor: invalid data parameters" << endl;
+		m_lastOpErrCode = 1;
+		return;
+	}
+
+	this->m_pFieldLinesData = params->pFieldLineData;
+	this->m_pPointChargeData = params->pPointChargeData;
+	this->m_nLines = params->nLines;
+	this->m_resolution = params->resolution;
+	this->m_useCurvature = params->useCurvature;
+	this->m_pPerfData = &params->perfData;
+
+	PartitionData();
+
+	m_lastOpErrCode = 0;
+	this->m_dataBound = true;
+}
+
+/**=============================================================================
+ * \brief Attaches the functor to its thread pool
+ *
+ * The pool is persistent, so this is cheap after the first run. The global
+ * error flag is set if no dataset is bound.
+ * ===========================================================================*/
+template <class T> void CPUElectrosFunctor<T>::AllocateResources()
+{
+	if (!this->m_dataBound) {
+		m_lastOpErrCode = 1;
+		return;
+	}
+
+	PerfTimer timer;
+	timer.start();
+	if (!m_pool)
+		m_pool = &ThreadPool::GetGlobal();
+
+	m_threadSlots.resize(m_pool->GetNumThreads());
+	for (size_t i = 0; i < m_threadSlots.size(); i++)
+		m_threadSlots[i].lastErrCode = 0;
+	for (size_t i = 0; i < m_functors.size(); i++) {
+		m_functors[i].perfData.stepTimes.clear();
+		m_functors[i].kernelTime = 0;
+	}
+	this->m_resourcesAllocated = true;
+	m_lastOpErrCode = 0;
+	this->m_pPerfData->add(TimingInfo("Resource allocation", timer.tick()));
+}
+
+/**=============================================================================
+ * \brief Detaches from the thread pool
+ *
+ * The pool itself is shared and outlives the functor.
+ * ===========================================================================*/
+template <class T> void CPUElectrosFunctor<T>::ReleaseResources()
+{
+	m_threadSlots.clear();
+	this->m_resourcesAllocated = false;
+}
+
+/**=============================================================================
+ * \brief Main functor
+ *
+ * Every device is backed by the same pool, so any functor may run on any
+ * device without penalty.
+ * @return First error code that is encountered
+ * @return 0 if no error is encountered
+ * ===========================================================================*/
+template <class T>
+unsigned long CPUElectrosFunctor<T>::MainFunctor(
+	size_t functorIndex, ///< Functor whose data to process
+	size_t deviceIndex ///< Device on which to process data
+)
+{
+	FunctorData &data = m_functors[functorIndex];
+	return BlockFunctor(deviceIndex, data.startIndex, data.elements);
+}
+
+/**=============================================================================
+ * \brief Block functor
+ *
+ * Hands lines [start, start + count) to the pool, and accounts the time to
+ * 'deviceIndex'.
+ * @return First error code that is encountered
+ * @return 0 if no error is encountered
+ * ===========================================================================*/
+template <class T>
+unsigned long CPUElectrosFunctor<T>::BlockFunctor(
+	size_t deviceIndex, ///< Device on which to process data
+	size_t start, ///< First line of the block
+	size_t count ///< Number of lines in the block
+)
+{
+	FunctorData &data = m_functors[deviceIndex];
+	// Only report the errors of this block
+	for (size_t i = 0; i < m_threadSlots.size(); i++)
+		m_threadSlots[i].lastErrCode = 0;
+
+	PerfTimer timer;
+	timer.start();
+	m_pool->ParallelFor(
+		start, start + count, CPU_LINES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			ThreadSlot &slot = m_threadSlots[thread];
+			int err;
+			if (m_grid && m_grid->IsBuilt())
+				err = CalcField_CPU_Grid_Range(
+					*this->m_pFieldLinesData, *m_grid,
+					this->m_nLines, begin, end - begin,
+					this->m_resolution,
+					this->m_useCurvature);
+			else
+				err = CalcField_CPU_Range(
+					*this->m_pFieldLinesData,
+					*this->m_pPointChargeData,
+					this->m_nLines, begin, end - begin,
+					this->m_resolution,
+					this->m_useCurvature);
+			if (err)
+				slot.lastErrCode = err;
+		});
+	double time = timer.tick();
+
+	data.lastOpErrCode = 0;
+	for (size_t i = 0; i < m_threadSlots.size(); i++) {
+		if (m_threadSlots[i].lastErrCode)
+			data.lastOpErrCode = m_threadSlots[i].lastErrCode;
+	}
+	data.kernelTime += time;
+	data.perfData.add(TimingInfo("Kernel execution time", time));
+	return data.lastOpErrCode;
+}
+
+/**=============================================================================
+ * \brief Dynamic scheduling parameters
+ *
+ * Blocks give every pool thread at least one chunk.
+ * ===========================================================================*/
+template <class T>
+size_t CPUElectrosFunctor<T>::GetWorkGranularity(size_t deviceIndex)
+{
+	return CPU_LINES_PER_TASK * m_pool->GetNumThreads();
+}
+
+template <class T>
+std::string CPUElectrosFunctor<T>::GetDeviceKey(size_t deviceIndex)
+{
+	std::ostringstream key;
+	key << "Host, " << m_pool->GetNumThreads() << " threads, "
+	    << (sizeof(T) == sizeof(float) ? "float" : "double");
+	// Rates through the grid do not scale with the charges
+	if (m_grid && m_grid->IsBuilt())
+		key << ", field grid";
+	return key.str();
+}
+
+/// Each step interpolates the field once, then takes the 13 FLOP of the step
+template <class T> double CPUElectrosFunctor<T>::GetUnitFLOP()
+{
+	if (!m_grid || !m_grid->IsBuilt())
+		return ElectrostaticFunctor<T>::GetUnitFLOP();
+	return (double)(this->GetSteps() - 1) * (m_grid->GetFieldFLOP() + 13);
+}
+
+/**=============================================================================
+ * \brief Reorganizes relevant data after all functors complete
+ *
+ * Computes the overall performance using the time of the longest-executing
+ * functor as the base time.
+ * ===========================================================================*/
+template <class T> void CPUElectrosFunctor<T>::PostRun()
+{
+	double time = 0;
+	for (size_t i = 0; i < m_functors.size(); i++) {
+		perfPacket &devTiming = m_functors[i].perfData;
+		for (size_t j = 0; j < devTiming.stepTimes.size(); j++)
+			this->m_pPerfData->add(devTiming.stepTimes[j]);
+		if (m_functors[i].kernelTime > time)
+			time = m_functors[i].kernelTime;
+	}
+
+	if (time > 0)
+		this->SetPerformance(time);
+}
+
+template class CPUElectrosFunctor<float>;
+template class CPUElectrosFunctor<double>;
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CPU_ELECTROSTATICS_HPP
+#define _CPU_ELECTROSTATICS_HPP
+
+#include "./../../GPGPU_Segment/src/ElectrostaticFunctor.hpp"
+#include "Thread_Pool.hpp"
+#include "Static_Field_Grid.hpp"
+#include <vector>
+
+/**=============================================================================
+ * \ingroup DEVICE_FUNCTORS
+ * @{
+ * ===========================================================================*/
+/**
+ * \brief Electrostatics functor running on the host processors
+ *
+ * The host is presented to AbstractFunctor as a single compute device, backed
+ * by a persistent ThreadPool. Each functor hands its lines to the pool in
+ * small, SIMD-aligned chunks, which the pinned workers pull until the range is
+ * exhausted.
+ */
+template <class T> class CPUElectrosFunctor : public ElectrostaticFunctor<T> {
+public:
+	CPUElectrosFunctor();
+	~CPUElectrosFunctor();
+
+	/*-----------------------AbstractFunctor overriders---------------------
+	 * The sequential order is that of AbstractFunctor:
+	 * BindData()
+	 * AllocateResources()
+	 * Run() - this calls the main functor
+	 */
+	void BindData(void *dataParameters);
+	void AllocateResources();
+	void ReleaseResources();
+	unsigned long MainFunctor(size_t functorIndex, size_t deviceIndex);
+	void PostRun();
+	bool Fail();
+	bool FailOnFunctor(size_t functorIndex);
+
+	void GenerateParameterList(size_t *nDevices);
+
+	/*---------------------Dynamic scheduling overriders--------------------
+	 * The host can compute any block of lines. Blocks are sized to give
+	 * every pool thread at least one chunk.
+	 */
+	size_t GetWorkGranularity(size_t deviceIndex);
+	std::string GetDeviceKey(size_t deviceIndex);
+	unsigned long BlockFunctor(size_t deviceIndex, size_t start,
+				   size_t count);
+
+	/// Runs on 'pool' instead of the process-wide ThreadPool
+	void SetThreadPool(ThreadPool *pool)
+	{
+		m_pool = pool;
+	}
+	/**
+	 * \brief Interpolates the field from 'grid' instead of summing it
+	 *
+	 * The grid should be built from the bound point charges, and must
+	 * outlive the run. NULL, the default, sums over the charges.
+	 */
+	void SetFieldGrid(const StaticFieldGrid<T> *grid)
+	{
+		m_grid = grid;
+	}
+	/// Counts the FLOP of the grid when there is one
+	double GetUnitFLOP();
+
+private:
+	/// Error code of the last global operation; 0 signals success
+	int m_lastOpErrCode;
+	/// Pool that executes the field line kernels
+	ThreadPool *m_pool;
+	/// Precomputed field of the point charges, if any
+	const StaticFieldGrid<T> *m_grid;
+
+	/// Partitions the data among functors
+	void PartitionData();
+
+	/// Data specific to each functor
+	class FunctorData {
+	public:
+		/// The starting index of pFieldLinesData that has been assigned
+		/// to this functor
+		size_t startIndex;
+		/// The number of field lines from 'startIndex' that has been
+		/// assigned to this functor
+		size_t elements;
+		/// Number of steps
+		size_t steps;
+		/// Error code of the last operation on this functor
+		int lastOpErrCode;
+		/// Time spent in the kernels by this functor
+		double kernelTime;
+		/// Functor-specific performance information
+		perfPacket perfData;
+	};
+	std::vector<FunctorData> m_functors;
+
+	/**
+	 * \brief Per-thread bookkeeping
+	 *
+	 * Every entry is only ever written by the pool thread that owns it, so
+	 * no atomics are needed. Entries are padded to a cache line to keep the
+	 * workers from invalidating each other's lines.
+	 */
+	struct ThreadSlot {
+		int lastErrCode;
+		char padding[64 - sizeof(int)];
+	};
+	std::vector<ThreadSlot> m_threadSlots;
+};
+///@}
+
+#endif //_CPU_ELECTROSTATICS_HPP
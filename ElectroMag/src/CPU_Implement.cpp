@@ -20,6 +20,7 @@
 // This needs to be visible before any vector templates
 #include "SSE math.h"
 #include "CPU Implement.h"
+#include "Static_Field_Grid.hpp"
 #include "X-Compat/HPC Timing.h"
 #if !defined(__CYGWIN__) // Don't expect performance if using Cygwin
 #include <omp.h>
@@ -35,6 +36,97 @@
 
 using namespace electro;
 
+/**
+ * \brief Computes all steps of a single field line, without curvature
+ * \brief correction
+ */
+template<class T>
+inline void CalcLine_CPU ( Vector3<Array<T> >& fieldLines,
+                           const pointCharge<T> *charges,
+                           const size_t n, const size_t p,
+                           const size_t totalSteps, const size_t line,
+                           const T resolution )
+{
+    // Intentionally starts from 1, since step 0 is reserved for the
+    // starting points
+    for ( size_t step = 1; step < totalSteps; step++ )
+    {
+
+        // Set temporary cummulative field vector to zero
+        Vector3<T> temp = {0,0,0},
+                          prevPoint = fieldLines[n* ( step - 1 ) + line];
+        for ( size_t point = 0; point < p; point++ )
+        {
+            // Add partial vectors to the field vector
+            temp += CoreFunctor ( charges[point], prevPoint );
+            // (electroPartFieldFLOP + 3) FLOPs
+        }
+        // Get the unit vector of the field vector, divide it by the
+        // resolution, and add it to the previous point
+        Vector3<T> result = ( prevPoint
+                + vec3SetInvLen ( temp, resolution ) );
+        // Total: 13 FLOP (Add = 3 FLOP, setLen = 10 FLOP)
+        fieldLines.write(result , step*n + line);
+    }
+}
+
+/**
+ * \brief Computes all steps of a single field line, with step length
+ * \brief adjusted by the curvature of the line
+ */
+template<class T>
+inline void CalcLine_CPU_Curvature ( const Vector3<T*> pLines,
+                                     const pointCharge<T> *charges,
+                                     const size_t n, const size_t p,
+                                     const size_t totalSteps,
+                                     const size_t line, const T resolution )
+{
+    // The field of the previous step; the first step uses the seed, as
+    // prevAccum does in the SSE kernels
+    Vector3<T> prevVec = {
+        pLines.x[line], pLines.y[line], pLines.z[line]
+    };
+    // Intentionally starts from 1, since step 0 is reserved for the
+    // starting points
+    for ( size_t step = 1; step < totalSteps; step++ )
+    {
+
+        // Set temporary cummulative field vector to zero
+        Vector3<T> temp = {0,0,0}, prevPoint = {
+            pLines.x[n* ( step - 1 ) + line],
+            pLines.y[n* ( step - 1 ) + line],
+            pLines.z[n* ( step - 1 ) + line]
+        };
+        //#pragma unroll(4)
+        //#pragma omp parallel for
+        for ( size_t point = 0; point < p; point++ )
+        {
+            // Add partial vectors to the field vector
+            temp += CoreFunctor ( charges[point], prevPoint );
+            // (electroPartFieldFLOP + 3) FLOPs
+        }
+        // Calculate curvature
+        T k = vec3LenSq ( temp );//5 FLOPs
+        k = vec3Len ( vec3Cross ( temp - prevVec, prevVec ) )
+                / ( k*sqrt ( k ) );
+        // 25FLOPs
+        // (3 vec sub + 9 vec cross + 10 setLen + 1 div + 1 mul + 1 sqrt)
+
+        // Finally, add the unit vector of the field divided by the
+        // resolution to the previous point to get the next point
+        // We increment the curvature by one to prevent a zero curvature
+        // from generating #NaN or #Inf, though any positive constant
+        // should work
+        Vector3<T> result = ( prevPoint + vec3SetInvLen ( temp, ( k+1 )
+                *resolution ) );
+        // Total: 15 FLOP (Add = 3 FLOP, setLen = 10 FLOP, add-mul = 2FLOP)
+        pLines.x[step*n + line] = result.x;
+        pLines.y[step*n + line] = result.y;
+        pLines.z[step*n + line] = result.z;
+        prevVec = temp;
+    }
+}
+
 template<class T>
 int CalcField_CPU_T ( Vector3<Array<T> >& fieldLines,
                       Array<pointCharge<T> >& pointCharges,
@@ -70,27 +162,8 @@ int CalcField_CPU_T ( Vector3<Array<T> >& fieldLines,
 #pragma omp parallel for
     for ( size_t line = 0; line < n; line++ )
     {
-        // Intentionally starts from 1, since step 0 is reserved for the
-        // starting points
-        for ( size_t step = 1; step < totalSteps; step++ )
-        {
-
-            // Set temporary cummulative field vector to zero
-            Vector3<T> temp = {0,0,0},
-                              prevPoint = fieldLines[n* ( step - 1 ) + line];
-            for ( size_t point = 0; point < p; point++ )
-            {
-                // Add partial vectors to the field vector
-                temp += CoreFunctor ( charges[point], prevPoint );
-                // (electroPartFieldFLOP + 3) FLOPs
-            }
-            // Get the unit vector of the field vector, divide it by the
-            // resolution, and add it to the previous point
-            Vector3<T> result = ( prevPoint
-                    + vec3SetInvLen ( temp, resolution ) );
-            // Total: 13 FLOP (Add = 3 FLOP, setLen = 10 FLOP)
-            fieldLines.write(result , step*n + line);
-        }
+        CalcLine_CPU ( fieldLines, charges, n, p, totalSteps, line,
+                       resolution );
     }
     // take ending measurement
     QueryHPCTimer ( &end );
@@ -139,44 +212,8 @@ int CalcField_CPU_T_Curvature (Vector3<Array<T> >& fieldLines,
 #pragma omp parallel for
     for ( size_t line = 0; line < n; line++ )
     {
-        // Intentionally starts from 1, since step 0 is reserved for the
-        // starting points
-        for ( size_t step = 1; step < totalSteps; step++ )
-        {
-
-            // Set temporary cummulative field vector to zero
-            Vector3<T> temp = {0,0,0}, prevVec, prevPoint;
-            prevVec = prevPoint = {
-                pLines.x[n* ( step - 1 ) + line],
-                pLines.y[n* ( step - 1 ) + line],
-                pLines.z[n* ( step - 1 ) + line]
-            };// Load prevVec like this to ensure similarity with GPU kernel
-            //#pragma unroll(4)
-            //#pragma omp parallel for
-            for ( size_t point = 0; point < p; point++ )
-            {
-                // Add partial vectors to the field vector
-                temp += CoreFunctor ( charges[point], prevPoint );
-                // (electroPartFieldFLOP + 3) FLOPs
-            }
-            // Calculate curvature
-            T k = vec3LenSq ( temp );//5 FLOPs
-            k = vec3Len ( vec3Cross ( temp - prevVec, prevVec ) )
-                    / ( k*sqrt ( k ) );
-            // 25FLOPs
-            // (3 vec sub + 9 vec cross + 10 setLen + 1 div + 1 mul + 1 sqrt)
-
-            // Finally, add the unit vector of the field divided by the
-            // resolution to the previous point to get the next point
-            // We increment the curvature by one to prevent a zero curvature
-            // from generating #NaN or #Inf, though any positive constant
-            // should work
-            Vector3<T> result = ( prevPoint + vec3SetInvLen ( temp, ( k+1 )
-                    *resolution ) );
-            // Total: 15 FLOP (Add = 3 FLOP, setLen = 10 FLOP, add-mul = 2FLOP)
-            fieldLines.write(result, step*n + line);
-            prevVec = temp;
-        }
+        CalcLine_CPU_Curvature ( pLines, charges, n, p, totalSteps, line,
+                                 resolution );
         // update progress
 #pragma omp atomic
         perfData.progress += perStep;
@@ -190,6 +227,38 @@ int CalcField_CPU_T_Curvature (Vector3<Array<T> >& fieldLines,
     return 0;
 }
 
+template<class T>
+int CalcField_CPU_Range ( Vector3<Array<T> >& fieldLines,
+                          Array<pointCharge<T> >& pointCharges,
+                          const size_t n, const size_t start,
+                          const size_t count, T resolution,
+                          bool useCurvature )
+{
+    if ( !n )
+        return 1;
+    if ( resolution == 0 )
+        return 2;
+    size_t p = pointCharges.GetSize();
+    size_t totalSteps = ( fieldLines.GetSize() ) /n;
+    if ( totalSteps < 2 )
+        return 3;
+    if ( start + count > n )
+        return 4;
+
+    Vector3<T*> pLines = fieldLines.GetDataPointers();
+    pointCharge<T> *charges = pointCharges.GetDataPointer();
+    for ( size_t line = start; line < start + count; line++ )
+    {
+        if ( useCurvature )
+            CalcLine_CPU_Curvature ( pLines, charges, n, p, totalSteps, line,
+                                     resolution );
+        else
+            CalcLine_CPU ( fieldLines, charges, n, p, totalSteps, line,
+                           resolution );
+    }
+    return 0;
+}
+
 #if (defined(__GNUC__) && defined(__SSE__)) \
         || defined (_MSC_VER) \
         || defined(__INTEL_COMPILER)
@@ -204,6 +273,118 @@ int CalcField_CPU_T_Curvature (Vector3<Array<T> >& fieldLines,
 #define LINES_WIDTH (LINES_PARRALELISM * SIMD_WIDTH)
 #define ALIGNMENT_MASK (LINES_WIDTH * sizeof(float) - 1)
 
+/**
+ * \brief Computes all steps of LINES_WIDTH consecutive field lines starting
+ * \brief at 'line', with curvature correction
+ *
+ * 'line' and 'n' must be multiples of SIMD_WIDTH, so that every row of the
+ * block is aligned for SSE loads and stores.
+ */
+inline void CalcLineBlock_CPU_Curvature ( const Vector3<float*> pLines,
+                                          const pointCharge<float> *pCharges,
+                                          const size_t n, const size_t p,
+                                          const size_t totalSteps,
+                                          const size_t line,
+                                          const float resolution )
+{
+    Vector3<__m128> prevPoint[LINES_PARRALELISM];
+    Vector3<__m128> Accum[LINES_PARRALELISM], prevAccum[LINES_PARRALELISM];
+
+    // We can now load the starting points; we only need to so this once
+    for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+    {
+        // Load data directly from memory
+        // No shuffling necessary for SOA data
+        const size_t base = line + ( i*SIMD_WIDTH );
+        prevAccum[i].x = prevPoint[i].x =_mm_load_ps (&pLines.x[base]);
+        prevAccum[i].y = prevPoint[i].y =_mm_load_ps (&pLines.y[base]);
+        prevAccum[i].z = prevPoint[i].z =_mm_load_ps (&pLines.z[base]);
+    }
+
+
+    const __m128 zero = _mm_set1_ps ( ( float ) 0 );
+    const __m128 elec_k = _mm_set1_ps ( ( float ) electro_k );
+    // curvature adjusting constant
+    const __m128 curvAdjust =_mm_set1_ps ( ( float ) 1 );
+    const __m128 res = _mm_set1_ps ( resolution );
+    const size_t nLines = n;
+
+    // Intentionally starts from 1
+    // step 0 is reserved for the starting points
+    for ( size_t step = 1; step < totalSteps; step++ )
+    {
+        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+            Accum[i].x = Accum[i].y = Accum[i].z = zero;
+
+        for ( size_t point = 0; point < p; point++ )
+        {
+            // Add partial vectors to the field vector
+
+            /*
+             * We only need to read one point charge at a time
+             * It must be the same for all lines we are computing, and thus
+             * we need to have the same value in all four doublewords of a
+             * SSE register
+             */
+            pointCharge<__m128> charge;
+            charge.magnitude = _mm_load_ps ( ( float* ) &pCharges[point] );
+
+            charge.position.x = _mm_shuffle_ps (
+                charge.magnitude, charge.magnitude,
+                _MM_SHUFFLE ( 0,0,0,0 ) );
+            charge.position.y = _mm_shuffle_ps (
+                charge.magnitude, charge.magnitude,
+                _MM_SHUFFLE ( 1,1,1,1 ) );
+            charge.position.z = _mm_shuffle_ps (
+                charge.magnitude, charge.magnitude,
+                _MM_SHUFFLE ( 2,2,2,2 ) );
+            charge.magnitude = _mm_shuffle_ps (
+                charge.magnitude, charge.magnitude,
+                _MM_SHUFFLE ( 3,3,3,3 ) );
+
+            /*
+             * Field computation
+             */
+            Accum[0] += electro::PartField ( charge, prevPoint[0], elec_k );
+
+#               if (LINES_PARRALELISM > 1)
+            Accum[1] += electro::PartField ( charge, prevPoint[1], elec_k );
+#               endif
+#               if (LINES_PARRALELISM == 3)
+#               error LINES_PARRALELISM Should not be set to 3, as the \
+                alignment mask may fail to function properly
+#               endif
+#               if (LINES_PARRALELISM > 3)
+            Accum[2] += electro::PartField ( charge, prevPoint[2], elec_k );
+            Accum[3] += electro::PartField ( charge, prevPoint[3], elec_k );
+#               endif
+#               if (LINES_PARRALELISM > 4)
+#               error Too many lines per iteration
+#               endif
+
+        }
+
+        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+        {
+            /*
+             * Curvature correction
+             */
+            __m128 k = vec3LenSq ( Accum[i] );
+            k = vec3Len ( vec3Cross ( Accum[i] - prevAccum[i],
+                                      prevAccum[i] ) ) / ( k*sqrt ( k ) );
+            prevAccum[i] = Accum[i];
+            prevPoint[i] += vec3SetInvLen ( Accum[i],
+                                            ( k+curvAdjust ) *res );
+
+            // No shuffling needed to store data back
+            size_t base = ( nLines * step + ( i*SIMD_WIDTH ) + line );
+            _mm_stream_ps(&pLines.x[base], prevPoint[i].x);
+            _mm_stream_ps(&pLines.y[base], prevPoint[i].y);
+            _mm_stream_ps(&pLines.z[base], prevPoint[i].z);
+        }
+    }
+}
+
 template<>
 int CalcField_CPU_T_Curvature<float> (
     Vector3<Array<float> >& fieldLines,
@@ -242,101 +423,8 @@ int CalcField_CPU_T_Curvature<float> (
         const Vector3<float*> pLines = fieldLines.GetDataPointers();
         const pointCharge<float> *pCharges = pointCharges.GetDataPointer();
 
-        Vector3<__m128> prevPoint[LINES_PARRALELISM];
-        Vector3<__m128> Accum[LINES_PARRALELISM], prevAccum[LINES_PARRALELISM];
-
-        // We can now load the starting points; we only need to so this once
-        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-        {
-            // Load data directly from memory
-            // No shuffling necessary for SOA data
-            const size_t base = line + ( i*SIMD_WIDTH );
-            prevAccum[i].x = prevPoint[i].x =_mm_load_ps (&pLines.x[base]);
-            prevAccum[i].y = prevPoint[i].y =_mm_load_ps (&pLines.y[base]);
-            prevAccum[i].z = prevPoint[i].z =_mm_load_ps (&pLines.z[base]);
-        }
-
-
-        const __m128 zero = _mm_set1_ps ( ( float ) 0 );
-        const __m128 elec_k = _mm_set1_ps ( ( float ) electro_k );
-        // curvature adjusting constant
-        const __m128 curvAdjust =_mm_set1_ps ( ( float ) 1 );
-        const __m128 res = _mm_set1_ps ( resolution );
-        const size_t nLines = n;
-
-        // Intentionally starts from 1
-        // step 0 is reserved for the starting points
-        for ( size_t step = 1; step < totalSteps; step++ )
-        {
-            for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-                Accum[i].x = Accum[i].y = Accum[i].z = zero;
-
-            for ( size_t point = 0; point < p; point++ )
-            {
-                // Add partial vectors to the field vector
-
-                /*
-                 * We only need to read one point charge at a time
-                 * It must be the same for all lines we are computing, and thus
-                 * we need to have the same value in all four doublewords of a
-                 * SSE register
-                 */
-                pointCharge<__m128> charge;
-                charge.magnitude = _mm_load_ps ( ( float* ) &pCharges[point] );
-
-                charge.position.x = _mm_shuffle_ps (
-                    charge.magnitude, charge.magnitude,
-                    _MM_SHUFFLE ( 0,0,0,0 ) );
-                charge.position.y = _mm_shuffle_ps (
-                    charge.magnitude, charge.magnitude,
-                    _MM_SHUFFLE ( 1,1,1,1 ) );
-                charge.position.z = _mm_shuffle_ps (
-                    charge.magnitude, charge.magnitude,
-                    _MM_SHUFFLE ( 2,2,2,2 ) );
-                charge.magnitude = _mm_shuffle_ps (
-                    charge.magnitude, charge.magnitude,
-                    _MM_SHUFFLE ( 3,3,3,3 ) );
-
-                /*
-                 * Field computation
-                 */
-                Accum[0] += electro::PartField ( charge, prevPoint[0], elec_k );
-
-#               if (LINES_PARRALELISM > 1)
-                Accum[1] += electro::PartField ( charge, prevPoint[1], elec_k );
-#               endif
-#               if (LINES_PARRALELISM == 3)
-#               error LINES_PARRALELISM Should not be set to 3, as the \
-                    alignment mask may fail to function properly
-#               endif
-#               if (LINES_PARRALELISM > 3)
-                Accum[2] += electro::PartField ( charge, prevPoint[2], elec_k );
-                Accum[3] += electro::PartField ( charge, prevPoint[3], elec_k );
-#               endif
-#               if (LINES_PARRALELISM > 4)
-#               error Too many lines per iteration
-#               endif
-
-            }
-
-            for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-            {
-                /*
-                 * Curvature correction
-                 */
-                __m128 k = vec3LenSq ( Accum[i] );
-                k = vec3Len ( vec3Cross ( Accum[i] - prevAccum[i],
-                                          prevAccum[i] ) ) / ( k*sqrt ( k ) );
-                prevPoint[i] += vec3SetInvLen ( Accum[i],
-                                                ( k+curvAdjust ) *res );
-
-                // No shuffling needed to store data back
-                size_t base = ( nLines * step + ( i*SIMD_WIDTH ) + line );
-                _mm_stream_ps(&pLines.x[base], prevPoint[i].x);
-                _mm_stream_ps(&pLines.y[base], prevPoint[i].y);
-                _mm_stream_ps(&pLines.z[base], prevPoint[i].z);
-            }
-        }
+        CalcLineBlock_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                      resolution );
         // update progress
 #pragma omp atomic
         perfData.progress += perStep;
@@ -350,6 +438,56 @@ int CalcField_CPU_T_Curvature<float> (
     return 0;
 }
 
+template<>
+int CalcField_CPU_Range<float> ( Vector3<Array<float> >& fieldLines,
+                                 Array<pointCharge<float> >& pointCharges,
+                                 const size_t n, const size_t start,
+                                 const size_t count, float resolution,
+                                 bool useCurvature )
+{
+    if ( !n )
+        return 1;
+    if ( resolution == 0 )
+        return 2;
+    size_t p = pointCharges.GetSize();
+    size_t totalSteps = ( fieldLines.GetSize() ) /n;
+    if ( totalSteps < 2 )
+        return 3;
+    if ( start + count > n )
+        return 4;
+
+    const Vector3<float*> pLines = fieldLines.GetDataPointers();
+    const pointCharge<float> *pCharges = pointCharges.GetDataPointer();
+    const size_t end = start + count;
+    size_t line = start;
+
+    // The SIMD kernel only exists with curvature correction, and needs every
+    // row of the block to be aligned. Everything it cannot take goes through
+    // the scalar kernel
+    if ( useCurvature && !( n % SIMD_WIDTH ) )
+    {
+        for ( ; ( line < end ) && ( line % LINES_WIDTH ); line++ )
+            CalcLine_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                     resolution );
+        for ( ; line + LINES_WIDTH <= end; line += LINES_WIDTH )
+            CalcLineBlock_CPU_Curvature ( pLines, pCharges, n, p, totalSteps,
+                                          line, resolution );
+        // Streaming stores are weakly ordered; make them visible before
+        // another thread reads the results
+        _mm_sfence();
+    }
+    for ( ; line < end; line++ )
+    {
+        if ( useCurvature )
+            CalcLine_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                     resolution );
+        else
+            CalcLine_CPU ( fieldLines, pCharges, n, p, totalSteps, line,
+                           resolution );
+    }
+    return 0;
+}
+
 #include <emmintrin.h>
 
 #undef  LINES_PARRALELISM
@@ -363,6 +501,102 @@ int CalcField_CPU_T_Curvature<float> (
 #undef ALIGNMENT_MASK
 #define ALIGNMENT_MASK (LINES_WIDTH * sizeof(double) - 1)
 
+/**
+ * \brief Double precision counterpart of the float block kernel
+ */
+inline void CalcLineBlock_CPU_Curvature ( const Vector3<double*> pLines,
+                                          const pointCharge<double> *pCharges,
+                                          const size_t n, const size_t p,
+                                          const size_t totalSteps,
+                                          const size_t line,
+                                          const double resolution )
+{
+    Vector3<__m128d> prevPoint[LINES_PARRALELISM];
+    Vector3<__m128d> Accum[LINES_PARRALELISM], prevAccum[LINES_PARRALELISM];
+
+    // We can now load the starting points
+    for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+    {
+        // Load data directly from memory. No shuffling necessary
+        const size_t base = line + ( i*SIMD_WIDTH );
+        prevAccum[i].x = prevPoint[i].x =_mm_load_pd (&pLines.x[base]);
+        prevAccum[i].y = prevPoint[i].y =_mm_load_pd (&pLines.y[base]);
+        prevAccum[i].z = prevPoint[i].z =_mm_load_pd (&pLines.z[base]);
+    }
+
+
+    const __m128d zero = _mm_set1_pd ( 0.0 );
+    const __m128d elec_k = _mm_set1_pd ( electro_k );
+    // curvature adjusting constant
+    const __m128d curvAdjust =_mm_set1_pd ( 1 );
+    const __m128d res = _mm_set1_pd ( resolution );
+    const size_t nLines = n;
+
+    // Intentionally starts from 1, since step 0 is reserved for the
+    // starting points
+    for ( size_t step = 1; step < totalSteps; step++ )
+    {
+        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+            Accum[i].x = Accum[i].y = Accum[i].z = zero;
+
+        for ( size_t point = 0; point < p; point++ )
+        {
+            // Add partial vectors to the field vector
+            pointCharge<__m128d> charge;
+            __m128d reader = _mm_load_pd ( ( double* ) &pCharges[point] );
+            charge.position.x = _mm_shuffle_pd ( reader, reader,
+                                                 _MM_SHUFFLE2 ( 0,0 ) );
+            charge.position.y = _mm_shuffle_pd ( reader, reader,
+                                                 _MM_SHUFFLE2 ( 1,1 ) );
+            reader = _mm_load_pd ( (( double* ) &pCharges[point]) + 2 );
+            charge.position.z = _mm_shuffle_pd ( reader, reader,
+                                                 _MM_SHUFFLE2 ( 0,0 ) );
+            charge.magnitude = _mm_shuffle_pd ( reader, reader,
+                                                _MM_SHUFFLE2 ( 1,1 ) );
+
+            /*
+             * Field computation
+             */
+            Accum[0] += electro::PartField ( charge, prevPoint[0], elec_k );
+
+#               if (LINES_PARRALELISM > 1)
+            Accum[1] += electro::PartField ( charge, prevPoint[1], elec_k );
+#               endif
+#               if (LINES_PARRALELISM == 3)
+#               error LINES_PARRALELISM Should not be set to 3, as the\
+            alignment mask may fail to function properly
+#               endif
+#               if (LINES_PARRALELISM > 3)
+            Accum[2] += electro::PartField ( charge, prevPoint[2], elec_k );
+            Accum[3] += electro::PartField ( charge, prevPoint[3], elec_k );
+#               endif
+#               if (LINES_PARRALELISM > 4)
+#               error Too many lines per iteration
+#               endif
+
+        }
+
+        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
+        {
+            /*
+             * Curvature correction
+             */
+            __m128d k = vec3LenSq ( Accum[i] );
+            k = vec3Len ( vec3Cross ( Accum[i] - prevAccum[i],
+                                      prevAccum[i] ) ) / ( k*sqrt ( k ) );
+            prevAccum[i] = Accum[i];
+            prevPoint[i] += vec3SetInvLen ( Accum[i],
+                                            ( k+curvAdjust ) *res );
+
+            // No shuffling needed to store data back
+            size_t base = ( nLines * step + ( i*SIMD_WIDTH ) + line );
+            _mm_stream_pd(&pLines.x[base], prevPoint[i].x);
+            _mm_stream_pd(&pLines.y[base], prevPoint[i].y);
+            _mm_stream_pd(&pLines.z[base], prevPoint[i].z);
+        }
+    }
+}
+
 template<>
 int CalcField_CPU_T_Curvature<double> (
     Vector3<Array<double> >& fieldLines,
@@ -400,90 +634,8 @@ int CalcField_CPU_T_Curvature<double> (
         const Vector3<double*> pLines = fieldLines.GetDataPointers();
         const pointCharge<double> *pCharges = pointCharges.GetDataPointer();
 
-
-        Vector3<__m128d> prevPoint[LINES_PARRALELISM];
-        Vector3<__m128d> Accum[LINES_PARRALELISM], prevAccum[LINES_PARRALELISM];
-
-        // We can now load the starting points
-        for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-        {
-            // Load data directly from memory. No shuffling necessary
-            const size_t base = line + ( i*SIMD_WIDTH );
-            prevAccum[i].x = prevPoint[i].x =_mm_load_pd (&pLines.x[base]);
-            prevAccum[i].y = prevPoint[i].y =_mm_load_pd (&pLines.y[base]);
-            prevAccum[i].z = prevPoint[i].z =_mm_load_pd (&pLines.z[base]);
-        }
-
-
-        const __m128d zero = _mm_set1_pd ( 0.0 );
-        const __m128d elec_k = _mm_set1_pd ( electro_k );
-        // curvature adjusting constant
-        const __m128d curvAdjust =_mm_set1_pd ( 1 );
-        const __m128d res = _mm_set1_pd ( resolution );
-        const size_t nLines = n;
-
-        // Intentionally starts from 1, since step 0 is reserved for the
-        // starting points
-        for ( size_t step = 1; step < totalSteps; step++ )
-        {
-            for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-                Accum[i].x = Accum[i].y = Accum[i].z = zero;
-
-            for ( size_t point = 0; point < p; point++ )
-            {
-                // Add partial vectors to the field vector
-                pointCharge<__m128d> charge;
-                __m128d reader = _mm_load_pd ( ( double* ) &pCharges[point] );
-                charge.position.x = _mm_shuffle_pd ( reader, reader,
-                                                     _MM_SHUFFLE2 ( 0,0 ) );
-                charge.position.y = _mm_shuffle_pd ( reader, reader,
-                                                     _MM_SHUFFLE2 ( 1,1 ) );
-                reader = _mm_load_pd ( (( double* ) &pCharges[point]) + 2 );
-                charge.position.z = _mm_shuffle_pd ( reader, reader,
-                                                     _MM_SHUFFLE2 ( 0,0 ) );
-                charge.magnitude = _mm_shuffle_pd ( reader, reader,
-                                                    _MM_SHUFFLE2 ( 1,1 ) );
-
-                /*
-                 * Field computation
-                 */
-                Accum[0] += electro::PartField ( charge, prevPoint[0], elec_k );
-
-#               if (LINES_PARRALELISM > 1)
-                Accum[1] += electro::PartField ( charge, prevPoint[1], elec_k );
-#               endif
-#               if (LINES_PARRALELISM == 3)
-#               error LINES_PARRALELISM Should not be set to 3, as the\
-                alignment mask may fail to function properly
-#               endif
-#               if (LINES_PARRALELISM > 3)
-                Accum[2] += electro::PartField ( charge, prevPoint[2], elec_k );
-                Accum[3] += electro::PartField ( charge, prevPoint[3], elec_k );
-#               endif
-#               if (LINES_PARRALELISM > 4)
-#               error Too many lines per iteration
-#               endif
-
-            }
-
-            for ( size_t i = 0; i < LINES_PARRALELISM; i++ )
-            {
-                /*
-                 * Curvature correction
-                 */
-                __m128d k = vec3LenSq ( Accum[i] );
-                k = vec3Len ( vec3Cross ( Accum[i] - prevAccum[i],
-                                          prevAccum[i] ) ) / ( k*sqrt ( k ) );
-                prevPoint[i] += vec3SetInvLen ( Accum[i],
-                                                ( k+curvAdjust ) *res );
-
-                // No shuffling needed to store data back
-                size_t base = ( nLines * step + ( i*SIMD_WIDTH ) + line );
-                _mm_stream_pd(&pLines.x[base], prevPoint[i].x);
-                _mm_stream_pd(&pLines.y[base], prevPoint[i].y);
-                _mm_stream_pd(&pLines.z[base], prevPoint[i].z);
-            }
-        }
+        CalcLineBlock_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                      resolution );
         // update progress
 #pragma omp atomic
         perfData.progress += perStep;
@@ -496,8 +648,134 @@ int CalcField_CPU_T_Curvature<double> (
             * ( p* ( CoreFunctorFLOP + 3 ) + 13 ) ) / perfData.time ) / 1E9;
     return 0;
 }
+template<>
+int CalcField_CPU_Range<double> ( Vector3<Array<double> >& fieldLines,
+                                  Array<pointCharge<double> >& pointCharges,
+                                  const size_t n, const size_t start,
+                                  const size_t count, double resolution,
+                                  bool useCurvature )
+{
+    if ( !n )
+        return 1;
+    if ( resolution == 0 )
+        return 2;
+    size_t p = pointCharges.GetSize();
+    size_t totalSteps = ( fieldLines.GetSize() ) /n;
+    if ( totalSteps < 2 )
+        return 3;
+    if ( start + count > n )
+        return 4;
+
+    const Vector3<double*> pLines = fieldLines.GetDataPointers();
+    const pointCharge<double> *pCharges = pointCharges.GetDataPointer();
+    const size_t end = start + count;
+    size_t line = start;
+
+    // Same partitioning as the single precision version
+    if ( useCurvature && !( n % SIMD_WIDTH ) )
+    {
+        for ( ; ( line < end ) && ( line % LINES_WIDTH ); line++ )
+            CalcLine_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                     resolution );
+        for ( ; line + LINES_WIDTH <= end; line += LINES_WIDTH )
+            CalcLineBlock_CPU_Curvature ( pLines, pCharges, n, p, totalSteps,
+                                          line, resolution );
+        _mm_sfence();
+    }
+    for ( ; line < end; line++ )
+    {
+        if ( useCurvature )
+            CalcLine_CPU_Curvature ( pLines, pCharges, n, p, totalSteps, line,
+                                     resolution );
+        else
+            CalcLine_CPU ( fieldLines, pCharges, n, p, totalSteps, line,
+                           resolution );
+    }
+    return 0;
+}
+
+#else
+template int CalcField_CPU_Range<float> ( Vector3<Array<float> >&,
+    Array<pointCharge<float> >&, const size_t, const size_t, const size_t,
+    float, bool );
+template int CalcField_CPU_Range<double> ( Vector3<Array<double> >&,
+    Array<pointCharge<double> >&, const size_t, const size_t, const size_t,
+    double, bool );
 #endif//SSE
 
+/**
+ * \brief Computes all steps of a single field line through the field of
+ * \brief 'grid', with or without curvature correction
+ *
+ * Steps are those of CalcLine_CPU and CalcLine_CPU_Curvature. The grid holds
+ * the sums of the charges without electro_k, which is applied here so that
+ * curvature sees the same field magnitude.
+ */
+template<class T>
+inline void CalcLine_CPU_Grid ( const Vector3<T*> pLines,
+                                const StaticFieldGrid<T>& grid,
+                                const size_t n, const size_t totalSteps,
+                                const size_t line, const T resolution,
+                                const bool useCurvature )
+{
+    // The field of the previous step; the first step uses the seed
+    Vector3<T> prevVec = {
+        pLines.x[line], pLines.y[line], pLines.z[line]
+    };
+    for ( size_t step = 1; step < totalSteps; step++ )
+    {
+        const Vector3<T> prevPoint = {
+            pLines.x[n* ( step - 1 ) + line],
+            pLines.y[n* ( step - 1 ) + line],
+            pLines.z[n* ( step - 1 ) + line]
+        };
+        const Vector3<T> temp = grid.Field ( prevPoint ) * ( T ) electro_k;
+        T scale = resolution;
+        if ( useCurvature )
+        {
+            const T k = vec3LenSq ( temp );
+            scale *= vec3Len ( vec3Cross ( temp - prevVec, prevVec ) )
+                    / ( k*sqrt ( k ) ) + 1;
+            prevVec = temp;
+        }
+        const Vector3<T> result = prevPoint + vec3SetInvLen ( temp, scale );
+        pLines.x[step*n + line] = result.x;
+        pLines.y[step*n + line] = result.y;
+        pLines.z[step*n + line] = result.z;
+    }
+}
+
+template<class T>
+int CalcField_CPU_Grid_Range ( Vector3<Array<T> >& fieldLines,
+                               const StaticFieldGrid<T>& grid,
+                               const size_t n, const size_t start,
+                               const size_t count, T resolution,
+                               bool useCurvature )
+{
+    if ( !n )
+        return 1;
+    if ( resolution == 0 )
+        return 2;
+    size_t totalSteps = ( fieldLines.GetSize() ) /n;
+    if ( totalSteps < 2 )
+        return 3;
+    if ( start + count > n )
+        return 4;
+
+    const Vector3<T*> pLines = fieldLines.GetDataPointers();
+    for ( size_t line = start; line < start + count; line++ )
+        CalcLine_CPU_Grid ( pLines, grid, n, totalSteps, line, resolution,
+                            useCurvature );
+    return 0;
+}
+
+template int CalcField_CPU_Grid_Range<float> ( Vector3<Array<float> >&,
+    const StaticFieldGrid<float>&, const size_t, const size_t, const size_t,
+    float, bool );
+template int CalcField_CPU_Grid_Range<double> ( Vector3<Array<double> >&,
+    const StaticFieldGrid<double>&, const size_t, const size_t, const size_t,
+    double, bool );
+
 template<>
 int CalcField_CPU<float> (
     Vector3<Array<float> >& fieldLines,
@@ -21,9 +21,15 @@
 #include <omp.h>
 #endif
 #include "./../../GPGPU_Segment/src/CL_Manager.hpp"
+#include "CPU_Electrostatics.hpp"
+#include "Particle_Ensemble.hpp"
+#include "Particle_System.hpp"
+#include "Static_Field_Grid.hpp"
+#include "Trajectory_Writer.hpp"
 #include "Electromag utils.h"
 #include "Graphics_dynlink.h"
 #include <SOA_utils.hpp>
+#include <map>
 #include <thread>
 
 //using namespace std;
@@ -52,10 +58,20 @@ static const struct SimulationParams param_list[] = {
 	{ "" },
 };
 
-void TestCL(Vector3<Array<float> > &fieldLines,
+bool TestCL(Vector3<Array<float> > &fieldLines,
 	    Array<electro::pointCharge<float> > &pointCharges, size_t n,
 	    float resolution, perfPacket &perfData, bool useCurvature,
-	    const char *preferred_platform_name = "");
+	    const char *preferred_platform_name = "",
+	    ElectrostaticFunctor<float> *hostFunctor = NULL,
+	    MetricsSink *metrics = NULL, size_t memBudget = 0,
+	    bool zeroCopy = true, int tuneMode = 0);
+bool TestCL(Vector3<Array<double> > &fieldLines,
+	    Array<electro::pointCharge<double> > &pointCharges, size_t n,
+	    double resolution, perfPacket &perfData, bool useCurvature,
+	    const char *preferred_platform_name = "",
+	    ElectrostaticFunctor<double> *hostFunctor = NULL,
+	    MetricsSink *metrics = NULL, size_t memBudget = 0,
+	    bool zeroCopy = true, int tuneMode = 0);
 
 using std::cerr;
 using std::cout;
@@ -107,11 +123,223 @@ static void print_simsize_help(const char *name)
 	cout << endl;
 }
 
+/*
+ * Sums up the steps sharing the same message. Steps profiled by the device
+ * also show how long their commands waited to start, and the estimated fraction
+ * of the device kept busy by kernels.
+ */
+static void print_step_times(const perfPacket &perf)
+{
+	struct StepSummary {
+		size_t count, profiled, withOccupancy;
+		double time, bytes, transferTime, latency, occupancy;
+	};
+	std::map<std::string, StepSummary> steps;
+	std::vector<std::string> order;
+
+	for (size_t i = 0; i < perf.stepTimes.size(); i++) {
+		const TimingInfo &step = perf.stepTimes[i];
+		if (!steps.count(step.message)) {
+			const StepSummary none = { 0, 0, 0, 0, 0, 0, 0, 0 };
+			steps[step.message] = none;
+			order.push_back(step.message);
+		}
+		StepSummary &sum = steps[step.message];
+		sum.count++;
+		sum.time += step.time;
+		if (step.bandwidth != 0.0) {
+			sum.bytes += step.bandwidth * step.time * 1024 * 1024;
+			sum.transferTime += step.time;
+		}
+		if (step.started != 0.0) {
+			sum.profiled++;
+			sum.latency += step.Latency();
+		}
+		if (step.occupancy != 0.0) {
+			sum.withOccupancy++;
+			sum.occupancy += step.occupancy;
+		}
+	}
+
+	for (size_t i = 0; i < order.size(); i++) {
+		const StepSummary &sum = steps[order[i]];
+		cout << order[i] << ": " << sum.time;
+		if (sum.count > 1)
+			cout << " (" << sum.count << " steps)";
+		cout << endl;
+		if (sum.transferTime != 0.0)
+			cout << "  Bandwidth: "
+			     << sum.bytes / sum.transferTime / (1024 * 1024)
+			     << " MB/s" << endl;
+		if (sum.profiled)
+			cout << "  Average launch latency: "
+			     << sum.latency / sum.profiled << endl;
+		if (sum.withOccupancy)
+			cout << "  Estimated occupancy: "
+			     << 100 * sum.occupancy / sum.withOccupancy << "%"
+			     << endl;
+	}
+}
+
 // to redirect stdout and stderr to out.txt use:
 //              >out.txt  2>&1
+/*
+ * Moves 'n' charged particles through the field of 'charges' and of each other
+ * for 'steps' steps, then reports the throughput of the particle system. A
+ * positive 'cutoff' limits interactions to charges closer than that, or, with
+ * 'ewald', splits them at that distance into a direct and a mesh part in a
+ * periodic box. Particles within a cutoff are sorted in Morton order every
+ * 'sortInterval' steps. With 'innerSteps' above 1, static charges farther than
+ * 'nearRadius' and the mesh act every 'innerSteps' steps only; the steps are
+ * grouped so that the particles travel for the same time. A 'grid', if not
+ * NULL, supplies the field of 'charges'. 'integrator' selects how the particles
+ * move, in a uniform magnetic field 'fieldZ' tesla strong along z. The positions
+ * after every step go to 'trajectory', if not NULL, which must be open.
+ */
+template <class T>
+static void run_particles(Array<electro::pointCharge<T> > &charges, size_t n,
+			  size_t steps, T cutoff, bool ewald,
+			  size_t sortInterval, size_t innerSteps, T nearRadius,
+			  const StaticFieldGrid<T> *grid,
+			  typename ParticleSystem<T>::Integrator integrator,
+			  T fieldZ, TrajectoryWriter<T> *trajectory,
+			  bool randseed)
+{
+	Array<electro::dynamicPointCharge<T> > particles(n, 256);
+	ParticleSystem<T> system;
+	perfPacket perf = { 0, 0 };
+	// Same region as the static charges
+	const Vector3<T> minBound = { -5000, -5000, -5000 };
+	const Vector3<T> maxBound = { 5000, 5000, 5000 };
+
+	InitializeDynamicChargeArray(particles, n, randseed);
+	if (cutoff > 0 && ewald)
+		system.SetEwald(cutoff, cutoff / 4);
+	else if (cutoff > 0)
+		system.SetCutoff(cutoff, cutoff / 4);
+	system.SetSortInterval(sortInterval);
+	if (!innerSteps)
+		innerSteps = 1;
+	system.SetMultipleTimeStep(innerSteps, nearRadius);
+	system.SetStaticFieldGrid(grid);
+	system.SetIntegrator(integrator);
+	const Vector3<T> field = { 0, 0, fieldZ };
+	system.SetMagneticField(field);
+	steps = (steps + innerSteps - 1) / innerSteps;
+	const T timeStep = (T)1E-3 * innerSteps;
+	if (system.Load(particles, n)) {
+		cerr << " Could not allocate " << n << " particles" << endl;
+		return;
+	}
+	if (trajectory)
+		trajectory->Write(0, 0, system.GetParticles().position,
+				  system.GetOrder());
+	for (size_t i = 0; i < steps; i++) {
+		if (system.Step(charges, timeStep, minBound, maxBound, perf)) {
+			cerr << " Particle step " << i << " failed" << endl;
+			return;
+		}
+		if (trajectory &&
+		    trajectory->Write(i + 1, (double)timeStep * (i + 1),
+				      system.GetParticles().position,
+				      system.GetOrder())) {
+			cerr << " Could not write the trajectory" << endl;
+			trajectory = NULL;
+		}
+	}
+
+	cout << " Particle system:\t\t" << n << " particles, " << steps
+	     << " steps" << endl;
+	cout << " Particle execution time:\t" << perf.time << " seconds"
+	     << endl;
+	cout << " Particle performance:\t\t" << perf.performance
+	     << " GFLOP/s" << endl;
+	if (trajectory)
+		cout << " Trajectory:\t\t\t" << trajectory->GetFrameCount()
+		     << " frames, waited " << trajectory->GetStallTime()
+		     << " seconds on the disk" << endl;
+	print_step_times(perf);
+}
+
+/**
+ * Moves 'systems' independent systems of 'n' charged particles each through
+ * the field of 'charges' for 'steps' steps, all of them in one ensemble, then
+ * reports the throughput of the ensemble.
+ */
+template <class T>
+static void run_ensemble(Array<electro::pointCharge<T> > &charges,
+			 size_t systems, size_t n, size_t steps, bool randseed)
+{
+	Array<electro::dynamicPointCharge<T> > particles(n, 256);
+	ParticleEnsemble<T> ensemble;
+	perfPacket perf = { 0, 0 };
+	const Vector3<T> minBound = { -5000, -5000, -5000 };
+	const Vector3<T> maxBound = { 5000, 5000, 5000 };
+
+	if (ensemble.Resize(systems, n)) {
+		cerr << " Could not allocate " << systems << " systems of " << n
+		     << " particles" << endl;
+		return;
+	}
+	// Each system starts from its own draw of the particles
+	for (size_t s = 0; s < systems; s++) {
+		InitializeDynamicChargeArray(particles, n, randseed,
+					     (unsigned int)s);
+		ensemble.Load(s, particles, n, (T)1E-3, minBound, maxBound);
+	}
+	for (size_t i = 0; i < steps; i++) {
+		if (ensemble.Step(charges, perf)) {
+			cerr << " Ensemble step " << i << " failed" << endl;
+			return;
+		}
+	}
+
+	cout << " Particle ensemble:\t\t" << systems << " systems of " << n
+	     << " particles, " << steps << " steps" << endl;
+	cout << " Ensemble execution time:\t" << perf.time << " seconds"
+	     << endl;
+	cout << " Ensemble performance:\t\t" << perf.performance
+	     << " GFLOP/s" << endl;
+	print_step_times(perf);
+}
+
 int main(int argc, char *argv[])
 {
-	const char *sim_name, *cl_plat_name = NULL;
+	const char *sim_name, *cl_plat_name = NULL, *rates_file = NULL;
+	const char *metrics_file = NULL, *dyn_count = NULL;
+	size_t dyn_steps = 100;
+	// Interaction range of dynamic particles; 0 for unlimited
+	double dyn_cutoff = 0;
+	bool dyn_ewald = false;
+	// Steps between Morton sorts of the dynamic particles; 0 for never
+	size_t dyn_sort = 16;
+	// Multiple time stepping: fast steps per slow step, and the radius
+	// within which static charges are fast
+	size_t dyn_respa = 1;
+	double dyn_near = 0;
+	// Independent systems of dynamic particles, stepped as an ensemble;
+	// 0 for one ParticleSystem
+	size_t dyn_ensemble = 0;
+	// Interpolate the field of the static charges from a grid? 0: no,
+	// 1: trilinear, 2: tricubic; and its near radius, 0 for automatic
+	int static_grid = 0;
+	double grid_near = 0;
+	// How the dynamic particles move, and the uniform magnetic field along
+	// z they move in, in tesla
+	ParticleSystem<FPprecision>::Integrator dyn_integrator =
+		ParticleSystem<FPprecision>::INTEGRATE_VERLET;
+	double dyn_field = 0;
+	// Trajectory of the dynamic particles: output file, steps between
+	// frames, encoding, and particles recorded, 0 for all
+	const char *traj_file = NULL;
+	size_t traj_stride = 1, traj_subset = 0;
+	TrajectoryWriter<FPprecision>::Encoding traj_encoding =
+		TrajectoryWriter<FPprecision>::ENCODE_FLOAT32;
+	// Device memory for field lines, per OpenCL device; 0 for no limit
+	size_t cl_mem_budget = 0;
+	bool cl_zero_copy = true;
+	// 0: stored kernel tuning only, 1: tune untuned devices, 2: retune all
+	int cl_tune_mode = 0;
 
 	cout << " Electromagnetism simulation application" << endl;
 	cout << " Compiled on " << __DATE__ << " at " << __TIME__ << endl;
@@ -124,9 +352,13 @@ int main(int argc, char *argv[])
 	bool useCurvature = true;
 	bool randseed = false;
 	bool randfieldinit = false;
+	// Sort charges and field line seeds in Morton order?
+	bool mortonSort = false;
 	bool regressData = false;
 	// OpenCL devel tests?
 	bool clMode = false;
+	// Run the host CPU alongside the OpenCL devices?
+	bool hybridMode = false;
 	// Get command-line options;
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "--cpu")) {
@@ -148,18 +380,85 @@ int main(int argc, char *argv[])
 			randseed = true;
 		} else if (!strcmp(argv[i], "--randfieldinit")) {
 			randfieldinit = true;
+		} else if (!strcmp(argv[i], "--morton")) {
+			mortonSort = true;
 		} else if (!strcmp(argv[i], "--autoregress")) {
 			regressData = true;
 		} else if (!strcmp(argv[i], "--clmode")) {
 			clMode = true;
 		} else if (starts_with(argv[i], "--clplatform")) {
 			cl_plat_name = strnext(argv[i], '=');
+		} else if (!strcmp(argv[i], "--hybrid")) {
+			clMode = true;
+			hybridMode = true;
+		} else if (starts_with(argv[i], "--ratesfile")) {
+			rates_file = strnext(argv[i], '=');
+		} else if (starts_with(argv[i], "--metrics")) {
+			// A file name, or '-' for stdout
+			metrics_file = strnext(argv[i], '=');
+		} else if (starts_with(argv[i], "--clmembudget")) {
+			// In MiB
+			cl_mem_budget = strtoul(strnext(argv[i], '='), NULL, 10)
+					<< 20;
+		} else if (!strcmp(argv[i], "--clnozerocopy")) {
+			cl_zero_copy = false;
+		} else if (starts_with(argv[i], "--dynamic")) {
+			// Overrides the particle count of the simulation size
+			dyn_count = strnext(argv[i], '=');
+		} else if (starts_with(argv[i], "--dynsteps")) {
+			dyn_steps = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (starts_with(argv[i], "--dyncutoff")) {
+			dyn_cutoff = strtod(strnext(argv[i], '='), NULL);
+		} else if (starts_with(argv[i], "--dynewald")) {
+			dyn_cutoff = strtod(strnext(argv[i], '='), NULL);
+			dyn_ewald = true;
+		} else if (starts_with(argv[i], "--dynsort")) {
+			dyn_sort = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (starts_with(argv[i], "--dynrespa")) {
+			dyn_respa = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (starts_with(argv[i], "--dynnear")) {
+			dyn_near = strtod(strnext(argv[i], '='), NULL);
+		} else if (!strcmp(argv[i], "--dynboris")) {
+			dyn_integrator =
+				ParticleSystem<FPprecision>::INTEGRATE_BORIS;
+		} else if (!strcmp(argv[i], "--dynboris=relativistic")) {
+			dyn_integrator = ParticleSystem<
+				FPprecision>::INTEGRATE_BORIS_RELATIVISTIC;
+		} else if (starts_with(argv[i], "--dynbfield")) {
+			dyn_field = strtod(strnext(argv[i], '='), NULL);
+		} else if (starts_with(argv[i], "--trajectory")) {
+			traj_file = strnext(argv[i], '=');
+		} else if (starts_with(argv[i], "--trajstride")) {
+			traj_stride = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (!strcmp(argv[i], "--trajformat=float16")) {
+			traj_encoding =
+				TrajectoryWriter<FPprecision>::ENCODE_FLOAT16;
+		} else if (!strcmp(argv[i], "--trajformat=quantized")) {
+			traj_encoding = TrajectoryWriter<
+				FPprecision>::ENCODE_QUANTIZED16;
+		} else if (starts_with(argv[i], "--trajsubset")) {
+			traj_subset = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (starts_with(argv[i], "--ensemble")) {
+			dyn_ensemble = strtoul(strnext(argv[i], '='), NULL, 10);
+		} else if (!strcmp(argv[i], "--staticgrid")) {
+			static_grid = 2;
+		} else if (!strcmp(argv[i], "--staticgrid=linear")) {
+			static_grid = 1;
+		} else if (starts_with(argv[i], "--gridnear")) {
+			grid_near = strtod(strnext(argv[i], '='), NULL);
+		} else if (!strcmp(argv[i], "--cltune")) {
+			cl_tune_mode = 1;
+		} else if (!strcmp(argv[i], "--cltune=all")) {
+			cl_tune_mode = 2;
 		} else {
 			cout << " Ignoring unknown argument: " << argv[i]
 			     << endl;
 		}
 	}
 
+	if (dyn_count)
+		simConfig.pDynamic = strtoul(dyn_count, NULL, 10);
+
 	Render::Renderer *FieldDisplay = 0;
 	// Do we need to load the graphicsModule?
 	if (display) {
@@ -204,10 +503,11 @@ int main(int argc, char *argv[])
 	Vector3<Array<FPprecision> > CPUlines, GPUlines;
 	Array<electro::pointCharge<FPprecision> > charges(p, 256);
 	// Only allocate memory if cpu comparison mode is specified
+	// Page alignment lets OpenCL devices sharing host memory use it in place
 	if (GPUenable)
-		GPUlines.AlignAlloc(n * len);
+		GPUlines.AlignAlloc(n * len, 4096);
 	if (CPUenable)
-		CPUlines.AlignAlloc(n * len);
+		CPUlines.AlignAlloc(n * len, 4096);
 	perfPacket CPUperf = { 0, 0 }, GPUperf = { 0, 0 };
 	std::ofstream data, regress;
 	//MainGUI.RegisterProgressIndicator((double * volatile)&CPUperf.progress);
@@ -239,6 +539,38 @@ int main(int argc, char *argv[])
 	// Initialize the starting points
 	InitializeFieldLineArray(*arrMain, n, nw, nh, nd, randfieldinit);
 
+	// Nearby seeds trace similar paths, and nearby charges are summed in
+	// turn. The lines are moved back to their seeds once computed
+	std::vector<unsigned int> chargeOrder, seedOrder;
+	if (mortonSort) {
+		MortonSortCharges(ThreadPool::GetGlobal(), charges, p,
+				  chargeOrder);
+		MortonSortSeeds(ThreadPool::GetGlobal(), *arrMain, n,
+				seedOrder);
+	}
+
+	// The host tracer and the particles share one grid over the region of
+	// the charges
+	StaticFieldGrid<FPprecision> fieldGrid;
+	if (static_grid) {
+		const Vector3<FPprecision> gridMin = { -5000, -5000, -5000 };
+		const Vector3<FPprecision> gridMax = { 5000, 5000, 5000 };
+		PerfTimer timer;
+		timer.start();
+		if (fieldGrid.Build(ThreadPool::GetGlobal(), charges, gridMin,
+				    gridMax, (FPprecision)grid_near,
+				    static_grid == 1 ?
+					    fieldGrid.INTERP_TRILINEAR :
+					    fieldGrid.INTERP_TRICUBIC)) {
+			cerr << " Could not build the static field grid" << endl;
+		} else {
+			cout << " Static field grid:		"
+			     << fieldGrid.GetNodeCount() << " nodes, near radius "
+			     << fieldGrid.GetNearRadius() << ", built in "
+			     << timer.tick() << " seconds" << endl;
+		}
+	}
+
 	// If both CPU and GPU modes are selected, the GPU array will have been
 	// initialized first
 	// Copy the same starting values to the CPU array
@@ -250,30 +582,56 @@ int main(int argc, char *argv[])
 	double GPUtime = 0, CPUtime = 0;
 	QueryHPCFrequency(&freq);
 
+	// Device throughputs measured in earlier sessions balance the load
+	// from the first block on
+	if (rates_file)
+		AbstractFunctor::LoadDeviceRates(rates_file);
+
+	// Periodic JSON samples of per-device progress and throughput
+	JsonMetricsSink *metrics = NULL;
+	if (metrics_file) {
+		metrics = new JsonMetricsSink(metrics_file);
+		if (metrics->Fail()) {
+			cerr << " Could not open metrics output " << metrics_file
+			     << endl;
+			delete metrics;
+			metrics = NULL;
+		}
+	}
+
+	// OpenCL may be unable to run, e.g. in double precision without fp64
+	bool clDone = false;
 	if (clMode && CPUenable) {
 		//StartConsoleMonitoring ( &CPUperf.progress );
-		TestCL(CPUlines, charges, n, 1.0, CPUperf, useCurvature,
-		       cl_plat_name);
+		CPUElectrosFunctor<FPprecision> hostFunctor;
+		hostFunctor.SetFieldGrid(&fieldGrid);
+		clDone = TestCL(CPUlines, charges, n, 1.0, CPUperf,
+				useCurvature, cl_plat_name,
+				hybridMode ? &hostFunctor : NULL, metrics,
+				cl_mem_budget, cl_zero_copy, cl_tune_mode);
+		if (!clDone)
+			cout << " Falling back to the CPU" << endl;
 		CPUperf.progress = 1.0;
-		for (size_t i = 0; i < CPUperf.stepTimes.size(); i++) {
-			TimingInfo profiler = CPUperf.stepTimes[i];
-			cout << profiler.message << ": " << profiler.time
-			     << endl;
-			if (profiler.bandwidth == 0.0)
-				continue;
-			cout << "  Bandwidth: " << profiler.bandwidth << " MB/s"
-			     << endl;
-		}
-	} else {
+		print_step_times(CPUperf);
+	}
+	if (!clDone) {
 		FPprecision resolution = 1;
 		if (GPUenable)
 			cout << " GPU" << endl;
 
 		if (CPUenable) {
-			StartConsoleMonitoring(&CPUperf.progress);
+			CPUElectrosFunctor<FPprecision> CPUfunctor;
+			CPUfunctor.SetFieldGrid(&fieldGrid);
+			CPUElectrosFunctor<FPprecision>::BindDataParams
+				dataParams = { &CPUlines,  &charges, n,
+					       resolution, CPUperf,  useCurvature };
+			ConsoleProgressSink progressBar;
+			CPUfunctor.AddMetricsSink(&progressBar);
+			if (metrics)
+				CPUfunctor.AddMetricsSink(metrics);
 			QueryHPCTimer(&start);
-			CalcField_CPU(CPUlines, charges, n, resolution, CPUperf,
-				      useCurvature);
+			CPUfunctor.BindData((void *)&dataParams);
+			CPUfunctor.Run();
 			QueryHPCTimer(&end);
 			CPUperf.progress = 1;
 			cout << " CPU kernel execution time:\t" << CPUperf.time
@@ -294,6 +652,52 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (mortonSort) {
+		if (CPUenable)
+			UnsortFieldLines(ThreadPool::GetGlobal(), CPUlines, n,
+					 seedOrder);
+		if (GPUenable)
+			UnsortFieldLines(ThreadPool::GetGlobal(), GPUlines, n,
+					 seedOrder);
+	}
+
+	if (simConfig.pDynamic && dyn_steps && dyn_ensemble)
+		run_ensemble(charges, dyn_ensemble, simConfig.pDynamic,
+			     dyn_steps, randseed);
+	else if (simConfig.pDynamic && dyn_steps) {
+		// The particles move in the same region as the static charges
+		TrajectoryWriter<FPprecision> trajectory;
+		if (traj_file) {
+			const Vector3<FPprecision> trajMin = { -5000, -5000,
+							       -5000 };
+			const Vector3<FPprecision> trajMax = { 5000, 5000, 5000 };
+			// The first particles, as they were initialized
+			std::vector<unsigned int> subset(
+				std::min(traj_subset, simConfig.pDynamic));
+			for (size_t i = 0; i < subset.size(); i++)
+				subset[i] = (unsigned int)i;
+			trajectory.SetEncoding(traj_encoding, trajMin, trajMax);
+			trajectory.SetStride(traj_stride);
+			trajectory.SetSubset(subset);
+			if (trajectory.Open(traj_file, simConfig.pDynamic))
+				cerr << " Could not open trajectory output "
+				     << traj_file << endl;
+		}
+		run_particles(charges, simConfig.pDynamic, dyn_steps,
+			      (FPprecision)dyn_cutoff, dyn_ewald, dyn_sort,
+			      dyn_respa, (FPprecision)dyn_near, &fieldGrid,
+			      dyn_integrator, (FPprecision)dyn_field,
+			      trajectory.IsOpen() ? &trajectory : NULL,
+			      randseed);
+		if (trajectory.IsOpen() && trajectory.Close())
+			cerr << " Could not write trajectory output "
+			     << traj_file << endl;
+	}
+
+	if (rates_file && !AbstractFunctor::SaveDeviceRates(rates_file))
+		cerr << " Could not save device rates to " << rates_file << endl;
+	delete metrics;
+
 	FieldRenderer::GLpacket GLdata;
 	volatile bool *shouldIQuit = 0;
 	if (display) {
@@ -26,8 +26,9 @@
 
 typedef void* ArrayHandle;
 
-void compare_electric_fields(Vector3<Array<float>> &field_a,
-			     Vector3<Array<float>> &field_b,
+template <class T>
+void compare_electric_fields(Vector3<Array<T>> &field_a,
+			     Vector3<Array<T>> &field_b,
 			     size_t num_lines, size_t line_len,
 			     const char *output_filename);
 
@@ -116,6 +117,41 @@ void InitializePointChargeArray ( Array<electro::pointCharge<T> > &charges,
     }
 }
 
+/**
+ * \brief Scatters particles of unit mass in the same region as the static
+ * \brief charges, with random charges and velocities of up to 1 m/s
+ *
+ * Different values of 'seedOffset' give different draws, so that several
+ * systems can be filled in turn, even when 'random' is not set.
+ */
+template<class T>
+void InitializeDynamicChargeArray (
+    Array<electro::dynamicPointCharge<T> > &particles,
+    size_t lenght,
+    bool random,
+    unsigned int seedOffset = 0 )
+{
+    long long pseudoSeed; QueryHPCTimer ( &pseudoSeed );
+    if ( random ) srand ( pseudoSeed%RAND_MAX + seedOffset );
+    else srand ( 2 + seedOffset );
+    for ( size_t i = 0; i < lenght ; i++ )
+    {
+        electro::dynamicPointCharge<T> &part = particles[i];
+        part.staticProp.position.x = ( T ) ( rand()- ( T ) RAND_MAX/2 )
+                / RAND_MAX*10000;
+        part.staticProp.position.y = ( T ) ( rand()- ( T ) RAND_MAX/2 )
+                / RAND_MAX*10000;
+        part.staticProp.position.z = ( T ) ( rand()- ( T ) RAND_MAX/2 )
+                / RAND_MAX*10000;
+        part.staticProp.magnitude = ( T ) ( rand()- ( T ) RAND_MAX/2 )
+                / RAND_MAX * 1E-3;
+        part.velocity.x = ( T ) ( rand()- ( T ) RAND_MAX/2 ) / RAND_MAX*2;
+        part.velocity.y = ( T ) ( rand()- ( T ) RAND_MAX/2 ) / RAND_MAX*2;
+        part.velocity.z = ( T ) ( rand()- ( T ) RAND_MAX/2 ) / RAND_MAX*2;
+        part.mass = 1;
+    }
+}
+
 template<class T1, class T2>
 void CopyPointChargeArray (
     Array<electro::pointCharge<T1> >& destination,  ///< Destination array
@@ -136,28 +172,4 @@ void CopyPointChargeArray (
     }
 }
 
-void MonitorProgressConsole ( volatile double * progress )
-{
-    const double step = ( double ) 1/60;
-    std::cout<<"[__________________________________________________________]"
-            <<std::endl;
-    for ( double next=step; next < ( 1.0 - 1E-3 ); next += step )
-    {
-        while ( *progress < next )
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds( 250 ));
-        }
-        std::cout<<".";
-        // Flush to make sure progress indicator is displayed immediately
-        std::cout.flush();
-    }
-    std::cout<<" Done"<<std::endl;
-    std::cout.flush();
-
-}
-
-void StartConsoleMonitoring ( volatile double * progress )
-{
-    new std::thread(MonitorProgressConsole, progress);
-}
 #endif//_ELECTROMAG_UTILS_H
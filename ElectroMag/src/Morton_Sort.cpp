@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Morton_Sort.hpp"
+#include <algorithm>
+
+/// Bits sorted by each pass of the radix sort
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+/// Blocks of keys per pool thread; each block keeps its own histogram
+#define RADIX_BLOCKS_PER_THREAD 4
+
+/// Moves the low MORTON_BITS bits of 'x' to every third bit
+static inline unsigned int SpreadBits(unsigned int x)
+{
+	x &= (1 << MORTON_BITS) - 1;
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+/// Digit of 'key' sorted by the pass at 'shift'
+static inline size_t Digit(const unsigned int key, const unsigned int shift)
+{
+	return (key >> shift) & (RADIX_BUCKETS - 1);
+}
+
+/// Scale from coordinates within [min, min + extent] to key cells
+template <class T> static inline T KeyScale(const T extent)
+{
+	const T cells = (T)(1 << MORTON_BITS);
+	return extent > 0 ? cells / extent : 0;
+}
+
+/// Key cell of 'x', clamped to the box
+template <class T>
+static inline unsigned int KeyCell(const T x, const T min, const T scale)
+{
+	const T cell = (x - min) * scale;
+	if (!(cell > 0))
+		return 0;
+	return cell < (1 << MORTON_BITS) ? (unsigned int)cell :
+					   (1 << MORTON_BITS) - 1;
+}
+
+template <class T>
+void MortonKeys(ThreadPool &pool, const Vector3<T *> points, const size_t n,
+		const Vector3<T> minBound, const Vector3<T> maxBound,
+		unsigned int *keys)
+{
+	const Vector3<T> scale = { KeyScale(maxBound.x - minBound.x),
+				   KeyScale(maxBound.y - minBound.y),
+				   KeyScale(maxBound.z - minBound.z) };
+	pool.ParallelFor(
+		0, n, MORTON_ELEMENTS_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const unsigned int x = KeyCell(
+					points.x[i], minBound.x, scale.x);
+				const unsigned int y = KeyCell(
+					points.y[i], minBound.y, scale.y);
+				const unsigned int z = KeyCell(
+					points.z[i], minBound.z, scale.z);
+				keys[i] = SpreadBits(x) | SpreadBits(y) << 1 |
+					  SpreadBits(z) << 2;
+			}
+		});
+}
+
+/**
+ * Least significant digit first. The keys are split into fixed blocks; every
+ * pass counts the digits of each block in parallel, turns the counts into the
+ * offset of each block and digit, then scatters the blocks in parallel. Blocks
+ * keep the order of their keys, and come out in their own order, so the sort
+ * is stable and does not depend on the threads. Passes over digits that all
+ * keys share are skipped.
+ */
+void RadixSortOrder(ThreadPool &pool, const unsigned int *keys, const size_t n,
+		    std::vector<unsigned int> &order)
+{
+	const size_t maxBlocks = RADIX_BLOCKS_PER_THREAD * pool.GetNumThreads();
+	size_t blocks = (n + MORTON_ELEMENTS_PER_TASK - 1) /
+			MORTON_ELEMENTS_PER_TASK;
+	blocks = std::max<size_t>(1, std::min(blocks, maxBlocks));
+	const size_t blockSize = (n + blocks - 1) / blocks;
+
+	std::vector<unsigned int> keyBuf[2], indexBuf[2];
+	keyBuf[0].assign(keys, keys + n);
+	keyBuf[1].resize(n);
+	indexBuf[0].resize(n);
+	indexBuf[1].resize(n);
+	for (size_t i = 0; i < n; i++)
+		indexBuf[0][i] = (unsigned int)i;
+	std::vector<size_t> offsets(blocks * RADIX_BUCKETS);
+
+	int cur = 0;
+	for (unsigned int shift = 0; shift < 32 && n; shift += RADIX_BITS) {
+		const unsigned int *srcKey = &keyBuf[cur][0];
+		const unsigned int *srcIndex = &indexBuf[cur][0];
+		unsigned int *dstKey = &keyBuf[1 - cur][0];
+		unsigned int *dstIndex = &indexBuf[1 - cur][0];
+		size_t *offset = &offsets[0];
+
+		pool.ParallelFor(0, blocks, 1, [&](size_t begin, size_t end,
+						   size_t thread) {
+			for (size_t b = begin; b < end; b++) {
+				size_t *count = offset + b * RADIX_BUCKETS;
+				const size_t last = std::min(n, b * blockSize +
+								blockSize);
+				std::fill(count, count + RADIX_BUCKETS, 0);
+				for (size_t i = b * blockSize; i < last; i++)
+					count[Digit(srcKey[i], shift)]++;
+			}
+		});
+
+		size_t sum = 0;
+		bool shared = false;
+		for (size_t d = 0; d < RADIX_BUCKETS; d++) {
+			size_t total = 0;
+			for (size_t b = 0; b < blocks; b++) {
+				size_t &slot = offset[b * RADIX_BUCKETS + d];
+				const size_t count = slot;
+				slot = sum + total;
+				total += count;
+			}
+			shared |= total == n;
+			sum += total;
+		}
+		if (shared)
+			continue;
+
+		pool.ParallelFor(0, blocks, 1, [&](size_t begin, size_t end,
+						   size_t thread) {
+			for (size_t b = begin; b < end; b++) {
+				size_t *next = offset + b * RADIX_BUCKETS;
+				const size_t last = std::min(n, b * blockSize +
+								blockSize);
+				for (size_t i = b * blockSize; i < last; i++) {
+					const size_t to =
+						next[Digit(srcKey[i], shift)]++;
+					dstKey[to] = srcKey[i];
+					dstIndex[to] = srcIndex[i];
+				}
+			}
+		});
+		cur = 1 - cur;
+	}
+	order.swap(indexBuf[cur]);
+}
+
+template <class T>
+void MortonOrder(ThreadPool &pool, const Vector3<T *> points, const size_t n,
+		 std::vector<unsigned int> &order)
+{
+	if (!n) {
+		order.clear();
+		return;
+	}
+	Vector3<T> minBound = { points.x[0], points.y[0], points.z[0] };
+	Vector3<T> maxBound = minBound;
+	for (size_t i = 1; i < n; i++) {
+		minBound.x = std::min(minBound.x, points.x[i]);
+		minBound.y = std::min(minBound.y, points.y[i]);
+		minBound.z = std::min(minBound.z, points.z[i]);
+		maxBound.x = std::max(maxBound.x, points.x[i]);
+		maxBound.y = std::max(maxBound.y, points.y[i]);
+		maxBound.z = std::max(maxBound.z, points.z[i]);
+	}
+	std::vector<unsigned int> keys(n);
+	MortonKeys(pool, points, n, minBound, maxBound, &keys[0]);
+	RadixSortOrder(pool, &keys[0], n, order);
+}
+
+template <class T>
+void MortonSortCharges(ThreadPool &pool,
+		       Array<electro::pointCharge<T> > &charges, const size_t n,
+		       std::vector<unsigned int> &order)
+{
+	std::vector<T> coords[3];
+	for (int d = 0; d < 3; d++)
+		coords[d].resize(n);
+	for (size_t i = 0; i < n; i++) {
+		coords[0][i] = charges[i].position.x;
+		coords[1][i] = charges[i].position.y;
+		coords[2][i] = charges[i].position.z;
+	}
+	const Vector3<T *> points = { n ? &coords[0][0] : NULL,
+				      n ? &coords[1][0] : NULL,
+				      n ? &coords[2][0] : NULL };
+	MortonOrder(pool, points, n, order);
+
+	std::vector<electro::pointCharge<T> > scratch;
+	ApplyOrder(pool, charges.GetDataPointer(), order.empty() ? NULL :
+		   &order[0], n, scratch);
+}
+
+template <class T>
+void MortonSortSeeds(ThreadPool &pool, Vector3<Array<T> > &lines,
+		     const size_t n, std::vector<unsigned int> &order)
+{
+	const Vector3<T *> seeds = lines.GetDataPointers();
+	MortonOrder(pool, seeds, n, order);
+
+	std::vector<T> scratch;
+	const unsigned int *perm = order.empty() ? NULL : &order[0];
+	ApplyOrder(pool, seeds.x, perm, n, scratch);
+	ApplyOrder(pool, seeds.y, perm, n, scratch);
+	ApplyOrder(pool, seeds.z, perm, n, scratch);
+}
+
+/// Every step of the lines is permuted like the seeds, one step per task
+template <class T>
+void UnsortFieldLines(ThreadPool &pool, Vector3<Array<T> > &lines,
+		      const size_t n, const std::vector<unsigned int> &order)
+{
+	if (!n || order.size() != n)
+		return;
+	const size_t steps = lines.GetSize() / n;
+	const Vector3<T *> data = lines.GetDataPointers();
+	const unsigned int *perm = &order[0];
+	std::vector<std::vector<T> > scratch(pool.GetNumThreads());
+	pool.ParallelFor(0, steps, 1, [&](size_t begin, size_t end,
+					  size_t thread) {
+		std::vector<T> &old = scratch[thread];
+		T *axes[3] = { data.x, data.y, data.z };
+		for (size_t s = begin; s < end; s++) {
+			for (int d = 0; d < 3; d++) {
+				T *row = axes[d] + s * n;
+				old.assign(row, row + n);
+				for (size_t i = 0; i < n; i++)
+					row[perm[i]] = old[i];
+			}
+		}
+	});
+}
+
+template void MortonKeys(ThreadPool &, const Vector3<float *>, const size_t,
+			 const Vector3<float>, const Vector3<float>,
+			 unsigned int *);
+template void MortonOrder(ThreadPool &, const Vector3<float *>, const size_t,
+			  std::vector<unsigned int> &);
+template void MortonSortCharges(ThreadPool &,
+				Array<electro::pointCharge<float> > &,
+				const size_t, std::vector<unsigned int> &);
+template void MortonSortSeeds(ThreadPool &, Vector3<Array<float> > &,
+			      const size_t, std::vector<unsigned int> &);
+template void UnsortFieldLines(ThreadPool &, Vector3<Array<float> > &,
+			       const size_t, const std::vector<unsigned int> &);
+
+template void MortonKeys(ThreadPool &, const Vector3<double *>, const size_t,
+			 const Vector3<double>, const Vector3<double>,
+			 unsigned int *);
+template void MortonOrder(ThreadPool &, const Vector3<double *>, const size_t,
+			  std::vector<unsigned int> &);
+template void MortonSortCharges(ThreadPool &,
+				Array<electro::pointCharge<double> > &,
+				const size_t, std::vector<unsigned int> &);
+template void MortonSortSeeds(ThreadPool &, Vector3<Array<double> > &,
+			      const size_t, std::vector<unsigned int> &);
+template void UnsortFieldLines(ThreadPool &, Vector3<Array<double> > &,
+			       const size_t, const std::vector<unsigned int> &);
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MORTON_SORT_HPP
+#define _MORTON_SORT_HPP
+
+#include "Electrostatics.h"
+#include "SOA_utils.hpp"
+#include "Thread_Pool.hpp"
+#include <vector>
+
+/// Bits of each coordinate in a Morton key
+#define MORTON_BITS 10
+/// Elements moved by one task of the pool
+#define MORTON_ELEMENTS_PER_TASK 4096
+
+/**=============================================================================
+ * \brief Spatial sorting in Morton (Z) order
+ *
+ * Coordinates are quantized to MORTON_BITS bits within the bounding box of the
+ * points, and their bits interleaved into one key. Points close in key order
+ * are close in space, so loops over the sorted points that look up their
+ * neighbors, or the cells around them, find those mostly in cache.
+ *
+ * Every sort yields a permutation 'order': the element at index i after the
+ * sort is the one at index order[i] before it. Results computed on sorted data
+ * are mapped back with it.
+ * ===========================================================================*/
+
+/// Morton keys of 'n' points within the box [minBound, maxBound]
+template <class T>
+void MortonKeys(ThreadPool &pool, const Vector3<T *> points, const size_t n,
+		const Vector3<T> minBound, const Vector3<T> maxBound,
+		unsigned int *keys);
+
+/**
+ * \brief Orders 'n' keys by a stable, parallel radix sort
+ *
+ * On return, keys[order[i]] is the i-th smallest key.
+ */
+void RadixSortOrder(ThreadPool &pool, const unsigned int *keys, const size_t n,
+		    std::vector<unsigned int> &order);
+
+/// Order that sorts 'n' points by their Morton keys within their bounding box
+template <class T>
+void MortonOrder(ThreadPool &pool, const Vector3<T *> points, const size_t n,
+		 std::vector<unsigned int> &order);
+
+/// Sorts the first 'n' charges in Morton order
+template <class T>
+void MortonSortCharges(ThreadPool &pool,
+		       Array<electro::pointCharge<T> > &charges, const size_t n,
+		       std::vector<unsigned int> &order);
+
+/// Sorts the 'n' starting points of a field line array in Morton order
+template <class T>
+void MortonSortSeeds(ThreadPool &pool, Vector3<Array<T> > &lines,
+		     const size_t n, std::vector<unsigned int> &order);
+
+/**
+ * \brief Moves the 'n' field lines traced from seeds sorted by
+ * \brief MortonSortSeeds() back to the places of their unsorted seeds
+ */
+template <class T>
+void UnsortFieldLines(ThreadPool &pool, Vector3<Array<T> > &lines,
+		      const size_t n, const std::vector<unsigned int> &order);
+
+/**
+ * \brief Permutes 'n' elements of 'data' so that element i becomes the old
+ * \brief element order[i]
+ *
+ * @param scratch Holds a copy of the old elements; kept to spare allocations
+ * when several arrays are permuted in a row
+ */
+template <class T>
+void ApplyOrder(ThreadPool &pool, T *data, const unsigned int *order,
+		const size_t n, std::vector<T> &scratch)
+{
+	scratch.assign(data, data + n);
+	const T *old = scratch.empty() ? NULL : &scratch[0];
+	pool.ParallelFor(0, n, MORTON_ELEMENTS_PER_TASK,
+			 [&](size_t begin, size_t end, size_t thread) {
+				 for (size_t i = begin; i < end; i++)
+					 data[i] = old[order[i]];
+			 });
+}
+
+#endif //_MORTON_SORT_HPP
@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PME_Solver.hpp"
+#include <algorithm>
+#include <cmath>
+
+/// Charges handed to a pool thread at a time
+#define PME_CHARGES_PER_TASK 64
+/// Limit on the points of the mesh, so that each mesh fits a few GB
+#define PME_MAX_POINTS (1 << 27)
+
+/// FLOP of one charge on one mesh point, when spreading and gathering
+#define PME_SPREAD_FLOP 10
+#define PME_GATHER_FLOP 30
+/// FLOP of a complex FFT, per point and per factor of two of its length
+#define PME_FFT_FLOP 5
+
+/**
+ * \brief Cardinal B-spline of order 'order' around a mesh point
+ *
+ * Computes theta[m] = M(w + order - 1 - m), the weight of the mesh point
+ * order - 1 - m points before the one at fraction 'w' behind the charge, and,
+ * if dtheta is not NULL, its derivative by w. The recursion is that of Essmann
+ * et al.
+ */
+template <class T>
+static void FillSpline(const T w, const unsigned int order, T *theta, T *dtheta)
+{
+	theta[order - 1] = 0;
+	theta[1] = w;
+	theta[0] = 1 - w;
+	for (unsigned int j = 3; j < order; j++) {
+		const T div = (T)1 / (j - 1);
+		theta[j - 1] = div * w * theta[j - 2];
+		for (unsigned int k = 1; k < j - 1; k++)
+			theta[j - k - 1] = div * ((w + k) * theta[j - k - 2] +
+						  (j - k - w) * theta[j - k - 1]);
+		theta[0] = div * (1 - w) * theta[0];
+	}
+	// The derivative of an order n spline comes from the order n - 1 one
+	if (dtheta) {
+		dtheta[0] = -theta[0];
+		for (unsigned int j = 1; j < order; j++)
+			dtheta[j] = theta[j - 1] - theta[j];
+	}
+	const T div = (T)1 / (order - 1);
+	theta[order - 1] = div * w * theta[order - 2];
+	for (unsigned int k = 1; k < order - 1; k++)
+		theta[order - k - 1] =
+			div * ((w + k) * theta[order - k - 2] +
+			       (order - k - w) * theta[order - k - 1]);
+	theta[0] = div * (1 - w) * theta[0];
+}
+
+/**
+ * \brief Squared moduli of the Euler exponential splines along one axis
+ *
+ * These undo the smoothing of the B-spline interpolation in reciprocal space.
+ * Zeros, which odd orders have at the Nyquist frequency, are replaced by the
+ * average of their neighbors.
+ */
+template <class T>
+static std::vector<T> SplineModuli(const size_t points, const unsigned int order)
+{
+	T spline[PME_MAX_ORDER];
+	FillSpline<T>(0, order, spline, NULL);
+	std::vector<T> moduli(points);
+	for (size_t m = 0; m < points; m++) {
+		std::complex<double> sum = 0;
+		// M(k + 1) = spline[order - 2 - k]
+		for (unsigned int k = 0; k + 1 < order; k++)
+			sum += std::polar((double)spline[order - 2 - k],
+					  2 * M_PI * m * k / points);
+		moduli[m] = (T)std::norm(sum);
+	}
+	for (size_t m = 0; m < points; m++) {
+		if (moduli[m] < 1E-7)
+			moduli[m] = (moduli[(m + points - 1) % points] +
+				     moduli[(m + 1) % points]) / 2;
+	}
+	return moduli;
+}
+
+/**
+ * \brief In-place radix-2 FFT of 'points' complex numbers
+ *
+ * 'twiddles' holds exp(-2 pi i k / points) for k < points / 2. The inverse
+ * transform is not normalized.
+ */
+template <class T>
+static void FFT(std::complex<T> *data, const size_t points,
+		const std::complex<T> *twiddles, const bool inverse)
+{
+	for (size_t i = 1, j = 0; i < points; i++) {
+		size_t bit = points >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(data[i], data[j]);
+	}
+	for (size_t len = 2; len <= points; len <<= 1) {
+		const size_t half = len / 2, step = points / len;
+		for (size_t i = 0; i < points; i += len) {
+			for (size_t k = 0; k < half; k++) {
+				std::complex<T> w = twiddles[k * step];
+				if (inverse)
+					w = std::conj(w);
+				const std::complex<T> a = data[i + k];
+				const std::complex<T> b = data[i + k + half] * w;
+				data[i + k] = a + b;
+				data[i + k + half] = a - b;
+			}
+		}
+	}
+}
+
+template <class T>
+PMESolver<T>::PMESolver() : m_coeff(0), m_order(0), m_flop(0)
+{
+	m_min.x = m_min.y = m_min.z = 0;
+	m_box = m_min;
+	m_dims[0] = m_dims[1] = m_dims[2] = 0;
+}
+
+template <class T>
+T PMESolver<T>::EwaldCoefficient(const T cutoff, const T tolerance)
+{
+	// Bracket erfc(x) = tolerance, then bisect
+	double high = 1;
+	while (erfc(high) > tolerance)
+		high *= 2;
+	double low = 0;
+	for (int i = 0; i < 64; i++) {
+		const double mid = (low + high) / 2;
+		if (erfc(mid) > tolerance)
+			low = mid;
+		else
+			high = mid;
+	}
+	return (T)(high / cutoff);
+}
+
+template <class T>
+int PMESolver<T>::Setup(const Vector3<T> minBound, const Vector3<T> maxBound,
+			const T ewaldCoeff, const T spacing,
+			const unsigned int order)
+{
+	const Vector3<T> box = maxBound - minBound;
+	if (!(box.x > 0 && box.y > 0 && box.z > 0) || !(ewaldCoeff > 0) ||
+	    !(spacing > 0) || order < 3 || order > PME_MAX_ORDER)
+		return 1;
+
+	const T extent[3] = { box.x, box.y, box.z };
+	size_t dims[3];
+	double points = 1;
+	for (int d = 0; d < 3; d++) {
+		dims[d] = 1;
+		while (dims[d] < order || dims[d] * spacing < extent[d]) {
+			if (dims[d] >= PME_MAX_POINTS)
+				return 1;
+			dims[d] *= 2;
+		}
+		points *= dims[d];
+	}
+	if (points > PME_MAX_POINTS)
+		return 1;
+
+	// The origin only shifts the mesh, so it does not change the solution
+	m_min = minBound;
+	if (m_coeff == ewaldCoeff && m_order == order && box.x == m_box.x &&
+	    box.y == m_box.y && box.z == m_box.z &&
+	    std::equal(dims, dims + 3, m_dims))
+		return 0;
+	m_box = box;
+	m_coeff = ewaldCoeff;
+	m_order = order;
+	std::copy(dims, dims + 3, m_dims);
+
+	const size_t total = (size_t)points;
+	m_mesh[0].assign(total, Complex(0));
+	m_mesh[1].assign(total, Complex(0));
+	std::vector<T> moduli[3];
+	for (int d = 0; d < 3; d++) {
+		m_twiddles[d].resize(dims[d] / 2);
+		for (size_t k = 0; k < dims[d] / 2; k++)
+			m_twiddles[d][k] =
+				std::polar((T)1, (T)(-2 * M_PI * k / dims[d]));
+		moduli[d] = SplineModuli<T>(dims[d], order);
+	}
+
+	/*
+	 * G(m) = exp(-pi^2 m^2 / coeff^2) / (pi V m^2 B(m)), where m is the
+	 * reciprocal vector of the frequency (mx / Lx, my / Ly, mz / Lz), and B
+	 * the product of the spline moduli. Frequencies past half the mesh stand
+	 * for negative ones.
+	 */
+	m_influence.resize(total);
+	const double volume = (double)box.x * box.y * box.z;
+	const double factor = M_PI * M_PI / ((double)ewaldCoeff * ewaldCoeff);
+	for (size_t z = 0; z < dims[2]; z++) {
+		const double mz = (z <= dims[2] / 2 ? (double)z :
+				   (double)z - dims[2]) / box.z;
+		for (size_t y = 0; y < dims[1]; y++) {
+			const double my = (y <= dims[1] / 2 ? (double)y :
+					   (double)y - dims[1]) / box.y;
+			const size_t row = (z * dims[1] + y) * dims[0];
+			for (size_t x = 0; x < dims[0]; x++) {
+				const double mx =
+					(x <= dims[0] / 2 ? (double)x :
+					 (double)x - dims[0]) / box.x;
+				const double mSq = mx * mx + my * my + mz * mz;
+				const double modulus = (double)moduli[0][x] *
+						       moduli[1][y] *
+						       moduli[2][z];
+				m_influence[row + x] =
+					mSq > 0 ? (T)(exp(-factor * mSq) /
+						      (M_PI * volume * mSq *
+						       modulus)) :
+						  0;
+			}
+		}
+	}
+	return 0;
+}
+
+template <class T> void PMESolver<T>::Clear()
+{
+	std::fill(m_mesh[0].begin(), m_mesh[0].end(), Complex(0));
+	std::fill(m_mesh[1].begin(), m_mesh[1].end(), Complex(0));
+	m_flop = 0;
+}
+
+template <class T>
+void PMESolver<T>::Locate(const Vector3<T> point, size_t base[3], T *theta,
+			  T *dtheta) const
+{
+	const T rel[3] = { (point.x - m_min.x) / m_box.x,
+			   (point.y - m_min.y) / m_box.y,
+			   (point.z - m_min.z) / m_box.z };
+	for (int d = 0; d < 3; d++) {
+		const size_t dim = m_dims[d];
+		// Periodic images of the point fall on the same mesh points
+		T u = (rel[d] - floor(rel[d])) * dim;
+		if (!(u < dim))
+			u = 0;
+		const T whole = floor(u);
+		base[d] = ((size_t)whole + dim - m_order + 1) % dim;
+		FillSpline(u - whole, m_order, theta + d * m_order,
+			   dtheta ? dtheta + d * m_order : NULL);
+	}
+}
+
+/**
+ * The charges are first sorted by the plane of their first mesh point. Each
+ * plane of the mesh is then filled by a single thread, from the charges whose
+ * splines reach it, so the threads need no locks and the sums are the same
+ * from run to run.
+ */
+template <class T>
+void PMESolver<T>::Spread(ThreadPool &pool, const Vector3<T *> pos,
+			  const T *charge, const Vector3<T *> current,
+			  const size_t n)
+{
+	if (!n)
+		return;
+	const unsigned int order = m_order;
+	const size_t *dims = m_dims;
+	m_theta.resize(n * 3 * order);
+	m_base.resize(n * 3);
+	T *theta = &m_theta[0];
+	size_t *base = &m_base[0];
+
+	pool.ParallelFor(
+		0, n, PME_CHARGES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				Locate(point, base + 3 * i,
+				       theta + 3 * order * i, NULL);
+			}
+		});
+
+	m_planeStart.assign(dims[2] + 1, 0);
+	m_planeIndex.resize(n);
+	for (size_t i = 0; i < n; i++)
+		m_planeStart[base[3 * i + 2] + 1]++;
+	for (size_t z = 0; z < dims[2]; z++)
+		m_planeStart[z + 1] += m_planeStart[z];
+	std::vector<size_t> next(m_planeStart.begin(), m_planeStart.end() - 1);
+	for (size_t i = 0; i < n; i++)
+		m_planeIndex[next[base[3 * i + 2]]++] = (unsigned int)i;
+
+	const size_t *planeStart = &m_planeStart[0];
+	const unsigned int *planeIndex = &m_planeIndex[0];
+	Complex *mesh0 = &m_mesh[0][0], *mesh1 = &m_mesh[1][0];
+	pool.ParallelFor(0, dims[2], 1, [&](size_t begin, size_t end,
+					    size_t thread) {
+		size_t xIndex[PME_MAX_ORDER];
+		for (size_t z = begin; z < end; z++) {
+			for (unsigned int mz = 0; mz < order; mz++) {
+				const size_t plane = (z + dims[2] - mz) % dims[2];
+				for (size_t k = planeStart[plane];
+				     k < planeStart[plane + 1]; k++) {
+					const size_t i = planeIndex[k];
+					const T *th = theta + 3 * order * i;
+					const size_t *b = base + 3 * i;
+					const T wz = th[2 * order + mz];
+					Complex a0(charge[i] * wz, 0), a1(0, 0);
+					if (current.x) {
+						a0.imag(current.x[i] * wz);
+						a1 = Complex(current.y[i] * wz,
+							     current.z[i] * wz);
+					}
+					for (unsigned int m = 0; m < order; m++)
+						xIndex[m] = (b[0] + m) % dims[0];
+					for (unsigned int my = 0; my < order;
+					     my++) {
+						const size_t y =
+							(b[1] + my) % dims[1];
+						const size_t row =
+							(z * dims[1] + y) *
+							dims[0];
+						const T wy = th[order + my];
+						const Complex c0 = a0 * wy;
+						const Complex c1 = a1 * wy;
+						for (unsigned int mx = 0;
+						     mx < order; mx++) {
+							const T wx = th[mx];
+							const size_t at =
+								row + xIndex[mx];
+							mesh0[at] += c0 * wx;
+							mesh1[at] += c1 * wx;
+						}
+					}
+				}
+			}
+		}
+	});
+	m_flop += (double)n * order * order * order * PME_SPREAD_FLOP;
+}
+
+/// Transforms the mesh along x, then y, then z, one line at a time
+template <class T>
+void PMESolver<T>::Transform(ThreadPool &pool, Complex *mesh,
+			     const bool inverse)
+{
+	const size_t nx = m_dims[0], ny = m_dims[1], nz = m_dims[2];
+	const Complex *twiddles[3] = { &m_twiddles[0][0], &m_twiddles[1][0],
+				       &m_twiddles[2][0] };
+
+	pool.ParallelFor(0, ny * nz, 16, [&](size_t begin, size_t end,
+					     size_t thread) {
+		for (size_t line = begin; line < end; line++)
+			FFT(mesh + line * nx, nx, twiddles[0], inverse);
+	});
+	// Lines along y and z are strided, so they go through a copy
+	pool.ParallelFor(0, nz, 1, [&](size_t begin, size_t end,
+				       size_t thread) {
+		std::vector<Complex> line(ny);
+		for (size_t z = begin; z < end; z++) {
+			Complex *plane = mesh + z * ny * nx;
+			for (size_t x = 0; x < nx; x++) {
+				for (size_t y = 0; y < ny; y++)
+					line[y] = plane[y * nx + x];
+				FFT(&line[0], ny, twiddles[1], inverse);
+				for (size_t y = 0; y < ny; y++)
+					plane[y * nx + x] = line[y];
+			}
+		}
+	});
+	pool.ParallelFor(0, ny, 1, [&](size_t begin, size_t end,
+				       size_t thread) {
+		std::vector<Complex> line(nz);
+		for (size_t y = begin; y < end; y++) {
+			for (size_t x = 0; x < nx; x++) {
+				Complex *first = mesh + y * nx + x;
+				for (size_t z = 0; z < nz; z++)
+					line[z] = first[z * ny * nx];
+				FFT(&line[0], nz, twiddles[2], inverse);
+				for (size_t z = 0; z < nz; z++)
+					first[z * ny * nx] = line[z];
+			}
+		}
+	});
+
+	const double points = (double)nx * ny * nz;
+	m_flop += points * PME_FFT_FLOP * log2(points);
+}
+
+/**
+ * The potential at mesh point k is the inverse transform of G times the
+ * transform of the density. G is real and even, so the real and imaginary
+ * densities packed in a mesh come out as the real and imaginary potentials.
+ */
+template <class T> void PMESolver<T>::Solve(ThreadPool &pool)
+{
+	const size_t planeSize = m_dims[0] * m_dims[1];
+	const T *influence = &m_influence[0];
+	for (int c = 0; c < 2; c++) {
+		Complex *mesh = &m_mesh[c][0];
+		Transform(pool, mesh, false);
+		pool.ParallelFor(0, m_dims[2], 1, [&](size_t begin, size_t end,
+						      size_t thread) {
+			for (size_t k = begin * planeSize; k < end * planeSize;
+			     k++)
+				mesh[k] *= influence[k];
+		});
+		Transform(pool, mesh, true);
+	}
+	m_flop += 2.0 * 2 * m_influence.size();
+}
+
+/**
+ * The fields are gradients of the potentials at the point: E = -grad phi, and
+ * B = curl A, where phi is the potential of the charges and A that of the
+ * currents. The gradients come from the derivatives of the splines.
+ */
+template <class T>
+void PMESolver<T>::Gather(ThreadPool &pool, const Vector3<T *> pos,
+			  const size_t n, const Vector3<T *> fieldE,
+			  const Vector3<T *> fieldB)
+{
+	const unsigned int order = m_order;
+	const size_t *dims = m_dims;
+	const Complex *mesh0 = &m_mesh[0][0], *mesh1 = &m_mesh[1][0];
+	// Mesh points per unit length, to turn derivatives by u into ones by x
+	const T scale[3] = { dims[0] / m_box.x, dims[1] / m_box.y,
+			     dims[2] / m_box.z };
+
+	pool.ParallelFor(
+		0, n, PME_CHARGES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			T theta[3 * PME_MAX_ORDER], dtheta[3 * PME_MAX_ORDER];
+			size_t xIndex[PME_MAX_ORDER];
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				size_t b[3];
+				Locate(point, b, theta, dtheta);
+				const T *tx = theta, *ty = theta + order,
+					*tz = theta + 2 * order;
+				const T *dx = dtheta, *dy = dtheta + order,
+					*dz = dtheta + 2 * order;
+				for (unsigned int m = 0; m < order; m++)
+					xIndex[m] = (b[0] + m) % dims[0];
+
+				// Gradients of (phi, Ax) and of (Ay, Az)
+				Complex g0[3], g1[3];
+				for (int d = 0; d < 3; d++)
+					g0[d] = g1[d] = Complex(0);
+				for (unsigned int mz = 0; mz < order; mz++) {
+					const size_t z = (b[2] + mz) % dims[2];
+					for (unsigned int my = 0; my < order;
+					     my++) {
+						const size_t y =
+							(b[1] + my) % dims[1];
+						const size_t row =
+							(z * dims[1] + y) *
+							dims[0];
+						const T wyz = ty[my] * tz[mz];
+						const T wdy = dy[my] * tz[mz];
+						const T wdz = ty[my] * dz[mz];
+						for (unsigned int mx = 0;
+						     mx < order; mx++) {
+							const size_t at =
+								row + xIndex[mx];
+							const Complex c0 =
+								mesh0[at];
+							const Complex c1 =
+								mesh1[at];
+							const T gx = dx[mx] * wyz;
+							const T gy = tx[mx] * wdy;
+							const T gz = tx[mx] * wdz;
+							g0[0] += c0 * gx;
+							g0[1] += c0 * gy;
+							g0[2] += c0 * gz;
+							g1[0] += c1 * gx;
+							g1[1] += c1 * gy;
+							g1[2] += c1 * gz;
+						}
+					}
+				}
+				for (int d = 0; d < 3; d++) {
+					g0[d] *= scale[d];
+					g1[d] *= scale[d];
+				}
+
+				fieldE.x[i] = -g0[0].real();
+				fieldE.y[i] = -g0[1].real();
+				fieldE.z[i] = -g0[2].real();
+				// d/dy Az - d/dz Ay, d/dz Ax - d/dx Az, ...
+				fieldB.x[i] = g1[1].imag() - g1[2].real();
+				fieldB.y[i] = g0[2].imag() - g1[0].imag();
+				fieldB.z[i] = g1[0].real() - g0[1].imag();
+			}
+		});
+	m_flop += (double)n * order * order * order * PME_GATHER_FLOP;
+}
+
+template class PMESolver<float>;
+template class PMESolver<double>;
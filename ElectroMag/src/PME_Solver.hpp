@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PME_SOLVER_HPP
+#define _PME_SOLVER_HPP
+
+#include "Vector.h"
+#include "Thread_Pool.hpp"
+#include <complex>
+#include <vector>
+
+/// Highest order of the interpolating B-splines
+#define PME_MAX_ORDER 12
+
+/**=============================================================================
+ * \brief Smooth particle mesh Ewald solver for periodic boxes
+ *
+ * Computes the reciprocal space part of the Ewald sums of the electric field,
+ * and of the magnetic field of moving charges, in a rectangular periodic box
+ * (Essmann et al., J. Chem. Phys. 103, 8577). Charges are spread onto a mesh
+ * with cardinal B-splines, convolved with the Ewald influence function through
+ * FFTs, and the gradients interpolated back with the derivatives of the same
+ * splines.
+ *
+ * The magnetic field is the curl of the vector potential of the current
+ * elements q v, each component of which is solved like a charge density. The
+ * four densities are packed in pairs into two complex meshes, so a step takes
+ * two transforms each way.
+ *
+ * As in the direct sums, fields are not multiplied by their constants. The
+ * k = 0 term is left out, as if a uniform background neutralized the box.
+ * ===========================================================================*/
+template <class T> class PMESolver {
+public:
+	PMESolver();
+
+	/**
+	 * \brief Prepares the mesh for the box [minBound, maxBound]
+	 *
+	 * Every side of the box gets the smallest power of two of mesh points
+	 * at most 'spacing' apart, and at least 'order' of them. Nothing is
+	 * recomputed if the parameters did not change since the last call.
+	 * @param ewaldCoeff Splitting parameter; see EwaldCoefficient()
+	 * @param order Order of the B-splines, from 3 to PME_MAX_ORDER
+	 * @return 0 on success, or 1 if the parameters are invalid or the mesh
+	 * is too large
+	 */
+	int Setup(const Vector3<T> minBound, const Vector3<T> maxBound,
+		  const T ewaldCoeff, const T spacing, const unsigned int order);
+
+	/// Empties the mesh before the charges of a step are spread
+	void Clear();
+	/**
+	 * \brief Spreads 'n' charges onto the mesh
+	 *
+	 * Can be called several times between Clear() and Solve() to add
+	 * several sets of charges. A NULL current.x means the charges are still.
+	 */
+	void Spread(ThreadPool &pool, const Vector3<T *> pos, const T *charge,
+		    const Vector3<T *> current, const size_t n);
+	/// Turns the spread densities into potentials
+	void Solve(ThreadPool &pool);
+	/// Stores the reciprocal fields at 'n' points in fieldE and fieldB
+	void Gather(ThreadPool &pool, const Vector3<T *> pos, const size_t n,
+		    const Vector3<T *> fieldE, const Vector3<T *> fieldB);
+
+	/// FLOP of the mesh operations since the last Clear()
+	double GetFLOP() const
+	{
+		return m_flop;
+	}
+
+	/**
+	 * \brief Splitting parameter for a real space 'cutoff'
+	 *
+	 * The real space contributions are scaled by erfc(coeff * r), which
+	 * drops to 'tolerance' at the cutoff.
+	 */
+	static T EwaldCoefficient(const T cutoff, const T tolerance);
+
+private:
+	typedef std::complex<T> Complex;
+
+	/// Mesh coordinates of a point, and the B-splines along each axis
+	void Locate(const Vector3<T> point, size_t base[3], T *theta,
+		    T *dtheta) const;
+	void Transform(ThreadPool &pool, Complex *mesh, const bool inverse);
+
+	Vector3<T> m_min, m_box;
+	T m_coeff;
+	unsigned int m_order;
+	/// Mesh points along each axis
+	size_t m_dims[3];
+	/**
+	 * Charge and x current, then y and z current, as real and imaginary
+	 * parts. Point (x, y, z) is at (z * dims[1] + y) * dims[0] + x
+	 */
+	std::vector<Complex> m_mesh[2];
+	/// Influence function, with the B-spline moduli folded in
+	std::vector<T> m_influence;
+	/// Roots of unity for the transforms along each axis
+	std::vector<Complex> m_twiddles[3];
+	/// B-splines and first mesh point of each charge being spread
+	std::vector<T> m_theta;
+	std::vector<size_t> m_base;
+	/// Charges of Spread() sorted by the mesh plane of their first point
+	std::vector<size_t> m_planeStart;
+	std::vector<unsigned int> m_planeIndex;
+	double m_flop;
+};
+
+#endif //_PME_SOLVER_HPP
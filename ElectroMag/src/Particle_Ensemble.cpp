@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Particle_Ensemble.hpp"
+#include "Particle_Kernels.hpp"
+#include "X-Compat/HPC Timing.h"
+#include <algorithm>
+
+/// Systems in a row are padded to a multiple of this; covers any SIMD width
+#define ENSEMBLE_PAD 16
+#define ENSEMBLE_ALIGN 64
+/// Systems whose fields one task sums, as a multiple of ENSEMBLE_PAD. The
+/// sums of a task stay in registers and L1 while the sources stream past
+#define ENSEMBLE_TILE 64
+/// Rows handed to a pool thread at a time by the integrators
+#define ROWS_PER_TASK 4
+
+/**
+ * \brief Sums the fields at particle i of systems [begin, end)
+ *
+ * Every source row j != i up to 'rows' is streamed once; the sums of all the
+ * systems are kept in registers meanwhile. end - begin must be a multiple of
+ * Ops::width no larger than ENSEMBLE_TILE, and begin a multiple of it.
+ */
+template <class Ops, class T>
+static void SumEnsembleFields(const size_t i, const size_t begin,
+			      const size_t end, const size_t rows,
+			      const size_t stride, const Vector3<T *> pos,
+			      const Vector3<T *> vel, const T *charge,
+			      const Vector3<T> *statPos, const T *statCharge,
+			      const size_t nStatic, const Vector3<T *> fieldE,
+			      const Vector3<T *> fieldB)
+{
+	typedef typename Ops::Reg Reg;
+	const size_t lanes = (end - begin) / Ops::width;
+	const Reg zero = Ops::Set(0);
+	Reg px[ENSEMBLE_TILE / Ops::width], py[ENSEMBLE_TILE / Ops::width],
+		pz[ENSEMBLE_TILE / Ops::width];
+	Reg ex[ENSEMBLE_TILE / Ops::width], ey[ENSEMBLE_TILE / Ops::width],
+		ez[ENSEMBLE_TILE / Ops::width];
+	Reg bx[ENSEMBLE_TILE / Ops::width], by[ENSEMBLE_TILE / Ops::width],
+		bz[ENSEMBLE_TILE / Ops::width];
+
+	const size_t target = i * stride + begin;
+	for (size_t k = 0; k < lanes; k++) {
+		const size_t at = target + k * Ops::width;
+		px[k] = Ops::Load(&pos.x[at]);
+		py[k] = Ops::Load(&pos.y[at]);
+		pz[k] = Ops::Load(&pos.z[at]);
+		ex[k] = ey[k] = ez[k] = zero;
+		bx[k] = by[k] = bz[k] = zero;
+	}
+
+	for (size_t j = 0; j < rows; j++) {
+		if (j == i)
+			continue;
+		const size_t row = j * stride + begin;
+		for (size_t k = 0; k < lanes; k++) {
+			const size_t at = row + k * Ops::width;
+			const Reg rx = px[k] - Ops::Load(&pos.x[at]);
+			const Reg ry = py[k] - Ops::Load(&pos.y[at]);
+			const Reg rz = pz[k] - Ops::Load(&pos.z[at]);
+			// Padding particles are uncharged, and add nothing
+			const Reg w = Ops::Load(&charge[at]) *
+				      Ops::InvCube(rx * rx + ry * ry + rz * rz);
+			const Reg wx = rx * w, wy = ry * w, wz = rz * w;
+			ex[k] = ex[k] + wx;
+			ey[k] = ey[k] + wy;
+			ez[k] = ez[k] + wz;
+			// B = q v x r / |r|^3
+			const Reg vx = Ops::Load(&vel.x[at]);
+			const Reg vy = Ops::Load(&vel.y[at]);
+			const Reg vz = Ops::Load(&vel.z[at]);
+			bx[k] = bx[k] + (vy * wz - vz * wy);
+			by[k] = by[k] + (vz * wx - vx * wz);
+			bz[k] = bz[k] + (vx * wy - vy * wx);
+		}
+	}
+
+	// The static charges are the same in every system
+	for (size_t j = 0; j < nStatic; j++) {
+		const Reg sx = Ops::Set(statPos[j].x);
+		const Reg sy = Ops::Set(statPos[j].y);
+		const Reg sz = Ops::Set(statPos[j].z);
+		const Reg q = Ops::Set(statCharge[j]);
+		for (size_t k = 0; k < lanes; k++) {
+			const Reg rx = px[k] - sx;
+			const Reg ry = py[k] - sy;
+			const Reg rz = pz[k] - sz;
+			const Reg w =
+				q * Ops::InvCube(rx * rx + ry * ry + rz * rz);
+			ex[k] = ex[k] + rx * w;
+			ey[k] = ey[k] + ry * w;
+			ez[k] = ez[k] + rz * w;
+		}
+	}
+
+	for (size_t k = 0; k < lanes; k++) {
+		const size_t at = target + k * Ops::width;
+		Ops::Store(&fieldE.x[at], ex[k]);
+		Ops::Store(&fieldE.y[at], ey[k]);
+		Ops::Store(&fieldE.z[at], ez[k]);
+		Ops::Store(&fieldB.x[at], bx[k]);
+		Ops::Store(&fieldB.y[at], by[k]);
+		Ops::Store(&fieldB.z[at], bz[k]);
+	}
+}
+
+template <class T>
+ParticleEnsemble<T>::ParticleEnsemble(ThreadPool *pool)
+	: m_pool(pool), m_systems(0), m_stride(0), m_maxParticles(0),
+	  m_nStatic(0)
+{
+}
+
+template <class T> ParticleEnsemble<T>::~ParticleEnsemble()
+{
+	Free();
+}
+
+template <class T> void ParticleEnsemble<T>::Free()
+{
+	m_position.Free();
+	m_velocity.Free();
+	m_accel.Free();
+	m_charge.Free();
+	m_mass.Free();
+	m_fieldE.Free();
+	m_fieldB.Free();
+	m_count.clear();
+	m_timeStep.clear();
+	m_minBound.clear();
+	m_maxBound.clear();
+	m_systems = m_stride = m_maxParticles = 0;
+}
+
+template <class T>
+int ParticleEnsemble<T>::Resize(size_t systems, size_t maxParticles)
+{
+	Free();
+	if (!systems || !maxParticles)
+		return 0;
+
+	const size_t stride =
+		(systems + ENSEMBLE_PAD - 1) / ENSEMBLE_PAD * ENSEMBLE_PAD;
+	const size_t elements = stride * maxParticles;
+	int err = 0;
+	err |= m_position.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_velocity.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_accel.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_charge.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_mass.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_fieldE.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	err |= m_fieldB.AlignAlloc(elements, ENSEMBLE_ALIGN);
+	if (err) {
+		Free();
+		return 1;
+	}
+	m_systems = systems;
+	m_stride = stride;
+	m_maxParticles = maxParticles;
+
+	// Until loaded, every system is made of padding: uncharged particles
+	// that sit still at the origin
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_position.Memset(zero);
+	m_velocity.Memset(zero);
+	m_accel.Memset(zero);
+	m_charge.Memset(0);
+	m_mass.Memset(1);
+	m_count.assign(systems, 0);
+	m_timeStep.assign(systems, 0);
+	m_minBound.assign(systems, zero);
+	m_maxBound.assign(systems, zero);
+	return 0;
+}
+
+template <class T>
+int ParticleEnsemble<T>::Load(size_t system,
+			      Array<electro::dynamicPointCharge<T> > &particles,
+			      size_t n, const T timeStep,
+			      const Vector3<T> minBound,
+			      const Vector3<T> maxBound)
+{
+	if (system >= m_systems || n > m_maxParticles ||
+	    particles.GetSize() < n)
+		return 1;
+
+	const Vector3<T> zero = { 0, 0, 0 };
+	for (size_t i = 0; i < m_maxParticles; i++) {
+		const size_t at = i * m_stride + system;
+		if (i < n) {
+			const electro::dynamicPointCharge<T> &part =
+				particles[i];
+			m_position.write(part.staticProp.position, at);
+			m_velocity.write(part.velocity, at);
+			m_charge[at] = part.staticProp.magnitude;
+			m_mass[at] = part.mass;
+		} else {
+			m_position.write(zero, at);
+			m_velocity.write(zero, at);
+			m_charge[at] = 0;
+			m_mass[at] = 1;
+		}
+		m_accel.write(zero, at);
+	}
+	m_count[system] = n;
+	m_timeStep[system] = timeStep;
+	m_minBound[system] = minBound;
+	m_maxBound[system] = maxBound;
+	return 0;
+}
+
+template <class T>
+void ParticleEnsemble<T>::Store(size_t system,
+				Array<electro::dynamicPointCharge<T> > &particles)
+{
+	if (system >= m_systems)
+		return;
+	const size_t n = std::min(m_count[system], particles.GetSize());
+	for (size_t i = 0; i < n; i++) {
+		const size_t at = i * m_stride + system;
+		electro::dynamicPointCharge<T> &part = particles[i];
+		part.staticProp.position = m_position[at];
+		part.staticProp.magnitude = m_charge[at];
+		part.velocity = m_velocity[at];
+		part.mass = m_mass[at];
+	}
+}
+
+template <class T>
+void ParticleEnsemble<T>::LoadStatics(Array<electro::pointCharge<T> > &statics)
+{
+	m_nStatic = statics.GetSize();
+	m_staticPos.resize(m_nStatic);
+	m_staticCharge.resize(m_nStatic);
+	for (size_t i = 0; i < m_nStatic; i++) {
+		m_staticPos[i] = statics[i].position;
+		m_staticCharge[i] = statics[i].magnitude;
+	}
+}
+
+template <class T> void ParticleEnsemble<T>::ComputeFields()
+{
+	typedef SimdOps<T> Ops;
+	const size_t rows = *std::max_element(m_count.begin(), m_count.end());
+	const size_t tiles = (m_stride + ENSEMBLE_TILE - 1) / ENSEMBLE_TILE;
+	const size_t stride = m_stride, nStatic = m_nStatic;
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const T *charge = m_charge.GetDataPointer();
+	const Vector3<T *> fieldE = m_fieldE.GetDataPointers();
+	const Vector3<T *> fieldB = m_fieldB.GetDataPointers();
+	const Vector3<T> *statPos = nStatic ? &m_staticPos[0] : NULL;
+	const T *statCharge = nStatic ? &m_staticCharge[0] : NULL;
+
+	m_pool->ParallelFor(
+		0, rows * tiles, 1,
+		[&](size_t first, size_t last, size_t thread) {
+			for (size_t t = first; t < last; t++) {
+				const size_t i = t / tiles;
+				const size_t begin = (t % tiles) * ENSEMBLE_TILE;
+				const size_t end =
+					std::min(begin + ENSEMBLE_TILE, stride);
+				SumEnsembleFields<Ops>(
+					i, begin, end, rows, stride, pos, vel,
+					charge, statPos, statCharge, nStatic,
+					fieldE, fieldB);
+			}
+		});
+}
+
+template <class T> void ParticleEnsemble<T>::Drift()
+{
+	const size_t systems = m_systems, stride = m_stride;
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> acc = m_accel.GetDataPointers();
+
+	m_pool->ParallelFor(
+		0, m_maxParticles, ROWS_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++)
+			for (size_t s = 0; s < systems; s++) {
+				if (i >= m_count[s])
+					continue;
+				const size_t at = i * stride + s;
+				const T dt = m_timeStep[s], dt2 = dt / 2;
+				// v(t + dt/2) = v(t) + a(t) * dt/2
+				Vector3<T> v = { vel.x[at] + acc.x[at] * dt2,
+						 vel.y[at] + acc.y[at] * dt2,
+						 vel.z[at] + acc.z[at] * dt2 };
+				// r(t + dt) = r(t) + v(t + dt/2) * dt
+				Vector3<T> r = { pos.x[at] + v.x * dt,
+						 pos.y[at] + v.y * dt,
+						 pos.z[at] + v.z * dt };
+				BoundToBox(r, v, m_minBound[s], m_maxBound[s]);
+				pos.x[at] = r.x;
+				pos.y[at] = r.y;
+				pos.z[at] = r.z;
+				vel.x[at] = v.x;
+				vel.y[at] = v.y;
+				vel.z[at] = v.z;
+			}
+		});
+}
+
+template <class T> void ParticleEnsemble<T>::Kick()
+{
+	const size_t systems = m_systems, stride = m_stride;
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> acc = m_accel.GetDataPointers();
+	const Vector3<T *> fieldE = m_fieldE.GetDataPointers();
+	const Vector3<T *> fieldB = m_fieldB.GetDataPointers();
+	const T *charge = m_charge.GetDataPointer();
+	const T *mass = m_mass.GetDataPointer();
+
+	m_pool->ParallelFor(
+		0, m_maxParticles, ROWS_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++)
+			for (size_t s = 0; s < systems; s++) {
+				if (i >= m_count[s])
+					continue;
+				const size_t at = i * stride + s;
+				const Vector3<T> E = { fieldE.x[at],
+						       fieldE.y[at],
+						       fieldE.z[at] };
+				const Vector3<T> B = { fieldB.x[at],
+						       fieldB.y[at],
+						       fieldB.z[at] };
+				const Vector3<T> v = { vel.x[at], vel.y[at],
+						       vel.z[at] };
+				// a(t + dt) = F(r(t + dt)) / m
+				const Vector3<T> a = Acceleration(
+					E, B, v, charge[at], mass[at]);
+				// v(t + dt) = v(t + dt/2) + a(t + dt) * dt/2
+				const T dt2 = m_timeStep[s] / 2;
+				vel.x[at] = v.x + a.x * dt2;
+				vel.y[at] = v.y + a.y * dt2;
+				vel.z[at] = v.z + a.z * dt2;
+				acc.x[at] = a.x;
+				acc.y[at] = a.y;
+				acc.z[at] = a.z;
+			}
+		});
+}
+
+template <class T>
+int ParticleEnsemble<T>::Step(Array<electro::pointCharge<T> > &statics,
+			      perfPacket &perfData)
+{
+	if (!m_systems)
+		return 1;
+	if (!m_pool)
+		m_pool = &ThreadPool::GetGlobal();
+
+	PerfTimer timer;
+	timer.start();
+	LoadStatics(statics);
+	Drift();
+	double integrateTime = timer.tick();
+	ComputeFields();
+	const double forceTime = timer.tick();
+	Kick();
+	integrateTime += timer.tick();
+
+	perfData.add(TimingInfo("Ensemble field summation", forceTime));
+	perfData.add(TimingInfo("Ensemble integration", integrateTime));
+
+	// Padding is summed over as well, but not counted
+	double FLOP = 0;
+	for (size_t s = 0; s < m_systems; s++) {
+		const double n = (double)m_count[s];
+		FLOP += n * (n - 1) * DYNAMIC_PAIR_FLOP +
+			n * m_nStatic * STATIC_PAIR_FLOP +
+			n * PARTICLE_STEP_FLOP;
+	}
+	const double time = integrateTime + forceTime;
+	const double doneFLOP = perfData.performance * 1E9 * perfData.time;
+	perfData.time += time;
+	if (perfData.time > 0)
+		perfData.performance =
+			(doneFLOP + FLOP) / perfData.time / 1E9;
+	return 0;
+}
+
+template <class T> T ParticleEnsemble<T>::KineticEnergy(size_t system)
+{
+	if (system >= m_systems)
+		return 0;
+	T energy = 0;
+	for (size_t i = 0; i < m_count[system]; i++) {
+		const size_t at = i * m_stride + system;
+		const Vector3<T> v = m_velocity[at];
+		energy += m_mass[at] * vec3LenSq(v) / 2;
+	}
+	return energy;
+}
+
+template class ParticleEnsemble<float>;
+template class ParticleEnsemble<double>;
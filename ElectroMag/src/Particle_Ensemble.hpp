@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PARTICLE_ENSEMBLE_HPP
+#define _PARTICLE_ENSEMBLE_HPP
+
+#include "Electrodynamics.h"
+#include "SOA_utils.hpp"
+#include "Thread_Pool.hpp"
+#include <vector>
+
+/**=============================================================================
+ * \brief Many small, independent particle systems stepped together
+ *
+ * Each system holds up to the same number of particles, moving in the field of
+ * the shared static charges and of the other particles of its own system, and
+ * has its own box and time step. Particle i of every system lies in a row,
+ * system after system, so that the field sums take a register of systems at a
+ * time: one pair (i, j) is evaluated in as many systems as fit in a register,
+ * with no gathers. Systems with fewer particles are padded with uncharged ones,
+ * which do not move.
+ *
+ * Systems are integrated with velocity Verlet and reflected back into their
+ * box, as ParticleSystem does with PAIRS_DIRECT.
+ * ===========================================================================*/
+template <class T> class ParticleEnsemble {
+public:
+	/// @param pool Pool running the steps; NULL uses the process-wide pool
+	explicit ParticleEnsemble(ThreadPool *pool = NULL);
+	~ParticleEnsemble();
+
+	/**
+	 * \brief Makes room for 'systems' systems of up to 'maxParticles'
+	 *
+	 * Every system starts empty.
+	 * @return 0 on success, or 1 if memory cannot be allocated
+	 */
+	int Resize(size_t systems, size_t maxParticles);
+
+	/**
+	 * \brief Copies the first 'n' particles into system 'system'
+	 *
+	 * The system moves in the box [minBound, maxBound] by 'timeStep' every
+	 * Step(). Accelerations start at zero.
+	 * @return 0 on success, or 1 if the system does not exist or 'n' does
+	 * not fit
+	 */
+	int Load(size_t system, Array<electro::dynamicPointCharge<T> > &particles,
+		 size_t n, const T timeStep, const Vector3<T> minBound,
+		 const Vector3<T> maxBound);
+	/// Copies the particles of system 'system' back to 'particles'
+	void Store(size_t system,
+		   Array<electro::dynamicPointCharge<T> > &particles);
+
+	/**
+	 * \brief Advances every system by its own time step
+	 *
+	 * The time of each phase is added to perfData.stepTimes; perfData.time
+	 * and perfData.performance accumulate over consecutive steps.
+	 * @return 0 on success
+	 */
+	int Step(Array<electro::pointCharge<T> > &statics, perfPacket &perfData);
+
+	/// Kinetic energy of the particles of system 'system'
+	T KineticEnergy(size_t system);
+
+	size_t GetSystemCount() const
+	{
+		return m_systems;
+	}
+	size_t GetSize(size_t system) const
+	{
+		return system < m_systems ? m_count[system] : 0;
+	}
+
+	void SetThreadPool(ThreadPool *pool)
+	{
+		m_pool = pool;
+	}
+
+private:
+	ParticleEnsemble(const ParticleEnsemble &);
+	ParticleEnsemble &operator=(const ParticleEnsemble &);
+
+	/// Transposes the static charges into m_staticPos and m_staticCharge
+	void LoadStatics(Array<electro::pointCharge<T> > &statics);
+	/// Sums the fields at the current positions into m_fieldE and m_fieldB
+	void ComputeFields();
+	/// Half kick with m_accel, then drift, over each system's time step
+	void Drift();
+	/// Turns the fields into accelerations, and kicks with them over half
+	/// of each system's time step
+	void Kick();
+	void Free();
+
+	/// Pool that executes the steps
+	ThreadPool *m_pool;
+	/// Systems, and the systems in a row, padded to whole registers
+	size_t m_systems, m_stride;
+	/// Particles per system, at most
+	size_t m_maxParticles;
+	/// Element (i, s), particle i of system s, is at i * m_stride + s
+	Vector3<Array<T> > m_position, m_velocity, m_accel;
+	Array<T> m_charge, m_mass;
+	/// Fields at the particles, without their constants
+	Vector3<Array<T> > m_fieldE, m_fieldB;
+	/// Particles, time step and box of each system
+	std::vector<size_t> m_count;
+	std::vector<T> m_timeStep;
+	std::vector<Vector3<T> > m_minBound, m_maxBound;
+	/// Static charges
+	size_t m_nStatic;
+	std::vector<Vector3<T> > m_staticPos;
+	std::vector<T> m_staticCharge;
+};
+
+#endif //_PARTICLE_ENSEMBLE_HPP
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PARTICLE_KERNELS_HPP
+#define _PARTICLE_KERNELS_HPP
+
+/*
+ * Building blocks shared by the particle integrators: register operations for
+ * the field sums, the Lorentz force and the reflecting box.
+ */
+#include "Electrodynamics.h"
+#include "Magnetics.h"
+
+/// FLOP of one static charge acting on a particle
+#define STATIC_PAIR_FLOP 18
+/// FLOP of one dynamic particle acting on another
+#define DYNAMIC_PAIR_FLOP 33
+/// FLOP per particle outside the source loops: kicks, drift and force
+#define PARTICLE_STEP_FLOP 42
+/// FLOP of one Boris kick of a particle, and of its relativistic variant
+#define BORIS_KICK_FLOP 56
+#define BORIS_RELATIVISTIC_KICK_FLOP 90
+/// FLOP of the drift of a particle
+#define PARTICLE_MOVE_FLOP 6
+
+/// Speed of light in vacuum, in m/s
+#define light_c 2.99792458E8
+
+/*
+ * Register operations used by the field sums. ScalarOps processes one element
+ * at a time; SimdOps, where available, as many as fit in an SSE register.
+ */
+template <class T> struct ScalarOps {
+	typedef T Reg;
+	enum { width = 1 };
+	static Reg Load(const T *ptr)
+	{
+		return *ptr;
+	}
+	static void Store(T *ptr, const Reg value)
+	{
+		*ptr = value;
+	}
+	static Reg Set(const T value)
+	{
+		return value;
+	}
+	/// 1 / |r|^3, or 0 for coincident charges
+	static Reg InvCube(const Reg lenSq)
+	{
+		return lenSq > 0 ? 1 / (lenSq * sqrt(lenSq)) : 0;
+	}
+	static T Sum(const Reg value)
+	{
+		return value;
+	}
+};
+
+#if (defined(__GNUC__) && defined(__SSE2__)) || defined(_MSC_VER) || \
+	defined(__INTEL_COMPILER)
+#include "SSE math.h"
+
+template <class T> struct SimdOps;
+
+template <> struct SimdOps<float> {
+	typedef __m128 Reg;
+	enum { width = 4 };
+	static Reg Load(const float *ptr)
+	{
+		return _mm_load_ps(ptr);
+	}
+	static void Store(float *ptr, const Reg value)
+	{
+		_mm_store_ps(ptr, value);
+	}
+	static Reg Set(const float value)
+	{
+		return _mm_set1_ps(value);
+	}
+	static Reg InvCube(const Reg lenSq)
+	{
+		const Reg inv = _mm_div_ps(_mm_set1_ps(1),
+					   _mm_mul_ps(lenSq, _mm_sqrt_ps(lenSq)));
+		return _mm_and_ps(inv, _mm_cmpgt_ps(lenSq, _mm_setzero_ps()));
+	}
+	static float Sum(const Reg value)
+	{
+		float lanes[4];
+		_mm_storeu_ps(lanes, value);
+		return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+};
+
+template <> struct SimdOps<double> {
+	typedef __m128d Reg;
+	enum { width = 2 };
+	static Reg Load(const double *ptr)
+	{
+		return _mm_load_pd(ptr);
+	}
+	static void Store(double *ptr, const Reg value)
+	{
+		_mm_store_pd(ptr, value);
+	}
+	static Reg Set(const double value)
+	{
+		return _mm_set1_pd(value);
+	}
+	static Reg InvCube(const Reg lenSq)
+	{
+		const Reg inv = _mm_div_pd(_mm_set1_pd(1),
+					   _mm_mul_pd(lenSq, _mm_sqrt_pd(lenSq)));
+		return _mm_and_pd(inv, _mm_cmpgt_pd(lenSq, _mm_setzero_pd()));
+	}
+	static double Sum(const Reg value)
+	{
+		double lanes[2];
+		_mm_storeu_pd(lanes, value);
+		return lanes[0] + lanes[1];
+	}
+};
+#else
+template <class T> struct SimdOps : public ScalarOps<T> {
+};
+#endif
+
+/**
+ * \brief Confines a particle to a rectangular box in the limits boxMin, boxMax
+ */
+template <class T>
+inline void BoundToBox(Vector3<T> &position, Vector3<T> &velocity,
+		       const Vector3<T> boxMin, const Vector3<T> boxMax)
+{
+	if (position.x > boxMax.x) {
+		position.x = 2 * boxMax.x - position.x;
+		velocity.x = -velocity.x;
+	}
+	if (position.y > boxMax.y) {
+		position.y = 2 * boxMax.y - position.y;
+		velocity.y = -velocity.y;
+	}
+	if (position.z > boxMax.z) {
+		position.z = 2 * boxMax.z - position.z;
+		velocity.z = -velocity.z;
+	}
+
+	if (position.x < boxMin.x) {
+		position.x = 2 * boxMin.x - position.x;
+		velocity.x = -velocity.x;
+	}
+	if (position.y < boxMin.y) {
+		position.y = 2 * boxMin.y - position.y;
+		velocity.y = -velocity.y;
+	}
+	if (position.z < boxMin.z) {
+		position.z = 2 * boxMin.z - position.z;
+		velocity.z = -velocity.z;
+	}
+}
+
+/**
+ * \brief Acceleration of a particle from the fields at its position
+ *
+ * E and B are sums of q r/|r|^3 and q v x r/|r|^3 over the sources.
+ */
+template <class T>
+inline Vector3<T> Acceleration(const Vector3<T> E, const Vector3<T> B,
+			       const Vector3<T> v, const T charge, const T mass)
+{
+	// F = q(E + v x B)
+	const Vector3<T> F =
+		(E * (T)electro_k + vec3Cross(v, B * (T)magneto_k)) * charge;
+	return F / mass;
+}
+
+/**
+ * \brief Kicks particles [begin, end) over 'dt' with the Boris scheme
+ *
+ * The electric field accelerates the particles over half of 'dt', the magnetic
+ * field rotates their velocities, and the electric field accelerates them over
+ * the other half. The rotation keeps the speed, so a step need not resolve the
+ * gyration in a strong magnetic field to stay stable. E and B are as given to
+ * Acceleration().
+ *
+ * If 'relativistic' is set, the kicks act on the momentum per unit mass, gamma
+ * v, and the rotation slows down by gamma. Speeds must stay below light_c.
+ * end - begin must be a multiple of Ops::width, and the arrays aligned for
+ * Ops::Load from begin.
+ */
+template <class Ops, bool relativistic, class T>
+inline void BorisKickRange(const size_t begin, const size_t end,
+			   const Vector3<T *> vel, const Vector3<T *> E,
+			   const Vector3<T *> B, const T *charge,
+			   const T *mass, const T dt)
+{
+	typedef typename Ops::Reg Reg;
+	const Reg one = Ops::Set(1), halfStep = Ops::Set(dt / 2);
+	const Reg eConst = Ops::Set((T)electro_k);
+	const Reg bConst = Ops::Set((T)magneto_k);
+	const Reg invCSq = Ops::Set((T)(1 / (light_c * light_c)));
+	for (size_t i = begin; i < end; i += Ops::width) {
+		const Reg qm = Ops::Load(&charge[i]) / Ops::Load(&mass[i]) *
+			       halfStep;
+		const Reg eScale = qm * eConst, bScale = qm * bConst;
+		Reg ux = Ops::Load(&vel.x[i]), uy = Ops::Load(&vel.y[i]),
+		    uz = Ops::Load(&vel.z[i]);
+		Reg gamma = one;
+		if (relativistic) {
+			gamma = one / sqrt(one - (ux * ux + uy * uy + uz * uz) *
+							 invCSq);
+			ux = ux * gamma;
+			uy = uy * gamma;
+			uz = uz * gamma;
+		}
+		// u- = u + q/m E dt/2
+		const Reg ax = Ops::Load(&E.x[i]) * eScale;
+		const Reg ay = Ops::Load(&E.y[i]) * eScale;
+		const Reg az = Ops::Load(&E.z[i]) * eScale;
+		ux = ux + ax;
+		uy = uy + ay;
+		uz = uz + az;
+		if (relativistic)
+			gamma = sqrt(one + (ux * ux + uy * uy + uz * uz) *
+						   invCSq);
+		// Rotate u- by 2 atan(|t|) around t = q/m B dt/2 / gamma
+		const Reg tScale = bScale / gamma;
+		const Reg tx = Ops::Load(&B.x[i]) * tScale;
+		const Reg ty = Ops::Load(&B.y[i]) * tScale;
+		const Reg tz = Ops::Load(&B.z[i]) * tScale;
+		const Reg sScale = (one + one) / (one + tx * tx + ty * ty +
+						  tz * tz);
+		const Reg sx = tx * sScale, sy = ty * sScale, sz = tz * sScale;
+		const Reg wx = ux + (uy * tz - uz * ty);
+		const Reg wy = uy + (uz * tx - ux * tz);
+		const Reg wz = uz + (ux * ty - uy * tx);
+		// u+ + q/m E dt/2
+		ux = ux + (wy * sz - wz * sy) + ax;
+		uy = uy + (wz * sx - wx * sz) + ay;
+		uz = uz + (wx * sy - wy * sx) + az;
+		if (relativistic) {
+			const Reg invGamma = one / sqrt(one + (ux * ux +
+				uy * uy + uz * uz) * invCSq);
+			ux = ux * invGamma;
+			uy = uy * invGamma;
+			uz = uz * invGamma;
+		}
+		Ops::Store(&vel.x[i], ux);
+		Ops::Store(&vel.y[i], uy);
+		Ops::Store(&vel.z[i], uz);
+	}
+}
+
+/**
+ * \brief BorisKickRange() over any range, a register at a time where possible
+ *
+ * 'begin' must be a multiple of the SIMD width, and the arrays aligned.
+ */
+template <bool relativistic, class T>
+inline void BorisKick(const size_t begin, const size_t end,
+		      const Vector3<T *> vel, const Vector3<T *> E,
+		      const Vector3<T *> B, const T *charge, const T *mass,
+		      const T dt)
+{
+	const size_t width = SimdOps<T>::width;
+	const size_t mid = begin + (end - begin) / width * width;
+	BorisKickRange<SimdOps<T>, relativistic>(begin, mid, vel, E, B,
+						 charge, mass, dt);
+	BorisKickRange<ScalarOps<T>, relativistic>(mid, end, vel, E, B,
+						   charge, mass, dt);
+}
+
+#endif //_PARTICLE_KERNELS_HPP
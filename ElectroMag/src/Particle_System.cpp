@@ -6,186 +6,1563 @@
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
  * (at your option) any later version.
- * 
+ *
  * ElectroMag is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  *  GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "Electrostatics.h"
-#include "Electrodynamics.h"
-#include "Magnetics.h"
-#include "Data Structures.h"
+#include "Particle_System.hpp"
+#include "Particle_Kernels.hpp"
 #include "X-Compat/HPC Timing.h"
+#include <algorithm>
+
+/// Particles handed to a pool thread at a time
+#define PARTICLES_PER_TASK 16
+/// Arrays are padded to a multiple of this many elements; covers any SIMD width
+#define PARTICLE_PAD 16
+#define PARTICLE_ALIGN 64
+/// Limit on the cells of a PAIRS_CUTOFF grid, per charge binned in it
+#define CELLS_PER_PARTICLE 4
+/// Relative size of the real space Ewald fields at the cutoff
+#define EWALD_TOLERANCE 1E-5
+/// Default PME mesh spacing, as a fraction of the cutoff
+#define EWALD_SPACING_PER_CUTOFF 8
+/// Fraction of the near radius over which static charges pass from the fast
+/// to the slow fields
+#define RESPA_SWITCH_FRACTION 0.2
+
+/**
+ * \brief Wraps a particle around the periodic box [boxMin, boxMin + period]
+ */
+template <class T>
+inline void WrapToBox(Vector3<T> &position, const Vector3<T> boxMin,
+		      const Vector3<T> period)
+{
+	position.x -= period.x * floor((position.x - boxMin.x) / period.x);
+	position.y -= period.y * floor((position.y - boxMin.y) / period.y);
+	position.z -= period.z * floor((position.z - boxMin.z) / period.z);
+}
+
+/// Replaces 'r' with its shortest periodic image
+template <class T>
+inline void MinimumImage(Vector3<T> &r, const Vector3<T> period,
+			 const Vector3<T> invPeriod)
+{
+	r.x -= period.x * floor(r.x * invPeriod.x + (T)0.5);
+	r.y -= period.y * floor(r.y * invPeriod.y + (T)0.5);
+	r.z -= period.z * floor(r.z * invPeriod.z + (T)0.5);
+}
+
+/**
+ * \brief Sums the fields of sources [0, count) at 'point'
+ *
+ * The electric field is accumulated into 'electroField' and, if 'magnetic' is
+ * set, the magnetic field of the moving sources into 'magneticField'. Neither
+ * is multiplied by its constant. 'count' must be a multiple of Ops::width, and
+ * the source arrays must be aligned for Ops::Load.
+ */
+template <class Ops, bool magnetic, class T>
+inline void SumFields(const Vector3<T> point, const Vector3<T *> srcPos,
+		      const Vector3<T *> srcVel, const T *srcCharge,
+		      const size_t count, Vector3<T> &electroField,
+		      Vector3<T> &magneticField)
+{
+	typedef typename Ops::Reg Reg;
+	const Reg zero = Ops::Set(0);
+	const Reg px = Ops::Set(point.x), py = Ops::Set(point.y),
+		  pz = Ops::Set(point.z);
+	Reg ex = zero, ey = zero, ez = zero, bx = zero, by = zero, bz = zero;
+
+	for (size_t j = 0; j < count; j += Ops::width) {
+		const Reg rx = px - Ops::Load(&srcPos.x[j]);
+		const Reg ry = py - Ops::Load(&srcPos.y[j]);
+		const Reg rz = pz - Ops::Load(&srcPos.z[j]);
+		// 3 FLOP
+		const Reg w = Ops::Load(&srcCharge[j]) *
+			      Ops::InvCube(rx * rx + ry * ry + rz * rz);
+		// 9 FLOP
+		ex += rx * w;
+		ey += ry * w;
+		ez += rz * w;
+		// 6 FLOP
+		if (magnetic) {
+			const Reg vx = Ops::Load(&srcVel.x[j]);
+			const Reg vy = Ops::Load(&srcVel.y[j]);
+			const Reg vz = Ops::Load(&srcVel.z[j]);
+			bx += (vy * rz - vz * ry) * w;
+			by += (vz * rx - vx * rz) * w;
+			bz += (vx * ry - vy * rx) * w;
+			// 15 FLOP
+		}
+	}
+	electroField.x += Ops::Sum(ex);
+	electroField.y += Ops::Sum(ey);
+	electroField.z += Ops::Sum(ez);
+	if (magnetic) {
+		magneticField.x += Ops::Sum(bx);
+		magneticField.y += Ops::Sum(by);
+		magneticField.z += Ops::Sum(bz);
+	}
+}
+
+/**
+ * \brief Evaluates each pair (i, j), j in [jBegin, jEnd), once
+ *
+ * The fields of every j at i are summed into fieldE[i] and fieldB[i], and the
+ * fields of i at every j are scattered into fieldE[j] and fieldB[j]. The
+ * electric contributions share r/|r|^3 and only differ in sign and charge. The
+ * magnetic field of i at j depends on the current element q v of i rather than
+ * that of j, so it takes a cross product of its own. Constants are not applied.
+ *
+ * The caller must own fieldE and fieldB outright; jBegin must be aligned for
+ * Ops::Load, and jEnd - jBegin a multiple of Ops::width.
+ */
+template <class Ops, class T>
+inline void SumPairs(const size_t i, const size_t jBegin, const size_t jEnd,
+		     const Vector3<T *> pos, const Vector3<T *> current,
+		     const T *charge, const Vector3<T *> fieldE,
+		     const Vector3<T *> fieldB)
+{
+	typedef typename Ops::Reg Reg;
+	const Reg zero = Ops::Set(0);
+	const Reg pix = Ops::Set(pos.x[i]), piy = Ops::Set(pos.y[i]),
+		  piz = Ops::Set(pos.z[i]);
+	const Reg qvix = Ops::Set(current.x[i]), qviy = Ops::Set(current.y[i]),
+		  qviz = Ops::Set(current.z[i]);
+	const Reg qi = Ops::Set(charge[i]);
+	Reg ex = zero, ey = zero, ez = zero, bx = zero, by = zero, bz = zero;
+
+	for (size_t j = jBegin; j < jEnd; j += Ops::width) {
+		const Reg rx = pix - Ops::Load(&pos.x[j]);
+		const Reg ry = piy - Ops::Load(&pos.y[j]);
+		const Reg rz = piz - Ops::Load(&pos.z[j]);
+		const Reg w = Ops::InvCube(rx * rx + ry * ry + rz * rz);
+		const Reg rwx = rx * w, rwy = ry * w, rwz = rz * w;
+		// 14 FLOP
+		const Reg qj = Ops::Load(&charge[j]);
+		ex += rwx * qj;
+		ey += rwy * qj;
+		ez += rwz * qj;
+		Ops::Store(&fieldE.x[j], Ops::Load(&fieldE.x[j]) - rwx * qi);
+		Ops::Store(&fieldE.y[j], Ops::Load(&fieldE.y[j]) - rwy * qi);
+		Ops::Store(&fieldE.z[j], Ops::Load(&fieldE.z[j]) - rwz * qi);
+		// 12 FLOP
+
+		const Reg qvjx = Ops::Load(&current.x[j]);
+		const Reg qvjy = Ops::Load(&current.y[j]);
+		const Reg qvjz = Ops::Load(&current.z[j]);
+		bx += qvjy * rwz - qvjz * rwy;
+		by += qvjz * rwx - qvjx * rwz;
+		bz += qvjx * rwy - qvjy * rwx;
+		// The vector from i to j is -r
+		Ops::Store(&fieldB.x[j], Ops::Load(&fieldB.x[j]) -
+			   (qviy * rwz - qviz * rwy));
+		Ops::Store(&fieldB.y[j], Ops::Load(&fieldB.y[j]) -
+			   (qviz * rwx - qvix * rwz));
+		Ops::Store(&fieldB.z[j], Ops::Load(&fieldB.z[j]) -
+			   (qvix * rwy - qviy * rwx));
+		// 24 FLOP
+	}
+	fieldE.x[i] += Ops::Sum(ex);
+	fieldE.y[i] += Ops::Sum(ey);
+	fieldE.z[i] += Ops::Sum(ez);
+	fieldB.x[i] += Ops::Sum(bx);
+	fieldB.y[i] += Ops::Sum(by);
+	fieldB.z[i] += Ops::Sum(bz);
+}
+
+/**
+ * \brief Adds the fields of a source to E and B, if it is within the cutoff
+ *
+ * 'r' points from the source to the field point. 'invScreening' is the inverse
+ * of the Debye length, or 0 for unscreened fields. A nonzero 'ewaldCoeff'
+ * leaves only the real space part of the Ewald sum, which is the field of the
+ * charge minus that of a Gaussian cloud of width 1 / ewaldCoeff around it.
+ * @return 1 if the source is within the cutoff, 0 otherwise
+ */
+template <bool magnetic, class T>
+inline size_t AddCutoffFields(const Vector3<T> r, const T charge,
+			      const Vector3<T> velocity, const T cutoffSq,
+			      const T invScreening, const T ewaldCoeff,
+			      Vector3<T> &E, Vector3<T> &B)
+{
+	const T lenSq = vec3LenSq(r);
+	if (!(lenSq > 0) || lenSq >= cutoffSq)
+		return 0;
+	const T len = sqrt(lenSq);
+	T w = charge / (lenSq * len);
+	if (invScreening > 0) {
+		const T x = len * invScreening;
+		w *= exp(-x) * (1 + x);
+	}
+	if (ewaldCoeff > 0) {
+		// erfc(x) + 2x / sqrt(pi) exp(-x^2)
+		const T x = len * ewaldCoeff;
+		w *= erfc(x) + (T)M_2_SQRTPI * x * exp(-x * x);
+	}
+	E += r * w;
+	if (magnetic)
+		B += vec3Cross(velocity, r) * w;
+	return 1;
+}
+
+/**
+ * \brief Share of the fast fields in a source at distance 'len'
+ *
+ * 1 within 'inner', 0 beyond 'outer', and a smooth step in between, so that
+ * sources pass from the fast to the slow fields without jumps.
+ */
+template <class T>
+inline T FastShare(const T len, const T inner, const T outer)
+{
+	if (len <= inner)
+		return 1;
+	if (len >= outer)
+		return 0;
+	const T x = (len - inner) / (outer - inner);
+	return 1 - x * x * (3 - 2 * x);
+}
+
+/**
+ * \brief Calls visit(k, image) for every point k in the 27 cells around 'cell'
+ *
+ * In a periodic grid, the cells past an edge are those at the opposite edge,
+ * shifted by one period. 'image' is the shift of the cell, coded as
+ * 9 (sz + 1) + 3 (sy + 1) + sx + 1, with sx, sy and sz the periods along each
+ * axis; see ImageShifts(). Grids less than three cells wide visit some cells
+ * more than once, under different shifts.
+ */
+template <class Grid, class Visitor>
+inline void VisitCells(const Grid &grid, const size_t cell[3], Visitor visit)
+{
+	size_t index[3][3], count[3];
+	int shift[3][3];
+	for (int d = 0; d < 3; d++) {
+		const size_t dim = grid.dims[d];
+		if (grid.periodic) {
+			for (int k = 0; k < 3; k++) {
+				const size_t c = cell[d] + dim + k - 1;
+				shift[d][k] = (int)(c / dim) - 1;
+				index[d][k] = c % dim;
+			}
+			count[d] = 3;
+		} else {
+			const size_t lo = cell[d] ? cell[d] - 1 : 0;
+			const size_t hi = cell[d] + 1 < dim ? cell[d] + 1 :
+							      cell[d];
+			for (size_t k = 0; k <= hi - lo; k++) {
+				index[d][k] = lo + k;
+				shift[d][k] = 0;
+			}
+			count[d] = hi - lo + 1;
+		}
+	}
+	for (size_t z = 0; z < count[2]; z++) {
+		const size_t plane = index[2][z] * grid.dims[1];
+		for (size_t y = 0; y < count[1]; y++) {
+			const size_t row = (plane + index[1][y]) * grid.dims[0];
+			const int rowImage = 9 * (shift[2][z] + 1) +
+					     3 * (shift[1][y] + 1) + 1;
+			for (size_t x = 0; x < count[0]; x++) {
+				const size_t c = row + index[0][x];
+				const unsigned char image =
+					(unsigned char)(rowImage + shift[0][x]);
+				const size_t last = grid.start[c + 1];
+				for (size_t k = grid.start[c]; k < last; k++)
+					visit(grid.index[k], image);
+			}
+		}
+	}
+}
+
+/// Offsets of the periodic images coded by VisitCells()
+template <class T>
+static void ImageShifts(const Vector3<T> period, Vector3<T> shifts[27])
+{
+	for (int z = -1; z <= 1; z++) {
+		for (int y = -1; y <= 1; y++) {
+			for (int x = -1; x <= 1; x++) {
+				Vector3<T> &shift =
+					shifts[9 * (z + 1) + 3 * (y + 1) + x + 1];
+				shift.x = x * period.x;
+				shift.y = y * period.y;
+				shift.z = z * period.z;
+			}
+		}
+	}
+}
+
+template <class T>
+inline bool SameVector(const Vector3<T> a, const Vector3<T> b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static size_t PadCount(size_t n)
+{
+	return (n + PARTICLE_PAD - 1) / PARTICLE_PAD * PARTICLE_PAD;
+}
+
+template <class T>
+ParticleSystem<T>::ParticleSystem(ThreadPool *pool)
+	: m_pool(pool), m_pairMode(PAIRS_SYMMETRIC), m_n(0), m_padded(0),
+	  m_nStatic(0), m_staticPadded(0), m_bufferThreads(0), m_cutoff(0),
+	  m_skin(0), m_screening(0), m_periodic(false), m_listValid(false),
+	  m_dynamicPairs(0), m_staticPairs(0), m_innerSteps(1),
+	  m_nearRadius(0), m_nearPairs(0), m_slowValid(false),
+	  m_sortInterval(0), m_stepsSinceSort(0), m_sorted(false), m_grid(NULL),
+	  m_integrator(INTEGRATE_VERLET), m_pushValid(false), m_ewaldCoeff(0),
+	  m_meshSpacing(0), m_meshOrder(0), m_meshFLOP(0)
+{
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_externalB = zero;
+}
+
+template <class T> ParticleSystem<T>::~ParticleSystem()
+{
+	Free();
+	m_staticPos.Free();
+	m_staticCharge.Free();
+}
+
+template <class T> void ParticleSystem<T>::Free()
+{
+	m_position.Free();
+	m_velocity.Free();
+	m_accel.Free();
+	m_charge.Free();
+	m_mass.Free();
+	m_fieldBuffers.Free();
+	m_current.Free();
+	m_meshE.Free();
+	m_meshB.Free();
+	m_slowE.Free();
+	m_slowB.Free();
+	m_pushE.Free();
+	m_pushB.Free();
+	m_n = m_padded = m_bufferThreads = 0;
+	m_listValid = false;
+	m_slowValid = false;
+	m_pushValid = false;
+	m_order.clear();
+}
+
+template <class T>
+int ParticleSystem<T>::Load(Array<electro::dynamicPointCharge<T> > &particles,
+			    size_t n)
+{
+	if (!n || particles.GetSize() < n)
+		return 1;
+
+	Free();
+	const size_t padded = PadCount(n);
+	int err = 0;
+	err |= m_position.AlignAlloc(padded, PARTICLE_ALIGN);
+	err |= m_velocity.AlignAlloc(padded, PARTICLE_ALIGN);
+	err |= m_accel.AlignAlloc(padded, PARTICLE_ALIGN);
+	err |= m_charge.AlignAlloc(padded, PARTICLE_ALIGN);
+	err |= m_mass.AlignAlloc(padded, PARTICLE_ALIGN);
+	if (err) {
+		Free();
+		return 1;
+	}
+	m_n = n;
+	m_padded = padded;
+
+	// Padding particles are uncharged, and sit still at the origin
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_position.Memset(zero);
+	m_velocity.Memset(zero);
+	m_accel.Memset(zero);
+	m_charge.Memset(0);
+	m_mass.Memset(1);
+	for (size_t i = 0; i < n; i++) {
+		const electro::dynamicPointCharge<T> &part = particles[i];
+		m_position.write(part.staticProp.position, i);
+		m_velocity.write(part.velocity, i);
+		m_charge[i] = part.staticProp.magnitude;
+		m_mass[i] = part.mass;
+	}
+	m_order.resize(n);
+	for (size_t i = 0; i < n; i++)
+		m_order[i] = (unsigned int)i;
+	m_stepsSinceSort = 0;
+	m_sorted = false;
+	return 0;
+}
+
+template <class T>
+void ParticleSystem<T>::Store(Array<electro::dynamicPointCharge<T> > &particles)
+{
+	for (size_t i = 0; i < m_n; i++) {
+		if (m_order[i] >= particles.GetSize())
+			continue;
+		electro::dynamicPointCharge<T> &part = particles[m_order[i]];
+		part.staticProp.position = m_position[i];
+		part.staticProp.magnitude = m_charge[i];
+		part.velocity = m_velocity[i];
+		part.mass = m_mass[i];
+	}
+}
+
+template <class T>
+electro::dynamicPointChargeSOA<T> ParticleSystem<T>::GetParticles()
+{
+	electro::dynamicPointChargeSOA<T> soa;
+	soa.position = m_position.GetDataPointers();
+	soa.velocity = m_velocity.GetDataPointers();
+	soa.mass = m_mass.GetDataPointer();
+	soa.charge = m_charge.GetDataPointer();
+	return soa;
+}
+
+template <class T> Vector3<T *> ParticleSystem<T>::GetAccelerations()
+{
+	return m_accel.GetDataPointers();
+}
+
+template <class T>
+int ParticleSystem<T>::LoadStatics(Array<electro::pointCharge<T> > &statics)
+{
+	const size_t p = statics.GetSize();
+	const size_t padded = PadCount(p);
+	if (padded != m_staticPadded) {
+		m_staticPos.Free();
+		m_staticCharge.Free();
+		m_staticPadded = 0;
+		if (padded &&
+		    (m_staticPos.AlignAlloc(padded, PARTICLE_ALIGN) ||
+		     m_staticCharge.AlignAlloc(padded, PARTICLE_ALIGN))) {
+			m_staticPos.Free();
+			m_staticCharge.Free();
+			return 1;
+		}
+		m_staticPadded = padded;
+	}
+	m_nStatic = p;
+
+	for (size_t i = 0; i < p; i++) {
+		m_staticPos.write(statics[i].position, i);
+		m_staticCharge[i] = statics[i].magnitude;
+	}
+	const Vector3<T> zero = { 0, 0, 0 };
+	for (size_t i = p; i < padded; i++) {
+		m_staticPos.write(zero, i);
+		m_staticCharge[i] = 0;
+	}
+	return 0;
+}
+
+template <class T> int ParticleSystem<T>::AllocFieldBuffers()
+{
+	const size_t threads = m_pool->GetNumThreads();
+	if (m_bufferThreads == threads)
+		return 0;
+
+	m_fieldBuffers.Free();
+	m_current.Free();
+	m_bufferThreads = 0;
+	if (m_fieldBuffers.AlignAlloc(threads * 6 * m_padded, PARTICLE_ALIGN))
+		return 1;
+	if (m_current.AlignAlloc(m_padded, PARTICLE_ALIGN)) {
+		m_fieldBuffers.Free();
+		return 1;
+	}
+	m_fieldBuffers.Memset(0);
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_current.Memset(zero);
+	m_bufferThreads = threads;
+	return 0;
+}
+
+template <class T> int ParticleSystem<T>::AllocMeshFields()
+{
+	if (m_meshE.GetSize())
+		return 0;
+	if (m_meshE.AlignAlloc(m_padded, PARTICLE_ALIGN) ||
+	    m_meshB.AlignAlloc(m_padded, PARTICLE_ALIGN) ||
+	    (!m_current.GetSize() &&
+	     m_current.AlignAlloc(m_padded, PARTICLE_ALIGN))) {
+		m_meshE.Free();
+		m_meshB.Free();
+		return 1;
+	}
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_current.Memset(zero);
+	return 0;
+}
+
+template <class T> int ParticleSystem<T>::AllocSlowFields()
+{
+	if (m_slowE.GetSize())
+		return 0;
+	if (m_slowE.AlignAlloc(m_padded, PARTICLE_ALIGN) ||
+	    m_slowB.AlignAlloc(m_padded, PARTICLE_ALIGN)) {
+		m_slowE.Free();
+		m_slowB.Free();
+		return 1;
+	}
+	return 0;
+}
+
+template <class T> int ParticleSystem<T>::AllocPushFields()
+{
+	if (m_pushE.GetSize())
+		return 0;
+	if (m_pushE.AlignAlloc(m_padded, PARTICLE_ALIGN) ||
+	    m_pushB.AlignAlloc(m_padded, PARTICLE_ALIGN)) {
+		m_pushE.Free();
+		m_pushB.Free();
+		return 1;
+	}
+	return 0;
+}
+
+template <class T>
+void ParticleSystem<T>::SetMagneticField(const Vector3<T> B)
+{
+	m_externalB = B / (T)magneto_k;
+	m_pushValid = false;
+}
+
+template <class T>
+void ParticleSystem<T>::SetEwald(T cutoff, T skin, T meshSpacing,
+				 unsigned int order)
+{
+	SetCutoff(cutoff, skin);
+	m_pairMode = PAIRS_EWALD;
+	m_periodic = true;
+	m_ewaldCoeff = cutoff > 0 ?
+		PMESolver<T>::EwaldCoefficient(cutoff, (T)EWALD_TOLERANCE) : 0;
+	m_meshSpacing = meshSpacing > 0 ? meshSpacing :
+					  cutoff / EWALD_SPACING_PER_CUTOFF;
+	m_meshOrder = order;
+}
+
+/**
+ * Forces are evaluated with the half-step velocities, both for the magnetic
+ * field of the sources and for the Lorentz force on the particle.
+ */
+template <class T>
+void ParticleSystem<T>::ComputeAccelerations(const FieldOutput &out,
+					     perfPacket &perfData)
+{
+	// The grid stands in for the sums over the static charges
+	FieldOutput sums = out;
+	if (UseGrid())
+		sums.parts &= ~FIELDS_STATIC;
+	if (m_pairMode == PAIRS_CUTOFF || m_pairMode == PAIRS_EWALD)
+		CutoffAccelerations(sums, perfData);
+	else if (m_pairMode == PAIRS_SYMMETRIC && !AllocFieldBuffers())
+		SymmetricAccelerations(sums);
+	else
+		DirectAccelerations(sums);
+	if (UseGrid() && (out.parts & FIELDS_STATIC))
+		GridStaticFields(out);
+	if (out.parts & FIELDS_NEAR)
+		NearStaticFields(out);
+}
+
+/// The uniform field goes with the fields of the dynamic particles
+template <class T>
+inline void ParticleSystem<T>::StoreFields(const FieldOutput &out,
+					   const size_t i, const Vector3<T> E,
+					   Vector3<T> B)
+{
+	if (out.parts & FIELDS_DYNAMIC)
+		B += m_externalB;
+	if (out.E.x) {
+		out.E.x[i] = E.x;
+		out.E.y[i] = E.y;
+		out.E.z[i] = E.z;
+		out.B.x[i] = B.x;
+		out.B.y[i] = B.y;
+		out.B.z[i] = B.z;
+		return;
+	}
+	const Vector3<T> a =
+		Acceleration(E, B, m_velocity[i], m_charge[i], m_mass[i]);
+	m_accel.write(a, i);
+}
+
+/**
+ * Pairs are counted as in the direct sum, so that pair modes compare on the
+ * same scale. With a cutoff, only the pairs within it are counted, plus the
+ * mesh operations of PAIRS_EWALD.
+ */
+template <class T>
+double ParticleSystem<T>::FieldFLOP(unsigned int parts) const
+{
+	const double n = (double)m_n;
+	double FLOP = 0;
+	if (UseGrid() && (parts & FIELDS_STATIC)) {
+		FLOP += n * m_grid->GetFieldFLOP();
+		parts &= ~FIELDS_STATIC;
+	}
+	if (m_pairMode == PAIRS_CUTOFF || m_pairMode == PAIRS_EWALD)
+		FLOP += (double)m_staticPairs * STATIC_PAIR_FLOP +
+			(double)m_dynamicPairs * DYNAMIC_PAIR_FLOP + m_meshFLOP;
+	else
+		FLOP += ((parts & FIELDS_STATIC) ?
+				 n * m_nStatic * STATIC_PAIR_FLOP : 0) +
+			((parts & FIELDS_DYNAMIC) ?
+				 n * (n - 1) * DYNAMIC_PAIR_FLOP : 0);
+	if (parts & FIELDS_NEAR)
+		FLOP += (double)m_nearPairs * STATIC_PAIR_FLOP;
+	return FLOP;
+}
+
+/// Every particle sums the fields of all others on its own
+template <class T>
+void ParticleSystem<T>::DirectAccelerations(const FieldOutput &out)
+{
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> statPos = m_staticPos.GetDataPointers();
+	const Vector3<T *> noVel = { NULL, NULL, NULL };
+	const T *charge = m_charge.GetDataPointer();
+	const T *statCharge = m_staticCharge.GetDataPointer();
+	const size_t padded = m_padded, staticPadded = m_staticPadded;
+	const bool statics = (out.parts & FIELDS_STATIC) != 0;
+	const bool dynamics = (out.parts & FIELDS_DYNAMIC) != 0;
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				Vector3<T> E = { 0, 0, 0 }, B = { 0, 0, 0 };
+				if (statics)
+					SumFields<SimdOps<T>, false>(
+						point, statPos, noVel,
+						statCharge, staticPadded, E, B);
+				if (dynamics)
+					SumFields<SimdOps<T>, true>(
+						point, pos, vel, charge, padded,
+						E, B);
+				StoreFields(out, i, E, B);
+			}
+		});
+}
+
+/**
+ * Each pair is evaluated once, by the thread that owns the lower index. A thread
+ * scatters into its own slice of m_fieldBuffers, so no two threads write the
+ * same element. A second pass sums the slices, adds the static charges, and
+ * clears the slices for the next step.
+ */
+template <class T>
+void ParticleSystem<T>::SymmetricAccelerations(const FieldOutput &out)
+{
+	typedef SimdOps<T> Ops;
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> statPos = m_staticPos.GetDataPointers();
+	const Vector3<T *> noVel = { NULL, NULL, NULL };
+	const T *charge = m_charge.GetDataPointer();
+	const T *statCharge = m_staticCharge.GetDataPointer();
+	const size_t padded = m_padded, staticPadded = m_staticPadded;
+	const Vector3<T *> current = m_current.GetDataPointers();
+	T *buffers = m_fieldBuffers.GetDataPointer();
+	const size_t nBuffers = m_bufferThreads;
+	const bool statics = (out.parts & FIELDS_STATIC) != 0;
+	const bool dynamics = (out.parts & FIELDS_DYNAMIC) != 0;
+	// Without pairs to scatter, the slices stay zeroed
+	const size_t scattered = dynamics ? m_n : 0;
+
+	for (size_t i = 0; i < scattered; i++) {
+		current.x[i] = charge[i] * vel.x[i];
+		current.y[i] = charge[i] * vel.y[i];
+		current.z[i] = charge[i] * vel.z[i];
+	}
+
+	m_pool->ParallelFor(
+		0, scattered, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			T *base = buffers + thread * 6 * padded;
+			const Vector3<T *> fieldE = { base, base + padded,
+						      base + 2 * padded };
+			const Vector3<T *> fieldB = { base + 3 * padded,
+						      base + 4 * padded,
+						      base + 5 * padded };
+			for (size_t i = begin; i < end; i++) {
+				// Scalar pairs up to the first aligned j
+				const size_t aligned = (i + Ops::width) /
+						       Ops::width * Ops::width;
+				SumPairs<ScalarOps<T> >(i, i + 1, aligned, pos,
+							current, charge, fieldE,
+							fieldB);
+				SumPairs<Ops>(i, aligned, padded, pos, current,
+					      charge, fieldE, fieldB);
+			}
+		});
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				Vector3<T> E = { 0, 0, 0 }, B = { 0, 0, 0 };
+				for (size_t t = 0; t < nBuffers; t++) {
+					T *field = buffers + t * 6 * padded + i;
+					E.x += field[0];
+					E.y += field[padded];
+					E.z += field[2 * padded];
+					B.x += field[3 * padded];
+					B.y += field[4 * padded];
+					B.z += field[5 * padded];
+					for (size_t k = 0; k < 6; k++)
+						field[k * padded] = 0;
+				}
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				if (statics)
+					SumFields<Ops, false>(point, statPos,
+							      noVel, statCharge,
+							      staticPadded, E,
+							      B);
+				StoreFields(out, i, E, B);
+			}
+		});
+}
+
+template <class T>
+void ParticleSystem<T>::CellGrid::Resize(const Vector3<T> min,
+					 const Vector3<T> max, T width,
+					 size_t maxCells, bool wrap)
+{
+	const T extent[3] = { max.x - min.x, max.y - min.y, max.z - min.z };
+	if (!maxCells)
+		maxCells = 1;
+	// Sparse boxes get wider cells rather than mostly empty ones
+	for (;;) {
+		double cells = 1;
+		for (int d = 0; d < 3; d++) {
+			const T fit = extent[d] / width;
+			dims[d] = fit < 1 ? 1 :
+				  fit < maxCells ? (size_t)fit : maxCells;
+			cells *= dims[d];
+		}
+		if (cells <= maxCells)
+			break;
+		width *= (T)1.25;
+	}
+	origin = min;
+	periodic = wrap;
+	invWidth.x = extent[0] > 0 ? dims[0] / extent[0] : 0;
+	invWidth.y = extent[1] > 0 ? dims[1] / extent[1] : 0;
+	invWidth.z = extent[2] > 0 ? dims[2] / extent[2] : 0;
+}
+
+template <class T>
+void ParticleSystem<T>::CellGrid::Locate(const Vector3<T> point,
+					 size_t cell[3]) const
+{
+	const T f[3] = { (point.x - origin.x) * invWidth.x,
+			 (point.y - origin.y) * invWidth.y,
+			 (point.z - origin.z) * invWidth.z };
+	for (int d = 0; d < 3; d++) {
+		if (!(f[d] > 0))
+			cell[d] = 0;
+		else if (f[d] >= dims[d])
+			cell[d] = dims[d] - 1;
+		else
+			cell[d] = (size_t)f[d];
+	}
+}
+
+template <class T>
+void ParticleSystem<T>::CellGrid::Bin(const Vector3<T *> points, size_t count)
+{
+	const size_t nCells = dims[0] * dims[1] * dims[2];
+	std::vector<size_t> cellOf(count);
+	start.assign(nCells + 1, 0);
+	index.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		const Vector3<T> point = { points.x[i], points.y[i],
+					   points.z[i] };
+		size_t cell[3];
+		Locate(point, cell);
+		cellOf[i] = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+		start[cellOf[i] + 1]++;
+	}
+	for (size_t c = 0; c < nCells; c++)
+		start[c + 1] += start[c];
+	std::vector<size_t> next(start.begin(), start.end() - 1);
+	for (size_t i = 0; i < count; i++)
+		index[next[cellOf[i]]++] = (unsigned int)i;
+}
 
+template <class T> bool ParticleSystem<T>::NeighborListsExpired()
+{
+	bool expired = !m_listValid || !SameVector(m_listMin, m_minBound) ||
+		       !SameVector(m_listMax, m_maxBound);
+	if (!expired) {
+		const Vector3<T *> pos = m_position.GetDataPointers();
+		const Vector3<T> *listPos = &m_listPos[0];
+		const bool periodic = m_periodic;
+		const Vector3<T> period = m_maxBound - m_minBound;
+		const Vector3<T> invPeriod = { 1 / period.x, 1 / period.y,
+					       1 / period.z };
+		for (size_t t = 0; t < m_threadSlots.size(); t++)
+			m_threadSlots[t].maxMoveSq = 0;
+		m_pool->ParallelFor(
+			0, m_n, PARTICLES_PER_TASK * 16,
+			[&](size_t begin, size_t end, size_t thread) {
+				T maxMoveSq = m_threadSlots[thread].maxMoveSq;
+				for (size_t i = begin; i < end; i++) {
+					Vector3<T> move = {
+						pos.x[i] - listPos[i].x,
+						pos.y[i] - listPos[i].y,
+						pos.z[i] - listPos[i].z
+					};
+					// Wrapping around the box is no move
+					if (periodic)
+						MinimumImage(move, period,
+							     invPeriod);
+					maxMoveSq = std::max(maxMoveSq,
+							     vec3LenSq(move));
+				}
+				m_threadSlots[thread].maxMoveSq = maxMoveSq;
+			});
+		const T half = m_skin / 2;
+		for (size_t t = 0; t < m_threadSlots.size(); t++)
+			expired |= m_threadSlots[t].maxMoveSq > half * half;
+	}
+	return expired;
+}
 
 /**
- * \brief Confines a particle to a rectangular box in the limits boxMin, boxMax
- */
-template<class T>
-inline void BoundToBox (
-    Vector3<T>& position,
-    Vector3<T>& velocity,
-    const Vector3<T> boxMin,
-    const Vector3<T> boxMax
-)
-{
-    if ( position.x > boxMax.x )
-    {
-        position.x = 2 * boxMax.x - position.x;
-        velocity.x = -velocity.x;
-    }
-    if ( position.y > boxMax.y )
-    {
-        position.y = 2 * boxMax.y - position.y;
-        velocity.y = -velocity.y;
-    }
-    if ( position.z > boxMax.z )
-    {
-        position.z = 2 * boxMax.z - position.z;
-        velocity.z = -velocity.z;
-    }
-
-    if ( position.x < boxMin.x )
-    {
-        position.x = 2 * boxMin.x - position.x;
-        velocity.x = -velocity.x;
-    }
-    if ( position.y < boxMin.y )
-    {
-        position.y = 2 * boxMin.y - position.y;
-        velocity.y = -velocity.y;
-    }
-    if ( position.z < boxMin.z )
-    {
-        position.z = 2 * boxMin.z - position.z;
-        velocity.z = -velocity.z;
-    }
+ * The lists are built in two passes over the same cells: the first counts the
+ * neighbors of every particle, and the second stores them at the offsets that
+ * the counts add up to. Both passes run in parallel. In a periodic box, the
+ * image of each neighbor is stored along with it, so the steps need not look
+ * for the nearest one.
+ */
+template <class T> void ParticleSystem<T>::BuildNeighborLists()
+{
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const T radius = m_cutoff + m_skin;
+	const T radiusSq = radius * radius;
+	const CellGrid &cells = m_cells;
+	const bool periodic = m_periodic;
+	Vector3<T> shifts[27];
+	ImageShifts(m_maxBound - m_minBound, shifts);
+
+	m_cells.Resize(m_minBound, m_maxBound, radius,
+		       CELLS_PER_PARTICLE * m_n, periodic);
+	m_cells.Bin(pos, m_n);
+
+	m_neighborStart.assign(m_n + 1, 0);
+	size_t *start = &m_neighborStart[0];
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				size_t cell[3], count = 0;
+				cells.Locate(point, cell);
+				VisitCells(cells, cell, [&](unsigned int j,
+							    unsigned char image) {
+					const Vector3<T> src = { pos.x[j],
+								 pos.y[j],
+								 pos.z[j] };
+					const Vector3<T> r =
+						point - src - shifts[image];
+					if (j != i && vec3LenSq(r) < radiusSq)
+						count++;
+				});
+				start[i + 1] = count;
+			}
+		});
+	for (size_t i = 0; i < m_n; i++)
+		start[i + 1] += start[i];
+
+	m_neighbors.resize(start[m_n]);
+	m_neighborImages.resize(periodic ? start[m_n] : 0);
+	unsigned int *neighbors = m_neighbors.empty() ? NULL : &m_neighbors[0];
+	unsigned char *images =
+		m_neighborImages.empty() ? NULL : &m_neighborImages[0];
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				size_t cell[3], next = start[i];
+				cells.Locate(point, cell);
+				VisitCells(cells, cell, [&](unsigned int j,
+							    unsigned char image) {
+					const Vector3<T> src = { pos.x[j],
+								 pos.y[j],
+								 pos.z[j] };
+					const Vector3<T> r =
+						point - src - shifts[image];
+					if (j == i || !(vec3LenSq(r) < radiusSq))
+						return;
+					if (periodic)
+						images[next] = image;
+					neighbors[next++] = j;
+				});
+			}
+		});
+
+	m_listPos.resize(m_n);
+	for (size_t i = 0; i < m_n; i++) {
+		m_listPos[i].x = pos.x[i];
+		m_listPos[i].y = pos.y[i];
+		m_listPos[i].z = pos.z[i];
+	}
+	m_listMin = m_minBound;
+	m_listMax = m_maxBound;
+	m_listValid = true;
 }
 
 /**
- * \brief Calculates the electro-magnetic and gravitational fields generated by
- * \brief a dynamic particle, and adds the result the existing field
+ * Every array moves with the particles. The padding stays at the end, as it
+ * is not sorted.
  */
-template<class T>
-inline void emgFieldsAdd (
-    const electro::dynamicPointCharge<T>& srcpart,
-    const Vector3<T>& position,
-    Vector3<T>& electroField,
-    Vector3<T>& magneticField,
-    Vector3<T>& gravitField
-)
+template <class T> void ParticleSystem<T>::SortParticles()
 {
-    Vector3<T> rInvSq = vec3InverseSquare (
-        vec3 ( position,srcpart.staticProp.position ) );
-    //vec3InverseSquareFLOP (10 FLOP)
+	std::vector<unsigned int> order, oldIndex;
+	MortonOrder(*m_pool, m_position.GetDataPointers(), m_n, order);
+	const unsigned int *perm = &order[0];
+
+	Vector3<Array<T> > *vectors[3] = { &m_position, &m_velocity, &m_accel };
+	for (int v = 0; v < 3; v++) {
+		const Vector3<T *> data = vectors[v]->GetDataPointers();
+		ApplyOrder(*m_pool, data.x, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.y, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.z, perm, m_n, m_sortScratch);
+	}
+	ApplyOrder(*m_pool, m_charge.GetDataPointer(), perm, m_n,
+		   m_sortScratch);
+	ApplyOrder(*m_pool, m_mass.GetDataPointer(), perm, m_n, m_sortScratch);
+	ApplyOrder(*m_pool, &m_order[0], perm, m_n, oldIndex);
+	Vector3<Array<T> > *slow[2] = { &m_slowE, &m_slowB };
+	for (int f = 0; f < 2 && m_slowValid; f++) {
+		const Vector3<T *> data = slow[f]->GetDataPointers();
+		ApplyOrder(*m_pool, data.x, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.y, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.z, perm, m_n, m_sortScratch);
+	}
+	Vector3<Array<T> > *push[2] = { &m_pushE, &m_pushB };
+	for (int f = 0; f < 2 && m_pushValid; f++) {
+		const Vector3<T *> data = push[f]->GetDataPointers();
+		ApplyOrder(*m_pool, data.x, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.y, perm, m_n, m_sortScratch);
+		ApplyOrder(*m_pool, data.z, perm, m_n, m_sortScratch);
+	}
+
+	m_stepsSinceSort = 0;
+	m_sorted = true;
+	m_listValid = false;
+}
 
-    // Electric field contribution
-    electroField += electro::PartFieldOp (
-        srcpart.staticProp.magnitude, rInvSq );
-    // (5 FLOP)
+/**
+ * Dynamic particles are taken from the neighbor lists, and static charges from
+ * the cells around each particle. The static cells are rebuilt every step, as
+ * the static charges may change between steps. With PAIRS_EWALD, the mesh
+ * fields of all charges are solved first, and the real space sums added to
+ * them.
+ */
+template <class T>
+void ParticleSystem<T>::CutoffAccelerations(const FieldOutput &out,
+					    perfPacket &perfData)
+{
+	if (m_threadSlots.size() != m_pool->GetNumThreads())
+		m_threadSlots.resize(m_pool->GetNumThreads());
+	const bool statics = (out.parts & FIELDS_STATIC) != 0;
+	const bool dynamics = (out.parts & FIELDS_DYNAMIC) != 0;
+	const bool mesh = m_pairMode == PAIRS_EWALD &&
+			  (out.parts & FIELDS_MESH) != 0;
 
-    // Magnetic field contribution
-    magneticField += magnetic::PartFieldOp (
-        srcpart.velocity, srcpart.staticProp.magnitude, rInvSq );
-    // (13 FLOP)
+	PerfTimer timer;
+	timer.start();
+	if (dynamics && NeighborListsExpired()) {
+		if (m_sortInterval &&
+		    (!m_sorted || m_stepsSinceSort >= m_sortInterval)) {
+			SortParticles();
+			perfData.add(TimingInfo("Particle sort", timer.tick()));
+		}
+		BuildNeighborLists();
+		perfData.add(TimingInfo("Particle neighbor lists",
+					timer.tick()));
+	}
 
-    // TODO: gravitational field contribution
-    // gravitField += gravitFieldOp();
-    // (5 FLOP)
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> statPos = m_staticPos.GetDataPointers();
+	const T *charge = m_charge.GetDataPointer();
+	const T *statCharge = m_staticCharge.GetDataPointer();
+	const size_t *start =
+		m_neighborStart.empty() ? NULL : &m_neighborStart[0];
+	const unsigned int *neighbors =
+		m_neighbors.empty() ? NULL : &m_neighbors[0];
+	const T cutoffSq = m_cutoff * m_cutoff;
+	const T invScreening = m_screening > 0 ? 1 / m_screening : 0;
+	const bool ewald = m_pairMode == PAIRS_EWALD;
+	const T ewaldCoeff = ewald ? m_ewaldCoeff : 0;
+	const Vector3<T> noVel = { 0, 0, 0 };
+	const CellGrid &statCells = m_staticCells;
+	const bool periodic = m_periodic;
+	const unsigned char *images =
+		m_neighborImages.empty() ? NULL : &m_neighborImages[0];
+	Vector3<T> shifts[27];
+	ImageShifts(m_maxBound - m_minBound, shifts);
 
-    // Total: 33 FLOP / jstep (28 w/o grav);
+	m_meshFLOP = 0;
+	if (mesh) {
+		timer.tick();
+		const Vector3<T *> current = m_current.GetDataPointers();
+		const Vector3<T *> noCurrent = { NULL, NULL, NULL };
+		for (size_t i = 0; i < m_n; i++) {
+			current.x[i] = charge[i] * vel.x[i];
+			current.y[i] = charge[i] * vel.y[i];
+			current.z[i] = charge[i] * vel.z[i];
+		}
+		m_pme.Clear();
+		m_pme.Spread(*m_pool, pos, charge, current, m_n);
+		m_pme.Spread(*m_pool, statPos, statCharge, noCurrent, m_nStatic);
+		m_pme.Solve(*m_pool);
+		m_pme.Gather(*m_pool, pos, m_n, m_meshE.GetDataPointers(),
+			     m_meshB.GetDataPointers());
+		m_meshFLOP = m_pme.GetFLOP();
+		perfData.add(TimingInfo("Particle mesh Ewald", timer.tick()));
+	}
+	const Vector3<T *> meshE = m_meshE.GetDataPointers();
+	const Vector3<T *> meshB = m_meshB.GetDataPointers();
+
+	if (statics) {
+		m_staticCells.Resize(m_minBound, m_maxBound, m_cutoff,
+				     CELLS_PER_PARTICLE * m_nStatic, periodic);
+		m_staticCells.Bin(statPos, m_nStatic);
+	}
+
+	for (size_t t = 0; t < m_threadSlots.size(); t++)
+		m_threadSlots[t].dynamicPairs = m_threadSlots[t].staticPairs = 0;
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			ThreadSlot &slot = m_threadSlots[thread];
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				Vector3<T> E = { 0, 0, 0 }, B = { 0, 0, 0 };
+				if (mesh) {
+					E.x = meshE.x[i];
+					E.y = meshE.y[i];
+					E.z = meshE.z[i];
+					B.x = meshB.x[i];
+					B.y = meshB.y[i];
+					B.z = meshB.z[i];
+				}
+				const size_t first = dynamics ? start[i] : 0;
+				const size_t last = dynamics ? start[i + 1] : 0;
+				for (size_t k = first; k < last; k++) {
+					const size_t j = neighbors[k];
+					Vector3<T> r = { point.x - pos.x[j],
+							 point.y - pos.y[j],
+							 point.z - pos.z[j] };
+					if (periodic)
+						r = r - shifts[images[k]];
+					const Vector3<T> v = { vel.x[j],
+							       vel.y[j],
+							       vel.z[j] };
+					slot.dynamicPairs +=
+						AddCutoffFields<true>(
+							r, charge[j], v,
+							cutoffSq, invScreening,
+							ewaldCoeff, E, B);
+				}
+
+				auto visit = [&](unsigned int j,
+						 unsigned char k) {
+					const Vector3<T> src = { statPos.x[j],
+								 statPos.y[j],
+								 statPos.z[j] };
+					const Vector3<T> r =
+						point - src - shifts[k];
+					slot.staticPairs +=
+						AddCutoffFields<false>(
+							r, statCharge[j], noVel,
+							cutoffSq, invScreening,
+							ewaldCoeff, E, B);
+				};
+				size_t cell[3];
+				if (statics) {
+					statCells.Locate(point, cell);
+					VisitCells(statCells, cell, visit);
+				}
+
+				StoreFields(out, i, E, B);
+			}
+		});
+
+	m_dynamicPairs = m_staticPairs = 0;
+	for (size_t t = 0; t < m_threadSlots.size(); t++) {
+		m_dynamicPairs += m_threadSlots[t].dynamicPairs;
+		m_staticPairs += m_threadSlots[t].staticPairs;
+	}
+}
+
+template <class T> T ParticleSystem<T>::NearRadius() const
+{
+	// The grid's static field is not cut off
+	if (!UseGrid() &&
+	    (m_pairMode == PAIRS_CUTOFF || m_pairMode == PAIRS_EWALD))
+		return std::min(m_nearRadius, m_cutoff);
+	return m_nearRadius;
 }
 
 /**
- * \brief executes one Verlet integration step on an
- * \brief electro-magneto-gravitational particle system
- */
-template<class T>
-int emgVerletStep (
-    Array<electro::dynamicPointCharge<T> >& dynCharges,
-    Array<electro::pointCharge<T> >& pointCharges,
-    Array<Vector3<T> >& verletAccel,
-    Vector3<T> minBound,
-    Vector3<T> maxBound,
-    const T timeStep,
-    const size_t n,
-    perfPacket& perfData
-)
-{
-    //TODO: Quick parameter check;
-    if ( !n )
-        return 1;
-
-    //get the size of the computation
-    size_t p = pointCharges.GetSize();
-
-    const T dt = timeStep;
-    const T dt2 = dt / 2;
-
-    // Big loop
-    for ( size_t i = 0; i < n; i++ ) //one particle at a time
-    {
-        electro::dynamicPointCharge<T> ipart = dynCharges[i];
-        Vector3<T> ipartAcc = verletAccel[i];
-
-        //TODO: v(t + dt/2) = v(t) + a(t) * dt/2;
-        ipart.velocity += ipartAcc * dt2;
-        // 6 FLOP
-
-        //TODO: r(t + dt) = r(t) + v(t + dt/2) * dt;
-        ipart.staticProp.position += ipart.velocity * dt;
-        // 6 FLOP
-
-        //TODO: Force computation F( r(t + dt) );
-        Vector3<T> electroField = {0, 0, 0};
-        for ( size_t jstat = 0; jstat < p; jstat++ )
-        {
-            electroField += electro::PartField ( pointCharges[jstat],
-                                                 ipart.staticProp.position );
-        }
-        Vector3<T> magneticField = {0, 0, 0};
-        Vector3<T> gravitField = {0, 0, 0};
-        // Use to loops to avoid calculating particle interacting with itself
-        for ( size_t j = 0; j < i; j++ )
-        {
-            emgFieldsAdd ( dynCharges[j], ipart.staticProp.position,
-                           electroField, magneticField, gravitField );
-            // Total: 33 FLOP / jstep (28 w/o grav);
-        }
-        for ( size_t j = i + 1; j < n; j++ )
-        {
-            emgFieldsAdd ( dynCharges[j], ipart.staticProp.position,
-                           electroField, magneticField, gravitField );
-            // Total: 33 FLOP / jstep (28 w/o grav);
-        }
-
-        ipartAcc = ipart.staticProp.magnitude * electroField +      // 3 FLOP
-                   magnetic::Force ( ipart, magneticField );        // 10 FLOP
-        // gravitForce;                                     // 3 FLOP
-        // 16 FLOP (13 w/o grav);
-
-        //TODO: a(t + dt) = F(cur)/m(cur);
-        ipartAcc /= ipart.mass;
-        // 3 FLOP
-
-        //TODO: v(t + dt) = v(t + dt/t) + a(t + dt) * dt/2;
-        ipart.velocity += ipartAcc * dt2;
-        // 6 FLOP
-
-        verletAccel[i] = ipartAcc;
-
-        BoundToBox ( ipart.staticProp.position,
-                     ipart.velocity,
-                     minBound, maxBound );
-    }
-    // 37 FLOP + (n - 1) * 33 FLOP) / istep
-
-    size_t totalFLOP = ( 37 + ( n - 1 ) * 33 ) * n;
-    return 0;
+ * Static charges are visited through m_nearCells, binned by Step(). They carry
+ * the kernel of the other static fields, screened or split as those are, so
+ * that the slow fields lose exactly what the fast ones gain.
+ */
+template <class T>
+void ParticleSystem<T>::NearStaticFields(const FieldOutput &out)
+{
+	const T radius = NearRadius();
+	m_nearPairs = 0;
+	if (!(radius > 0) || !m_nStatic)
+		return;
+
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> statPos = m_staticPos.GetDataPointers();
+	const T *statCharge = m_staticCharge.GetDataPointer();
+	const bool cutoff = !UseGrid() && (m_pairMode == PAIRS_CUTOFF ||
+					m_pairMode == PAIRS_EWALD);
+	const T radiusSq = radius * radius;
+	const T inner = radius * (T)(1 - RESPA_SWITCH_FRACTION);
+	const T invScreening = cutoff && m_screening > 0 ? 1 / m_screening : 0;
+	const T ewaldCoeff = cutoff && m_pairMode == PAIRS_EWALD ?
+				     m_ewaldCoeff : 0;
+	const T sign = (out.parts & FIELDS_STATIC) ? -1 : 1;
+	const Vector3<T> noVel = { 0, 0, 0 };
+	const CellGrid &cells = m_nearCells;
+	Vector3<T> shifts[27];
+	ImageShifts(m_maxBound - m_minBound, shifts);
+
+	if (m_threadSlots.size() != m_pool->GetNumThreads())
+		m_threadSlots.resize(m_pool->GetNumThreads());
+	for (size_t t = 0; t < m_threadSlots.size(); t++)
+		m_threadSlots[t].staticPairs = 0;
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			ThreadSlot &slot = m_threadSlots[thread];
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				Vector3<T> E = { 0, 0, 0 };
+				size_t cell[3];
+				cells.Locate(point, cell);
+				VisitCells(cells, cell, [&](unsigned int j,
+							    unsigned char k) {
+					const Vector3<T> src = { statPos.x[j],
+								 statPos.y[j],
+								 statPos.z[j] };
+					const Vector3<T> r =
+						point - src - shifts[k];
+					Vector3<T> e = { 0, 0, 0 }, b;
+					if (!AddCutoffFields<false>(
+						    r, statCharge[j], noVel,
+						    radiusSq, invScreening,
+						    ewaldCoeff, e, b))
+						return;
+					const T len = sqrt(vec3LenSq(r));
+					E += e * FastShare(len, inner, radius);
+					slot.staticPairs++;
+				});
+
+				AddStaticField(out, i, E * sign);
+			}
+		});
+	for (size_t t = 0; t < m_threadSlots.size(); t++)
+		m_nearPairs += m_threadSlots[t].staticPairs;
 }
 
+template <class T>
+void ParticleSystem<T>::GridStaticFields(const FieldOutput &out)
+{
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const StaticFieldGrid<T> &grid = *m_grid;
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> point = { pos.x[i], pos.y[i],
+							   pos.z[i] };
+				AddStaticField(out, i, grid.Field(point));
+			}
+		});
+}
+
+template <class T>
+inline void ParticleSystem<T>::AddStaticField(const FieldOutput &out,
+					      const size_t i,
+					      const Vector3<T> E)
+{
+	if (out.E.x) {
+		out.E.x[i] += E.x;
+		out.E.y[i] += E.y;
+		out.E.z[i] += E.z;
+		return;
+	}
+	// Static charges have no magnetic field
+	const T scale = (T)electro_k * m_charge[i] / m_mass[i];
+	m_accel.write(m_accel[i] + E * scale, i);
+}
+
+template <class T> void ParticleSystem<T>::Drift(const T dt)
+{
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> acc = m_accel.GetDataPointers();
+	const Vector3<T> minBound = m_minBound, maxBound = m_maxBound;
+	const Vector3<T> period = maxBound - minBound;
+	const bool periodic = m_periodic;
+	const T dt2 = dt / 2;
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				// v(t + dt/2) = v(t) + a(t) * dt/2
+				Vector3<T> v = { vel.x[i] + acc.x[i] * dt2,
+						 vel.y[i] + acc.y[i] * dt2,
+						 vel.z[i] + acc.z[i] * dt2 };
+				// r(t + dt) = r(t) + v(t + dt/2) * dt
+				Vector3<T> r = { pos.x[i] + v.x * dt,
+						 pos.y[i] + v.y * dt,
+						 pos.z[i] + v.z * dt };
+				if (periodic)
+					WrapToBox(r, minBound, period);
+				else
+					BoundToBox(r, v, minBound, maxBound);
+				pos.x[i] = r.x;
+				pos.y[i] = r.y;
+				pos.z[i] = r.z;
+				vel.x[i] = v.x;
+				vel.y[i] = v.y;
+				vel.z[i] = v.z;
+			}
+		});
+}
+
+template <class T> void ParticleSystem<T>::Kick(const T dt)
+{
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> acc = m_accel.GetDataPointers();
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				vel.x[i] += acc.x[i] * dt;
+				vel.y[i] += acc.y[i] * dt;
+				vel.z[i] += acc.z[i] * dt;
+			}
+		});
+}
+
+/**
+ * The magnetic force is taken at the velocity before the kick, unless the
+ * integrator is a Boris one.
+ */
+template <class T> void ParticleSystem<T>::SlowKick(const T dt)
+{
+	if (m_integrator != INTEGRATE_VERLET) {
+		Push(m_slowE.GetDataPointers(), m_slowB.GetDataPointers(), dt);
+		return;
+	}
+
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T *> slowE = m_slowE.GetDataPointers();
+	const Vector3<T *> slowB = m_slowB.GetDataPointers();
+	const T *charge = m_charge.GetDataPointer();
+	const T *mass = m_mass.GetDataPointer();
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				const Vector3<T> E = { slowE.x[i], slowE.y[i],
+						       slowE.z[i] };
+				const Vector3<T> B = { slowB.x[i], slowB.y[i],
+						       slowB.z[i] };
+				const Vector3<T> v = { vel.x[i], vel.y[i],
+						       vel.z[i] };
+				const Vector3<T> a = Acceleration(
+					E, B, v, charge[i], mass[i]);
+				vel.x[i] += a.x * dt;
+				vel.y[i] += a.y * dt;
+				vel.z[i] += a.z * dt;
+			}
+		});
+}
+
+template <class T>
+void ParticleSystem<T>::Push(const Vector3<T *> E, const Vector3<T *> B,
+			     const T dt)
+{
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const T *charge = m_charge.GetDataPointer();
+	const T *mass = m_mass.GetDataPointer();
+	const bool relativistic = m_integrator == INTEGRATE_BORIS_RELATIVISTIC;
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			if (relativistic)
+				BorisKick<true>(begin, end, vel, E, B, charge,
+						mass, dt);
+			else
+				BorisKick<false>(begin, end, vel, E, B, charge,
+						 mass, dt);
+		});
+}
+
+template <class T> void ParticleSystem<T>::Move(const T dt)
+{
+	const Vector3<T *> pos = m_position.GetDataPointers();
+	const Vector3<T *> vel = m_velocity.GetDataPointers();
+	const Vector3<T> minBound = m_minBound, maxBound = m_maxBound;
+	const Vector3<T> period = maxBound - minBound;
+	const bool periodic = m_periodic;
+
+	m_pool->ParallelFor(
+		0, m_n, PARTICLES_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t i = begin; i < end; i++) {
+				Vector3<T> v = { vel.x[i], vel.y[i], vel.z[i] };
+				Vector3<T> r = { pos.x[i] + v.x * dt,
+						 pos.y[i] + v.y * dt,
+						 pos.z[i] + v.z * dt };
+				if (periodic)
+					WrapToBox(r, minBound, period);
+				else
+					BoundToBox(r, v, minBound, maxBound);
+				pos.x[i] = r.x;
+				pos.y[i] = r.y;
+				pos.z[i] = r.z;
+				vel.x[i] = v.x;
+				vel.y[i] = v.y;
+				vel.z[i] = v.z;
+			}
+		});
+}
+
+/**
+ * With multiple time steps, the slow fields kick the particles over half of
+ * 'timeStep', the particles take m_innerSteps velocity Verlet steps in the
+ * fast fields, and the slow fields at the new positions kick them over the
+ * other half.
+ *
+ * The Boris integrators replace each kick with a Boris kick over the same time,
+ * with the fields at the particles in place of their accelerations.
+ */
+template <class T>
+int ParticleSystem<T>::Step(Array<electro::pointCharge<T> > &statics,
+			    const T timeStep, const Vector3<T> minBound,
+			    const Vector3<T> maxBound, perfPacket &perfData)
+{
+	const bool cutoff = m_pairMode == PAIRS_CUTOFF ||
+			    m_pairMode == PAIRS_EWALD;
+	const bool periodic = m_periodic;
+	const bool multiple = m_innerSteps > 1;
+	const bool boris = m_integrator != INTEGRATE_VERLET;
+	const Vector3<T> period = maxBound - minBound;
+	if (!m_n)
+		return 1;
+	if (cutoff && !(m_cutoff > 0 && m_skin >= 0))
+		return 1;
+	// The nearest image must be the only one within reach
+	const T reach = 2 * (m_cutoff + m_skin);
+	if (periodic && (!cutoff || !(period.x >= reach &&
+					period.y >= reach && period.z >= reach)))
+		return 1;
+	if (periodic && UseGrid())
+		return 1;
+	if (!m_pool)
+		m_pool = &ThreadPool::GetGlobal();
+	if (m_pairMode == PAIRS_EWALD &&
+	    (m_pme.Setup(minBound, maxBound, m_ewaldCoeff, m_meshSpacing,
+			 m_meshOrder) ||
+	     AllocMeshFields()))
+		return 1;
+	if (multiple && AllocSlowFields())
+		return 1;
+	if (boris && AllocPushFields())
+		return 1;
+	m_minBound = minBound;
+	m_maxBound = maxBound;
+	m_stepsSinceSort++;
+
+	PerfTimer timer;
+	timer.start();
+	if (LoadStatics(statics))
+		return 1;
+	// Cells only hold images within the box
+	if (periodic) {
+		const Vector3<T *> statPos = m_staticPos.GetDataPointers();
+		for (size_t i = 0; i < m_nStatic; i++) {
+			Vector3<T> r = { statPos.x[i], statPos.y[i],
+					 statPos.z[i] };
+			WrapToBox(r, minBound, period);
+			m_staticPos.write(r, i);
+		}
+	}
+	if (multiple && NearRadius() > 0) {
+		m_nearCells.Resize(minBound, maxBound, NearRadius(),
+				   CELLS_PER_PARTICLE * m_nStatic, periodic);
+		m_nearCells.Bin(m_staticPos.GetDataPointers(), m_nStatic);
+	}
+
+	const Vector3<T *> none = { NULL, NULL, NULL };
+	// Boris kicks take the fields, and Verlet kicks the accelerations
+	const Vector3<T *> pushE = boris ? m_pushE.GetDataPointers() : none;
+	const Vector3<T *> pushB = boris ? m_pushB.GetDataPointers() : none;
+	const FieldOutput all = { FIELDS_ALL, pushE, pushB };
+	const FieldOutput fast = { FIELDS_DYNAMIC | FIELDS_NEAR, pushE, pushB };
+	const FieldOutput slow = { FIELDS_STATIC | FIELDS_MESH | FIELDS_NEAR,
+				   m_slowE.GetDataPointers(),
+				   m_slowB.GetDataPointers() };
+	const size_t innerSteps = multiple ? m_innerSteps : 1;
+	const T dt = timeStep / innerSteps;
+	double integrateTime = timer.tick(), forceTime = 0, slowTime = 0;
+	const double kickFLOP =
+		m_integrator == INTEGRATE_BORIS_RELATIVISTIC ?
+			BORIS_RELATIVISTIC_KICK_FLOP : BORIS_KICK_FLOP;
+	const double stepFLOP =
+		boris ? 2 * kickFLOP + PARTICLE_MOVE_FLOP : PARTICLE_STEP_FLOP;
+	double FLOP = (double)m_n * stepFLOP * innerSteps;
+
+	if (multiple) {
+		// The accelerations carried over are not those of the fast
+		// fields after a Load() or a change of settings
+		if (!m_slowValid) {
+			ComputeAccelerations(fast, perfData);
+			FLOP += FieldFLOP(fast.parts);
+			ComputeAccelerations(slow, perfData);
+			FLOP += FieldFLOP(slow.parts);
+			m_slowValid = true;
+			m_pushValid = boris;
+			slowTime += timer.tick();
+		}
+		SlowKick(timeStep / 2);
+		integrateTime += timer.tick();
+	}
+	// Boris kicks start from the fields of the last step, which a Load()
+	// or a change of settings leaves behind
+	if (boris && !m_pushValid) {
+		const FieldOutput &out = multiple ? fast : all;
+		ComputeAccelerations(out, perfData);
+		FLOP += FieldFLOP(out.parts);
+		m_pushValid = true;
+		forceTime += timer.tick();
+	}
+
+	for (size_t s = 0; s < innerSteps; s++) {
+		if (boris) {
+			Push(pushE, pushB, dt / 2);
+			Move(dt);
+		} else {
+			Drift(dt);
+		}
+		integrateTime += timer.tick();
+
+		// a(t + dt) = F(r(t + dt)) / m
+		const FieldOutput &out = multiple ? fast : all;
+		ComputeAccelerations(out, perfData);
+		FLOP += FieldFLOP(out.parts);
+		forceTime += timer.tick();
+
+		// v(t + dt) = v(t + dt/2) + a(t + dt) * dt/2
+		if (boris)
+			Push(pushE, pushB, dt / 2);
+		else
+			Kick(dt / 2);
+		integrateTime += timer.tick();
+	}
+
+	if (multiple) {
+		ComputeAccelerations(slow, perfData);
+		FLOP += FieldFLOP(slow.parts);
+		slowTime += timer.tick();
+		SlowKick(timeStep / 2);
+		integrateTime += timer.tick();
+		perfData.add(TimingInfo("Particle slow fields", slowTime));
+	}
+
+	perfData.add(TimingInfo("Particle field summation", forceTime));
+	perfData.add(TimingInfo("Particle integration", integrateTime));
+
+	// Padding is summed over as well, but not counted
+	const double time = integrateTime + forceTime + slowTime;
+	const double doneFLOP = perfData.performance * 1E9 * perfData.time;
+	perfData.time += time;
+	if (perfData.time > 0)
+		perfData.performance =
+			(doneFLOP + FLOP) / perfData.time / 1E9;
+	return 0;
+}
+
+template <class T>
+int emgVerletStep(Array<electro::dynamicPointCharge<T> > &dynCharges,
+		  Array<electro::pointCharge<T> > &pointCharges,
+		  Array<Vector3<T> > &verletAccel, Vector3<T> minBound,
+		  Vector3<T> maxBound, const T timeStep, const size_t n,
+		  perfPacket &perfData, const T cutoff)
+{
+	if (verletAccel.GetSize() < n)
+		return 1;
+
+	ParticleSystem<T> system;
+	if (system.Load(dynCharges, n))
+		return 1;
+	// The lists only live for one step, so they need no skin
+	if (cutoff > 0)
+		system.SetCutoff(cutoff, 0);
+
+	Vector3<T *> acc = system.GetAccelerations();
+	for (size_t i = 0; i < n; i++) {
+		acc.x[i] = verletAccel[i].x;
+		acc.y[i] = verletAccel[i].y;
+		acc.z[i] = verletAccel[i].z;
+	}
+
+	const int err = system.Step(pointCharges, timeStep, minBound, maxBound,
+				    perfData);
+	if (err)
+		return err;
+
+	system.Store(dynCharges);
+	for (size_t i = 0; i < n; i++) {
+		Vector3<T> a = { acc.x[i], acc.y[i], acc.z[i] };
+		verletAccel[i] = a;
+	}
+	return 0;
+}
+
+template class ParticleSystem<float>;
+template class ParticleSystem<double>;
+
+template int emgVerletStep(Array<electro::dynamicPointCharge<float> > &,
+			   Array<electro::pointCharge<float> > &,
+			   Array<Vector3<float> > &, Vector3<float>,
+			   Vector3<float>, const float, const size_t,
+			   perfPacket &, const float);
+template int emgVerletStep(Array<electro::dynamicPointCharge<double> > &,
+			   Array<electro::pointCharge<double> > &,
+			   Array<Vector3<double> > &, Vector3<double>,
+			   Vector3<double>, const double, const size_t,
+			   perfPacket &, const double);
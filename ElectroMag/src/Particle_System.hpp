@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PARTICLE_SYSTEM_HPP
+#define _PARTICLE_SYSTEM_HPP
+
+#include "Electrodynamics.h"
+#include "SOA_utils.hpp"
+#include "Thread_Pool.hpp"
+#include "PME_Solver.hpp"
+#include "Morton_Sort.hpp"
+#include "Static_Field_Grid.hpp"
+#include <vector>
+
+/**=============================================================================
+ * \brief Electro-magnetic particle system, integrated with velocity Verlet
+ *
+ * Particles are kept in structure of arrays form, padded with uncharged
+ * particles to a whole number of SIMD registers, so that the loops over source
+ * charges load positions, velocities and charges straight into registers.
+ * Every step hands the particles to a ThreadPool in small chunks; each worker
+ * sums the fields at its particles over all static and dynamic charges.
+ *
+ * Charges closer than the floating point resolution, including a particle and
+ * itself, do not interact.
+ *
+ * By default, the pairs of dynamic particles are evaluated once each, and the
+ * contributions scattered to both particles (see SetPairMode()). With a cutoff
+ * radius, only nearby charges interact, and a step costs O(n) (see
+ * SetCutoff()). With particle mesh Ewald, the box repeats periodically, and the
+ * charges outside the cutoff act through a mesh, in O(n log n) (see
+ * SetEwald()). In both, the particles can be kept in Morton order, so that
+ * neighbors in space are neighbors in memory (see SetSortInterval()).
+ *
+ * The slowly varying fields of far static charges and of the mesh can be
+ * updated less often than those of nearby charges (see SetMultipleTimeStep()),
+ * and the field of the static charges can be interpolated from a precomputed
+ * grid rather than summed (see SetStaticFieldGrid()).
+ * ===========================================================================*/
+template <class T> class ParticleSystem {
+public:
+	/// @param pool Pool running the steps; NULL uses the process-wide pool
+	explicit ParticleSystem(ThreadPool *pool = NULL);
+	~ParticleSystem();
+
+	/**
+	 * \brief Copies the first 'n' particles into the system
+	 *
+	 * Accelerations start at zero.
+	 * @return 0 on success, or 1 if 'particles' is too small or memory
+	 * cannot be allocated
+	 */
+	int Load(Array<electro::dynamicPointCharge<T> > &particles, size_t n);
+	/// Copies the state of the particles back to 'particles', in the order
+	/// they were loaded in
+	void Store(Array<electro::dynamicPointCharge<T> > &particles);
+
+	/**
+	 * \brief Advances every particle by 'timeStep'
+	 *
+	 * The particles move in the field of 'statics' and of each other, and
+	 * are reflected back into the box [minBound, maxBound], or wrapped
+	 * around it if it is periodic (see SetPeriodic()). The time of
+	 * each phase is added to perfData.stepTimes; perfData.time and
+	 * perfData.performance accumulate over consecutive steps.
+	 * @return 0 on success
+	 */
+	int Step(Array<electro::pointCharge<T> > &statics, const T timeStep,
+		 const Vector3<T> minBound, const Vector3<T> maxBound,
+		 perfPacket &perfData);
+
+	size_t GetSize() const
+	{
+		return m_n;
+	}
+
+	/// Views of the particle arrays, in the order of GetOrder(); valid
+	/// until the next Load() or Step()
+	electro::dynamicPointChargeSOA<T> GetParticles();
+	/// Accelerations at the current positions, carried between steps
+	Vector3<T *> GetAccelerations();
+	/**
+	 * \brief Index at Load() of each particle
+	 *
+	 * Particle i of GetParticles() and GetAccelerations() was particle
+	 * GetOrder()[i] of the array given to Load().
+	 */
+	const unsigned int *GetOrder() const
+	{
+		return m_order.empty() ? NULL : &m_order[0];
+	}
+
+	void SetThreadPool(ThreadPool *pool)
+	{
+		m_pool = pool;
+	}
+
+	/// How the interactions between dynamic particles are evaluated
+	enum PairMode {
+		/// Every particle sums the fields of all others
+		PAIRS_DIRECT,
+		/// Every pair is evaluated once, and its contributions are
+		/// scattered to both particles through per-thread buffers
+		PAIRS_SYMMETRIC,
+		/// Only charges within the cutoff radius interact; selected by
+		/// SetCutoff()
+		PAIRS_CUTOFF,
+		/// Charges within the cutoff radius interact directly, and all
+		/// charges and their periodic images through a mesh; selected
+		/// by SetEwald()
+		PAIRS_EWALD
+	};
+	/**
+	 * \brief Selects how pairs of dynamic particles are evaluated
+	 *
+	 * PAIRS_SYMMETRIC takes half the square roots and divisions of
+	 * PAIRS_DIRECT, at the cost of six field arrays per pool thread. If
+	 * those cannot be allocated, the direct sum is used. The default is
+	 * PAIRS_SYMMETRIC.
+	 */
+	void SetPairMode(PairMode mode)
+	{
+		m_pairMode = mode;
+		m_slowValid = false;
+	}
+
+	/**
+	 * \brief Restricts interactions to charges closer than 'cutoff'
+	 *
+	 * Switches to PAIRS_CUTOFF. Static and dynamic charges are binned in a
+	 * grid of cells spanning the box of Step(), at least cutoff + skin
+	 * wide. Each particle keeps a list of the dynamic particles within
+	 * cutoff + skin, which is rebuilt, along with the cells, only once a
+	 * particle has moved more than skin / 2.
+	 *
+	 * If 'screening' is not zero, fields are Yukawa-screened with that
+	 * Debye length: each contribution is scaled by exp(-r/L)(1 + r/L).
+	 * Fields are not shifted, so they jump to zero at the cutoff.
+	 */
+	void SetCutoff(T cutoff, T skin, T screening = 0)
+	{
+		m_cutoff = cutoff;
+		m_skin = skin;
+		m_screening = screening;
+		m_listValid = false;
+		m_slowValid = false;
+		m_pairMode = PAIRS_CUTOFF;
+	}
+
+	/**
+	 * \brief Sums the fields of all charges and their periodic images with
+	 * smooth particle mesh Ewald
+	 *
+	 * Switches to PAIRS_EWALD, and makes the box periodic. The sums are
+	 * split so that the real space part drops to 1E-5 of the full
+	 * field at 'cutoff'; that part is summed over the neighbor lists, as
+	 * in SetCutoff(). The rest is solved on a mesh at most 'meshSpacing'
+	 * apart, or cutoff / 8 if that is 0, and interpolated with B-splines
+	 * of order 'order' (see PMESolver).
+	 *
+	 * The magnetic field of the moving charges is split the same way.
+	 * Net charge and current are neutralized by a uniform background.
+	 */
+	void SetEwald(T cutoff, T skin, T meshSpacing = 0,
+		      unsigned int order = 4);
+
+	/**
+	 * \brief Makes the box of Step() periodic
+	 *
+	 * Particles leaving the box enter it at the opposite side, and every
+	 * charge acts through its nearest image. Only PAIRS_CUTOFF and
+	 * PAIRS_EWALD support periodic boxes, and the box must be at least
+	 * twice cutoff + skin wide.
+	 */
+	void SetPeriodic(bool periodic)
+	{
+		m_periodic = periodic;
+		m_listValid = false;
+		m_slowValid = false;
+	}
+
+	/**
+	 * \brief Sorts the particles in Morton order every 'interval' steps
+	 *
+	 * Only PAIRS_CUTOFF and PAIRS_EWALD sort, as the all-pairs modes stream
+	 * every charge anyway. A sort invalidates the neighbor lists, so it
+	 * waits for their next rebuild once 'interval' steps have passed, and
+	 * the first one takes place at the first build. 0, the default, never
+	 * sorts.
+	 */
+	void SetSortInterval(size_t interval)
+	{
+		m_sortInterval = interval;
+	}
+
+	/**
+	 * \brief Splits every step into 'innerSteps' steps of the fast forces
+	 *
+	 * Impulse multiple time stepping (r-RESPA, Tuckerman et al.). The slow
+	 * fields are those of the static charges farther than 'nearRadius',
+	 * and the mesh part of PAIRS_EWALD. They act as two half kicks, at the
+	 * ends of a step of Step(), between which the particles move through
+	 * 'innerSteps' velocity Verlet steps in the fast fields, those of the
+	 * dynamic particles and of the nearby static charges. Sources move from
+	 * one part to the other over the outer fifth of 'nearRadius', which in
+	 * the cutoff modes is limited to the cutoff.
+	 *
+	 * The slow fields at the end of a step are reused at the start of the
+	 * next, so changes to the static charges between steps act half a step
+	 * late. 'innerSteps' of 1, the default, takes plain Verlet steps.
+	 */
+	void SetMultipleTimeStep(size_t innerSteps, T nearRadius = 0)
+	{
+		m_innerSteps = innerSteps ? innerSteps : 1;
+		m_nearRadius = nearRadius > 0 ? nearRadius : 0;
+		m_slowValid = false;
+	}
+
+	/**
+	 * \brief Takes the field of the static charges from 'grid'
+	 *
+	 * The grid replaces the sums over the static charges given to Step(),
+	 * which should be those it was built from; it is not rebuilt when they
+	 * change. The static field is then unscreened in every pair mode, and
+	 * the near radius of SetMultipleTimeStep() is not limited to the
+	 * cutoff. Periodic boxes are not supported. The grid must outlive its
+	 * use. NULL, the default, or a grid not yet built, sums over the
+	 * static charges.
+	 */
+	void SetStaticFieldGrid(const StaticFieldGrid<T> *grid)
+	{
+		m_grid = grid;
+		m_slowValid = false;
+	}
+
+	/// How Step() moves the particles through the fields
+	enum Integrator {
+		/// Velocity Verlet, with the Lorentz force at the half-step
+		/// velocity
+		INTEGRATE_VERLET,
+		/// Two half Boris kicks around the drift, which rotate the
+		/// velocities in the magnetic field
+		INTEGRATE_BORIS,
+		/// Boris kicks on the relativistic momentum
+		INTEGRATE_BORIS_RELATIVISTIC
+	};
+	/**
+	 * \brief Selects how the particles are moved
+	 *
+	 * Boris kicks rotate the velocities in the magnetic field instead of
+	 * pushing them along v x B, so they take steps as long as a sizable
+	 * fraction of a gyration without gaining energy. They keep the fields
+	 * at the particles, six more arrays, where Verlet keeps the
+	 * accelerations; these are evaluated once more at the first step.
+	 * The default is INTEGRATE_VERLET.
+	 */
+	void SetIntegrator(Integrator integrator)
+	{
+		m_integrator = integrator;
+		m_pushValid = false;
+	}
+
+	/**
+	 * \brief Adds a uniform magnetic field 'B', in tesla
+	 *
+	 * The field acts with the fields of the dynamic particles, so with
+	 * multiple time steps it is a fast field. The default is none.
+	 */
+	void SetMagneticField(const Vector3<T> B);
+
+private:
+	ParticleSystem(const ParticleSystem &);
+	ParticleSystem &operator=(const ParticleSystem &);
+
+	/// Transposes the static charges into m_staticPos and m_staticCharge
+	int LoadStatics(Array<electro::pointCharge<T> > &statics);
+
+	/// Contributions to the fields, so that they can be summed apart
+	enum FieldParts {
+		/// Dynamic particles; only the real space part with Ewald
+		FIELDS_DYNAMIC = 1,
+		/// Static charges; only the real space part with Ewald
+		FIELDS_STATIC = 2,
+		/// Mesh part of PAIRS_EWALD, from all charges
+		FIELDS_MESH = 4,
+		FIELDS_ALL = 7,
+		/// Share of the fast fields in the static charges within
+		/// m_nearRadius; taken off the others if FIELDS_STATIC is set
+		FIELDS_NEAR = 8
+	};
+	/// Where an evaluation of the fields leaves its results
+	struct FieldOutput {
+		/// Parts of the fields to sum; see FieldParts
+		unsigned int parts;
+		/// Arrays the fields are stored in, or NULL E.x to turn them
+		/// into accelerations in m_accel
+		Vector3<T *> E, B;
+	};
+	/// Sums the fields at the current positions into 'out'
+	void ComputeAccelerations(const FieldOutput &out, perfPacket &perfData);
+	void DirectAccelerations(const FieldOutput &out);
+	void SymmetricAccelerations(const FieldOutput &out);
+	void CutoffAccelerations(const FieldOutput &out, perfPacket &perfData);
+	/// Stores the fields E and B at particle i in 'out'
+	void StoreFields(const FieldOutput &out, size_t i, const Vector3<T> E,
+			 Vector3<T> B);
+	/// FLOP of the last evaluation of the fields 'parts'
+	double FieldFLOP(unsigned int parts) const;
+	/// Adds the FIELDS_NEAR part to 'out'
+	void NearStaticFields(const FieldOutput &out);
+	/// Whether the static field comes from m_grid; not until it is built
+	bool UseGrid() const
+	{
+		return m_grid && m_grid->IsBuilt();
+	}
+	/// Adds the field of the static charges, interpolated from m_grid
+	void GridStaticFields(const FieldOutput &out);
+	/// Adds the static field E to particle i of 'out'
+	void AddStaticField(const FieldOutput &out, size_t i,
+			    const Vector3<T> E);
+	/// Radius within which static charges are fast
+	T NearRadius() const;
+
+	/// Half kick with m_accel, then drift, over 'dt'
+	void Drift(const T dt);
+	/// Kicks with m_accel over 'dt'
+	void Kick(const T dt);
+	/// Kicks with m_slowE and m_slowB over 'dt'
+	void SlowKick(const T dt);
+	/// Boris kicks with the fields 'E' and 'B' over 'dt'
+	void Push(const Vector3<T *> E, const Vector3<T *> B, const T dt);
+	/// Drifts over 'dt' with the current velocities
+	void Move(const T dt);
+	/// Sizes m_fieldBuffers for the threads of m_pool
+	int AllocFieldBuffers();
+	/// Allocates m_meshE, m_meshB and m_current
+	int AllocMeshFields();
+	/// Allocates m_slowE and m_slowB
+	int AllocSlowFields();
+	/// Allocates m_pushE and m_pushB
+	int AllocPushFields();
+	void Free();
+
+	/// Pool that executes the steps
+	ThreadPool *m_pool;
+	PairMode m_pairMode;
+	/// Number of particles, and number of allocated (padded) elements
+	size_t m_n, m_padded;
+	Vector3<Array<T> > m_position, m_velocity, m_accel;
+	Array<T> m_charge, m_mass;
+	/// Static charges, and the padded size of their arrays
+	size_t m_nStatic, m_staticPadded;
+	Vector3<Array<T> > m_staticPos;
+	Array<T> m_staticCharge;
+	/**
+	 * Fields scattered by PAIRS_SYMMETRIC: for each of m_bufferThreads
+	 * threads, the x, y, z of E then of B, m_padded elements each. Kept
+	 * zeroed between steps
+	 */
+	Array<T> m_fieldBuffers;
+	size_t m_bufferThreads;
+	/// Current elements q v of the particles, for PAIRS_SYMMETRIC
+	Vector3<Array<T> > m_current;
+
+	/// Uniform grid of cells spanning the box, used by PAIRS_CUTOFF
+	struct CellGrid {
+		Vector3<T> origin;
+		/// Cells per unit of length, along each axis
+		Vector3<T> invWidth;
+		size_t dims[3];
+		/// Whether the cells past an edge are those at the opposite one
+		bool periodic;
+		/// Points of cell c are index[start[c]] to index[start[c + 1]]
+		std::vector<size_t> start;
+		std::vector<unsigned int> index;
+
+		/// Sizes the grid for the box [min, max] and 'width' wide cells
+		void Resize(const Vector3<T> min, const Vector3<T> max,
+			    T width, size_t maxCells, bool wrap);
+		/// Cell containing 'point'; points outside go to the edges
+		void Locate(const Vector3<T> point, size_t cell[3]) const;
+		/// Counting sort of 'count' points into the cells
+		void Bin(const Vector3<T *> points, size_t count);
+	};
+	/// Whether any particle moved more than half the skin since the last
+	/// build of the cells and neighbor lists
+	bool NeighborListsExpired();
+	void BuildNeighborLists();
+	/// Sorts the particle arrays in Morton order, along with m_order
+	void SortParticles();
+
+	T m_cutoff, m_skin, m_screening;
+	bool m_periodic;
+	/// Box of the current step
+	Vector3<T> m_minBound, m_maxBound;
+	CellGrid m_cells, m_staticCells;
+	/**
+	 * Neighbors within cutoff + skin of particle i are
+	 * m_neighbors[m_neighborStart[i]] to m_neighbors[m_neighborStart[i + 1]]
+	 */
+	std::vector<size_t> m_neighborStart;
+	std::vector<unsigned int> m_neighbors;
+	/// Periodic image of each neighbor, in a periodic box
+	std::vector<unsigned char> m_neighborImages;
+	/// Positions when the lists were built, and the box they were built in
+	std::vector<Vector3<T> > m_listPos;
+	Vector3<T> m_listMin, m_listMax;
+	bool m_listValid;
+	/// Pairs evaluated by the last CutoffAccelerations()
+	size_t m_dynamicPairs, m_staticPairs;
+
+	/// Multiple time stepping: inner steps per step, the radius within
+	/// which static charges are fast, and their cells
+	size_t m_innerSteps;
+	T m_nearRadius;
+	CellGrid m_nearCells;
+	/// Static pairs summed by the last NearStaticFields()
+	size_t m_nearPairs;
+	/// Slow fields, and whether they are those at the current positions
+	Vector3<Array<T> > m_slowE, m_slowB;
+	bool m_slowValid;
+
+	/// Index at Load() of each particle
+	std::vector<unsigned int> m_order;
+	size_t m_sortInterval, m_stepsSinceSort;
+	bool m_sorted;
+	std::vector<T> m_sortScratch;
+
+	/// Precomputed field of the static charges, if any
+	const StaticFieldGrid<T> *m_grid;
+
+	Integrator m_integrator;
+	/// Uniform magnetic field, divided by magneto_k
+	Vector3<T> m_externalB;
+	/// Fast fields the Boris kicks use, and whether they are those at the
+	/// current positions
+	Vector3<Array<T> > m_pushE, m_pushB;
+	bool m_pushValid;
+
+	/// Ewald splitting parameter, mesh spacing and interpolation order
+	T m_ewaldCoeff, m_meshSpacing;
+	unsigned int m_meshOrder;
+	PMESolver<T> m_pme;
+	/// Mesh fields at the particles, and FLOP of the last mesh solution
+	Vector3<Array<T> > m_meshE, m_meshB;
+	double m_meshFLOP;
+
+	/// Per-thread results, padded to a cache line
+	struct ThreadSlot {
+		size_t dynamicPairs, staticPairs;
+		T maxMoveSq;
+		char padding[64 - 2 * sizeof(size_t) - sizeof(T)];
+	};
+	std::vector<ThreadSlot> m_threadSlots;
+};
+
+/**
+ * \brief executes one Verlet integration step on an
+ * \brief electro-magneto-gravitational particle system
+ *
+ * Convenience wrapper over ParticleSystem for callers keeping the particles in
+ * array of structures form. The conversion costs O(n), so long runs should
+ * keep a ParticleSystem instead. A positive 'cutoff' limits interactions to
+ * charges closer than that; see ParticleSystem::SetCutoff().
+ */
+template <class T>
+int emgVerletStep(Array<electro::dynamicPointCharge<T> > &dynCharges,
+		  Array<electro::pointCharge<T> > &pointCharges,
+		  Array<Vector3<T> > &verletAccel, Vector3<T> minBound,
+		  Vector3<T> maxBound, const T timeStep, const size_t n,
+		  perfPacket &perfData, const T cutoff = 0);
+
+#endif //_PARTICLE_SYSTEM_HPP
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Static_Field_Grid.hpp"
+#include "PME_Solver.hpp"
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+/// Node spacings per near radius
+#define GRID_SPACING_PER_RADIUS 8
+/// Relative size of the smooth part missing at the near radius
+#define GRID_TOLERANCE 1E-6
+/// Charges within the near radius, on average, when it is picked by Build()
+#define GRID_NEAR_CHARGES 8
+/// Limit on the nodes of a grid, so that it fits in 100 MB
+#define GRID_MAX_NODES (1 << 22)
+/// Node intervals along each side of the blocks sharing a near list
+#define GRID_BLOCK_INTERVALS 4
+/// Entries of the table of near shares, evenly spaced in the squared distance
+#define GRID_SHARE_ENTRIES 4096
+/// Rows of nodes, or blocks, handed to a pool thread at a time
+#define GRID_ROWS_PER_TASK 4
+
+/// FLOP of one near list entry
+#define GRID_NEAR_PAIR_FLOP 20
+/// FLOP of one charge on one node, and of each interpolation
+#define GRID_NODE_PAIR_FLOP 18
+#define GRID_TRILINEAR_FLOP 70
+#define GRID_TRICUBIC_FLOP 480
+
+/**
+ * \brief Weight of the smooth part of a charge at distance sqrt(lenSq)
+ *
+ * The smooth field is q r/|r|^3 (erf(x) - 2x / sqrt(pi) exp(-x^2)), with
+ * x = coeff |r|. It is finite at the charge, where the difference is taken
+ * from its series to spare the cancellation.
+ */
+static inline double SmoothWeight(const double lenSq, const double coeff)
+{
+	const double x2 = lenSq * coeff * coeff;
+	const double coeff3 = coeff * coeff * coeff;
+	if (x2 < 1E-6)
+		return 2 * M_2_SQRTPI / 3 * coeff3 * (1 - 0.6 * x2);
+	const double x = sqrt(x2);
+	return (erf(x) - M_2_SQRTPI * x * exp(-x2)) * coeff3 / (x2 * x);
+}
+
+/**
+ * \brief Field at 'point' of those of the 'p' charges beyond sqrt(radiusSq)
+ *
+ * The charges within are moved a thousand radii away rather than skipped,
+ * which leaves them a share far below the tolerance, but lets the compiler
+ * vectorize the loop.
+ */
+template <class T>
+static inline Vector3<T> FarField(const Vector3<T> point, const T *x,
+				  const T *y, const T *z, const T *q,
+				  const size_t p, const T radiusSq)
+{
+	const T awaySq = radiusSq * (T)1E6;
+	T Ex = 0, Ey = 0, Ez = 0;
+	for (size_t j = 0; j < p; j++) {
+		const T rx = point.x - x[j];
+		const T ry = point.y - y[j];
+		const T rz = point.z - z[j];
+		const T len = rx * rx + ry * ry + rz * rz;
+		const T lenSq = len >= radiusSq ? len : awaySq;
+		const T w = q[j] / (lenSq * sqrt(lenSq));
+		Ex += rx * w;
+		Ey += ry * w;
+		Ez += rz * w;
+	}
+	const Vector3<T> E = { Ex, Ey, Ez };
+	return E;
+}
+
+/// Catmull-Rom weights of the nodes before, at, after and two after 't'
+template <class T> static inline void CubicWeights(const T t, T w[4])
+{
+	const T t2 = t * t, t3 = t2 * t;
+	w[0] = (-t3 + 2 * t2 - t) / 2;
+	w[1] = (3 * t3 - 5 * t2 + 2) / 2;
+	w[2] = (-3 * t3 + 4 * t2 + t) / 2;
+	w[3] = (t3 - t2) / 2;
+}
+
+template <class T>
+StaticFieldGrid<T>::StaticFieldGrid()
+	: m_interp(INTERP_TRICUBIC), m_radius(0), m_coeff(0), m_shareScale(0),
+	  m_fieldFLOP(0), m_buildFLOP(0)
+{
+	m_min.x = m_min.y = m_min.z = 0;
+	m_max = m_invSpacing = m_min;
+	for (int d = 0; d < 3; d++)
+		m_dims[d] = m_nodeDims[d] = m_blockDims[d] = 0;
+}
+
+template <class T> void StaticFieldGrid<T>::Free()
+{
+	std::vector<Vector3<T> >().swap(m_nodes);
+	std::vector<electro::pointCharge<T> >().swap(m_charges);
+	std::vector<electro::pointCharge<T> >().swap(m_nearCharges);
+	m_blockStart.clear();
+	m_shares.clear();
+}
+
+/**
+ * Blocks tile the node intervals from node 0, one spacing before the box, and
+ * their lists cover the closed block, so that every node and every point in
+ * the box finds its near charges in a single list.
+ */
+template <class T> void StaticFieldGrid<T>::BuildNearLists(ThreadPool &pool)
+{
+	const size_t *dims = m_blockDims;
+	const size_t blocks = dims[0] * dims[1] * dims[2];
+	const size_t p = m_charges.size();
+	const T width[3] = { GRID_BLOCK_INTERVALS / m_invSpacing.x,
+			     GRID_BLOCK_INTERVALS / m_invSpacing.y,
+			     GRID_BLOCK_INTERVALS / m_invSpacing.z };
+	const T origin[3] = { m_min.x - 1 / m_invSpacing.x,
+			      m_min.y - 1 / m_invSpacing.y,
+			      m_min.z - 1 / m_invSpacing.z };
+	const T radiusSq = m_radius * m_radius;
+	const electro::pointCharge<T> *src = p ? &m_charges[0] : NULL;
+
+	std::vector<std::vector<unsigned int> > lists(blocks);
+	pool.ParallelFor(
+		0, blocks, GRID_ROWS_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t b = begin; b < end; b++) {
+				const size_t at[3] = { b % dims[0],
+						       b / dims[0] % dims[1],
+						       b / dims[0] / dims[1] };
+				T lo[3], hi[3];
+				for (int d = 0; d < 3; d++) {
+					lo[d] = origin[d] + at[d] * width[d];
+					hi[d] = lo[d] + width[d];
+				}
+				for (size_t j = 0; j < p; j++) {
+					const T pos[3] = { src[j].position.x,
+							   src[j].position.y,
+							   src[j].position.z };
+					// Squared distance from the block
+					T distSq = 0;
+					for (int d = 0; d < 3; d++) {
+						const T out = std::max(
+							lo[d] - pos[d],
+							pos[d] - hi[d]);
+						if (out > 0)
+							distSq += out * out;
+					}
+					if (distSq < radiusSq)
+						lists[b].push_back(
+							(unsigned int)j);
+				}
+			}
+		});
+
+	// Copied in block order, so that each list is read in a row
+	m_blockStart.assign(blocks + 1, 0);
+	for (size_t b = 0; b < blocks; b++)
+		m_blockStart[b + 1] = m_blockStart[b] + lists[b].size();
+	m_nearCharges.resize(m_blockStart[blocks]);
+	for (size_t b = 0; b < blocks; b++) {
+		for (size_t k = 0; k < lists[b].size(); k++)
+			m_nearCharges[m_blockStart[b] + k] =
+				m_charges[lists[b][k]];
+	}
+}
+
+template <class T>
+inline size_t StaticFieldGrid<T>::BlockOf(const size_t node[3]) const
+{
+	size_t block[3];
+	for (int d = 0; d < 3; d++)
+		block[d] = std::min(node[d] / GRID_BLOCK_INTERVALS,
+				    m_blockDims[d] - 1);
+	return (block[2] * m_blockDims[1] + block[1]) * m_blockDims[0] +
+	       block[0];
+}
+
+template <class T>
+int StaticFieldGrid<T>::Build(ThreadPool &pool,
+			      Array<electro::pointCharge<T> > &charges,
+			      const Vector3<T> minBound,
+			      const Vector3<T> maxBound, T nearRadius,
+			      Interpolation interp)
+{
+	Free();
+	const size_t p = charges.GetSize();
+	const T extent[3] = { maxBound.x - minBound.x, maxBound.y - minBound.y,
+			      maxBound.z - minBound.z };
+	if (!(extent[0] > 0 && extent[1] > 0 && extent[2] > 0))
+		return 1;
+
+	const double volume = (double)extent[0] * extent[1] * extent[2];
+	if (!(nearRadius > 0))
+		nearRadius = (T)cbrt(3 * GRID_NEAR_CHARGES * volume /
+				     (4 * M_PI * (p ? p : 1)));
+	T spacing = nearRadius / GRID_SPACING_PER_RADIUS;
+	for (;;) {
+		double nodes = 1;
+		for (int d = 0; d < 3; d++) {
+			m_dims[d] = std::max<size_t>(
+				1, (size_t)ceil(extent[d] / spacing));
+			m_nodeDims[d] = m_dims[d] + 3;
+			// Blocks tile the m_nodeDims[d] - 1 intervals
+			m_blockDims[d] = (m_nodeDims[d] + GRID_BLOCK_INTERVALS -
+					  2) / GRID_BLOCK_INTERVALS;
+			nodes *= m_nodeDims[d];
+		}
+		if (nodes <= GRID_MAX_NODES)
+			break;
+		spacing *= (T)1.25;
+		nearRadius *= (T)1.25;
+	}
+
+	m_interp = interp;
+	m_min = minBound;
+	m_max = maxBound;
+	m_invSpacing.x = m_dims[0] / extent[0];
+	m_invSpacing.y = m_dims[1] / extent[1];
+	m_invSpacing.z = m_dims[2] / extent[2];
+	m_radius = nearRadius;
+	m_coeff = PMESolver<T>::EwaldCoefficient(nearRadius,
+						 (T)GRID_TOLERANCE);
+
+	std::vector<T> coords[4];
+	try {
+		m_charges.assign(charges.GetDataPointer(),
+				 charges.GetDataPointer() + p);
+		m_nodes.resize(m_nodeDims[0] * m_nodeDims[1] * m_nodeDims[2]);
+		BuildNearLists(pool);
+		for (int d = 0; d < 4; d++)
+			coords[d].resize(p);
+	} catch (std::bad_alloc &) {
+		Free();
+		return 1;
+	}
+	for (size_t j = 0; j < p; j++) {
+		coords[0][j] = m_charges[j].position.x;
+		coords[1][j] = m_charges[j].position.y;
+		coords[2][j] = m_charges[j].position.z;
+		coords[3][j] = m_charges[j].magnitude;
+	}
+
+	/*
+	 * Every node sums the full field of the charges beyond the near radius,
+	 * whose smooth part differs from it by less than the tolerance, and the
+	 * smooth part of those on its near list, in double precision.
+	 */
+	const T *x = p ? &coords[0][0] : NULL;
+	const T *y = p ? &coords[1][0] : NULL;
+	const T *z = p ? &coords[2][0] : NULL;
+	const T *q = p ? &coords[3][0] : NULL;
+	const T radiusSq = nearRadius * nearRadius;
+	const double coeff = m_coeff;
+	const double spacings[3] = { 1 / (double)m_invSpacing.x,
+				     1 / (double)m_invSpacing.y,
+				     1 / (double)m_invSpacing.z };
+	const size_t *dims = m_nodeDims;
+	const size_t *blockStart = &m_blockStart[0];
+	const electro::pointCharge<T> *near =
+		m_nearCharges.empty() ? NULL : &m_nearCharges[0];
+	Vector3<T> *nodes = &m_nodes[0];
+	pool.ParallelFor(
+		0, dims[1] * dims[2], GRID_ROWS_PER_TASK,
+		[&](size_t begin, size_t end, size_t thread) {
+			for (size_t row = begin; row < end; row++) {
+				size_t node[3] = { 0, row % dims[1],
+						   row / dims[1] };
+				// Node 0 lies one spacing before the box
+				double at[3];
+				at[1] = minBound.y +
+					spacings[1] * (node[1] - 1.0);
+				at[2] = minBound.z +
+					spacings[2] * (node[2] - 1.0);
+				for (; node[0] < dims[0]; node[0]++) {
+					at[0] = minBound.x +
+						spacings[0] * (node[0] - 1.0);
+					const Vector3<T> point = { (T)at[0],
+								   (T)at[1],
+								   (T)at[2] };
+					Vector3<T> E = FarField(point, x, y, z,
+								q, p, radiusSq);
+					double smooth[3] = { 0, 0, 0 };
+					const size_t b = BlockOf(node);
+					for (size_t k = blockStart[b];
+					     k < blockStart[b + 1]; k++) {
+						const Vector3<T> &pos =
+							near[k].position;
+						const double r[3] = {
+							at[0] - pos.x,
+							at[1] - pos.y,
+							at[2] - pos.z
+						};
+						const double lenSq =
+							r[0] * r[0] +
+							r[1] * r[1] +
+							r[2] * r[2];
+						if (!(lenSq < radiusSq))
+							continue;
+						const double w =
+							near[k].magnitude *
+							SmoothWeight(lenSq,
+								     coeff);
+						for (int d = 0; d < 3; d++)
+							smooth[d] += r[d] * w;
+					}
+					E.x += (T)smooth[0];
+					E.y += (T)smooth[1];
+					E.z += (T)smooth[2];
+					nodes[row * dims[0] + node[0]] = E;
+				}
+			}
+		});
+
+	// Share of the near sums in the field of a charge, by lenSq
+	m_shares.resize(GRID_SHARE_ENTRIES + 2);
+	m_shareScale = (T)(GRID_SHARE_ENTRIES / radiusSq);
+	for (size_t k = 0; k < m_shares.size(); k++) {
+		const double arg = sqrt((double)k / GRID_SHARE_ENTRIES) *
+				   nearRadius * coeff;
+		m_shares[k] = (T)(erfc(arg) +
+				  M_2_SQRTPI * arg * exp(-arg * arg));
+	}
+
+	const double blocks = (double)(m_blockStart.size() - 1);
+	m_fieldFLOP = m_nearCharges.size() / blocks * GRID_NEAR_PAIR_FLOP +
+		      (interp == INTERP_TRICUBIC ? GRID_TRICUBIC_FLOP :
+						   GRID_TRILINEAR_FLOP);
+	m_buildFLOP = (double)m_nodes.size() * p * GRID_NODE_PAIR_FLOP;
+	return 0;
+}
+
+template <class T>
+inline bool StaticFieldGrid<T>::Contains(const Vector3<T> point) const
+{
+	return point.x >= m_min.x && point.x <= m_max.x &&
+	       point.y >= m_min.y && point.y <= m_max.y &&
+	       point.z >= m_min.z && point.z <= m_max.z;
+}
+
+template <class T>
+Vector3<T> StaticFieldGrid<T>::DirectField(const Vector3<T> point) const
+{
+	Vector3<T> E = { 0, 0, 0 };
+	for (size_t j = 0; j < m_charges.size(); j++) {
+		const Vector3<T> r = point - m_charges[j].position;
+		const T lenSq = vec3LenSq(r);
+		if (lenSq > 0)
+			E += r * (m_charges[j].magnitude /
+				  (lenSq * (T)sqrt(lenSq)));
+	}
+	return E;
+}
+
+/**
+ * The point falls in the interval [i, i + 1) of each axis, at fraction t. The
+ * trilinear weights are those of nodes i and i + 1, and the cubic ones those
+ * of nodes i - 1 to i + 2; m_nodes starts at node -1.
+ */
+template <class T>
+Vector3<T> StaticFieldGrid<T>::Field(const Vector3<T> point) const
+{
+	if (!Contains(point) || m_nodes.empty())
+		return DirectField(point);
+
+	const T f[3] = { (point.x - m_min.x) * m_invSpacing.x,
+			 (point.y - m_min.y) * m_invSpacing.y,
+			 (point.z - m_min.z) * m_invSpacing.z };
+	const bool cubic = m_interp == INTERP_TRICUBIC;
+	const size_t order = cubic ? 4 : 2;
+	size_t first[3], node[3];
+	T w[3][4];
+	for (int d = 0; d < 3; d++) {
+		const size_t i = std::min((size_t)f[d], m_dims[d] - 1);
+		const T t = f[d] - i;
+		node[d] = i + 1;
+		first[d] = cubic ? i : i + 1;
+		if (cubic) {
+			CubicWeights(t, w[d]);
+		} else {
+			w[d][0] = 1 - t;
+			w[d][1] = t;
+		}
+	}
+
+	Vector3<T> E = { 0, 0, 0 };
+	for (size_t c = 0; c < order; c++) {
+		for (size_t b = 0; b < order; b++) {
+			const Vector3<T> *row =
+				&m_nodes[((first[2] + c) * m_nodeDims[1] +
+					  first[1] + b) * m_nodeDims[0] +
+					 first[0]];
+			const T wzy = w[2][c] * w[1][b];
+			for (size_t a = 0; a < order; a++)
+				E += row[a] * (wzy * w[0][a]);
+		}
+	}
+
+	// The rest of the charges within the near radius
+	const T radiusSq = m_radius * m_radius;
+	const T scale = m_shareScale;
+	const T *shares = &m_shares[0];
+	const size_t block = BlockOf(node);
+	const size_t last = m_blockStart[block + 1];
+	for (size_t k = m_blockStart[block]; k < last; k++) {
+		const electro::pointCharge<T> &src = m_nearCharges[k];
+		const Vector3<T> r = point - src.position;
+		const T lenSq = vec3LenSq(r);
+		if (!(lenSq > 0) || lenSq >= radiusSq)
+			continue;
+		// Linear interpolation of the share in lenSq
+		const T u = lenSq * scale;
+		const size_t e = (size_t)u;
+		const T share =
+			shares[e] + (u - e) * (shares[e + 1] - shares[e]);
+		E += r * (src.magnitude * share / (lenSq * (T)sqrt(lenSq)));
+	}
+	return E;
+}
+
+template class StaticFieldGrid<float>;
+template class StaticFieldGrid<double>;
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _STATIC_FIELD_GRID_HPP
+#define _STATIC_FIELD_GRID_HPP
+
+#include "Electrostatics.h"
+#include "SOA_utils.hpp"
+#include "Thread_Pool.hpp"
+#include <vector>
+
+/**=============================================================================
+ * \brief Precomputed field of a fixed set of point charges
+ *
+ * The field of every charge is split, as in the Ewald sums, into that of a
+ * Gaussian cloud of width 1 / coeff around it, which is smooth everywhere, and
+ * the rest, which is singular at the charge but drops to nothing within the
+ * near radius. The smooth part of all charges is sampled once on a uniform
+ * grid of nodes and interpolated; the rest is summed directly over the charges
+ * within the near radius, which every block of nodes keeps a list of. A field
+ * evaluation thus costs the same however many charges there are, and stays
+ * exact close to them.
+ *
+ * Outside the box of the grid, the field is summed directly over all charges.
+ * As in the direct sums, fields are not multiplied by electro_k.
+ * ===========================================================================*/
+template <class T> class StaticFieldGrid {
+public:
+	StaticFieldGrid();
+
+	/// How the smooth part is interpolated between the nodes
+	enum Interpolation {
+		/// The 8 nodes around the point; error of order spacing^2
+		INTERP_TRILINEAR,
+		/// The 64 nodes around the point, with Catmull-Rom splines
+		/// along each axis; error of order spacing^3
+		INTERP_TRICUBIC
+	};
+
+	/**
+	 * \brief Samples the field of 'charges' in the box [minBound, maxBound]
+	 *
+	 * Charges are copied, so later changes to 'charges' are not seen until
+	 * the grid is built again. The nodes are nearRadius / 8 apart, and the
+	 * smooth part falls short of the full field by 1E-6 at nearRadius. A
+	 * 'nearRadius' of 0 picks the one holding 8 charges on average. Both
+	 * grow if the grid would exceed 2^22 nodes.
+	 * @return 0 on success, or 1 if the box is empty or memory cannot be
+	 * allocated
+	 */
+	int Build(ThreadPool &pool, Array<electro::pointCharge<T> > &charges,
+		  const Vector3<T> minBound, const Vector3<T> maxBound,
+		  T nearRadius = 0, Interpolation interp = INTERP_TRICUBIC);
+	void Free();
+
+	/// Field at 'point', as the sum of q r/|r|^3 over the charges
+	Vector3<T> Field(const Vector3<T> point) const;
+
+	bool IsBuilt() const
+	{
+		return !m_nodes.empty();
+	}
+	size_t GetNodeCount() const
+	{
+		return m_nodes.size();
+	}
+	T GetNearRadius() const
+	{
+		return m_radius;
+	}
+	/// Estimated FLOP of one Field() within the box
+	double GetFieldFLOP() const
+	{
+		return m_fieldFLOP;
+	}
+	/// FLOP of the last Build()
+	double GetBuildFLOP() const
+	{
+		return m_buildFLOP;
+	}
+
+private:
+	/// Whether 'point' is inside the box the nodes cover
+	bool Contains(const Vector3<T> point) const;
+	/// Field at 'point' summed over every charge
+	Vector3<T> DirectField(const Vector3<T> point) const;
+	/// Lists the charges within the near radius of every block
+	void BuildNearLists(ThreadPool &pool);
+	/// Block whose list covers a node, given in node coordinates
+	size_t BlockOf(const size_t node[3]) const;
+
+	Interpolation m_interp;
+	Vector3<T> m_min, m_max;
+	/// Node intervals per unit of length, along each axis
+	Vector3<T> m_invSpacing;
+	/// Intervals along each axis; one more node lies outside each end
+	size_t m_dims[3];
+	/// Nodes along each axis, and the smooth field at each of them.
+	/// Node (x, y, z) is at (z * nodeDims[1] + y) * nodeDims[0] + x
+	size_t m_nodeDims[3];
+	std::vector<Vector3<T> > m_nodes;
+	/// Near radius, and the splitting parameter that goes with it
+	T m_radius, m_coeff;
+	std::vector<electro::pointCharge<T> > m_charges;
+	/// Blocks of nodes along each axis. The charges within the near radius
+	/// of block b are m_nearCharges[m_blockStart[b]] up to that of b + 1,
+	/// copied so that they are read in a row
+	size_t m_blockDims[3];
+	std::vector<size_t> m_blockStart;
+	std::vector<electro::pointCharge<T> > m_nearCharges;
+	/// Share of the near sums in the field of a charge, tabulated by the
+	/// squared distance times m_shareScale
+	std::vector<T> m_shares;
+	T m_shareScale;
+	double m_fieldFLOP, m_buildFLOP;
+};
+
+#endif //_STATIC_FIELD_GRID_HPP
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Thread_Pool.hpp"
+#include <X-Compat/Threading.h>
+#include <atomic>
+#include <cstdio>
+
+ThreadPool::ThreadPool(size_t nThreads, bool pinThreads)
+	: m_task(NULL), m_generation(0), m_pending(0), m_quit(false)
+{
+	if (!nThreads)
+		nThreads = Threads::GetNumberOfProcessors();
+
+	for (size_t i = 0; i < nThreads; i++)
+		m_threads.push_back(
+			std::thread(&ThreadPool::WorkerLoop, this, i, pinThreads));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i].join();
+}
+
+ThreadPool &ThreadPool::GetGlobal()
+{
+	static ThreadPool globalPool;
+	return globalPool;
+}
+
+void ThreadPool::WorkerLoop(size_t index, bool pin)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "EMag pool %u", (unsigned int)index);
+	Threads::SetCurrentThreadName(name);
+	if (pin)
+		Threads::SetCurrentThreadAffinity(index);
+
+	unsigned long lastGeneration = 0;
+	for (;;) {
+		const Task *task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_quit && m_generation == lastGeneration)
+				m_wake.wait(lock);
+			if (m_quit)
+				return;
+			lastGeneration = m_generation;
+			task = m_task;
+		}
+
+		(*task)(index);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!--m_pending)
+			m_done.notify_all();
+	}
+}
+
+void ThreadPool::Run(const Task &task)
+{
+	std::lock_guard<std::mutex> job(m_jobMutex);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_task = &task;
+	m_pending = m_threads.size();
+	m_generation++;
+	m_wake.notify_all();
+	while (m_pending)
+		m_done.wait(lock);
+	m_task = NULL;
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain,
+			     const RangeTask &task)
+{
+	if (begin >= end)
+		return;
+	if (!grain)
+		grain = 1;
+
+	std::atomic<size_t> next(begin);
+	Task chunker = [&](size_t threadIndex) {
+		for (;;) {
+			size_t start = next.fetch_add(grain);
+			if (start >= end)
+				return;
+			size_t stop = (end - start > grain) ? start + grain : end;
+			task(start, stop, threadIndex);
+		}
+	};
+	Run(chunker);
+}
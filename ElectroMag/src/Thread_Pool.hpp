@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _THREAD_POOL_HPP
+#define _THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**=============================================================================
+ * \brief Persistent pool of worker threads, each pinned to one core
+ *
+ * OpenMP regions create (or wake) their team on every entry, and give no
+ * control over where threads land. The pool creates its workers once, pins
+ * each one to a separate logical processor, and parks them on a condition
+ * variable between jobs. Jobs are dispatched with Run() or ParallelFor(), both
+ * of which block the calling thread until every worker is done.
+ *
+ * Only one job may be in flight at a time; concurrent callers are serialized.
+ * ===========================================================================*/
+class ThreadPool {
+public:
+	/// Job run once on every worker; receives the index of the worker
+	typedef std::function<void(size_t threadIndex)> Task;
+	/// Job run on a sub-range [begin, end) by worker 'threadIndex'
+	typedef std::function<void(size_t begin, size_t end, size_t threadIndex)>
+		RangeTask;
+
+	/**
+	 * @param nThreads Number of workers; 0 uses one per available processor
+	 * @param pinThreads Pin worker i to the i-th available processor
+	 */
+	explicit ThreadPool(size_t nThreads = 0, bool pinThreads = true);
+	~ThreadPool();
+
+	size_t GetNumThreads() const
+	{
+		return m_threads.size();
+	}
+
+	/// Runs 'task' once on every worker and waits for all of them
+	void Run(const Task &task);
+
+	/**
+	 * \brief Splits [begin, end) in chunks of 'grain' elements that the
+	 * \brief workers pull until the range is exhausted
+	 *
+	 * Chunk boundaries are always multiples of 'grain' away from 'begin', so
+	 * kernels that need aligned starting points only need an aligned 'begin'.
+	 */
+	void ParallelFor(size_t begin, size_t end, size_t grain,
+			 const RangeTask &task);
+
+	/// Process-wide pool, created on first use
+	static ThreadPool &GetGlobal();
+
+private:
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+
+	void WorkerLoop(size_t index, bool pin);
+
+	std::vector<std::thread> m_threads;
+	/// Serializes Run() callers
+	std::mutex m_jobMutex;
+	/// Protects the job state below
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const Task *m_task;
+	/// Incremented for every job so that workers never run a job twice
+	unsigned long m_generation;
+	/// Workers that have not yet finished the current job
+	size_t m_pending;
+	bool m_quit;
+};
+
+#endif//_THREAD_POOL_HPP
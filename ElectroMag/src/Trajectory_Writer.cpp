@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Trajectory_Writer.hpp"
+#include "X-Compat/HPC Timing.h"
+#include <cstdint>
+#include <cstring>
+
+/// A buffer is handed to the background thread once it holds this many bytes
+#define TRAJECTORY_BUFFER_BYTES (1 << 20)
+#define TRAJECTORY_MAGIC "EMTRAJ01"
+
+/// Appends the bytes of 'value' to 'buffer'
+template <class V>
+static void Append(std::vector<unsigned char> &buffer, const V value)
+{
+	const unsigned char *bytes = (const unsigned char *)&value;
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+/// Stores the bytes of 'value' at 'out', and moves past them
+template <class V> static inline void Put(unsigned char *&out, const V value)
+{
+	memcpy(out, &value, sizeof(value));
+	out += sizeof(value);
+}
+
+/**
+ * \brief Nearest IEEE half precision value of 'value'
+ *
+ * Ties round to even. Values beyond the largest half, 65504, become infinite.
+ */
+static uint16_t HalfFromFloat(const float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const uint32_t sign = (bits >> 16) & 0x8000;
+	const uint32_t absBits = bits & 0x7fffffff;
+
+	// Infinity and NaN
+	if (absBits >= 0x7f800000)
+		return sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0);
+	// 65520 and up round to infinity
+	if (absBits >= 0x477ff000)
+		return sign | 0x7c00;
+	// Below 2^-14, halves are subnormal, in units of 2^-24
+	if (absBits < 0x38800000) {
+		if (absBits < 0x33000000)
+			return sign;
+		const uint32_t mantissa = (absBits & 0x7fffff) | 0x800000;
+		const uint32_t shift = 126 - (absBits >> 23);
+		uint32_t half = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t tie = 1u << (shift - 1);
+		if (rest > tie || (rest == tie && (half & 1)))
+			half++;
+		return sign | half;
+	}
+	// Rebias the exponent from 127 to 15; a carry out of the mantissa
+	// correctly moves on to the next exponent
+	uint32_t half = (absBits - 0x38000000) >> 13;
+	const uint32_t rest = absBits & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return sign | half;
+}
+
+template <class T>
+TrajectoryWriter<T>::TrajectoryWriter()
+	: m_encoding(ENCODE_FLOAT32), m_stride(1), m_file(NULL),
+	  m_particles(0), m_frameBytes(0), m_frames(0), m_stallTime(0),
+	  m_fill(0), m_busy(false), m_quit(false), m_failed(false)
+{
+	const Vector3<T> zero = { 0, 0, 0 };
+	m_minBound = m_maxBound = zero;
+}
+
+template <class T> TrajectoryWriter<T>::~TrajectoryWriter()
+{
+	Close();
+}
+
+template <class T>
+void TrajectoryWriter<T>::SetEncoding(Encoding encoding,
+				      const Vector3<T> minBound,
+				      const Vector3<T> maxBound)
+{
+	m_encoding = encoding;
+	m_minBound = minBound;
+	m_maxBound = maxBound;
+}
+
+template <class T>
+int TrajectoryWriter<T>::Open(const char *fileName, size_t particles)
+{
+	Close();
+	for (size_t i = 0; i < m_subset.size(); i++) {
+		if (m_subset[i] >= particles)
+			return 1;
+	}
+	m_file = fopen(fileName, "wb");
+	if (!m_file)
+		return 1;
+
+	m_particles = particles;
+	m_recorded = m_subset;
+	if (m_recorded.empty()) {
+		m_recorded.resize(particles);
+		for (size_t i = 0; i < particles; i++)
+			m_recorded[i] = (unsigned int)i;
+	}
+	const size_t coordBytes = m_encoding == ENCODE_FLOAT32 ? 4 : 2;
+	m_frameBytes = sizeof(uint64_t) + sizeof(double) +
+		       3 * m_recorded.size() * coordBytes;
+	m_frames = 0;
+	m_stallTime = 0;
+	m_busy = m_quit = m_failed = false;
+	m_fill = 0;
+	for (int b = 0; b < 2; b++) {
+		m_buffers[b].clear();
+		m_buffers[b].reserve(TRAJECTORY_BUFFER_BYTES + m_frameBytes);
+	}
+
+	// The header goes out with the first buffer
+	std::vector<unsigned char> &header = m_buffers[m_fill];
+	header.insert(header.end(), TRAJECTORY_MAGIC, TRAJECTORY_MAGIC + 8);
+	Append(header, (uint32_t)m_encoding);
+	Append(header, (uint32_t)m_stride);
+	Append(header, (uint64_t)m_recorded.size());
+	Append(header, (uint64_t)particles);
+	Append(header, (double)m_minBound.x);
+	Append(header, (double)m_minBound.y);
+	Append(header, (double)m_minBound.z);
+	Append(header, (double)m_maxBound.x);
+	Append(header, (double)m_maxBound.y);
+	Append(header, (double)m_maxBound.z);
+	for (size_t i = 0; i < m_recorded.size(); i++)
+		Append(header, (uint32_t)m_recorded[i]);
+
+	m_thread = std::thread(&TrajectoryWriter::WriterLoop, this);
+	return 0;
+}
+
+/**
+ * Particles are looked up through 'order' once per recorded frame, so that
+ * the recorded ones keep their place in the file however the system sorts its
+ * arrays.
+ */
+template <class T>
+int TrajectoryWriter<T>::Write(size_t step, double time,
+			       const Vector3<T *> positions,
+			       const unsigned int *order)
+{
+	if (!m_file)
+		return 1;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_failed)
+			return 1;
+	}
+	if (step % m_stride)
+		return 0;
+
+	if (order) {
+		m_where.resize(m_particles);
+		for (size_t i = 0; i < m_particles; i++)
+			m_where[order[i]] = (unsigned int)i;
+	}
+	std::vector<unsigned char> &buffer = m_buffers[m_fill];
+	const size_t start = buffer.size();
+	buffer.resize(start + m_frameBytes);
+	unsigned char *out = &buffer[start];
+	Put(out, (uint64_t)step);
+	Put(out, time);
+
+	const size_t count = m_recorded.size();
+	const T *axes[3] = { positions.x, positions.y, positions.z };
+	const T mins[3] = { m_minBound.x, m_minBound.y, m_minBound.z };
+	const T maxs[3] = { m_maxBound.x, m_maxBound.y, m_maxBound.z };
+	for (int a = 0; a < 3; a++) {
+		const T *coord = axes[a];
+		const T scale = maxs[a] > mins[a] ? 65535 / (maxs[a] - mins[a])
+						  : 0;
+		const unsigned int *where = order ? &m_where[0] : NULL;
+		const unsigned int *recorded = &m_recorded[0];
+		switch (m_encoding) {
+		case ENCODE_FLOAT16:
+			for (size_t k = 0; k < count; k++) {
+				const size_t at = where ? where[recorded[k]]
+							: recorded[k];
+				Put(out, HalfFromFloat((float)coord[at]));
+			}
+			break;
+		case ENCODE_QUANTIZED16:
+			for (size_t k = 0; k < count; k++) {
+				const size_t at = where ? where[recorded[k]]
+							: recorded[k];
+				T q = (coord[at] - mins[a]) * scale;
+				q = q < 0 ? 0 : (q > 65535 ? 65535 : q);
+				Put(out, (uint16_t)(q + (T)0.5));
+			}
+			break;
+		default:
+			for (size_t k = 0; k < count; k++) {
+				const size_t at = where ? where[recorded[k]]
+							: recorded[k];
+				Put(out, (float)coord[at]);
+			}
+			break;
+		}
+	}
+	m_frames++;
+
+	if (buffer.size() >= TRAJECTORY_BUFFER_BYTES)
+		Flush();
+	return 0;
+}
+
+template <class T> double TrajectoryWriter<T>::WaitIdle()
+{
+	PerfTimer timer;
+	timer.start();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_busy)
+		m_idle.wait(lock);
+	return timer.tick();
+}
+
+/// The buffer being written out must be on disk before it is filled again
+template <class T> void TrajectoryWriter<T>::Flush()
+{
+	m_stallTime += WaitIdle();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fill ^= 1;
+		m_busy = true;
+	}
+	m_wake.notify_all();
+	m_buffers[m_fill].clear();
+}
+
+template <class T> void TrajectoryWriter<T>::WriterLoop()
+{
+	for (;;) {
+		std::vector<unsigned char> *buffer;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_busy && !m_quit)
+				m_wake.wait(lock);
+			if (!m_busy)
+				return;
+			buffer = &m_buffers[m_fill ^ 1];
+		}
+
+		const bool written =
+			buffer->empty() ||
+			fwrite(&(*buffer)[0], 1, buffer->size(), m_file) ==
+				buffer->size();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_failed |= !written;
+			m_busy = false;
+		}
+		m_idle.notify_all();
+	}
+}
+
+template <class T> int TrajectoryWriter<T>::Close()
+{
+	if (!m_file)
+		return 0;
+
+	if (!m_buffers[m_fill].empty())
+		Flush();
+	WaitIdle();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+	m_thread.join();
+
+	const bool closed = fclose(m_file) == 0;
+	m_file = NULL;
+	m_where.clear();
+	return m_failed || !closed ? 1 : 0;
+}
+
+template class TrajectoryWriter<float>;
+template class TrajectoryWriter<double>;
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TRAJECTORY_WRITER_HPP
+#define _TRAJECTORY_WRITER_HPP
+
+#include "Vector.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**=============================================================================
+ * \brief Streams particle positions to a binary trajectory file
+ *
+ * Frames are encoded into one of two buffers on the caller's thread, and a
+ * background thread writes out the other. The caller only waits when it fills
+ * a buffer before the previous one is on disk, that is when the disk cannot
+ * keep up on average.
+ *
+ * The file holds, in the byte order of the writing host:
+ *  - char[8] "EMTRAJ01"
+ *  - uint32 encoding (see Encoding), uint32 stride
+ *  - uint64 particles recorded, uint64 particles in the system
+ *  - float64[3] minimum and float64[3] maximum of the box
+ *  - uint32 index of every recorded particle, in the order given to Load()
+ *  - frames, all of the same size: uint64 step, float64 time, then the x,
+ *    then the y, then the z coordinates of the recorded particles
+ * ===========================================================================*/
+template <class T> class TrajectoryWriter {
+public:
+	TrajectoryWriter();
+	~TrajectoryWriter();
+
+	/// How coordinates are stored
+	enum Encoding {
+		/// IEEE single precision, 4 bytes
+		ENCODE_FLOAT32,
+		/// IEEE half precision, 2 bytes; about 3 significant digits
+		ENCODE_FLOAT16,
+		/// 2 bytes, in steps of 1/65535 of the box; positions outside
+		/// are clamped to its faces
+		ENCODE_QUANTIZED16
+	};
+	/**
+	 * \brief Selects the encoding, and the box [minBound, maxBound] that
+	 * ENCODE_QUANTIZED16 spans
+	 *
+	 * The default is ENCODE_FLOAT32. Takes effect at the next Open().
+	 */
+	void SetEncoding(Encoding encoding, const Vector3<T> minBound,
+			 const Vector3<T> maxBound);
+	/// Records only the steps that are multiples of 'stride'; 1, the
+	/// default, records every step. Takes effect at the next Open()
+	void SetStride(size_t stride)
+	{
+		m_stride = stride ? stride : 1;
+	}
+	/**
+	 * \brief Records only the particles at 'indices' in the array given to
+	 * Load()
+	 *
+	 * An empty list, the default, records every particle. Takes effect at
+	 * the next Open().
+	 */
+	void SetSubset(const std::vector<unsigned int> &indices)
+	{
+		m_subset = indices;
+	}
+
+	/**
+	 * \brief Starts a trajectory of a system of 'particles' particles
+	 *
+	 * @return 0 on success, or 1 if the file cannot be opened or the subset
+	 * names a particle that does not exist
+	 */
+	int Open(const char *fileName, size_t particles);
+	/**
+	 * \brief Offers the positions after step 'step', at time 'time'
+	 *
+	 * 'order', if not NULL, gives for each element of 'positions' its index
+	 * in the array given to Load(), as ParticleSystem::GetOrder() does.
+	 * @return 0 if the frame was recorded or skipped, or 1 if the file is
+	 * not open or a write has failed
+	 */
+	int Write(size_t step, double time, const Vector3<T *> positions,
+		  const unsigned int *order = NULL);
+	/**
+	 * \brief Writes out the buffered frames, and closes the file
+	 *
+	 * @return 0 unless a write has failed
+	 */
+	int Close();
+
+	bool IsOpen() const
+	{
+		return m_file != NULL;
+	}
+	/// Frames recorded since Open()
+	size_t GetFrameCount() const
+	{
+		return m_frames;
+	}
+	/// Seconds Write() has waited for the background thread since Open()
+	double GetStallTime() const
+	{
+		return m_stallTime;
+	}
+
+private:
+	TrajectoryWriter(const TrajectoryWriter &);
+	TrajectoryWriter &operator=(const TrajectoryWriter &);
+
+	/// Hands the buffer being filled to the background thread
+	void Flush();
+	/// Waits until the background thread is idle, and returns the time
+	/// waited
+	double WaitIdle();
+	void WriterLoop();
+
+	/// Settings, fixed from Open() to Close()
+	Encoding m_encoding;
+	Vector3<T> m_minBound, m_maxBound;
+	size_t m_stride;
+	std::vector<unsigned int> m_subset;
+
+	FILE *m_file;
+	size_t m_particles;
+	/// Particles recorded: m_subset, or all of them
+	std::vector<unsigned int> m_recorded;
+	/// Element of the current positions holding each particle of Load()
+	std::vector<unsigned int> m_where;
+	size_t m_frameBytes, m_frames;
+	double m_stallTime;
+
+	/// The buffer being filled, and the other one, being written out
+	std::vector<unsigned char> m_buffers[2];
+	size_t m_fill;
+	std::thread m_thread;
+	/// Protects the state below
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	/// The background thread has a buffer to write out
+	bool m_busy;
+	bool m_quit;
+	bool m_failed;
+};
+
+#endif //_TRAJECTORY_WRITER_HPP
@@ -30,11 +30,12 @@ using std::ofstream;
  * Compare to electric fields that are preusmed to be identical. Looks for
  * linea in 'b' that are close to the line in 'a' but suddenly jump off-course
  */
-void compare_electric_fields(Vector3<Array<float> > &field_a,
-			     Vector3<Array<float> > &field_b, size_t num_lines,
+template <class T>
+void compare_electric_fields(Vector3<Array<T> > &field_a,
+			     Vector3<Array<T> > &field_b, size_t num_lines,
 			     size_t line_len, const char *output_filename)
 {
-	Vector3<float> a, b, ap, bp;
+	Vector3<T> a, b, ap, bp;
 	ofstream regress;
 
 	/* Okay to use assert in debug-only code */
@@ -57,7 +58,7 @@ void compare_electric_fields(Vector3<Array<float> > &field_a,
 			bp = field_b[iLast];
 
 			// Calculate the distance between the a and b point
-			float offset3D = vec3Len(vec3(a, b));
+			T offset3D = vec3Len(vec3(a, b));
 			if (offset3D > 0.1f) {
 				regress << " good [" << line << "][" << step - 1 << "] x: " << ap.x << " y: " << ap.y << " z: " << ap.z << endl
 					<< " bad  [" << line << "][" << step - 1 << "] x: " << bp.x << " y: " << bp.y << " z: " << bp.z << endl
@@ -80,3 +81,10 @@ void compare_electric_fields(Vector3<Array<float> > &field_a,
 	regress.close();
 	cout << " Verification complete" << endl;
 }
+
+template void compare_electric_fields<float>(Vector3<Array<float> > &,
+					     Vector3<Array<float> > &, size_t,
+					     size_t, const char *);
+template void compare_electric_fields<double>(Vector3<Array<double> > &,
+					      Vector3<Array<double> > &, size_t,
+					      size_t, const char *);
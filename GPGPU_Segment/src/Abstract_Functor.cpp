@@ -16,10 +16,31 @@
  *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "Abstract_Functor.hpp"
+#include <X-Compat/HPC Timing.h>
+#include <chrono>
 #include <cstdio>
+#include <fstream>
 #include <thread>
 
+/*
+ * Dynamic scheduling parameters. A device is given roughly its share of the
+ * remaining work divided into SCHED_BLOCKS_PER_DEVICE blocks, so blocks shrink
+ * as the run progresses. Block durations are clamped to keep the scheduling
+ * overhead low at the start, and the tail short at the end.
+ */
+#define SCHED_BLOCKS_PER_DEVICE 4
+#define SCHED_MIN_BLOCK_TIME 0.02
+#define SCHED_MAX_BLOCK_TIME 2.0
+/// Fraction of the work given to a device whose throughput is unknown
+#define SCHED_PROBE_FRACTION 64
+/// Weight of the newest measurement in a device's throughput estimate
+#define SCHED_RATE_WEIGHT 0.5
+
+std::map<std::string, double> AbstractFunctor::learnedRates;
+std::mutex AbstractFunctor::hRatesMutex;
+
 AbstractFunctor::AbstractFunctor()
+    : metricsPeriod(0.5), auxRunning(false)
 {}
 
 AbstractFunctor::~AbstractFunctor()
@@ -70,6 +91,7 @@ unsigned long AbstractFunctor::AsyncFunctor(
         {
             // the functor has succeeded, this device can execute another
             // functor
+            pObject->deviceProgress[deviceID].blocksDone++;
             if (pObject->nFailed)
             {
                 // A Failed functor is available for processing
@@ -97,6 +119,316 @@ unsigned long AbstractFunctor::AsyncAuxFunctor(
     return aParameters->functorClass->AuxFunctor();
 }
 
+bool AbstractFunctor::GrabBlock(
+    size_t deviceIndex, size_t nDevices, AbstractFunctor::WorkBlock *block)
+{
+    const size_t maxUnits = GetMaxBlockUnits(deviceIndex);
+    if (!maxUnits) return false;
+
+    // Blocks that failed elsewhere take priority over fresh work
+    if (!failedBlocks.empty())
+    {
+        *block = failedBlocks.back();
+        failedBlocks.pop_back();
+        if (block->count > maxUnits)
+        {
+            WorkBlock rest = {block->start + maxUnits,
+                              block->count - maxUnits};
+            failedBlocks.push_back(rest);
+            block->count = maxUnits;
+        }
+        return true;
+    }
+
+    const size_t remaining = totalUnits - nextUnit;
+    if (!remaining) return false;
+
+    size_t units;
+    const double rate = deviceRates[deviceIndex];
+    if (rate <= 0)
+    {
+        // Unknown device: give it a small probe block to measure its speed
+        units = remaining / (nDevices * SCHED_PROBE_FRACTION);
+    }
+    else
+    {
+        // Devices of unknown speed are assumed as fast as the slowest known
+        double totalRate = 0, slowest = rate;
+        size_t nUnknown = 0;
+        for (size_t i = 0; i < nDevices; i++)
+        {
+            if (deviceRates[i] <= 0) nUnknown++;
+            else if (deviceRates[i] < slowest) slowest = deviceRates[i];
+            totalRate += deviceRates[i];
+        }
+        totalRate += nUnknown * slowest;
+
+        double blockTime = remaining * unitCost / totalRate
+            / SCHED_BLOCKS_PER_DEVICE;
+        if (blockTime < SCHED_MIN_BLOCK_TIME) blockTime = SCHED_MIN_BLOCK_TIME;
+        if (blockTime > SCHED_MAX_BLOCK_TIME) blockTime = SCHED_MAX_BLOCK_TIME;
+        const double fUnits = rate * blockTime / unitCost;
+        units = (fUnits < (double)remaining) ? (size_t)fUnits : remaining;
+    }
+
+    // Round up to the device granularity, but stay within its limits
+    const size_t granularity = GetWorkGranularity(deviceIndex);
+    if (granularity > 1)
+    {
+        units = (units + granularity - 1) / granularity * granularity;
+        if (units > maxUnits && maxUnits >= granularity)
+            units = maxUnits / granularity * granularity;
+    }
+    if (!units) units = 1;
+    if (units > maxUnits) units = maxUnits;
+    if (units > remaining) units = remaining;
+
+    block->start = nextUnit;
+    block->count = units;
+    nextUnit += units;
+    return true;
+}
+
+unsigned long AbstractFunctor::AsyncBlockFunctor(
+    AbstractFunctor::AsyncParameters *aParameters)
+{
+    AbstractFunctor *pObject = aParameters->functorClass;
+    const size_t deviceID = aParameters->functorIndex;
+    const size_t nDevices = aParameters->nFunctors;
+    std::unique_lock<std::mutex> lock(pObject->hRemapMutex);
+    unsigned long retVal = 0;
+
+    for (;;)
+    {
+        WorkBlock block;
+        if (!pObject->GrabBlock(deviceID, nDevices, &block))
+        {
+            // A busy device may still fail and queue its block, so only
+            // leave once every block has been accounted for
+            if (!pObject->nBusy) break;
+            pObject->hWorkSignal.wait(lock);
+            continue;
+        }
+        pObject->nBusy++;
+        lock.unlock();
+
+        PerfTimer timer;
+        timer.start();
+        retVal = pObject->BlockFunctor(deviceID, block.start, block.count);
+        const double time = timer.tick();
+
+        lock.lock();
+        pObject->nBusy--;
+        DeviceProgress &progress = pObject->deviceProgress[deviceID];
+        if (retVal)
+        {
+            // This device is no longer trusted with any work
+            pObject->failedBlocks.push_back(block);
+            pObject->nHealthy--;
+            progress.failed = true;
+            pObject->hWorkSignal.notify_all();
+            break;
+        }
+        progress.unitsDone += block.count;
+        progress.blocksDone++;
+        if (time > 0)
+        {
+            double &rate = pObject->deviceRates[deviceID];
+            const double measured = block.count * pObject->unitCost / time;
+            rate = (rate > 0) ?
+                (1 - SCHED_RATE_WEIGHT) * rate + SCHED_RATE_WEIGHT * measured :
+                measured;
+        }
+        if (!pObject->nBusy) pObject->hWorkSignal.notify_all();
+    }
+
+    return retVal;
+}
+
+unsigned long AbstractFunctor::RunDynamic(size_t nDevices)
+{
+    totalUnits = GetWorkUnits();
+    unitCost = GetUnitCost();
+    if (unitCost <= 0) unitCost = 1;
+    nextUnit = 0;
+    nBusy = 0;
+    nHealthy = nDevices;
+    failedBlocks.clear();
+
+    // Start from the throughputs remembered from previous runs
+    const std::vector<std::string> &keys = deviceKeys;
+    deviceRates.assign(nDevices, 0);
+    hRatesMutex.lock();
+    for (size_t i = 0; i < nDevices; i++)
+    {
+        std::map<std::string, double>::const_iterator it;
+        if (!keys[i].empty()
+            && (it = learnedRates.find(keys[i])) != learnedRates.end())
+            deviceRates[i] = it->second;
+    }
+    hRatesMutex.unlock();
+
+    std::vector<AsyncParameters> launchParams(nDevices);
+    std::vector<std::thread> handles;
+    for (size_t i = 0; i < nDevices; i++)
+    {
+        launchParams[i].functorClass = this;
+        launchParams[i].functorIndex = i;
+        launchParams[i].nFunctors = nDevices;
+        handles.push_back(
+            std::thread(AbstractFunctor::AsyncBlockFunctor, &launchParams[i]));
+    }
+    for (size_t i = 0; i < nDevices; i++)
+    {
+        handles[i].join();
+    }
+
+    hRatesMutex.lock();
+    for (size_t i = 0; i < nDevices; i++)
+    {
+        if (!keys[i].empty() && deviceRates[i] > 0)
+            learnedRates[keys[i]] = deviceRates[i];
+    }
+    hRatesMutex.unlock();
+
+    // Whatever is left could not be processed by any device
+    this->nFailed = failedBlocks.size() + (nextUnit < totalUnits ? 1 : 0);
+    return this->nFailed;
+}
+
+bool AbstractFunctor::LoadDeviceRates(const char *fileName)
+{
+    std::ifstream file(fileName);
+    if (!file) return false;
+
+    std::lock_guard<std::mutex> lock(hRatesMutex);
+    double rate;
+    std::string key;
+    // One device per line: the rate, followed by the key
+    while (file >> rate && std::getline(file >> std::ws, key))
+    {
+        if (rate > 0 && !key.empty()) learnedRates[key] = rate;
+    }
+    return true;
+}
+
+bool AbstractFunctor::SaveDeviceRates(const char *fileName)
+{
+    std::ofstream file(fileName);
+    if (!file) return false;
+
+    std::lock_guard<std::mutex> lock(hRatesMutex);
+    std::map<std::string, double>::const_iterator it;
+    file.precision(10);
+    for (it = learnedRates.begin(); it != learnedRates.end(); it++)
+    {
+        file << it->second << " " << it->first << std::endl;
+    }
+    return !file.fail();
+}
+
+void AbstractFunctor::AddMetricsSink(MetricsSink *sink)
+{
+    metricsSinks.push_back(sink);
+}
+
+void AbstractFunctor::ClearMetricsSinks()
+{
+    metricsSinks.clear();
+}
+
+void AbstractFunctor::SetMetricsPeriod(double seconds)
+{
+    metricsPeriod = seconds;
+}
+
+void AbstractFunctor::ResetProgress(size_t nDevices)
+{
+    DeviceProgress blank = {0, 0, false, {0}};
+    deviceProgress.assign(nDevices, blank);
+    lastUnitsDone.assign(nDevices, 0);
+    deviceKeys.resize(nDevices);
+    deviceScores.resize(nDevices);
+    for (size_t i = 0; i < nDevices; i++)
+    {
+        deviceKeys[i] = GetDeviceKey(i);
+        deviceScores[i] = GetDeviceScore(i);
+    }
+    QueryHPCTimer(&runStart);
+    lastSampleTime = runStart;
+}
+
+bool AbstractFunctor::WaitForStop(double seconds)
+{
+    std::unique_lock<std::mutex> lock(hAuxMutex);
+    if (auxRunning)
+    {
+        hAuxSignal.wait_for(lock,
+            std::chrono::microseconds((long long)(seconds * 1E6)));
+    }
+    return !auxRunning;
+}
+
+void AbstractFunctor::CollectMetrics(MetricsSample *sample, bool final)
+{
+    long long now, freq;
+    QueryHPCTimer(&now);
+    QueryHPCFrequency(&freq);
+    const double elapsed = (double)(now - runStart) / freq;
+    // Final samples report the average over the whole run
+    const double interval = final ? elapsed
+        : (double)(now - lastSampleTime) / freq;
+    const double flopPerUnit = GetUnitFLOP();
+
+    sample->elapsed = elapsed;
+    sample->totalUnits = GetWorkUnits();
+    sample->unitsDone = 0;
+    sample->unitsPerSec = 0;
+    sample->final = final;
+    sample->devices.resize(deviceProgress.size());
+    for (size_t i = 0; i < deviceProgress.size(); i++)
+    {
+        const DeviceProgress &progress = deviceProgress[i];
+        DeviceMetrics &dev = sample->devices[i];
+        dev.name = deviceKeys[i];
+        dev.score = deviceScores[i];
+        dev.unitsDone = progress.unitsDone;
+        dev.blocksDone = progress.blocksDone;
+        dev.failed = progress.failed;
+        const size_t units = final ? dev.unitsDone
+            : dev.unitsDone - lastUnitsDone[i];
+        dev.unitsPerSec = (interval > 0) ? units / interval : 0;
+        dev.gflops = dev.unitsPerSec * flopPerUnit / 1E9;
+        lastUnitsDone[i] = dev.unitsDone;
+
+        sample->unitsDone += dev.unitsDone;
+        sample->unitsPerSec += dev.unitsPerSec;
+    }
+    sample->gflops = sample->unitsPerSec * flopPerUnit / 1E9;
+    if (sample->totalUnits)
+        sample->progress = (double)sample->unitsDone / sample->totalUnits;
+    else
+        sample->progress = final ? 1 : 0;
+    lastSampleTime = now;
+}
+
+unsigned long AbstractFunctor::MonitorDevices(volatile double *pProgress)
+{
+    MetricsSample sample;
+    bool done;
+    do
+    {
+        done = WaitForStop(metricsPeriod);
+        CollectMetrics(&sample, done);
+        if (pProgress) *pProgress = sample.progress;
+        for (size_t i = 0; i < metricsSinks.size(); i++)
+        {
+            metricsSinks[i]->Report(sample);
+        }
+    } while (!done);
+    return 0;
+}
+
 unsigned long AbstractFunctor::Run()
 {
     // Allocate needed resources on each device
@@ -108,6 +440,36 @@ unsigned long AbstractFunctor::Run()
     GenerateParameterList(&nFunctors);
     if (Fail()) return (2<<16);
 
+    // Start the auxiliary functor
+    ResetProgress(nFunctors);
+    auxRunning = true;
+    AbstractFunctor::AsyncParameters auxParams = {this, 0, 0};
+    std::thread hAuxFunctor(AbstractFunctor::AsyncAuxFunctor, &auxParams);
+
+    // Functors that can split their work let the devices balance the load
+    if (GetWorkUnits())
+    {
+        RunDynamic(nFunctors);
+    }
+    else
+    {
+        RunStatic(nFunctors);
+    }
+
+    // Now terminate the auxiliary functor
+    hAuxMutex.lock();
+    auxRunning = false;
+    hAuxSignal.notify_all();
+    hAuxMutex.unlock();
+    hAuxFunctor.join();
+
+    PostRun();
+
+    return this->nFailed;
+}
+
+unsigned long AbstractFunctor::RunStatic(size_t nFunctors)
+{
     // Alocate resources for calling the async functors
     AbstractFunctor::AsyncParameters *launchParams =
         new AbstractFunctor::AsyncParameters[nFunctors];
@@ -133,28 +495,18 @@ unsigned long AbstractFunctor::Run()
         //Threads::SetThreadName(threadID, threadName);
     }
 
-    // Create thread for auxiliary functor
-    /*AbstractFunctor::AsyncParameters auxParams = {this, 0, 0};
-    std::thread *hAuxFunctor
-    = new std::thread(AbstractFunctor::AsyncAuxFunctor,&auxParams);*/
-    // Set the name for the thread
-    //Threads::SetThreadName(threadID, "Aux Functor");
-
     // Now wait for all functors to complete
     for (size_t i = 0; i < nFunctors; i++)
     {
         handles[i]->join();
+        delete handles[i];
     }
+    delete [] handles;
+    delete [] launchParams;
 
     // Release resources used for syncronization
     delete [] this->idleDevices;
     delete [] this->failedFunctors;
 
-    // Now terminate the auxiliary functor
-    //hAuxFunctor.cancel();
-    //delete hAuxFunctor;
-
-    PostRun();
-
     return this->nFailed;
 }
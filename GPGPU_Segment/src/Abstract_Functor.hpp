@@ -25,8 +25,13 @@
 
 #ifndef _ABSTRACT_FUNCTOR_H
 #define _ABSTRACT_FUNCTOR_H
+#include <condition_variable>
+#include <map>
 #include <mutex>
+#include <string>
+#include <vector>
 #include <Data Structures.h>
+#include "Functor_Metrics.hpp"
 
 
 /** ****************************************************************************
@@ -111,12 +116,12 @@ public:
      * \brief separate thread
      * 
      * This function is called after creating the worker threads for the main
-     * functor. If this function does not return after the other worker threads
-     * terminate, its thread will be killed. The auxiliary functor should thus
-     * not be used for any critical purpose, as it may be unexpectedly
-     * terminated. It can however be used for monitoring the status of the
+     * functor. Once the worker threads terminate, WaitForStop() returns true,
+     * and Run() waits for the auxiliary functor to return before calling
+     * PostRun(). The auxiliary functor should not be used for any critical
+     * purpose. It can however be used for monitoring the status of the
      * worker functors, and/or combining real-time performance and progress
-     * information
+     * information; MonitorDevices() does just that.
      */
     virtual unsigned long AuxFunctor() = 0;
 
@@ -145,6 +150,104 @@ public:
      */
     virtual bool FailOnFunctor(size_t functorIndex) = 0;
 
+    /**
+     * \name Dynamic scheduling
+     *
+     * Functors that can process an arbitrary block of their data override
+     * these. Run() then switches from one static partition per device to a
+     * shared queue of work units, from which every device pulls blocks sized
+     * to the throughput it has shown so far. Fast devices thus take more of
+     * the work, and the blocks shrink towards the end of the run so that no
+     * device is left with a large block after the others have finished.
+     * \n
+     * Device throughputs are remembered per device key across runs, and may be
+     * saved to and loaded from a file.
+     * @{
+     */
+    /// Number of work units to distribute; 0 selects static scheduling
+    virtual size_t GetWorkUnits()
+    {
+        return 0;
+    }
+    /// Relative cost of one unit, so that rates carry over between datasets
+    virtual double GetUnitCost()
+    {
+        return 1;
+    }
+    /// Blocks for 'deviceIndex' are sized in multiples of this many units
+    virtual size_t GetWorkGranularity(size_t deviceIndex)
+    {
+        return 1;
+    }
+    /// Largest block 'deviceIndex' can process in a single call
+    virtual size_t GetMaxBlockUnits(size_t deviceIndex)
+    {
+        return (size_t)-1;
+    }
+    /// Identifies a device across runs; an empty key is never remembered
+    virtual std::string GetDeviceKey(size_t deviceIndex)
+    {
+        return std::string();
+    }
+    /// Score the device was selected with, relative to the best one; 0 if
+    /// the functor does not rank its devices
+    virtual double GetDeviceScore(size_t deviceIndex)
+    {
+        return 0;
+    }
+    /**
+     * \brief Processes units [start, start + count) on 'deviceIndex'
+     *
+     * Returns 0 on success. A device that fails a block is not given any
+     * further work, and the block is handed to the remaining devices.
+     */
+    virtual unsigned long BlockFunctor(
+        size_t deviceIndex, size_t start, size_t count)
+    {
+        return 1;
+    }
+
+    /// Loads remembered device throughputs from 'fileName'
+    static bool LoadDeviceRates(const char *fileName);
+    /// Saves the remembered device throughputs to 'fileName'
+    static bool SaveDeviceRates(const char *fileName);
+    /** @} */
+
+    /**
+     * \name Telemetry
+     *
+     * While Run() executes, MonitorDevices() periodically sends the progress
+     * and throughput of every device to the attached sinks. The device
+     * threads only ever write their own progress slot, so no atomic
+     * operations or locks are added to their path.
+     * @{
+     */
+    /// Attaches 'sink'; the functor does not take ownership
+    void AddMetricsSink(MetricsSink *sink);
+    /// Detaches all sinks
+    void ClearMetricsSinks();
+    /// Sets the interval between samples
+    void SetMetricsPeriod(double seconds);
+    /// FLOP needed for one work unit; 0 if not known
+    virtual double GetUnitFLOP()
+    {
+        return 0;
+    }
+    /** @} */
+
+protected:
+    /**
+     * \brief Reports device metrics until the worker threads terminate
+     *
+     * Meant to be called from AuxFunctor(). If 'pProgress' is given, it is
+     * kept updated with the fraction of work units completed.
+     */
+    unsigned long MonitorDevices(volatile double *pProgress);
+    /// Waits up to 'seconds'; returns true once the worker threads are done
+    bool WaitForStop(double seconds);
+    /// Takes a snapshot of the progress of every device
+    void CollectMetrics(MetricsSample *sample, bool final);
+
 private:
     //--------------------Functor Remapping Constructs------------------------//
     struct AsyncParameters
@@ -179,6 +282,78 @@ private:
     static unsigned long AsyncFunctor(AsyncParameters *parameters);
     static unsigned long AsyncAuxFunctor(AsyncParameters *parameters);
 
+    //-----------------------------Telemetry---------------------------------//
+    /**
+     * \brief Progress of one device
+     *
+     * Only written by the thread driving the device, and only read by the
+     * auxiliary functor. Padded to a cache line so that device threads do not
+     * invalidate each other's lines.
+     */
+    struct DeviceProgress
+    {
+        volatile size_t unitsDone;
+        volatile size_t blocksDone;
+        volatile bool failed;
+        char padding[64 - 2 * sizeof(size_t) - sizeof(bool)];
+    };
+    std::vector<DeviceProgress> deviceProgress;
+    /// Device keys of the current run
+    std::vector<std::string> deviceKeys;
+    /// Selection scores of the devices of the current run
+    std::vector<double> deviceScores;
+    /// Units completed by each device at the time of the previous sample
+    std::vector<size_t> lastUnitsDone;
+    /// Start of the run, and time of the previous sample, in timer ticks
+    long long runStart, lastSampleTime;
+    std::vector<MetricsSink *> metricsSinks;
+    double metricsPeriod;
+    /// Set while the worker threads are running
+    bool auxRunning;
+    std::mutex hAuxMutex;
+    std::condition_variable hAuxSignal;
+
+    /// Prepares the progress slots of 'nDevices' devices
+    void ResetProgress(size_t nDevices);
+
+    //-------------------------Dynamic Scheduling-----------------------------//
+    /// A range of work units
+    struct WorkBlock
+    {
+        size_t start;
+        size_t count;
+    };
+    /// Signals idle devices that failed work was queued, or that all work
+    /// has been accounted for
+    std::condition_variable hWorkSignal;
+    /// First unit that has not yet been handed out
+    size_t nextUnit;
+    /// Total number of units in the current run
+    size_t totalUnits;
+    /// Cost of one unit, as returned by GetUnitCost()
+    double unitCost;
+    /// Blocks that failed on one device, and must be given to another
+    std::vector<WorkBlock> failedBlocks;
+    /// Throughput of each device, in cost units per second; 0 if unknown
+    std::vector<double> deviceRates;
+    /// Number of devices currently processing a block
+    size_t nBusy;
+    /// Number of devices that have not failed
+    size_t nHealthy;
+
+    /// Runs one static partition per device, remapping failed functors
+    unsigned long RunStatic(size_t nFunctors);
+    /// Runs the pull-based scheduler over 'nDevices' devices
+    unsigned long RunDynamic(size_t nDevices);
+    /// Picks the next block for 'deviceIndex'; false if no work is left
+    bool GrabBlock(size_t deviceIndex, size_t nDevices, WorkBlock *block);
+    /// Thread entry point for each device under dynamic scheduling
+    static unsigned long AsyncBlockFunctor(AsyncParameters *parameters);
+
+    /// Throughputs remembered across runs, by device key
+    static std::map<std::string, double> learnedRates;
+    static std::mutex hRatesMutex;
+
 
 
 };
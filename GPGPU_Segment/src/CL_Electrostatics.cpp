@@ -16,11 +16,14 @@
  *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "CL_Electrostatics.hpp"
+#include "CL_Program_Cache.hpp"
+#include "Kernel_Sources.hpp"
 #include <iostream>
-#include <fstream>
+#include <vector>
 #include <X-Compat/HPC Timing.h>
 
 CLElectrosFunctor<float> CLtest;
+CLElectrosFunctor<double> CLtestDouble;
 
 // Declare the static device manager
 template <class T> OpenCL::ClManager CLElectrosFunctor<T>::m_DeviceManager;
@@ -56,6 +59,7 @@ using namespace OpenCL;
 template <class T> CLElectrosFunctor<T>::~CLElectrosFunctor()
 {
 	ReleaseResources();
+	CloseSessions();
 }
 
 /**=============================================================================
@@ -95,45 +99,53 @@ template <class T> bool CLElectrosFunctor<T>::Fail()
  * ===========================================================================*/
 template <class T> bool CLElectrosFunctor<T>::FailOnFunctor(size_t functorIndex)
 {
-	return false;
+	if (functorIndex >= m_functors.size())
+		return true;
+	return (m_functors[functorIndex].lastOpErrCode != CL_SUCCESS);
 }
 
 /**=============================================================================
  * \brief Guess-and-hope-for-the-best method of distributing data among functors
  *
+ * The split by compute units is only used by MainFunctor(). Run() normally
+ * lets the devices pull blocks dynamically, in which case only the per-device
+ * parameters matter.
  * Does NOT cause an error condition.
  * ===========================================================================*/
 template <class T> void CLElectrosFunctor<T>::PartitionData()
 {
-	const ClManager::clPlatformProp *platform;
+	// Resources are tied to the previous partitioning
+	ReleaseResources();
+	m_functors.clear();
 
-	platform = m_DeviceManager.FindPlatformByName(m_preferred_platform);
-	if (!platform) {
-		cerr << "No platform '" << m_preferred_platform << "' found" << endl;
+	const std::vector<ClManager::RankedDevice> ranked =
+		m_DeviceManager.SelectDevices(m_selection);
+	if (ranked.empty()) {
+		cerr << "No device found on platform '"
+		     << m_selection.platformName << "'" << endl;
 		return;
 	}
 
-	std::cout<<"Using OpenCL platform: " << platform->name << std::endl;
-	auto &devs = platform->devices;
-
-	if (!m_nDevices) {
-		// TODO: signal an error
-		if (!devs.size())
-			return;
-		m_nDevices = devs.size();
+	// Devices that cannot compute in our precision are left out
+	std::vector<ClManager::clDeviceProp *> devs;
+	std::vector<double> scores;
+	for (size_t i = 0; i < ranked.size(); i++) {
+		ClManager::clDeviceProp *dev = ranked[i].device;
+		if (FindPrecExtension(*dev)) {
+			cout << "Using " << dev->name << " on OpenCL platform "
+			     << ranked[i].platform->name << endl;
+			devs.push_back(dev);
+			scores.push_back(ranked[i].score);
+		} else {
+			cout << " " << dev->name << " has no " << FindPrecType()
+			     << " support; skipping" << endl;
+		}
 	}
-	// Multiple of alignment for the number of threads
-	/*
-	 * The multiplicity of the number of threads in a compute unit
-	 * FIXME: The multiplicity should reflect the actual hardware
-	 * conditions. For example, an nvidia device will need a multiplicity
-	 * of 32 just to fully utilize the hardware, but some newer nvidia
-	 * devices need 6 work groups, each with at least 32 work-iems, meaning
-	 * a minimum multiplivity of 192. Since there is no way to gather this
-	 * information from OpenCL, we just assume a constant multiplicity of
-	 * 256
-	 */
-	const size_t unitAlign = 256;
+
+	// TODO: signal an error
+	if (!devs.size())
+		return;
+	m_nDevices = devs.size();
 
 	// Find the total number of available compute units
 	size_t computeUnits = 0;
@@ -151,9 +163,25 @@ template <class T> void CLElectrosFunctor<T>::PartitionData()
 	for (size_t i = 0; i < m_nDevices; i++) {
 		FunctorData dataParams;
 		ClManager::clDeviceProp *dev = devs[i];
+		/*
+		 * We use the kernel configuration for calculating the local and
+		 * global work sizes, and morphing the kernel code to operate with
+		 * optimal vector widths
+		 */
+		dataParams.device = dev;
+		dataParams.score = scores[i];
+		SelectKernelConfig(dataParams);
 
-		const double proportion = dev->maxComputeUnits / computeUnits;
-		size_t devAlign = dev->maxComputeUnits * unitAlign;
+		/*
+		 * Give each compute unit a whole number of work groups. The
+		 * work group size is the tuned one when the device has been
+		 * tuned, which reflects the actual hardware better than any
+		 * constant multiplicity.
+		 */
+		const double proportion =
+			(double)dev->maxComputeUnits / computeUnits;
+		size_t devAlign = dev->maxComputeUnits * dataParams.local[0] *
+				  dataParams.vecWidth;
 		size_t devWidth = (size_t)(this->m_nLines * proportion);
 
 		/*
@@ -163,7 +191,7 @@ template <class T> void CLElectrosFunctor<T>::PartitionData()
 		 */
 		devWidth = ((devWidth + devAlign - 1) / devAlign) * devAlign;
 		// Sanity check
-		if (devWidth > remainingLines)
+		if (devWidth > remainingLines || i == m_nDevices - 1)
 			devWidth = remainingLines;
 		// Initialize parameter arrays
 		dataParams.startIndex = this->m_nLines - remainingLines;
@@ -175,10 +203,28 @@ template <class T> void CLElectrosFunctor<T>::PartitionData()
 		//dataParams->pPerfData->progress = 0;
 		// Flag that resources have not yet been allocated
 		dataParams.lastOpErrCode = CL_INVALID_CONTEXT;
-		dataParams.device = dev;
-		// We use this for calculating the local/global work sizes, and morphing
-		// the kernel code to operate with optimal vector widths
-		dataParams.vecWidth = FindVectorWidth(*dev);
+		dataParams.context = NULL;
+		for (size_t set = 0; set < 2; set++) {
+			dataParams.devFieldMem[set].x = NULL;
+			dataParams.devFieldMem[set].y = NULL;
+			dataParams.devFieldMem[set].z = NULL;
+		}
+		dataParams.hostFieldMem.x = NULL;
+		dataParams.hostFieldMem.y = NULL;
+		dataParams.hostFieldMem.z = NULL;
+		dataParams.zeroCopy = false;
+		dataParams.bufferLines = 0;
+		dataParams.chargeMem = NULL;
+		dataParams.program = NULL;
+		dataParams.kernel = NULL;
+		dataParams.queue = NULL;
+		dataParams.transferQueue = NULL;
+		dataParams.capacity = 0;
+		dataParams.windowSteps = 0;
+		dataParams.nCharges = 0;
+		dataParams.groupsPerUnit = 1;
+		dataParams.lineStepTime = 0;
+		dataParams.kernelTime = 0;
 		//dataParams->ctxIsUsable = false;
 		m_functors.push_back(dataParams);
 	}
@@ -187,7 +233,7 @@ template <class T> void CLElectrosFunctor<T>::PartitionData()
 template <class T>
 void CLElectrosFunctor<T>::GenerateParameterList(size_t *nDev)
 {
-	*nDev = 1;
+	*nDev = m_functors.size();
 }
 
 /**=============================================================================
@@ -226,7 +272,8 @@ void CLElectrosFunctor<T>::BindData(
 	// since resource allocation depends on the way data is partitioned
 	PartitionData();
 
-	m_lastOpErrCode = CL_SUCCESS;
+	// Lets callers fall back to another functor when no device can help
+	m_lastOpErrCode = m_functors.empty() ? CL_DEVICE_NOT_FOUND : CL_SUCCESS;
 	this->m_dataBound = true;
 }
 
@@ -240,17 +287,187 @@ void CLElectrosFunctor<T>::BindData(
  * ===========================================================================*/
 template <class T> void CLElectrosFunctor<T>::PostRun()
 {
+	double time = 0;
 	for (size_t i = 0; i < m_functors.size(); i++) {
 		perfPacket &devTiming = m_functors[i].perfData;
 		for (size_t j = 0; j < devTiming.stepTimes.size(); j++) {
 			this->m_pPerfData->add(devTiming.stepTimes[j]);
 		}
+		if (m_functors[i].kernelTime > time)
+			time = m_functors[i].kernelTime;
 	}
+	if (time == 0)
+		return;
+
+	this->SetPerformance(time);
+}
+
+/**=============================================================================
+ * \brief Dynamic scheduling parameters
+ *
+ * Blocks are sized in whole work groups, and limited by the device buffers.
+ * ===========================================================================*/
+template <class T>
+size_t CLElectrosFunctor<T>::GetWorkGranularity(size_t deviceIndex)
+{
+	const FunctorData &data = m_functors[deviceIndex];
+	return data.local[0] * data.vecWidth;
+}
+
+template <class T>
+size_t CLElectrosFunctor<T>::GetMaxBlockUnits(size_t deviceIndex)
+{
+	// Failed devices report no room, so they are never handed work
+	const FunctorData &data = m_functors[deviceIndex];
+	return (data.lastOpErrCode == CL_SUCCESS) ? data.capacity : 0;
+}
+
+template <class T>
+std::string CLElectrosFunctor<T>::GetDeviceKey(size_t deviceIndex)
+{
+	return DeviceKey(*m_functors[deviceIndex].device);
+}
+
+template <class T>
+double CLElectrosFunctor<T>::GetDeviceScore(size_t deviceIndex)
+{
+	return m_functors[deviceIndex].score;
+}
+
+/// Kernel that computes field lines with the given configuration
+template <class T>
+const char *CLElectrosFunctor<T>::KernelName(const KernelConfig &config)
+{
+	return (config.groupRows > 1) ? "CalcField_MT_curvature" :
+					"CalcField_curvature";
 }
 
+/// Identifies a device, its driver, and the precision of the kernels
+template <class T>
+std::string CLElectrosFunctor<T>::DeviceKey(const ClManager::clDeviceProp &dev)
+{
+	return std::string(dev.name) + " (" + dev.driverVersion + ") " +
+	       FindPrecType();
+}
+
+/// Lines per work group of the untuned kernel configuration
 #define BLOCK_X 128
+/// Work items along the lines in each work group of the MT kernel
 #define BLOCK_X_MT 32
+/// Most work items splitting the charges of each line in the MT kernel
 #define BLOCK_Y_MT 8
+/// Work items per compute unit below which the MT kernel is considered
+#define CL_MT_ITEMS_PER_UNIT 256
+/// Fewest steps per window before lines are split into smaller slabs
+#define CL_MIN_WINDOW_STEPS 64
+/// Number of slabs a block is split into, to overlap transfers with kernels
+#define CL_PIPELINE_SLABS 4
+/// Fewest work groups per slab; smaller blocks are not split
+#define CL_MIN_SLAB_GROUPS 16
+/// Host alignment runtimes need to use CL_MEM_USE_HOST_PTR memory in place
+#define CL_ZERO_COPY_ALIGN 4096
+/// Lines in the tuning sample, per compute unit of the device
+#define CL_TUNE_LINES_PER_UNIT 1024
+/// Most lines in the tuning sample
+#define CL_TUNE_MAX_LINES 65536
+/// Rows computed by each tuning run, starting point included
+#define CL_TUNE_STEPS 8
+/// Most point charges in the tuning sample
+#define CL_TUNE_CHARGES 1024
+/// Timed runs of each candidate; the fastest one counts
+#define CL_TUNE_RUNS 3
+/// Kernel time each launch aims for, in seconds; far below display watchdogs
+#define CL_TARGET_LAUNCH_TIME 0.05
+/// Steps per launch until the kernel time of a device is known
+#define CL_FIRST_BATCH_STEPS 32
+
+/**=============================================================================
+ * \brief Sizes the field buffers of a device
+ *
+ * Two sets of buffers share the device memory, or the budget set with
+ * SetMemoryBudget(). If all lines and steps fit in one set, they are processed
+ * in one window. Otherwise, the steps are processed in windows. Windows hold
+ * all lines, unless that leaves fewer than CL_MIN_WINDOW_STEPS steps per
+ * window, in which case the lines are split into slabs.
+ *
+ * Devices that share memory with the host, such as CPU runtimes, work on the
+ * host arrays in place instead, if the arrays are page aligned and each row
+ * starts on a whole vector. Their device buffers only hold one work group of
+ * lines, for the partial group at the end of a block; see BlockFunctor().
+ * @return CL_MEM_OBJECT_ALLOCATION_FAILURE if not even one work group fits
+ * ===========================================================================*/
+template <class T> CLerror CLElectrosFunctor<T>::SizeBuffers(size_t deviceID)
+{
+	FunctorData &data = m_functors[deviceID];
+	const ClManager::clDeviceProp *dev = data.device;
+
+	// Both sets of field buffers may take up to three quarters of the memory
+	cl_ulong maxBuffer = dev->maxMemAllocSize;
+	cl_ulong total = dev->globalMemSize / 4 * 3;
+	if (m_memBudget && total > m_memBudget)
+		total = m_memBudget;
+	if (maxBuffer > total / 6)
+		maxBuffer = total / 6;
+
+	const size_t groupLines = data.local[0] * data.vecWidth;
+	const size_t allLines =
+		((this->m_nLines + groupLines - 1) / groupLines) * groupLines;
+	const cl_ulong rowBytes = sizeof(T) * allLines;
+	data.capacity = allLines;
+	data.windowSteps = data.steps;
+
+	Vector3<T *> hostArr = this->m_pFieldLinesData->GetDataPointers();
+	const bool aligned = !((size_t)hostArr.x % CL_ZERO_COPY_ALIGN) &&
+			     !((size_t)hostArr.y % CL_ZERO_COPY_ALIGN) &&
+			     !((size_t)hostArr.z % CL_ZERO_COPY_ALIGN);
+	// AllocateResources() wraps each whole host array in a single buffer
+	const cl_ulong hostBytes =
+		(cl_ulong)sizeof(T) * this->m_nLines * data.steps;
+	data.zeroCopy = m_zeroCopy && aligned &&
+			(dev->hostUnifiedMemory ||
+			 (dev->type & CL_DEVICE_TYPE_CPU)) &&
+			!(this->m_nLines % data.vecWidth) &&
+			sizeof(T) * groupLines * data.steps <= maxBuffer &&
+			hostBytes <= dev->maxMemAllocSize;
+	if (data.zeroCopy) {
+		data.bufferLines = groupLines;
+		return CL_SUCCESS;
+	}
+
+	if (rowBytes * data.steps > maxBuffer) {
+		data.windowSteps = (size_t)(maxBuffer / rowBytes);
+		if (data.windowSteps < CL_MIN_WINDOW_STEPS) {
+			data.windowSteps = CL_MIN_WINDOW_STEPS;
+			if (data.windowSteps > data.steps)
+				data.windowSteps = data.steps;
+			const size_t fit = (size_t)(
+				maxBuffer / (sizeof(T) * data.windowSteps));
+			data.capacity = (fit / groupLines) * groupLines;
+		}
+		if (data.windowSteps > data.steps)
+			data.windowSteps = data.steps;
+	}
+	data.bufferLines = data.capacity;
+	// A window must advance by at least one step
+	if (!data.capacity || data.windowSteps < 2)
+		return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+	return CL_SUCCESS;
+}
+
+/// Releases the buffers in 'mem', if any, and clears them
+static CLerror ReleaseMemObjects(Vector3<cl_mem> *mem)
+{
+	CLerror err = CL_SUCCESS;
+	if (mem->x)
+		err |= clReleaseMemObject(mem->x);
+	if (mem->y)
+		err |= clReleaseMemObject(mem->y);
+	if (mem->z)
+		err |= clReleaseMemObject(mem->z);
+	mem->x = mem->y = mem->z = NULL;
+	return err;
+}
+
 /**=============================================================================
  * \brief
  *
@@ -264,79 +481,265 @@ template <class T> void CLElectrosFunctor<T>::AllocateResources()
 {
 	if (!this->m_dataBound) {
 		cout << "NonononoData" << endl;
+		m_lastOpErrCode = CL_INVALID_VALUE;
 		return;
 	}
+	// Only the objects tied to the previous dataset go; sessions stay
+	ReleaseResources();
 
 	CLerror err;
 
 	PerfTimer timer, devTimer;
-	;
 	perfPacket &profiler = *this->m_pPerfData;
+	size_t nReady = 0;
 	timer.start();
-	for (size_t iDev = 0; iDev < m_nDevices; iDev++) {
+	for (size_t iDev = 0; iDev < m_functors.size(); iDev++) {
 		devTimer.start();
 		FunctorData &data = m_functors[iDev];
+		data.lastOpErrCode = CL_INVALID_CONTEXT;
+		data.perfData.stepTimes.clear();
+		data.kernelTime = 0;
 
 		ClManager::clDeviceProp *dev = data.device;
-		cl_context_properties props[] = {
-			CL_CONTEXT_PLATFORM,
-			(cl_context_properties)dev->platform, 0, 0
-		};
-		data.context = clCreateContext(props, 1, &dev->deviceID, NULL,
-					       NULL, &err);
+		err = OpenSession(iDev);
 		CL_ASSERTC(err, "Could not create context");
+		DeviceSession &session = m_sessions[dev->deviceID];
+
+		// The kernel shape decides how the buffers are sized
+		const bool retune = m_tuneMode == TUNE_ALL &&
+				    !m_tunedConfigs.count(DeviceKey(*dev));
+		if (retune || (m_tuneMode == TUNE_MISSING && !data.tuned)) {
+			err = TuneKernel(iDev);
+			if (err != CL_SUCCESS)
+				cerr << " Tuning failed; using the default kernel"
+				     << " configuration. CL error: " << err
+				     << endl;
+		}
+
+		err = SizeBuffers(iDev);
+		CL_ASSERTC(err, "Device cannot hold a single block of lines");
+		if (data.zeroCopy)
+			cout << " Working on host memory in place" << endl;
+		else if (data.windowSteps < data.steps)
+			cout << " Processing " << data.windowSteps
+			     << " steps at a time, in slabs of up to "
+			     << data.capacity << " lines" << endl;
 
 		// Size of each buffer
-		const size_t size = sizeof(T) * data.elements * data.steps;
-		data.devFieldMem.x = clCreateBuffer(
-			data.context, CL_MEM_READ_WRITE, size, NULL, &err);
-		CL_ASSERTC(err, "clCreateBuffer.x failed ");
-		data.devFieldMem.y = clCreateBuffer(
-			data.context, CL_MEM_READ_WRITE, size, NULL, &err);
-		CL_ASSERTC(err, "clCreateBuffer.y failed ");
-		data.devFieldMem.z = clCreateBuffer(
-			data.context, CL_MEM_READ_WRITE, size, NULL, &err);
-		CL_ASSERTC(err, "clCreateBuffer.z failed ");
-		data.chargeMem =
-			clCreateBuffer(data.context, CL_MEM_READ_ONLY,
-				       this->m_pPointChargeData->GetSizeBytes(),
-				       NULL, &err);
-		CL_ASSERTC(err, "clCreateBuffer.q failed ");
+		const size_t size =
+			sizeof(T) * data.bufferLines * data.windowSteps;
+		/*
+		 * Pooled buffers large enough are reused as they are, unless a
+		 * lower memory budget has been set since they were allocated.
+		 */
+		err = CL_SUCCESS;
+		if (session.fieldBytes < size ||
+		    (m_memBudget && 6 * session.fieldBytes > m_memBudget)) {
+			for (size_t set = 0; set < 2; set++)
+				ReleaseMemObjects(&session.fieldMem[set]);
+			session.fieldBytes = 0;
+			for (size_t set = 0; set < 2 && !err; set++) {
+				Vector3<cl_mem> &mem = session.fieldMem[set];
+				mem.x = clCreateBuffer(data.context,
+						       CL_MEM_READ_WRITE, size,
+						       NULL, &err);
+				if (err == CL_SUCCESS)
+					mem.y = clCreateBuffer(
+						data.context, CL_MEM_READ_WRITE,
+						size, NULL, &err);
+				if (err == CL_SUCCESS)
+					mem.z = clCreateBuffer(
+						data.context, CL_MEM_READ_WRITE,
+						size, NULL, &err);
+			}
+			if (err == CL_SUCCESS)
+				session.fieldBytes = size;
+		}
+		CL_ASSERTC(err, "clCreateBuffer failed ");
+		data.devFieldMem[0] = session.fieldMem[0];
+		data.devFieldMem[1] = session.fieldMem[1];
+		if (data.zeroCopy) {
+			Vector3<T *> hostArr =
+				this->m_pFieldLinesData->GetDataPointers();
+			const size_t hostSize =
+				sizeof(T) * this->m_nLines * data.steps;
+			const cl_mem_flags flags =
+				CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR;
+			Vector3<cl_mem> &mem = data.hostFieldMem;
+			mem.x = clCreateBuffer(data.context, flags, hostSize,
+					       hostArr.x, &err);
+			if (err == CL_SUCCESS)
+				mem.y = clCreateBuffer(data.context, flags,
+						       hostSize, hostArr.y,
+						       &err);
+			if (err == CL_SUCCESS)
+				mem.z = clCreateBuffer(data.context, flags,
+						       hostSize, hostArr.z,
+						       &err);
+			CL_ASSERTC(err, "Wrapping host arrays failed");
+		}
 
 		data.perfData.add(TimingInfo("Resource allocation on device",
 					     devTimer.tick()));
-		LoadKernels(iDev);
+		err = LoadKernels(iDev);
+		CL_ASSERTC(err, "Could not load kernels");
+		EstimateGroupsPerUnit(data);
+		// Charges are uploaded once, and shared by all blocks
+		err = UploadCharges(iDev);
+		CL_ASSERTC(err, "Could not upload point charges");
 		devTimer.stop();
+
+		data.lastOpErrCode = CL_SUCCESS;
+		nReady++;
 	}
 	profiler.add(TimingInfo("Resource allocation", timer.tick()));
+
+	// Only fail globally if no device can run
+	m_lastOpErrCode = nReady ? CL_SUCCESS : CL_DEVICE_NOT_AVAILABLE;
+	this->m_resourcesAllocated = (nReady != 0);
 }
 
 /**=============================================================================
- * \brief Releases all resources used by the functors
+ * \brief Releases the resources tied to the bound dataset
  *
- * Releases all host buffers and device memory, then destroys any device
- * contexts. If an error is encountered, execution is not interrupted, and the
- * global error flag is set to the last error that was encountered.
+ * The wrappers of the host arrays are released, and the functors let go of the
+ * objects borrowed from the device sessions. Sessions are kept for the next
+ * run, except those of devices that failed, which may be left unusable. If an
+ * error is encountered, execution is not interrupted.
  * ===========================================================================*/
 template <class T> void CLElectrosFunctor<T>::ReleaseResources()
 {
-	for (size_t iDev = 0; iDev < m_nDevices; iDev++) {
+	for (size_t iDev = 0; iDev < m_functors.size(); iDev++) {
 		FunctorData &data = m_functors[iDev];
-		CLerror err = CL_SUCCESS;
-		clReleaseContext(data.context);
-		if (err)
-			cout << "clReleaseContext returns: " << err << endl;
-
-		err = CL_SUCCESS;
+		CLerror err = ReleaseMemObjects(&data.hostFieldMem);
 		if (err)
 			cout << "clReleaseMemObject cummulates: " << err
 			     << endl;
+
+		if (data.context && data.lastOpErrCode != CL_SUCCESS)
+			CloseSession(data.device->deviceID);
+		for (size_t set = 0; set < 2; set++) {
+			Vector3<cl_mem> &mem = data.devFieldMem[set];
+			mem.x = mem.y = mem.z = NULL;
+		}
+		data.chargeMem = NULL;
+		data.kernel = NULL;
+		data.program = NULL;
+		data.queue = data.transferQueue = NULL;
+		data.context = NULL;
+		data.lastOpErrCode = CL_INVALID_CONTEXT;
 	}
+	this->m_resourcesAllocated = false;
+}
+
+/**=============================================================================
+ * \brief Gets the session of a device, creating it on first use
+ *
+ * The functor borrows the context and queues of the session.
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T> CLerror CLElectrosFunctor<T>::OpenSession(size_t deviceID)
+{
+	FunctorData &data = m_functors[deviceID];
+	const ClManager::clDeviceProp *dev = data.device;
+	if (!m_sessions.count(dev->deviceID)) {
+		DeviceSession session;
+		session.context = NULL;
+		session.queue = session.transferQueue = NULL;
+		for (size_t set = 0; set < 2; set++) {
+			Vector3<cl_mem> &mem = session.fieldMem[set];
+			mem.x = mem.y = mem.z = NULL;
+		}
+		session.fieldBytes = 0;
+		session.chargeMem = NULL;
+		session.chargeBytes = 0;
+
+		cl_context_properties props[] = {
+			CL_CONTEXT_PLATFORM,
+			(cl_context_properties)dev->platform, 0, 0
+		};
+		CLerror err;
+		session.context = clCreateContext(props, 1, &dev->deviceID,
+						  NULL, NULL, &err);
+		CL_ASSERTE(err, "clCreateContext failed");
+		m_sessions[dev->deviceID] = session;
+
+		DeviceSession &added = m_sessions[dev->deviceID];
+		// Commands are timed by the device; see CollectProfile()
+		const cl_command_queue_properties queueProps =
+			CL_QUEUE_PROFILING_ENABLE;
+		added.queue = clCreateCommandQueue(added.context, dev->deviceID,
+						   queueProps, &err);
+		if (err == CL_SUCCESS)
+			added.transferQueue = clCreateCommandQueue(
+				added.context, dev->deviceID, queueProps, &err);
+		if (err != CL_SUCCESS)
+			CloseSession(dev->deviceID);
+		CL_ASSERTE(err, "clCreateCommandQueue failed");
+	}
+
+	const DeviceSession &session = m_sessions[dev->deviceID];
+	data.context = session.context;
+	data.queue = session.queue;
+	data.transferQueue = session.transferQueue;
+	return CL_SUCCESS;
+}
+
+/// Releases everything held by the session of 'device', if it has one
+template <class T> void CLElectrosFunctor<T>::CloseSession(cl_device_id device)
+{
+	typename std::map<cl_device_id, DeviceSession>::iterator it =
+		m_sessions.find(device);
+	if (it == m_sessions.end())
+		return;
+	DeviceSession &session = it->second;
+
+	CLerror err = CL_SUCCESS;
+	for (size_t set = 0; set < 2; set++)
+		err |= ReleaseMemObjects(&session.fieldMem[set]);
+	if (session.chargeMem)
+		err |= clReleaseMemObject(session.chargeMem);
+	if (err)
+		cout << "clReleaseMemObject cummulates: " << err << endl;
+
+	err = CL_SUCCESS;
+	typename std::map<std::string,
+			  std::pair<cl_program, cl_kernel> >::iterator kernel;
+	for (kernel = session.kernels.begin(); kernel != session.kernels.end();
+	     kernel++) {
+		err |= clReleaseKernel(kernel->second.second);
+		err |= clReleaseProgram(kernel->second.first);
+	}
+	if (session.queue)
+		err |= clReleaseCommandQueue(session.queue);
+	if (session.transferQueue)
+		err |= clReleaseCommandQueue(session.transferQueue);
+	if (err)
+		cout << "Releasing kernels and queues cummulates: " << err
+		     << endl;
+
+	if (session.context) {
+		err = clReleaseContext(session.context);
+		if (err)
+			cout << "clReleaseContext returns: " << err << endl;
+	}
+	m_sessions.erase(it);
+}
+
+template <class T> void CLElectrosFunctor<T>::CloseSessions()
+{
+	// The functors must not keep borrowed handles
+	ReleaseResources();
+	while (!m_sessions.empty())
+		CloseSession(m_sessions.begin()->first);
 }
 
 /**=============================================================================
  * \brief Main functor
  *
+ * Processes the static partition of 'functorIndex', in as many blocks as the
+ * buffers of 'deviceIndex' require.
  * @return First error code that is encountered
  * @return CL_SUCCESS if no error is encountered
  * ===========================================================================*/
@@ -346,246 +749,1076 @@ unsigned long CLElectrosFunctor<T>::MainFunctor(
 	size_t deviceIndex ///< Device on which to process data
 )
 {
-	if (functorIndex != deviceIndex)
-		cerr << "WARNING: Different functor and device" << endl;
-	PerfTimer timer;
 	FunctorData &funData = m_functors[functorIndex];
 	FunctorData &devData = m_functors[deviceIndex];
+	if (!devData.capacity)
+		return CL_INVALID_BUFFER_SIZE;
+
+	const size_t end = funData.startIndex + funData.elements;
+	for (size_t start = funData.startIndex; start < end;
+	     start += devData.capacity) {
+		size_t count = end - start;
+		if (count > devData.capacity)
+			count = devData.capacity;
+		unsigned long err = BlockFunctor(deviceIndex, start, count);
+		if (err)
+			return err;
+	}
+	return CL_SUCCESS;
+}
+
+/// Releases 'event', if any, and clears it
+static void ReleaseEvent(cl_event *event)
+{
+	if (*event)
+		clReleaseEvent(*event);
+	*event = NULL;
+}
+
+/**=============================================================================
+ * \brief Sends the starting points of lines [start, start + lines) to row 0
+ * of buffer set 'set', on the transfer queue
+ *
+ * @param done [out] Signaled when the transfer completes
+ * ===========================================================================*/
+template <class T>
+CLerror CLElectrosFunctor<T>::EnqueueSeeds(size_t deviceID, size_t set,
+					   size_t start, size_t lines,
+					   cl_event *done)
+{
+	FunctorData &data = m_functors[deviceID];
+	Vector3<cl_mem> &mem = data.devFieldMem[set];
+	Vector3<T *> hostArr = this->m_pFieldLinesData->GetDataPointers();
+	const size_t rowSize = lines * sizeof(T);
+	cl_command_queue queue = data.transferQueue;
+
+	const char *label = "Host to device transfer";
+	CLerror err = CL_SUCCESS;
+	err |= clEnqueueWriteBuffer(queue, mem.x, CL_FALSE, 0, rowSize,
+				    &hostArr.x[start], 0, NULL,
+				    ProfileCommand(data, label, rowSize));
+	err |= clEnqueueWriteBuffer(queue, mem.y, CL_FALSE, 0, rowSize,
+				    &hostArr.y[start], 0, NULL,
+				    ProfileCommand(data, label, rowSize));
+	// In order, so the last write signals all three
+	err |= clEnqueueWriteBuffer(queue, mem.z, CL_FALSE, 0, rowSize,
+				    &hostArr.z[start], 0, NULL, done);
+	if (err == CL_SUCCESS)
+		ProfileEvent(data, *done, label, rowSize);
+	return err;
+}
+
+/**=============================================================================
+ * \brief Queues the kernel launches computing rows [firstRow, firstRow + rows)
+ *
+ * The rows are computed in batches of BatchSteps() steps, one launch each. A
+ * launch starts from the last row of the previous one, so a batch boundary
+ * does not change the results. Only arguments 6 and 8 of the kernel are set.
+ * @param wait Events the first launch waits for
+ * @param done [out] Event of the last launch, if not NULL
+ * @return First error code that is encountered
+ * ===========================================================================*/
+template <class T>
+CLerror CLElectrosFunctor<T>::EnqueueSteps(FunctorData &data, size_t firstRow,
+					   size_t rows, const size_t *offset,
+					   const size_t *global, cl_uint nWait,
+					   const cl_event *wait, cl_event *done)
+{
+	const size_t lines = global[0] * data.vecWidth;
+	const size_t batch = BatchSteps(data, lines);
+	const double occupancy = Occupancy(data, global);
+	const char *label = "Kernel execution";
+	CLerror err = CL_SUCCESS;
+	for (size_t row = firstRow; row < firstRow + rows; row += batch) {
+		cl_uint param = (cl_uint)row;
+		// const unsigned int fieldIndex,
+		err |= clSetKernelArg(data.kernel, 6, sizeof(param), &param);
+		param = (cl_uint)(firstRow + rows - row);
+		if (param > batch)
+			param = (cl_uint)batch;
+		// const unsigned int nSteps
+		err |= clSetKernelArg(data.kernel, 8, sizeof(param), &param);
+		if (err != CL_SUCCESS)
+			return err;
+
+		// The queue is in order; only the first launch needs to wait
+		const bool last = (row + batch >= firstRow + rows);
+		cl_event *event = (last && done) ?
+					  done :
+					  ProfileCommand(data, label, 0,
+							 occupancy);
+		err = clEnqueueNDRangeKernel(data.queue, data.kernel, 3, offset,
+					     global, data.local, nWait, wait,
+					     event);
+		if (err != CL_SUCCESS)
+			return err;
+		if (event == done)
+			ProfileEvent(data, *done, label, 0, occupancy);
+		nWait = 0;
+		wait = NULL;
+	}
+	return err;
+}
+
+/**=============================================================================
+ * \brief Steps per kernel launch over 'lines' lines
+ *
+ * Long launches stall the display on some systems, and trip the watchdogs of
+ * the drivers. Launches aim for CL_TARGET_LAUNCH_TIME, at the kernel speed
+ * measured on the previous block.
+ * ===========================================================================*/
+template <class T>
+size_t CLElectrosFunctor<T>::BatchSteps(const FunctorData &data, size_t lines)
+{
+	if (!(data.lineStepTime > 0) || !lines)
+		return CL_FIRST_BATCH_STEPS;
+	const double steps = CL_TARGET_LAUNCH_TIME / (data.lineStepTime * lines);
+	if (steps < 1)
+		return 1;
+	if (steps > data.steps)
+		return data.steps;
+	return (size_t)steps;
+}
+
+/**=============================================================================
+ * \brief Keeps the event of a command for profiling
+ *
+ * Meant to be passed as the event argument of the command; the event is
+ * released by CollectProfile().
+ * @return Where the command stores its event
+ * ===========================================================================*/
+template <class T>
+cl_event *CLElectrosFunctor<T>::ProfileCommand(FunctorData &data,
+					       const char *label, size_t bytes,
+					       double occupancy)
+{
+	const ProfiledCommand command = { NULL, label, bytes, occupancy };
+	data.commands.push_back(command);
+	return &data.commands.back().event;
+}
+
+/// Profiles the command signaling 'event', which the caller still owns
+template <class T>
+void CLElectrosFunctor<T>::ProfileEvent(FunctorData &data, cl_event event,
+					const char *label, size_t bytes,
+					double occupancy)
+{
+	if (!event)
+		return;
+	clRetainEvent(event);
+	*ProfileCommand(data, label, bytes, occupancy) = event;
+}
+
+/**=============================================================================
+ * \brief Adds the device timestamps of the profiled commands to the step times
+ *
+ * Must be called once the commands have completed. The step time of a command
+ * is its execution time on the device; the time it spent waiting before that
+ * is kept in its queued and submitted timestamps. Commands that failed, or
+ * were not profiled by the runtime, are left out.
+ * ===========================================================================*/
+template <class T>
+void CLElectrosFunctor<T>::CollectProfile(FunctorData &data)
+{
+	static const cl_profiling_info params[4] = {
+		CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+		CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+	};
+	for (size_t i = 0; i < data.commands.size(); i++) {
+		const ProfiledCommand &command = data.commands[i];
+		if (!command.event)
+			continue;
+		cl_ulong stamps[4];
+		CLerror err = CL_SUCCESS;
+		for (size_t s = 0; s < 4 && err == CL_SUCCESS; s++)
+			err = clGetEventProfilingInfo(command.event, params[s],
+						      sizeof(stamps[s]),
+						      &stamps[s], NULL);
+		clReleaseEvent(command.event);
+		if (err != CL_SUCCESS || stamps[3] < stamps[2])
+			continue;
+
+		const double time = (stamps[3] - stamps[2]) * 1e-9;
+		TimingInfo info = (command.bytes && time > 0) ?
+					  TimingInfo(command.label, time,
+						     command.bytes) :
+					  TimingInfo(command.label, time);
+		info.queued = stamps[0] * 1e-9;
+		info.submitted = stamps[1] * 1e-9;
+		info.started = stamps[2] * 1e-9;
+		info.ended = stamps[3] * 1e-9;
+		info.occupancy = command.occupancy;
+		data.perfData.add(info);
+	}
+	data.commands.clear();
+}
+
+/**=============================================================================
+ * \brief Estimates how many work groups of the kernel a compute unit holds
+ *
+ * OpenCL does not expose the resident work items of a compute unit, so at least
+ * one maximum-sized work group is assumed to fit. The local memory used by the
+ * kernel may allow fewer groups.
+ * ===========================================================================*/
+template <class T>
+void CLElectrosFunctor<T>::EstimateGroupsPerUnit(FunctorData &data)
+{
+	const ClManager::clDeviceProp *dev = data.device;
+	const size_t groupSize = data.local[0] * data.local[1];
+	size_t groups = dev->maxWorkGroupSize / groupSize;
+	cl_ulong localMem = 0;
+	CLerror err = clGetKernelWorkGroupInfo(data.kernel, dev->deviceID,
+					       CL_KERNEL_LOCAL_MEM_SIZE,
+					       sizeof(localMem), &localMem,
+					       NULL);
+	if (err == CL_SUCCESS && localMem &&
+	    dev->localMemSize / localMem < groups)
+		groups = (size_t)(dev->localMemSize / localMem);
+	data.groupsPerUnit = groups ? groups : 1;
+}
+
+/// Fraction of the device the work groups of a launch are estimated to fill
+template <class T>
+double CLElectrosFunctor<T>::Occupancy(const FunctorData &data,
+				       const size_t *global)
+{
+	const double groups = (double)(global[0] / data.local[0]) *
+			      (global[1] / data.local[1]);
+	const double slots =
+		(double)data.device->maxComputeUnits * data.groupsPerUnit;
+	if (!slots)
+		return 0;
+	return (groups < slots) ? groups / slots : 1.0;
+}
+
+/**=============================================================================
+ * \brief Block functor
+ *
+ * Computes lines [start, start + count) on 'deviceIndex'. On zero-copy devices,
+ * the whole work groups of the block are computed in the host arrays; only
+ * the lines before the first vector boundary, and the partial group at the
+ * end, go through the device buffers.
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T>
+unsigned long CLElectrosFunctor<T>::BlockFunctor(
+	size_t deviceIndex, ///< Device on which to process data
+	size_t start, ///< First line of the block
+	size_t count ///< Number of lines in the block
+)
+{
+	FunctorData &devData = m_functors[deviceIndex];
+	if (devData.lastOpErrCode != CL_SUCCESS)
+		return devData.lastOpErrCode;
+	if (count > devData.capacity)
+		return CL_INVALID_BUFFER_SIZE;
+	if (!devData.zeroCopy)
+		return BufferedFunctor(deviceIndex, start, count);
+
+	const size_t vecWidth = devData.vecWidth;
+	const size_t groupLines = devData.local[0] * vecWidth;
+	size_t head = (vecWidth - start % vecWidth) % vecWidth;
+	if (head > count)
+		head = count;
+	const size_t direct = ((count - head) / groupLines) * groupLines;
+	const size_t tail = count - head - direct;
+
+	unsigned long err = CL_SUCCESS;
+	if (head)
+		err = BufferedFunctor(deviceIndex, start, head);
+	if (!err && direct)
+		err = ZeroCopyFunctor(deviceIndex, start + head, direct);
+	if (!err && tail)
+		err = BufferedFunctor(deviceIndex, start + head + direct, tail);
+	return err;
+}
+
+/**=============================================================================
+ * \brief Computes lines in place, in the host arrays
+ *
+ * The kernel runs over the wrapped host arrays, with the host row pitch, and a
+ * global offset selecting the lines. 'start' must be on a vector boundary, and
+ * 'count' a whole number of work groups, so that no other lines are written.
+ * Mapping the part of each row that was written makes the results visible to
+ * the host.
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T>
+unsigned long CLElectrosFunctor<T>::ZeroCopyFunctor(size_t deviceIndex,
+						     size_t start, size_t count)
+{
+	FunctorData &devData = m_functors[deviceIndex];
+	PerfTimer timer;
 	perfPacket &profiler = devData.perfData;
 	timer.start();
 	CLerror err;
-	cl_context ctx = devData.context;
 
-	cout << " Preparing buffers" << endl;
-	Vector3<cl_mem> &arrdata = devData.devFieldMem;
-	cl_mem &charges = devData.chargeMem;
-	cl_kernel &kernel = devData.kernel;
+	Vector3<cl_mem> &mem = devData.hostFieldMem;
+	cl_kernel kernel = devData.kernel;
+	cl_command_queue queue = devData.queue;
 
 	err = CL_SUCCESS;
 	// __global float *x,
-	err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &arrdata.x);
+	err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &mem.x);
 	// __global float *y,
-	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &arrdata.y);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &mem.y);
 	// __global float *z,
-	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &arrdata.z);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &mem.z);
 	// __global pointCharge *Charges,
-	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &charges);
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &devData.chargeMem);
 	// const unsigned int linePitch,
-	cl_uint param = this->m_nLines;
+	cl_uint param = (cl_uint)this->m_nLines;
 	err |= clSetKernelArg(kernel, 4, sizeof(param), &param);
 	// const unsigned int p,
 	param = (cl_uint)this->m_pPointChargeData->GetSize();
 	err |= clSetKernelArg(kernel, 5, sizeof(param), &param);
-	// const unsigned int fieldIndex,
-	param = 1;
-	err |= clSetKernelArg(kernel, 6, sizeof(param), &param);
-
 	// const float resolution
 	T res = this->m_resolution;
 	err |= clSetKernelArg(kernel, 7, sizeof(res), &res);
-	if (err)
-		cout << "clSetKernelArg cummulates: " << err << endl;
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "clSetKernelArg failed");
 
 	//==========================================================================
-	cl_command_queue queue =
-		clCreateCommandQueue(ctx, devData.device->deviceID, 0, &err);
-	if (err)
-		cout << "clCreateCommandQueue returns: " << err << endl;
-
+	size_t offset[3] = { start / devData.vecWidth, 0, 0 };
+	size_t global[3] = { count / devData.vecWidth, devData.local[1], 1 };
 	timer.tick();
-	Vector3<T *> hostArr = this->m_pFieldLinesData->GetDataPointers();
-	const size_t start = funData.startIndex;
-	const size_t size = funData.elements * sizeof(T) * funData.steps;
+	err = EnqueueSteps(devData, 1, devData.steps - 1, offset, global, 0,
+			   NULL, NULL);
+	if (err == CL_SUCCESS)
+		err = clFinish(queue);
+	if (err != CL_SUCCESS)
+		CollectProfile(devData);
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "Computing field lines failed");
+	const double time = timer.tick();
+	devData.kernelTime += time;
+	devData.lineStepTime = time / ((double)count * (devData.steps - 1));
 
-	err = CL_SUCCESS;
-	err |= clEnqueueWriteBuffer(queue, arrdata.x, CL_FALSE, 0, size,
-				    &hostArr.x[start], 0, NULL, NULL);
-	if (err)
-		cout << "Write 1 returns: " << err << endl;
-	err |= clEnqueueWriteBuffer(queue, arrdata.y, CL_FALSE, 0, size,
-				    &hostArr.y[start], 0, NULL, NULL);
-	if (err)
-		cout << "Write 2 returns: " << err << endl;
-	err |= clEnqueueWriteBuffer(queue, arrdata.z, CL_FALSE, 0, size,
-				    &hostArr.z[start], 0, NULL, NULL);
-	if (err)
-		cout << "Write 3 returns: " << err << endl;
-	const size_t qSize = this->m_pPointChargeData->GetSizeBytes();
-	err |= clEnqueueWriteBuffer(queue, charges, CL_FALSE, 0, qSize,
-				    this->m_pPointChargeData->GetDataPointer(),
-				    0, NULL, NULL);
-	if (err)
-		cout << "Write 4 returns: " << err << endl;
-	CL_ASSERTE(err, "Sending data to device failed");
+	//==========================================================================
+	/*
+	 * Map only the lines of this block in each row. The lines in between
+	 * may belong to other blocks, still being computed elsewhere, and a
+	 * runtime keeping a device copy of the arrays would overwrite them
+	 * with stale data on mapping.
+	 */
+	const size_t rowBytes = count * sizeof(T);
+	cl_mem planes[3] = { mem.x, mem.y, mem.z };
+	for (size_t step = 1; step < devData.steps && err == CL_SUCCESS;
+	     step++) {
+		const size_t mapOffset =
+			(step * this->m_nLines + start) * sizeof(T);
+		for (size_t i = 0; i < 3 && err == CL_SUCCESS; i++) {
+			void *ptr = clEnqueueMapBuffer(
+				queue, planes[i], CL_FALSE, CL_MAP_READ,
+				mapOffset, rowBytes, 0, NULL, NULL, &err);
+			if (err == CL_SUCCESS)
+				err = clEnqueueUnmapMemObject(
+					queue, planes[i], ptr, 0, NULL, NULL);
+		}
+	}
+	if (err == CL_SUCCESS)
+		err = clFinish(queue);
+	const double syncTime = timer.tick();
+	CollectProfile(devData);
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "Synchronizing host memory failed");
+	// Too many maps to profile on the device one by one
+	profiler.add(TimingInfo("Host memory synchronization", syncTime,
+				3 * rowBytes * (devData.steps - 1)));
+	profiler.add(TimingInfo("Block wall time", time + syncTime));
+	return CL_SUCCESS;
+}
 
-	// Finish memory copies before starting the kernel
-	CL_ASSERTE(clFinish(queue), "Pre-kernel sync");
+/**=============================================================================
+ * \brief Computes lines through the device buffers
+ *
+ * Computes lines [start, start + count) on 'deviceIndex', as a pipeline of
+ * tiles. A tile is a slab of lines and a window of steps. Blocks are split
+ * into up to CL_PIPELINE_SLABS slabs if all steps fit in one window, and the
+ * steps are split into windows otherwise (see SizeBuffers()).
+ *
+ * Consecutive tiles alternate between the two sets of device buffers. Kernels
+ * and on-device copies run on the compute queue; the starting points and the
+ * results move on the transfer queue. While a tile computes, the starting
+ * points of the next slab are uploaded, and the previous tile is read back.
+ * Events order each kernel after the uploads it needs, and after the previous
+ * read-back from its buffer set.
+ *
+ * Within a slab, each window starts from the last row of the previous window,
+ * which is copied on the device. Each window is computed in batches of steps
+ * (see EnqueueSteps()). Lines are packed on the device with a row
+ * pitch of a whole number of work groups; lines past the end of a slab are
+ * computed from stale buffer contents, and never read back.
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T>
+unsigned long CLElectrosFunctor<T>::BufferedFunctor(
+	size_t deviceIndex, ///< Device on which to process data
+	size_t start, ///< First line of the block
+	size_t count ///< Number of lines in the block
+)
+{
+	FunctorData &devData = m_functors[deviceIndex];
+	if (count > devData.bufferLines)
+		return CL_INVALID_BUFFER_SIZE;
+
+	PerfTimer timer;
+	perfPacket &profiler = devData.perfData;
+	timer.start();
+	CLerror err;
 
-	profiler.add(TimingInfo("Host to device transfer", timer.tick(),
-				3 * size + qSize));
+	Vector3<cl_mem> *mem = devData.devFieldMem;
+	cl_kernel kernel = devData.kernel;
+	cl_command_queue queue = devData.queue;
+	cl_command_queue transferQueue = devData.transferQueue;
+	const size_t groupLines = devData.local[0] * devData.vecWidth;
 
-	//==========================================================================
+	err = CL_SUCCESS;
+	// __global pointCharge *Charges,
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &devData.chargeMem);
+	// const unsigned int p,
+	cl_uint param = (cl_uint)this->m_pPointChargeData->GetSize();
+	err |= clSetKernelArg(kernel, 5, sizeof(param), &param);
+	// const float resolution
+	T res = this->m_resolution;
+	err |= clSetKernelArg(kernel, 7, sizeof(res), &res);
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "clSetKernelArg failed");
 
-	cout << " Executing kernel" << endl;
+	// Slabs are only worth it if they still fill the device
+	size_t slabLines = count;
+	if (devData.windowSteps == devData.steps) {
+		const size_t groups = (count + groupLines - 1) / groupLines;
+		size_t slabGroups =
+			(groups + CL_PIPELINE_SLABS - 1) / CL_PIPELINE_SLABS;
+		if (slabGroups < CL_MIN_SLAB_GROUPS)
+			slabGroups = CL_MIN_SLAB_GROUPS;
+		if (slabGroups * groupLines < count)
+			slabLines = slabGroups * groupLines;
+	}
+
+	//==========================================================================
+	cl_event uploadDone = NULL, kernelDone = NULL;
+	cl_event readDone[2] = { NULL, NULL };
+	size_t lines = slabLines;
+	if (lines > count)
+		lines = count;
 
+	// Nothing else can run until the first starting points are in
 	timer.tick();
-	err |= clEnqueueNDRangeKernel(queue, kernel, 3, NULL, funData.global,
-				      funData.local, 0, NULL, NULL);
-	if (err)
-		cout << "clEnqueueNDRangeKernel returns: " << err << endl;
-	// Let kernel finish before continuing
-	CL_ASSERTE(clFinish(queue), "Post-kernel sync");
-	double time = timer.tick();
-	this->m_pPerfData->time = time;
-	this->m_pPerfData->performance =
-		(this->m_nLines *
-		 ((2500 - 1) * (this->m_pPointChargeData->GetSize() *
-					(electroPartFieldFLOP + 3) +
-				13)) /
-		 time) /
-		1E9;
-	profiler.add(TimingInfo("Kernel execution time", time));
+	err = EnqueueSeeds(deviceIndex, 0, start, lines, &uploadDone);
+	if (err == CL_SUCCESS)
+		err = clWaitForEvents(1, &uploadDone);
+	if (err != CL_SUCCESS) {
+		clFinish(transferQueue);
+		ReleaseEvent(&uploadDone);
+		CollectProfile(devData);
+	}
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "Sending data to device failed");
+	const double uploadTime = timer.tick();
+
 	//==========================================================================
-	cout << " Recovering results" << endl;
+	Vector3<T *> hostArr = this->m_pFieldLinesData->GetDataPointers();
+	const size_t hostPitch = this->m_nLines * sizeof(T);
+	const size_t end = start + count;
+	const size_t lastRow = devData.steps - 1;
+	const size_t windowRows = devData.windowSteps - 1;
+	size_t slabStart = start, row = 0, rows = 0, set = 0;
+	// Line steps computed by the kernels, padding included
+	double lineSteps = 0;
 
 	timer.tick();
-	err = CL_SUCCESS;
-	err |= clEnqueueReadBuffer(queue, arrdata.x, CL_FALSE, 0, size,
-				   hostArr.x, 0, NULL, NULL);
-	if (err)
-		cout << " Read 1 returns: " << err << endl;
-	err |= clEnqueueReadBuffer(queue, arrdata.y, CL_FALSE, 0, size,
-				   hostArr.y, 0, NULL, NULL);
-	if (err)
-		cout << " Read 2 returns: " << err << endl;
-	err |= clEnqueueReadBuffer(queue, arrdata.z, CL_FALSE, 0, size,
-				   hostArr.z, 0, NULL, NULL);
-	if (err)
-		cout << " Read 3 returns: " << err << endl;
-	if (err)
-		cout << "clEnqueueReadBuffer cummulates: " << err << endl;
+	for (;;) {
+		Vector3<cl_mem> &cur = mem[set], &next = mem[set ^ 1];
+		const size_t pitch =
+			((lines + groupLines - 1) / groupLines) * groupLines;
+		const size_t bufferPitch = pitch * sizeof(T);
+		const size_t rowSize = lines * sizeof(T);
+		size_t global[3] = { pitch / devData.vecWidth,
+				     devData.local[1], 1 };
+		rows = lastRow - row;
+		if (rows > windowRows)
+			rows = windowRows;
+
+		err = CL_SUCCESS;
+		// __global float *x,
+		err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &cur.x);
+		// __global float *y,
+		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &cur.y);
+		// __global float *z,
+		err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &cur.z);
+		// const unsigned int linePitch,
+		param = (cl_uint)pitch;
+		err |= clSetKernelArg(kernel, 4, sizeof(param), &param);
+		if (err != CL_SUCCESS)
+			break;
+
+		// Wait for the starting points, and for the previous tile in
+		// this set to be read back
+		cl_event wait[2];
+		cl_uint nWait = 0;
+		if (uploadDone)
+			wait[nWait++] = uploadDone;
+		if (readDone[set])
+			wait[nWait++] = readDone[set];
+		ReleaseEvent(&kernelDone);
+		err = EnqueueSteps(devData, 1, rows, NULL, global, nWait,
+				   nWait ? wait : NULL, &kernelDone);
+		if (err != CL_SUCCESS)
+			break;
+		lineSteps += (double)pitch * rows;
+		ReleaseEvent(&uploadDone);
+		ReleaseEvent(&readDone[set]);
+
+		// Prepare the starting points of the next tile
+		const bool moreWindows = (row + rows < lastRow);
+		const size_t nextStart = slabStart + lines;
+		size_t nextLines = 0;
+		if (moreWindows) {
+			const size_t carry = windowRows * bufferPitch;
+			const char *label = "Device to device copy";
+			err |= clEnqueueCopyBuffer(
+				queue, cur.x, next.x, carry, 0, rowSize, 0, NULL,
+				ProfileCommand(devData, label, rowSize));
+			err |= clEnqueueCopyBuffer(
+				queue, cur.y, next.y, carry, 0, rowSize, 0, NULL,
+				ProfileCommand(devData, label, rowSize));
+			err |= clEnqueueCopyBuffer(
+				queue, cur.z, next.z, carry, 0, rowSize, 0, NULL,
+				ProfileCommand(devData, label, rowSize));
+		} else if (nextStart < end) {
+			nextLines = end - nextStart;
+			if (nextLines > slabLines)
+				nextLines = slabLines;
+			err |= EnqueueSeeds(deviceIndex, set ^ 1, nextStart,
+					    nextLines, &uploadDone);
+		}
+
+		// Rows 1 to 'rows' go back to the host array, of pitch m_nLines
+		const size_t bufferOrigin[3] = { 0, 1, 0 };
+		const size_t hostOrigin[3] = { slabStart * sizeof(T), row + 1,
+					       0 };
+		const size_t region[3] = { rowSize, rows, 1 };
+		const char *label = "Device to host transfer";
+		err |= clEnqueueReadBufferRect(
+			transferQueue, cur.x, CL_FALSE, bufferOrigin,
+			hostOrigin, region, bufferPitch, 0, hostPitch, 0,
+			hostArr.x, 1, &kernelDone,
+			ProfileCommand(devData, label, rowSize * rows));
+		err |= clEnqueueReadBufferRect(
+			transferQueue, cur.y, CL_FALSE, bufferOrigin,
+			hostOrigin, region, bufferPitch, 0, hostPitch, 0,
+			hostArr.y, 1, &kernelDone,
+			ProfileCommand(devData, label, rowSize * rows));
+		// In order, so the last read signals the whole tile
+		err |= clEnqueueReadBufferRect(transferQueue, cur.z, CL_FALSE,
+					       bufferOrigin, hostOrigin, region,
+					       bufferPitch, 0, hostPitch, 0,
+					       hostArr.z, 1, &kernelDone,
+					       &readDone[set]);
+		if (err != CL_SUCCESS)
+			break;
+		ProfileEvent(devData, readDone[set], label, rowSize * rows);
+
+		if (moreWindows) {
+			row += rows;
+		} else if (nextLines) {
+			slabStart = nextStart;
+			lines = nextLines;
+			row = 0;
+		} else {
+			break;
+		}
+		set ^= 1;
+	}
 
-	clFinish(queue);
+	// Results are complete once the last kernel and all reads are done
+	if (err == CL_SUCCESS)
+		err = clWaitForEvents(1, &kernelDone);
+	const double time = timer.tick();
+	CLerror syncErr = clFinish(queue);
+	syncErr |= clFinish(transferQueue);
+	ReleaseEvent(&uploadDone);
+	ReleaseEvent(&kernelDone);
+	ReleaseEvent(&readDone[0]);
+	ReleaseEvent(&readDone[1]);
+	CollectProfile(devData);
+	if (err == CL_SUCCESS)
+		err = syncErr;
+	devData.lastOpErrCode = err;
+	CL_ASSERTE(err, "Computing field lines failed");
 
-	profiler.add(
-		TimingInfo("Device to host transfer", timer.tick(), 3 * size));
+	devData.kernelTime += time;
+	devData.lineStepTime = time / lineSteps;
+	// Only the read-back of the last tile is not hidden by a kernel
+	profiler.add(TimingInfo("Block wall time",
+				uploadTime + time + timer.tick()));
 	return CL_SUCCESS;
 }
 
 /**=============================================================================
- * \brief Auxiliary functor
+ * \brief Picks the kernel configuration of a device
  *
- * Compiles and updates progress information in real-time
+ * A configuration tuned by this functor takes precedence over the tuning
+ * database, which takes precedence over the hand-picked defaults: BLOCK_X lines
+ * per work group, at the preferred vector width of the device.
  * ===========================================================================*/
-template <class T> unsigned long CLElectrosFunctor<T>::AuxFunctor()
+template <class T>
+void CLElectrosFunctor<T>::SelectKernelConfig(FunctorData &data)
 {
-	return 0;
+	const std::string key = DeviceKey(*data.device);
+	KernelConfig config;
+	std::map<std::string, KernelConfig>::const_iterator it =
+		m_tunedConfigs.find(key);
+	data.tuned = true;
+	if (it != m_tunedConfigs.end()) {
+		config = it->second;
+	} else if (!LoadKernelConfig(key, &config) ||
+		   config.groupSize > data.device->maxWorkGroupSize ||
+		   !*FindVecType(config.vecWidth)) {
+		data.tuned = false;
+		config.vecWidth = FindVectorWidth(*data.device);
+		config.groupSize = BLOCK_X / config.vecWidth;
+		config.groupRows = 1;
+		config.unroll = 0;
+	}
+	ApplyKernelConfig(data, config);
 }
 
 /**=============================================================================
- * \brief Loads and compile kernels
+ * \brief Sets the work group shape of a device for the bound dataset
  *
- * @param deviceID Device/functor combination on which to operate
+ * With too few lines to keep every compute unit busy, each line is given up to
+ * BLOCK_Y_MT work items, which split the charges among themselves in the MT
+ * kernel. This only pays off with enough charges to give each of them at least
+ * one row of BLOCK_X_MT charges.
+ * ===========================================================================*/
+template <class T>
+void CLElectrosFunctor<T>::ApplyKernelConfig(FunctorData &data,
+					     const KernelConfig &config)
+{
+	const ClManager::clDeviceProp *dev = data.device;
+	data.vecWidth = config.vecWidth;
+	data.unroll = config.unroll;
+	data.local[0] = config.groupSize;
+	data.local[1] = 1;
+	data.local[2] = 1;
+
+	const size_t items = (this->m_nLines + data.vecWidth - 1) /
+			     data.vecWidth;
+	const size_t wanted = dev->maxComputeUnits * CL_MT_ITEMS_PER_UNIT;
+	const size_t p = this->m_pPointChargeData->GetSize();
+	// The partial fields of a group are summed in local memory
+	const size_t itemLocalMem = 3 * sizeof(T) * data.vecWidth;
+	size_t rows = 1;
+	while (rows < BLOCK_Y_MT && items * rows * 2 <= wanted &&
+	       p >= BLOCK_X_MT * rows * 2 &&
+	       BLOCK_X_MT * rows * 2 <= dev->maxWorkGroupSize &&
+	       BLOCK_X_MT * rows * 2 * itemLocalMem <= dev->localMemSize)
+		rows *= 2;
+	if (rows > 1) {
+		data.local[0] = BLOCK_X_MT;
+		data.local[1] = rows;
+	}
+}
+
+/**=============================================================================
+ * \brief Measures the fastest kernel configuration of a device
+ *
+ * Each candidate is compiled and timed on a small sample: the first starting
+ * points of the dataset and at most CL_TUNE_CHARGES charges, over CL_TUNE_STEPS
+ * rows. The work group size and vector width are searched first, with the
+ * charge loop unrolled completely; the unroll factor is then searched for the
+ * winning shape. The winner is applied to the device, and kept in the tuning
+ * database.
  * @return First error code that is encountered
  * @return CL_SUCCESS if no error is encountered
  * ===========================================================================*/
-template <class T> CLerror CLElectrosFunctor<T>::LoadKernels(size_t deviceID)
+template <class T> CLerror CLElectrosFunctor<T>::TuneKernel(size_t deviceID)
 {
+	static const size_t groupSizes[] = { 32, 64, 128, 256 };
+	static const size_t vecWidths[] = { 1, 2, 4 };
+	static const size_t unrolls[] = { 1, 4, 8 };
+	// Largest work group of any candidate, in work items and in lines
+	const size_t maxGroup = 256, maxGroupLines = maxGroup * 4;
+
 	PerfTimer timer;
 	timer.start();
 	FunctorData &data = m_functors[deviceID];
+	const ClManager::clDeviceProp *dev = data.device;
+	cout << " Tuning kernel on " << dev->name << endl;
+
+	// Every candidate must cover the sample with whole work groups
+	size_t lines = dev->maxComputeUnits * CL_TUNE_LINES_PER_UNIT;
+	if (lines > CL_TUNE_MAX_LINES)
+		lines = CL_TUNE_MAX_LINES;
+	lines = ((lines + maxGroupLines - 1) / maxGroupLines) * maxGroupLines;
+
+	// The first starting points, repeated as needed
+	Vector3<T *> hostArr = this->m_pFieldLinesData->GetDataPointers();
+	std::vector<T> seedX(lines), seedY(lines), seedZ(lines);
+	for (size_t i = 0; i < lines; i++) {
+		const size_t src = i % this->m_nLines;
+		seedX[i] = hostArr.x[src];
+		seedY[i] = hostArr.y[src];
+		seedZ[i] = hostArr.z[src];
+	}
+	Vector3<T *> seeds;
+	seeds.x = &seedX[0];
+	seeds.y = &seedY[0];
+	seeds.z = &seedZ[0];
+
+	size_t nCharges = this->m_pPointChargeData->GetSize();
+	if (nCharges > CL_TUNE_CHARGES)
+		nCharges = CL_TUNE_CHARGES;
+	std::vector<electro::pointCharge<T> > charges(
+		((nCharges + maxGroup - 1) / maxGroup) * maxGroup);
+	for (size_t i = 0; i < nCharges; i++)
+		charges[i] = (*this->m_pPointChargeData)[i];
+
+	CLerror err;
+	cl_command_queue queue =
+		clCreateCommandQueue(data.context, dev->deviceID, 0, &err);
+	CL_ASSERTE(err, "clCreateCommandQueue failed");
+	// x, y, z, then the charges
+	cl_mem mem[4] = { NULL, NULL, NULL, NULL };
+	const size_t fieldSize = sizeof(T) * lines * CL_TUNE_STEPS;
+	const size_t qSize = charges.size() * sizeof(charges[0]);
+	for (size_t i = 0; i < 3 && err == CL_SUCCESS; i++)
+		mem[i] = clCreateBuffer(data.context, CL_MEM_READ_WRITE,
+					fieldSize, NULL, &err);
+	if (err == CL_SUCCESS)
+		mem[3] = clCreateBuffer(data.context, CL_MEM_READ_ONLY, qSize,
+					NULL, &err);
+	if (err == CL_SUCCESS)
+		err = clEnqueueWriteBuffer(queue, mem[3], CL_TRUE, 0, qSize,
+					   &charges[0], 0, NULL, NULL);
 
-	cout << " Reading kernel source" << endl;
-	using std::ifstream;
-	ifstream reader("Electrostatics.cl.c", ifstream::in);
-	if (!reader.good()) {
-		cout << "Cannot open program source" << endl;
+	KernelConfig best = { 0, 1, 0, 0 };
+	double bestRate = 0;
+	for (size_t v = 0; v < 3 && err == CL_SUCCESS; v++) {
+		if (!*FindVecType(vecWidths[v]))
+			continue;
+		for (size_t g = 0; g < 4; g++) {
+			if (groupSizes[g] > dev->maxWorkGroupSize)
+				continue;
+			KernelConfig config = { groupSizes[g], 1,
+						vecWidths[v], 0 };
+			const double rate = TimeKernelConfig(
+				deviceID, config, queue, mem, lines, nCharges,
+				seeds);
+			if (rate > bestRate) {
+				best = config;
+				bestRate = rate;
+			}
+		}
+	}
+	for (size_t u = 0; u < 3 && bestRate > 0; u++) {
+		KernelConfig config = best;
+		config.unroll = unrolls[u];
+		const double rate = TimeKernelConfig(deviceID, config, queue,
+						     mem, lines, nCharges, seeds);
+		if (rate > bestRate) {
+			best = config;
+			bestRate = rate;
+		}
+	}
+
+	for (size_t i = 0; i < 4; i++) {
+		if (mem[i])
+			clReleaseMemObject(mem[i]);
+	}
+	clReleaseCommandQueue(queue);
+	CL_ASSERTE(err, "Preparing the tuning sample failed");
+	// No candidate could be built and run
+	if (bestRate <= 0)
+		return CL_INVALID_KERNEL;
+
+	cout << " Tuned kernel: " << best.groupSize << " work items, vector width "
+	     << best.vecWidth << ", unroll " << best.unroll << "; "
+	     << bestRate << " steps/s" << endl;
+	const std::string key = DeviceKey(*dev);
+	m_tunedConfigs[key] = best;
+	if (!SaveKernelConfig(key, best))
+		cerr << " Could not store the tuned kernel configuration" << endl;
+	ApplyKernelConfig(data, best);
+	// The kernel time scales with the charges; a first guess for BatchSteps()
+	data.lineStepTime = (double)this->m_pPointChargeData->GetSize() /
+			    (nCharges * bestRate);
+	data.tuned = true;
+	data.perfData.add(TimingInfo("Kernel tuning", timer.tick()));
+	return CL_SUCCESS;
+}
+
+/**=============================================================================
+ * \brief Times one kernel configuration on the tuning sample
+ *
+ * 'mem' holds the x, y and z sample buffers, then the padded charges. The first
+ * run warms up the device and is not counted.
+ * @return Line steps computed per second, or 0 if the configuration cannot run
+ * ===========================================================================*/
+template <class T>
+double CLElectrosFunctor<T>::TimeKernelConfig(size_t deviceID,
+					      const KernelConfig &config,
+					      cl_command_queue queue,
+					      const cl_mem *mem, size_t lines,
+					      size_t nCharges,
+					      const Vector3<T *> &seeds)
+{
+	cl_program prog;
+	bool fromCache;
+	CLerror err = BuildProgram(deviceID, config, &prog, &fromCache);
+	if (!prog)
+		return 0;
+	cl_kernel kernel = NULL;
+	if (err == CL_SUCCESS)
+		kernel = clCreateKernel(prog, KernelName(config), &err);
+
+	for (cl_uint i = 0; i < 4 && err == CL_SUCCESS; i++)
+		err = clSetKernelArg(kernel, i, sizeof(cl_mem), &mem[i]);
+	cl_uint param = (cl_uint)lines;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 4, sizeof(param), &param);
+	param = (cl_uint)nCharges;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 5, sizeof(param), &param);
+	param = 1;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 6, sizeof(param), &param);
+	T res = this->m_resolution;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 7, sizeof(res), &res);
+	param = CL_TUNE_STEPS - 1;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 8, sizeof(param), &param);
+
+	size_t global[3] = { lines / config.vecWidth, config.groupRows, 1 };
+	size_t local[3] = { config.groupSize, config.groupRows, 1 };
+	const T *rows[3] = { seeds.x, seeds.y, seeds.z };
+	PerfTimer timer;
+	double best = 0;
+	for (size_t run = 0; run <= CL_TUNE_RUNS && err == CL_SUCCESS; run++) {
+		// Every run starts from the same points
+		for (size_t i = 0; i < 3 && err == CL_SUCCESS; i++)
+			err = clEnqueueWriteBuffer(queue, mem[i], CL_TRUE, 0,
+						   sizeof(T) * lines, rows[i],
+						   0, NULL, NULL);
+		timer.start();
+		if (err == CL_SUCCESS)
+			err = clEnqueueNDRangeKernel(queue, kernel, 3, NULL,
+						     global, local, 0, NULL,
+						     NULL);
+		if (err == CL_SUCCESS)
+			err = clFinish(queue);
+		const double time = timer.tick();
+		if (run && (best == 0 || time < best))
+			best = time;
+	}
+
+	if (kernel)
+		clReleaseKernel(kernel);
+	clReleaseProgram(prog);
+	if (err != CL_SUCCESS || best <= 0)
+		return 0;
+	return (double)lines * (CL_TUNE_STEPS - 1) / best;
+}
+
+/**=============================================================================
+ * \brief Builds the field line program for one kernel configuration
+ *
+ * Different devices require different work group sizes to operate optimally.
+ * The amount of __local memory on some kernels depends on these work-group
+ * sizes. This causes a problem as explained below:
+ * There are two ways to use group-local memory
+ * 1) Allocate it as a parameter with clSetKernelArg()
+ * 2) Declare it as a constant __local array within the cl kernel
+ * Option (1) has the advantage of flexibility, but the extra indexing overhead
+ * is a performance killer (20-25% easily lost on nvidia GPUs)
+ * Option (2) has the advantage that the compiler knows the arrays are of
+ * constant size, and is free to do extreme optimizations.
+ * Of course, then both host and kernel have to agree on the size of the work
+ * group.
+ * We abuse the fact that the source code is compiled at runtime, decide those
+ * sizes in the host code, then #define them in the kernel code, before it is
+ * compiled.
+ * @param program [out] The program, or NULL if none could be created. A program
+ * that failed to build is still returned, so that its build log can be queried.
+ * @return Error code of the build
+ * ===========================================================================*/
+template <class T>
+CLerror CLElectrosFunctor<T>::BuildProgram(size_t deviceID,
+					   const KernelConfig &config,
+					   cl_program *program, bool *fromCache)
+{
+	FunctorData &data = m_functors[deviceID];
+	*program = NULL;
+	std::string source;
+	if (!GetKernelSource("Electrostatics.cl.c", &source)) {
+		cout << "Cannot load program source" << endl;
 		return -1;
 	}
-	reader.seekg(0, std::ios::end);
-	size_t length = reader.tellg();
-	reader.seekg(0, std::ios::beg);
-	char *source = new char[length];
-	reader.read(source, length);
-	reader.close();
 
-	/*
-	 * Different devices require different work group sizes to operate
-	 * optimally. The amount of __local memory on some kernels depends on
-	 * these work-group sizes. This causes a problem as explained below:
-	 * There are two ways to use group-local memory
-	 * 1) Allocate it as a parameter with clSetKernelArg()
-	 * 2) Declare it as a constant __local array within the cl kernel
-	 * Option (1) has the advantage of flexibility, but the extra indexing
-	 * overhead is a performance killer (20-25% easily lost on nvidia GPUs)
-	 * Option (2) has the advantage that the compiler knows the arrays are
-	 * of constant size, and is free to do extreme optimizations.
-	 * Of course, then both host and kernel have to agree on the size of the
-	 * work group.
-	 * We abuse the fact that the source code is compiled at runtime, decide
-	 * those sizes in the host code, then #define them in the kernel code,
-	 * before it is compiled.
-	 */
+	// Double precision is an extension before OpenCL 1.2
+	const char *extension = FindPrecExtension(*data.device);
+	char pragma[128] = "";
+	if (extension && *extension)
+		snprintf(pragma, sizeof(pragma),
+			 "#pragma OPENCL EXTENSION %s : enable\n", extension);
 
-	// BLOCK size
-	data.local[0] = BLOCK_X;
-	data.local[1] = 1;
-	data.local[2] = 1;
-	size_t local_MT[3] = { BLOCK_X_MT, BLOCK_Y_MT, 1 };
+	char defines[1024];
+	snprintf(defines, sizeof(defines),
+		 "%s"
+		 "#define BLOCK_X %u\n"
+		 "#define BLOCK_X_MT %u\n"
+		 "#define BLOCK_Y_MT %u\n"
+		 "#define KERNEL_UNROLL %u\n"
+		 "#define Tprec %s\n"
+		 "#define Tvec %s\n",
+		 pragma, (unsigned int)config.groupSize,
+		 (unsigned int)config.groupSize, (unsigned int)config.groupRows,
+		 (unsigned int)config.unroll, FindPrecType(),
+		 FindVecType(config.vecWidth));
+
+	const char *srcs[2] = { defines, source.c_str() };
+	CLerror err;
+	// Double precision is chosen for accuracy; keep the IEEE semantics
+	const char *options = (sizeof(T) == sizeof(float)) ?
+				      "-cl-fast-relaxed-math" :
+				      "";
+	*program = BuildProgramCached(data.context, *data.device, 2, srcs,
+				      options, fromCache, &err);
+	return err;
+}
+
+/**=============================================================================
+ * \brief Loads and compile kernels
+ *
+ * @param deviceID Device/functor combination on which to operate
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T> CLerror CLElectrosFunctor<T>::LoadKernels(size_t deviceID)
+{
+	PerfTimer timer;
+	timer.start();
+	FunctorData &data = m_functors[deviceID];
+
+	// BLOCK size comes from the kernel configuration
 	// GRID size
-	data.global[0] = ((this->m_nLines + BLOCK_X - 1) / BLOCK_X) * BLOCK_X;
+	const size_t groupLines = data.local[0] * data.vecWidth;
+	data.global[0] =
+		((this->m_nLines + groupLines - 1) / groupLines) * groupLines;
 	data.global[0] /= data.vecWidth;
-	data.local[0] /= data.vecWidth;
-	data.global[1] = 1;
+	data.global[1] = data.local[1];
 	data.global[2] = 1;
+	const KernelConfig config = { data.local[0], data.local[1],
+				      data.vecWidth, data.unroll };
+	cout << "Kernel  : " << KernelName(config) << endl;
 	cout << "Local   : " << data.local[0] << " " << data.local[1] << " "
 	     << data.local[2] << endl;
-	cout << "Local_MT: " << local_MT[0] << " " << local_MT[1] << " "
-	     << local_MT[2] << endl;
 	cout << "Global  : " << data.global[0] << " " << data.global[1] << " "
 	     << data.global[2] << endl;
 
-	char defines[1024];
-	const size_t kernelSteps =
-		this->m_pFieldLinesData->GetSize() / this->m_nLines;
-	snprintf(defines, sizeof(defines),
-		 "#define BLOCK_X %u\n"
-		 "#define BLOCK_X_MT %u\n"
-		 "#define BLOCK_Y_MT %u\n"
-		 "#define KERNEL_STEPS %u\n"
-		 "#define Tprec %s\n"
-		 "#define Tvec %s\n",
-		 (unsigned int)data.local[0], (unsigned int)local_MT[0],
-		 (unsigned int)local_MT[1], (unsigned int)kernelSteps,
-		 FindPrecType(), FindVecType(data.vecWidth));
+	// Kernels already built in this session are used as they are
+	DeviceSession &session = m_sessions[data.device->deviceID];
+	char key[96];
+	snprintf(key, sizeof(key), "%u %u %u %u",
+		 (unsigned int)config.groupSize, (unsigned int)config.groupRows,
+		 (unsigned int)config.vecWidth, (unsigned int)config.unroll);
+	typename std::map<std::string,
+			  std::pair<cl_program, cl_kernel> >::iterator built =
+		session.kernels.find(key);
+	if (built != session.kernels.end()) {
+		data.program = built->second.first;
+		data.kernel = built->second.second;
+		data.perfData.add(TimingInfo("Kernel reused", timer.tick()));
+		return CL_SUCCESS;
+	}
 
-	cout << " Calc'ed kern steps " << kernelSteps << endl;
-	char *srcs[2] = { defines, source };
 	CLerror err;
-	cl_program prog = clCreateProgramWithSource(
-		data.context, 2, (const char **)srcs, NULL, &err);
-	if (err)
+	bool fromCache;
+	cl_program prog;
+	err = BuildProgram(deviceID, config, &prog, &fromCache);
+	if (!prog) {
 		cout << "clCreateProgramWithSource returns: " << err << endl;
-
-	char options[] = "-cl-fast-relaxed-math";
-	err = clBuildProgram(prog, 0, NULL, options, NULL, NULL);
+		return err;
+	}
 	if (err)
 		cout << "clBuildProgram returns: " << err << endl;
 
-	size_t logSize;
-	clGetProgramBuildInfo(prog, data.device->deviceID, CL_PROGRAM_BUILD_LOG,
-			      0, NULL, &logSize);
-	char *log = (char *)malloc(logSize);
-	clGetProgramBuildInfo(prog, data.device->deviceID, CL_PROGRAM_BUILD_LOG,
-			      logSize, log, 0);
-	cout << "Program Build Log:" << endl << log << endl;
+	if (!fromCache || err) {
+		size_t logSize;
+		clGetProgramBuildInfo(prog, data.device->deviceID,
+				      CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+		char *log = (char *)malloc(logSize);
+		clGetProgramBuildInfo(prog, data.device->deviceID,
+				      CL_PROGRAM_BUILD_LOG, logSize, log, 0);
+		cout << "Program Build Log:" << endl << log << endl;
+		free(log);
+	}
+	if (err != CL_SUCCESS)
+		clReleaseProgram(prog);
 	CL_ASSERTE(err, "clBuildProgram failed");
-	data.perfData.add(TimingInfo("Program compilation", timer.tick()));
+	data.perfData.add(TimingInfo(fromCache ? "Program loaded from cache" :
+						 "Program compilation",
+				     timer.tick()));
 
 	//==========================================================================
 	cout << " Preparing kernel" << endl;
-	data.kernel = clCreateKernel(prog, "CalcField_curvature", &err);
+	cl_kernel kernel = clCreateKernel(prog, KernelName(config), &err);
+	if (err != CL_SUCCESS)
+		clReleaseProgram(prog);
 	CL_ASSERTE(err, "clCreateKernel");
+	session.kernels[key] = std::make_pair(prog, kernel);
+	data.program = prog;
+	data.kernel = kernel;
+	return CL_SUCCESS;
+}
+
+/**=============================================================================
+ * \brief Uploads the point charges to a device
+ *
+ * The kernel reads the charges one work group at a time, so the array is padded
+ * to a multiple of the work group size with zero-magnitude charges.
+ * @param deviceID Device/functor combination on which to operate
+ * @return First error code that is encountered
+ * @return CL_SUCCESS if no error is encountered
+ * ===========================================================================*/
+template <class T> CLerror CLElectrosFunctor<T>::UploadCharges(size_t deviceID)
+{
+	PerfTimer timer;
+	timer.start();
+	FunctorData &data = m_functors[deviceID];
+	const size_t p = this->m_pPointChargeData->GetSize();
+	const size_t groupSize = data.local[0] * data.local[1];
+	data.nCharges = ((p + groupSize - 1) / groupSize) * groupSize;
+
+	std::vector<electro::pointCharge<T> > padded(data.nCharges);
+	for (size_t i = 0; i < p; i++)
+		padded[i] = (*this->m_pPointChargeData)[i];
+
+	const size_t qSize = data.nCharges * sizeof(padded[0]);
+	CLerror err;
+	DeviceSession &session = m_sessions[data.device->deviceID];
+	if (session.chargeBytes < qSize) {
+		if (session.chargeMem)
+			clReleaseMemObject(session.chargeMem);
+		session.chargeBytes = 0;
+		session.chargeMem = clCreateBuffer(data.context,
+						   CL_MEM_READ_ONLY, qSize,
+						   NULL, &err);
+		CL_ASSERTE(err, "clCreateBuffer.q failed ");
+		session.chargeBytes = qSize;
+	}
+	data.chargeMem = session.chargeMem;
+	err = clEnqueueWriteBuffer(data.queue, data.chargeMem, CL_TRUE, 0, qSize,
+				   &padded[0], 0, NULL, NULL);
+	CL_ASSERTE(err, "Sending charges to device failed");
+	data.perfData.add(TimingInfo("Charge upload", timer.tick(), qSize));
 	return CL_SUCCESS;
 }
 
@@ -635,6 +1868,39 @@ template <> const char *CLElectrosFunctor<double>::FindPrecType()
 	return "double";
 }
 
+/**=============================================================================
+ * \brief Extension needed to compute in single precision
+ *
+ * @return an empty string; every device supports single precision
+ * ===========================================================================*/
+template <>
+const char *CLElectrosFunctor<float>::FindPrecExtension(
+	const OpenCL::ClManager::clDeviceProp &dev)
+{
+	return "";
+}
+/**=============================================================================
+ * \brief Extension needed to compute in double precision
+ *
+ * Older AMD devices only offer cl_amd_fp64, which lacks a few built-ins the
+ * kernels do not use.
+ * @return the extension to enable, "" if none is needed, or NULL if the device
+ * has no double precision support
+ * ===========================================================================*/
+template <>
+const char *CLElectrosFunctor<double>::FindPrecExtension(
+	const OpenCL::ClManager::clDeviceProp &dev)
+{
+	if (dev.extensions.find("cl_khr_fp64") != std::string::npos)
+		return "cl_khr_fp64";
+	if (dev.extensions.find("cl_amd_fp64") != std::string::npos)
+		return "cl_amd_fp64";
+	// From OpenCL 1.2, doubles may be a core feature, with no pragma needed
+	if (dev.doubleFpConfig)
+		return "";
+	return NULL;
+}
+
 /**=============================================================================
  * \brief 
  *
@@ -673,3 +1939,5 @@ template <> const char *CLElectrosFunctor<double>::FindVecType(size_t vecWidth)
 	}
 }
 
+template class CLElectrosFunctor<float>;
+template class CLElectrosFunctor<double>;
@@ -21,6 +21,9 @@
 #include "ElectrostaticFunctor.hpp"
 #include "Electrostatics.h"
 #include "CL_Manager.hpp"
+#include "CL_Kernel_Tuning.hpp"
+#include <deque>
+#include <map>
 
 typedef int CLerror;
 
@@ -49,48 +52,152 @@ public:
 	void AllocateResources();
 	void ReleaseResources();
 	unsigned long MainFunctor(size_t functorIndex, size_t deviceIndex);
-	unsigned long AuxFunctor();
 	void PostRun();
 	bool Fail();
 	bool FailOnFunctor(size_t functorIndex);
 
 	void GenerateParameterList(size_t *nDevices);
+
+	/*---------------------Dynamic scheduling overriders--------------------
+	 * Any block of lines can be computed by any device, as long as it fits
+	 * in the device buffers. Blocks are sized in multiples of the lines
+	 * covered by one work group.
+	 */
+	size_t GetWorkGranularity(size_t deviceIndex);
+	size_t GetMaxBlockUnits(size_t deviceIndex);
+	std::string GetDeviceKey(size_t deviceIndex);
+	double GetDeviceScore(size_t deviceIndex);
+	unsigned long BlockFunctor(size_t deviceIndex, size_t start,
+				   size_t count);
+
 	void SetPreferredPlatform(const char *partial_platform_name)
 	{
-		m_preferred_platform = std::string(partial_platform_name);
+		m_selection.platformName = std::string(partial_platform_name);
+	}
+
+	/**
+	 * \brief Sets how devices are picked for the next dataset
+	 *
+	 * See ClManager::SelectDevices(). By default, devices of all platforms
+	 * are ranked by the probe alone, and those scoring at least a twentieth
+	 * of the best one are used.
+	 */
+	void SetSelectionPolicy(const OpenCL::ClManager::SelectionPolicy &policy)
+	{
+		m_selection = policy;
+	}
+
+	/**
+	 * \brief Limits the device memory used by field lines on each device
+	 *
+	 * Datasets that do not fit are processed in windows of steps; see
+	 * BlockFunctor(). 0 uses as much as the device allows.
+	 */
+	void SetMemoryBudget(size_t bytes)
+	{
+		m_memBudget = bytes;
+	}
+
+	/**
+	 * \brief Allows kernels to work on the host arrays in place
+	 *
+	 * Only used on devices that share memory with the host. Enabled by
+	 * default; see SizeBuffers().
+	 */
+	void SetZeroCopy(bool enable)
+	{
+		m_zeroCopy = enable;
+	}
+
+	/// When the kernel configuration is measured on each device
+	enum TuneMode {
+		/// Use tuned configurations from the database, or the defaults
+		TUNE_STORED,
+		/// Tune devices that have no configuration in the database
+		TUNE_MISSING,
+		/// Tune every device, replacing stored configurations
+		TUNE_ALL
+	};
+	/**
+	 * \brief Selects when kernels are tuned; see TuneKernel()
+	 *
+	 * Devices are tuned at most once per functor, while allocating
+	 * resources. The default is TUNE_STORED.
+	 */
+	void SetTuneMode(TuneMode mode)
+	{
+		m_tuneMode = mode;
 	}
 
+	/**
+	 * \brief Releases the device sessions kept between runs
+	 *
+	 * Contexts, compiled kernels and buffers outlive ReleaseResources(), so
+	 * that back to back runs skip the setup; see AllocateResources(). This
+	 * gives their memory back. Must not be called during a run.
+	 */
+	void CloseSessions();
+
 private:
 	/// Specifies the error code incurred during the last global operation
 	CLerror m_lastOpErrCode;
 
 	/// Records the total number of available compute devices
 	size_t m_nDevices;
+	/// Device memory, in bytes, the field buffers may use; 0 for no limit
+	size_t m_memBudget;
+	/// Use host arrays in place on devices that share host memory
+	bool m_zeroCopy;
+	TuneMode m_tuneMode;
+	/// Configurations tuned by this functor, by device key
+	std::map<std::string, OpenCL::KernelConfig> m_tunedConfigs;
 
 	static OpenCL::ClManager m_DeviceManager;
 
 	/// Partitions the Data for different devices
 	void PartitionData();
 
+	/// A command whose device timestamps are kept once it completes
+	struct ProfiledCommand {
+		cl_event event;
+		/// Step the command is reported as
+		const char *label;
+		/// Bytes transferred, if any
+		size_t bytes;
+		/// Occupancy estimate of a kernel launch; 0 otherwise
+		double occupancy;
+	};
+
 	// Device and functor  related information
 	class FunctorData {
 	public:
 		/// ID of the device this functor is intended to run on
 		OpenCL::ClManager::clDeviceProp *device;
+		/// Score the device was selected with; see SelectDevices()
+		double score;
 		/// Context associated with the device
 		cl_context context;
-		/// Device buffer for the field line
-		Vector3<cl_mem> devFieldMem;
+		/**
+		 * Device buffers for the field lines. Consecutive tiles of a
+		 * block alternate between the two sets, so that one tile can
+		 * be transferred while the other one computes.
+		 */
+		Vector3<cl_mem> devFieldMem[2];
+		/// The host field line arrays, wrapped for zero-copy access
+		Vector3<cl_mem> hostFieldMem;
+		/// Whether the kernel works on the host arrays in place
+		bool zeroCopy;
 		/// Device buffer for point charges
 		cl_mem chargeMem;
-		/// X-size of kernel block, dependent on selected kernel (MT/NON_MT)
-		unsigned int blockXSize;
-		/// kernel block size, dependent on selected kernel (MT/NON_MT)
-		unsigned int blockDim;
-		/// Number of lines to be processed by this device
-		size_t widthGlobX;
-		/// Number of blocks that can be launched during a kernel call
-		size_t nBlocksPerSegment;
+		/// Largest block of lines the device can process at once
+		size_t capacity;
+		/// Number of lines each set of device buffers can hold
+		size_t bufferLines;
+		/// Number of rows each set of device buffers can hold, starting
+		/// point included. Equals 'steps' unless the dataset is windowed
+		size_t windowSteps;
+		/// Number of charges in chargeMem, padded to a whole work group
+		size_t nCharges;
 		/// Keeps track of errors that ocuur on the context current to the
 		/// functor
 		CLerror lastOpErrCode;
@@ -105,37 +212,122 @@ private:
 		size_t elements;
 		/// Number of steps
 		size_t steps;
-		/// The preffered vector width of the device
+		/// Lines computed by each work item
 		size_t vecWidth;
+		/// Unroll factor of the charge loop; 0 unrolls it completely
+		size_t unroll;
+		/// Whether the kernel configuration was measured on the device
+		bool tuned;
 		/// Global and local work-sizes
 		size_t global[3], local[3];
 		/// The OpenCL kernel
 		cl_kernel kernel;
+		/// The program the kernel was built from
+		cl_program program;
 		/// the command queue used for execution
 		cl_command_queue queue;
+		/// Queue for host transfers, so they overlap with kernels
+		cl_command_queue transferQueue;
+		/// Work groups each compute unit is estimated to hold
+		size_t groupsPerUnit;
+		/// Commands of the current block, profiled when it completes
+		std::deque<ProfiledCommand> commands;
+		/// Kernel time per line and step, from the tuning runs or the
+		/// last block; 0 until measured
+		double lineStepTime;
+		/// Time spent in blocks processed on this device
+		double kernelTime;
 		/// Functor-specific performance information
 		perfPacket perfData;
 	};
 	/// Contains data for each individual functor
 	std::vector<FunctorData> m_functors;
-	std::string m_preferred_platform;
 
+	/**
+	 * Objects that outlive a run on one device. The context, queues, kernel
+	 * and buffers of a FunctorData are borrowed from here.
+	 */
+	class DeviceSession {
+	public:
+		cl_context context;
+		cl_command_queue queue;
+		cl_command_queue transferQueue;
+		/// Kernels built so far, by configuration
+		std::map<std::string, std::pair<cl_program, cl_kernel> > kernels;
+		/// Pooled field buffers; they only grow
+		Vector3<cl_mem> fieldMem[2];
+		/// Size of each pooled field buffer, in bytes
+		size_t fieldBytes;
+		/// Pooled charge buffer
+		cl_mem chargeMem;
+		/// Size of the pooled charge buffer, in bytes
+		size_t chargeBytes;
+	};
+	/// Sessions of the devices used so far
+	std::map<cl_device_id, DeviceSession> m_sessions;
+
+	/// How PartitionData() picks the devices
+	OpenCL::ClManager::SelectionPolicy m_selection;
+
+	CLerror OpenSession(size_t deviceID);
+	void CloseSession(cl_device_id device);
+	CLerror SizeBuffers(size_t deviceID);
+	unsigned long ZeroCopyFunctor(size_t deviceID, size_t start,
+				      size_t count);
+	unsigned long BufferedFunctor(size_t deviceID, size_t start,
+				      size_t count);
+	CLerror EnqueueSeeds(size_t deviceID, size_t set, size_t start,
+			     size_t lines, cl_event *done);
+	CLerror EnqueueSteps(FunctorData &data, size_t firstRow, size_t rows,
+			     const size_t *offset, const size_t *global,
+			     cl_uint nWait, const cl_event *wait,
+			     cl_event *done);
+	size_t BatchSteps(const FunctorData &data, size_t lines);
+	cl_event *ProfileCommand(FunctorData &data, const char *label,
+				 size_t bytes, double occupancy = 0);
+	void ProfileEvent(FunctorData &data, cl_event event, const char *label,
+			  size_t bytes, double occupancy = 0);
+	void CollectProfile(FunctorData &data);
+	void EstimateGroupsPerUnit(FunctorData &data);
+	double Occupancy(const FunctorData &data, const size_t *global);
+	void SelectKernelConfig(FunctorData &data);
+	void ApplyKernelConfig(FunctorData &data,
+			       const OpenCL::KernelConfig &config);
+	CLerror TuneKernel(size_t deviceID);
+	double TimeKernelConfig(size_t deviceID,
+				const OpenCL::KernelConfig &config,
+				cl_command_queue queue, const cl_mem *mem,
+				size_t lines, size_t nCharges,
+				const Vector3<T *> &seeds);
+	CLerror BuildProgram(size_t deviceID, const OpenCL::KernelConfig &config,
+			     cl_program *program, bool *fromCache);
 	CLerror LoadKernels(size_t deviceID);
+	CLerror UploadCharges(size_t deviceID);
 
 	static size_t FindVectorWidth(OpenCL::ClManager::clDeviceProp &dev);
 	static const char *FindPrecType();
+	static const char *FindPrecExtension(
+		const OpenCL::ClManager::clDeviceProp &dev);
 	static const char *FindVecType(size_t vecWidth);
+	static std::string DeviceKey(const OpenCL::ClManager::clDeviceProp &dev);
+	static const char *KernelName(const OpenCL::KernelConfig &config);
 };
 ///@}
 extern CLElectrosFunctor<float> CLtest;
+extern CLElectrosFunctor<double> CLtestDouble;
 
 /**=============================================================================
  * \brief Electrostatics functor constructor
  *
  * Initializes critical variables
  * ===========================================================================*/
-template <class T> CLElectrosFunctor<T>::CLElectrosFunctor() : m_nDevices(0)
+template <class T> CLElectrosFunctor<T>::CLElectrosFunctor()
+	: m_nDevices(0), m_memBudget(0), m_zeroCopy(true),
+	  m_tuneMode(TUNE_STORED)
 {
+	m_selection.maxDevices = 0;
+	m_selection.minScore = 0.05;
+	m_selection.propertyWeight = 0;
 }
 
 #endif //CL_ELECTROSTATICS_HPP
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "CL_Kernel_Tuning.hpp"
+#include "CL_Program_Cache.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#if defined(_WIN32) || defined(_WIN64)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using std::string;
+typedef std::map<string, OpenCL::KernelConfig> ConfigMap;
+
+string OpenCL::GetTuningDatabasePath()
+{
+	const char *path = getenv("ELECTROMAG_TUNING_DB");
+	if (path)
+		return string(path);
+
+	const string dir = GetProgramCacheDir();
+	if (dir.empty())
+		return string();
+	return dir + "/kernel-tuning.txt";
+}
+
+/// Reads every entry of the database at 'path'
+static void ReadDatabase(const string &path, ConfigMap *configs)
+{
+	std::ifstream file(path.c_str());
+	OpenCL::KernelConfig config;
+	config.groupRows = 1;
+	string key;
+	while (file >> config.groupSize >> config.vecWidth >> config.unroll &&
+	       std::getline(file >> std::ws, key)) {
+		if (config.groupSize && config.vecWidth && !key.empty())
+			(*configs)[key] = config;
+	}
+}
+
+bool OpenCL::LoadKernelConfig(const string &deviceKey, KernelConfig *config)
+{
+	const string path = GetTuningDatabasePath();
+	if (path.empty())
+		return false;
+
+	ConfigMap configs;
+	ReadDatabase(path, &configs);
+	ConfigMap::const_iterator it = configs.find(deviceKey);
+	if (it == configs.end())
+		return false;
+	*config = it->second;
+	return true;
+}
+
+bool OpenCL::SaveKernelConfig(const string &deviceKey,
+			      const KernelConfig &config)
+{
+	const string path = GetTuningDatabasePath();
+	if (path.empty())
+		return false;
+	const size_t slash = path.find_last_of("/\\");
+	if (slash != string::npos && slash && !MakeDirs(path.substr(0, slash)))
+		return false;
+
+	ConfigMap configs;
+	ReadDatabase(path, &configs);
+	configs[deviceKey] = config;
+
+	// Entries of other devices may be written concurrently; last one wins
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	const string tmpPath = path + suffix;
+	bool ok;
+	{
+		std::ofstream file(tmpPath.c_str());
+		for (ConfigMap::const_iterator it = configs.begin();
+		     it != configs.end(); it++) {
+			const KernelConfig &entry = it->second;
+			file << entry.groupSize << " " << entry.vecWidth << " "
+			     << entry.unroll << " " << it->first << std::endl;
+		}
+		file.close();
+		ok = !file.fail();
+	}
+#if defined(_WIN32) || defined(_WIN64)
+	// rename() does not replace existing files on windows
+	if (ok)
+		remove(path.c_str());
+#endif
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CL_KERNEL_TUNING_HPP
+#define _CL_KERNEL_TUNING_HPP
+
+#include <string>
+
+namespace OpenCL
+{
+/// Compile-time parameters of a field line kernel
+struct KernelConfig {
+	/// Work items per work group, along the lines
+	size_t groupSize;
+	/**
+	 * Work items splitting the charges of each line. Above 1, the MT kernel
+	 * is used. Chosen from the dataset, so it is not stored.
+	 */
+	size_t groupRows;
+	/// Lines computed by each work item
+	size_t vecWidth;
+	/// Unroll factor of the charge loop; 0 unrolls it completely
+	size_t unroll;
+};
+
+/**=============================================================================
+ * \brief Looks up the tuned kernel configuration of a device
+ *
+ * Configurations are kept in a text file, one device per line: the work group
+ * size, vector width and unroll factor, followed by the device key. The file is
+ * $ELECTROMAG_TUNING_DB, or kernel-tuning.txt in the program cache directory.
+ * @return false if the device has no stored configuration
+ * ===========================================================================*/
+bool LoadKernelConfig(const std::string &deviceKey, KernelConfig *config);
+
+/// Stores the configuration of a device, replacing any previous entry
+bool SaveKernelConfig(const std::string &deviceKey, const KernelConfig &config);
+
+/// Path of the tuning database; empty if tuning results are not kept
+std::string GetTuningDatabasePath();
+
+} // namespace OpenCL
+
+#endif //_CL_KERNEL_TUNING_HPP
@@ -16,11 +16,14 @@
  *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "CL_Manager.hpp"
+#include <X-Compat/HPC Timing.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 using namespace OpenCL;
 
-ClManager GlobalClManager;
+ClManager OpenCL::GlobalClManager;
 vector<ClManager::clPlatformProp *> *ClManager::platforms = NULL;
 
 bool deviceMan::ComputeDeviceManager::deviceScanComplete = false;
@@ -35,6 +38,106 @@ static bool FirstClManagerInitialized = false;
 
 using std::cerr;
 using std::endl;
+
+#ifndef CL_DEVICE_DOUBLE_FP_CONFIG
+/* Provided by cl_khr_fp64 before OpenCL 1.2 */
+#define CL_DEVICE_DOUBLE_FP_CONFIG 0x1032
+#endif
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+/* cl_khr_pci_bus_info */
+#define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+#endif
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+/* cl_nv_device_attribute_query */
+#define CL_DEVICE_PCI_BUS_ID_NV 0x4008
+#define CL_DEVICE_PCI_SLOT_ID_NV 0x4009
+#endif
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+/* cl_amd_device_attribute_query */
+#define CL_DEVICE_TOPOLOGY_AMD 0x4037
+#define CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD 1
+#endif
+
+/*
+ * Extension lists easily outgrow a fixed buffer, and a query into a buffer that
+ * is too small fails outright, so size the string first.
+ */
+static std::string GetPlatformString(cl_platform_id platform,
+				     cl_platform_info param)
+{
+	size_t size = 0;
+	if (clGetPlatformInfo(platform, param, 0, NULL, &size) != CL_SUCCESS ||
+	    !size)
+		return std::string();
+	vector<char> str(size);
+	if (clGetPlatformInfo(platform, param, size, &str[0], NULL) !=
+	    CL_SUCCESS)
+		return std::string();
+	return std::string(&str[0]);
+}
+
+static std::string GetDeviceString(cl_device_id device, cl_device_info param)
+{
+	size_t size = 0;
+	if (clGetDeviceInfo(device, param, 0, NULL, &size) != CL_SUCCESS ||
+	    !size)
+		return std::string();
+	vector<char> str(size);
+	if (clGetDeviceInfo(device, param, size, &str[0], NULL) != CL_SUCCESS)
+		return std::string();
+	return std::string(&str[0]);
+}
+
+/*
+ * Fills 'location' with the PCI domain, bus, device and function of 'device',
+ * through whichever extension the runtime offers. Returns false if none does,
+ * or the device is not on a PCI bus.
+ */
+static bool QueryPciLocation(cl_device_id device, const std::string &extensions,
+			     cl_uint location[4])
+{
+	if (extensions.find("cl_khr_pci_bus_info") != std::string::npos &&
+	    clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_INFO_KHR,
+			    4 * sizeof(cl_uint), location, NULL) == CL_SUCCESS)
+		return true;
+
+	if (extensions.find("cl_nv_device_attribute_query") !=
+	    std::string::npos) {
+		cl_uint bus, slot;
+		if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_ID_NV,
+				    sizeof(bus), &bus, NULL) == CL_SUCCESS &&
+		    clGetDeviceInfo(device, CL_DEVICE_PCI_SLOT_ID_NV,
+				    sizeof(slot), &slot, NULL) == CL_SUCCESS) {
+			location[0] = 0;
+			location[1] = bus;
+			location[2] = slot >> 3;
+			location[3] = slot & 7;
+			return true;
+		}
+	}
+
+	if (extensions.find("cl_amd_device_attribute_query") !=
+	    std::string::npos) {
+		// cl_device_topology_amd: the type, 17 unused bytes, then the
+		// bus, device and function
+		unsigned char topology[24];
+		cl_uint type;
+		if (clGetDeviceInfo(device, CL_DEVICE_TOPOLOGY_AMD,
+				    sizeof(topology), topology, NULL) ==
+		    CL_SUCCESS) {
+			memcpy(&type, topology, sizeof(type));
+			if (type != CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD)
+				return false;
+			location[0] = 0;
+			location[1] = topology[21];
+			location[2] = topology[22];
+			location[3] = topology[23];
+			return true;
+		}
+	}
+	return false;
+}
+
 deviceMan::ComputeDeviceManager::ComputeDeviceManager()
 {
 }
@@ -150,9 +253,8 @@ ClManager::clPlatformProp::clPlatformProp(cl_platform_id platID)
 	clGetPlatformInfo(this->platformID, CL_PLATFORM_VERSION,
 			  sizeof(this->version), (void *)this->version, 0);
 
-	clGetPlatformInfo(this->platformID, CL_PLATFORM_EXTENSIONS,
-			  sizeof(this->extensions), (void *)this->extensions,
-			  0);
+	this->extensions = GetPlatformString(this->platformID,
+					     CL_PLATFORM_EXTENSIONS);
 
 	// Now get device details for this platform
 	// Query the number of devices
@@ -186,12 +288,12 @@ ClManager::clDeviceProp::clDeviceProp(cl_device_id devID)
 			sizeof(this->compilerAvailable),
 			(void *)&this->compilerAvailable, 0);
 
-	/*clGetDeviceInfo(this->deviceID,
-            CL_DEVICE_DOUBLE_FP_CONFIG,
-            sizeof(this->doubleFpConfig),
-            (void*)&this->doubleFpConfig,
-            0);
-    */
+	// Devices without double precision may reject the query
+	this->doubleFpConfig = 0;
+	clGetDeviceInfo(this->deviceID, CL_DEVICE_DOUBLE_FP_CONFIG,
+			sizeof(this->doubleFpConfig),
+			(void *)&this->doubleFpConfig, 0);
+
 	clGetDeviceInfo(this->deviceID, CL_DEVICE_ENDIAN_LITTLE,
 			sizeof(this->littleEndian), (void *)&this->littleEndian,
 			0);
@@ -203,8 +305,7 @@ ClManager::clDeviceProp::clDeviceProp(cl_device_id devID)
 			sizeof(this->execCapabilities),
 			(void *)&this->execCapabilities, 0);
 
-	clGetDeviceInfo(this->deviceID, CL_DEVICE_EXTENSIONS,
-			sizeof(this->extensions), (void *)this->extensions, 0);
+	this->extensions = GetDeviceString(this->deviceID, CL_DEVICE_EXTENSIONS);
 
 	clGetDeviceInfo(this->deviceID, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE,
 			sizeof(this->globalMemCacheSize),
@@ -420,6 +521,12 @@ ClManager::clDeviceProp::clDeviceProp(cl_device_id devID)
 	clGetDeviceInfo(this->deviceID, CL_DRIVER_VERSION,
 			sizeof(this->driverVersion),
 			(void *)this->driverVersion, 0);
+
+	this->hasPciLocation =
+		QueryPciLocation(this->deviceID, this->extensions,
+				 this->pciLocation);
+
+	this->probeRate = -1;
 }
 
 ClManager::clPlatformProp::~clPlatformProp()
@@ -466,3 +573,219 @@ void ClManager::ListAllDevices(std::ostream &out)
 		out << endl;
 	}
 }
+
+/// Work items of the probe, per compute unit
+#define CL_PROBE_ITEMS_PER_UNIT 1024
+/// Shortest probe run that is trusted, in seconds
+#define CL_PROBE_MIN_TIME 0.005
+/// Most iterations of the probe loop
+#define CL_PROBE_MAX_ITERS (1 << 20)
+/// Floating point operations per iteration of the probe loop
+#define CL_PROBE_FLOP 5
+/// SIMD lanes assumed for each compute unit of a GPU
+#define CL_GPU_LANES_PER_UNIT 32
+
+/*
+ * Same mix of operations as the field line kernels: multiply-adds and a
+ * reciprocal square root. Every iteration depends on the previous one, so the
+ * loop cannot be folded away.
+ */
+static const char probeSource[] =
+	"__kernel void Probe(__global float *out, const unsigned int iters)\n"
+	"{\n"
+	"	float x = get_global_id(0) * 1e-6f, y = 1.0f;\n"
+	"	for (unsigned int i = 0; i < iters; i++) {\n"
+	"		y = mad(x, y, 0.5f);\n"
+	"		x = rsqrt(mad(y, y, 1.0f));\n"
+	"	}\n"
+	"	out[get_global_id(0)] = x + y;\n"
+	"}\n";
+
+double ClManager::ProbeDevice(clDeviceProp &dev)
+{
+	if (dev.probeRate >= 0)
+		return dev.probeRate;
+	dev.probeRate = 0;
+	if (!dev.available || !dev.compilerAvailable)
+		return 0;
+
+	cl_int err;
+	cl_context_properties props[] = {
+		CL_CONTEXT_PLATFORM, (cl_context_properties)dev.platform, 0
+	};
+	cl_context context =
+		clCreateContext(props, 1, &dev.deviceID, NULL, NULL, &err);
+	if (err != CL_SUCCESS)
+		return 0;
+
+	const size_t items =
+		(dev.maxComputeUnits ? dev.maxComputeUnits : 1) *
+		CL_PROBE_ITEMS_PER_UNIT;
+	cl_command_queue queue = NULL;
+	cl_mem out = NULL;
+	cl_program prog = NULL;
+	cl_kernel kernel = NULL;
+	const char *src = probeSource;
+	queue = clCreateCommandQueue(context, dev.deviceID, 0, &err);
+	if (err == CL_SUCCESS)
+		out = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+				     items * sizeof(cl_float), NULL, &err);
+	if (err == CL_SUCCESS)
+		prog = clCreateProgramWithSource(context, 1, &src, NULL, &err);
+	if (err == CL_SUCCESS)
+		err = clBuildProgram(prog, 1, &dev.deviceID, "", NULL, NULL);
+	if (err == CL_SUCCESS)
+		kernel = clCreateKernel(prog, "Probe", &err);
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 0, sizeof(out), &out);
+
+	/*
+	 * The first launch pays for the compilation of the kernel and the
+	 * warm-up of the queue and device, so it is run once untimed.
+	 */
+	PerfTimer timer;
+	double time = 0;
+	cl_uint iters = 16;
+	if (err == CL_SUCCESS)
+		err = clSetKernelArg(kernel, 1, sizeof(iters), &iters);
+	if (err == CL_SUCCESS)
+		err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &items,
+					     NULL, 0, NULL, NULL);
+	if (err == CL_SUCCESS)
+		err = clFinish(queue);
+	while (err == CL_SUCCESS) {
+		err = clSetKernelArg(kernel, 1, sizeof(iters), &iters);
+		timer.start();
+		if (err == CL_SUCCESS)
+			err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+						     &items, NULL, 0, NULL,
+						     NULL);
+		if (err == CL_SUCCESS)
+			err = clFinish(queue);
+		time = timer.tick();
+		if (time >= CL_PROBE_MIN_TIME || iters >= CL_PROBE_MAX_ITERS)
+			break;
+		iters *= 2;
+	}
+	if (err == CL_SUCCESS && time > 0)
+		dev.probeRate =
+			(double)items * iters * CL_PROBE_FLOP / time / 1E9;
+
+	if (kernel)
+		clReleaseKernel(kernel);
+	if (prog)
+		clReleaseProgram(prog);
+	if (out)
+		clReleaseMemObject(out);
+	if (queue)
+		clReleaseCommandQueue(queue);
+	clReleaseContext(context);
+	return dev.probeRate;
+}
+
+double ClManager::EstimatePeak(const clDeviceProp &dev)
+{
+	// A multiply-add per lane and cycle
+	double lanes = dev.preferredVectorWidth_float;
+	if (dev.type & CL_DEVICE_TYPE_GPU)
+		lanes = CL_GPU_LANES_PER_UNIT;
+	if (lanes < 1)
+		lanes = 1;
+	return 2 * lanes * dev.maxComputeUnits * dev.maxClockFrequency / 1E3;
+}
+
+/*
+ * Whether 'a' and 'b', from different platforms, are the same hardware. The
+ * PCI location settles it when both runtimes report one.
+ */
+static bool SameDevice(const ClManager::clDeviceProp &a,
+		       const ClManager::clDeviceProp &b)
+{
+	if (a.hasPciLocation && b.hasPciLocation)
+		return !memcmp(a.pciLocation, b.pciLocation,
+			       sizeof(a.pciLocation));
+	return a.vendorID == b.vendorID && a.type == b.type &&
+	       !strcmp(a.name, b.name);
+}
+
+/// Orders devices from the best score to the worst
+static bool BetterScore(const ClManager::RankedDevice &a,
+			const ClManager::RankedDevice &b)
+{
+	return a.score > b.score;
+}
+
+vector<ClManager::RankedDevice>
+ClManager::SelectDevices(const SelectionPolicy &policy, std::ostream &out)
+{
+	if (!deviceScanComplete)
+		ScanDevices();
+
+	const bool probe = policy.propertyWeight < 1;
+	vector<RankedDevice> ranked;
+	double bestProbe = 0, bestPeak = 0;
+	for (const clPlatformProp *platform : *platforms) {
+		std::string name(platform->name);
+		if (name.find(policy.platformName) == std::string::npos)
+			continue;
+		for (clDeviceProp *dev : platform->devices) {
+			if (probe && ProbeDevice(*dev) <= 0) {
+				out << " " << dev->name << " (" << platform->name
+				    << ") cannot run the probe; skipping"
+				    << endl;
+				continue;
+			}
+			const RankedDevice entry = { dev, platform, 0 };
+			ranked.push_back(entry);
+			bestProbe = std::max(bestProbe, dev->probeRate);
+			bestPeak = std::max(bestPeak, EstimatePeak(*dev));
+		}
+	}
+
+	const double weight = probe ? policy.propertyWeight : 1;
+	for (size_t i = 0; i < ranked.size(); i++) {
+		const clDeviceProp &dev = *ranked[i].device;
+		double score = 0;
+		if (weight < 1)
+			score += (1 - weight) * dev.probeRate / bestProbe;
+		if (weight > 0 && bestPeak > 0)
+			score += weight * EstimatePeak(dev) / bestPeak;
+		ranked[i].score = score;
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), BetterScore);
+	const double best = ranked.empty() ? 0 : ranked[0].score;
+
+	out << " Device ranking:" << endl;
+	vector<RankedDevice> selected;
+	for (size_t i = 0; i < ranked.size(); i++) {
+		RankedDevice entry = ranked[i];
+		entry.score = (best > 0) ? entry.score / best : 0;
+		out << "  " << entry.score << "  " << entry.device->name << " ("
+		    << entry.platform->name << ")";
+		if (probe)
+			out << ", " << entry.device->probeRate << " GFLOP/s";
+
+		/*
+		 * The same device from a better runtime is already selected.
+		 * Identical devices on the same platform are distinct boards,
+		 * and are all kept.
+		 */
+		bool duplicate = false;
+		for (size_t j = 0; j < i; j++) {
+			if (ranked[j].platform != entry.platform)
+				duplicate |= SameDevice(*ranked[j].device,
+							*entry.device);
+		}
+		if (duplicate)
+			out << "; same device on a better runtime, skipping";
+		else if (entry.score < policy.minScore)
+			out << "; too slow, skipping";
+		else if (policy.maxDevices &&
+			 selected.size() >= policy.maxDevices)
+			out << "; device limit reached, skipping";
+		else
+			selected.push_back(entry);
+		out << endl;
+	}
+	return selected;
+}
@@ -21,6 +21,7 @@
 #define CL_TARGET_OPENCL_VERSION 110
 #include <CL/cl.h>
 #include <iostream>
+#include <string>
 #include <vector>
 
 /**=============================================================================
@@ -82,7 +83,7 @@ public:
 		/** \brief CL_DEVICE_EXECUTION_CAPABILITIES*/
 		cl_device_exec_capabilities execCapabilities;
 		/** \brief CL_DEVICE_EXTENSIONS */
-		char extensions[1024];
+		std::string extensions;
 
 		/** \brief CL_DEVICE_GLOBAL_MEM_CACHE_SIZE*/
 		cl_ulong globalMemCacheSize;
@@ -207,6 +208,22 @@ public:
 		/** \brief CL_DRIVER_VERSION */
 		char driverVersion[256];
 
+		/**
+		 * \brief Throughput on the probe kernel, in GFLOP/s
+		 *
+		 * 0 if the device cannot run the probe, negative until it is
+		 * probed. See ClManager::ProbeDevice()
+		 */
+		double probeRate;
+
+		/// Whether pciLocation is known
+		bool hasPciLocation;
+		/// PCI domain, bus, device and function, from whichever
+		/// extension of cl_khr_pci_bus_info,
+		/// cl_nv_device_attribute_query and
+		/// cl_amd_device_attribute_query the runtime offers
+		cl_uint pciLocation[4];
+
 		/// Fills the properties with those of the chosen 'deviceID'
 		void SetDeviceID(cl_device_id deviceID);
 	};
@@ -238,7 +255,7 @@ public:
 		char vendor[256];
 
 		/** \brief CL_PLATFORM_EXTENSIONS */
-		char extensions[1024];
+		std::string extensions;
 
 		/** \brief List of all devices in the platform */
 		vector<clDeviceProp *> devices;
@@ -255,6 +272,56 @@ public:
 
 	size_t GetNumDevices();
 
+	/// How SelectDevices() picks the devices of a run
+	struct SelectionPolicy {
+		/// Only platforms whose name contains this; empty for all
+		std::string platformName;
+		/// Most devices to select; 0 for no limit
+		size_t maxDevices;
+		/// Devices scoring below this fraction of the best one are left
+		/// out
+		double minScore;
+		/**
+		 * Weight of the device properties in the score, from 0 to 1.
+		 * The probe throughput makes up the rest; at 1, devices are not
+		 * probed at all.
+		 */
+		double propertyWeight;
+	};
+
+	/// A device picked by SelectDevices()
+	struct RankedDevice {
+		clDeviceProp *device;
+		const clPlatformProp *platform;
+		/// Score relative to the best device; the best one scores 1
+		double score;
+	};
+
+	/**
+	 * \brief Ranks the devices of all matching platforms
+	 *
+	 * Runtimes exposing the same device compete with each other, and only
+	 * the best scoring one is kept. Devices are told apart by their PCI
+	 * location where the runtimes report it, and by their vendor, type and
+	 * name otherwise; identical devices of one platform are all kept. The
+	 * ranking is written to 'out'.
+	 * @return The selected devices, best first
+	 */
+	vector<RankedDevice> SelectDevices(const SelectionPolicy &policy,
+					   std::ostream &out = std::cout);
+
+	/**
+	 * \brief Measures the throughput of a device on a short probe kernel
+	 *
+	 * The probe is lengthened until it runs long enough to be timed
+	 * reliably. Devices are only probed once.
+	 * @return The throughput in GFLOP/s, or 0 if the probe cannot run
+	 */
+	static double ProbeDevice(clDeviceProp &dev);
+
+	/// Peak throughput guessed from the properties of 'dev', in GFLOP/s
+	static double EstimatePeak(const clDeviceProp &dev);
+
 private:
 	//------------------------Global Context tracking---------------------//
 	/** List of all platforms found on the machine
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "CL_Program_Cache.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <direct.h>
+#include <process.h>
+#define mkdir(path, mode) _mkdir(path)
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+
+/// Identifies cache files, and their layout version
+static const char cacheMagic[8] = { 'E', 'M', 'C', 'L', 'B', 'I', 'N', '1' };
+
+/// 64-bit FNV-1a hash of 'len' bytes, continuing from 'hash'
+static unsigned long long HashBytes(unsigned long long hash, const void *data,
+				    size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/// Hashes a string, including its terminator, so that "ab"+"c" != "a"+"bc"
+static unsigned long long HashString(unsigned long long hash, const char *str)
+{
+	return HashBytes(hash, str, strlen(str) + 1);
+}
+
+bool OpenCL::MakeDirs(const string &path)
+{
+	for (size_t pos = 1; pos <= path.size(); pos++) {
+		if (pos != path.size() && path[pos] != '/' && path[pos] != '\\')
+			continue;
+		const string dir = path.substr(0, pos);
+		struct stat info;
+		if (stat(dir.c_str(), &info) == 0)
+			continue;
+		if (mkdir(dir.c_str(), 0755) != 0)
+			return false;
+	}
+	return true;
+}
+
+string OpenCL::GetProgramCacheDir()
+{
+	const char *dir = getenv("ELECTROMAG_CACHE_DIR");
+	if (dir)
+		return string(dir);
+
+	if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+		return string(dir) + "/electromag";
+	if ((dir = getenv("HOME")) && *dir)
+		return string(dir) + "/.cache/electromag";
+	if ((dir = getenv("LOCALAPPDATA")) && *dir)
+		return string(dir) + "/electromag";
+	return string();
+}
+
+/// Reads the binary cached under 'hash' from 'fileName'
+static bool LoadBinary(const string &fileName, unsigned long long hash,
+		       vector<unsigned char> *binary)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+		return false;
+
+	char magic[sizeof(cacheMagic)];
+	unsigned long long storedHash, size;
+	bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+		  !memcmp(magic, cacheMagic, sizeof(magic)) &&
+		  fread(&storedHash, sizeof(storedHash), 1, file) == 1 &&
+		  storedHash == hash &&
+		  fread(&size, sizeof(size), 1, file) == 1 && size > 0 &&
+		  size < (1ULL << 31);
+	if (ok) {
+		binary->resize((size_t)size);
+		ok = fread(&(*binary)[0], 1, binary->size(), file) ==
+		     binary->size();
+		// Trailing garbage means the entry is not what we wrote
+		ok = ok && fgetc(file) == EOF;
+	}
+	fclose(file);
+	return ok;
+}
+
+/// Stores 'binary' under 'hash', replacing 'fileName' atomically
+static void SaveBinary(const string &dir, const string &fileName,
+		       unsigned long long hash,
+		       const vector<unsigned char> &binary)
+{
+	if (!OpenCL::MakeDirs(dir))
+		return;
+
+	// Concurrent runs each write their own file, then swap it in
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	const string tmpName = fileName + suffix;
+	FILE *file = fopen(tmpName.c_str(), "wb");
+	if (!file)
+		return;
+
+	unsigned long long size = binary.size();
+	bool ok = fwrite(cacheMagic, sizeof(cacheMagic), 1, file) == 1 &&
+		  fwrite(&hash, sizeof(hash), 1, file) == 1 &&
+		  fwrite(&size, sizeof(size), 1, file) == 1 &&
+		  fwrite(&binary[0], 1, binary.size(), file) == binary.size();
+	ok = (fclose(file) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+	// rename() does not replace existing files on windows
+	remove(fileName.c_str());
+#endif
+	if (!ok || rename(tmpName.c_str(), fileName.c_str()) != 0)
+		remove(tmpName.c_str());
+}
+
+/// Retrieves the binary of a program built for a single device
+static bool GetProgramBinary(cl_program prog, vector<unsigned char> *binary)
+{
+	size_t size = 0;
+	cl_int err = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES,
+				      sizeof(size), &size, NULL);
+	if (err != CL_SUCCESS || !size)
+		return false;
+
+	binary->resize(size);
+	unsigned char *ptr = &(*binary)[0];
+	err = clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(ptr), &ptr,
+			       NULL);
+	return err == CL_SUCCESS;
+}
+
+cl_program OpenCL::BuildProgramCached(cl_context context,
+				      const ClManager::clDeviceProp &device,
+				      cl_uint nSources, const char **sources,
+				      const char *options, bool *fromCache,
+				      cl_int *err)
+{
+	*fromCache = false;
+
+	// Anything that could change the generated code goes in the key
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	hash = HashString(hash, device.name);
+	hash = HashString(hash, device.deviceVersion);
+	hash = HashString(hash, device.driverVersion);
+	hash = HashString(hash, options ? options : "");
+	for (cl_uint i = 0; i < nSources; i++)
+		hash = HashString(hash, sources[i]);
+
+	const string dir = GetProgramCacheDir();
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.clbin", hash);
+	const string fileName = dir + name;
+
+	vector<unsigned char> binary;
+	if (!dir.empty() && LoadBinary(fileName, hash, &binary)) {
+		const size_t size = binary.size();
+		const unsigned char *ptr = &binary[0];
+		cl_int status = CL_INVALID_BINARY;
+		cl_program prog = clCreateProgramWithBinary(
+			context, 1, &device.deviceID, &size, &ptr, &status,
+			err);
+		if (*err == CL_SUCCESS && status == CL_SUCCESS)
+			*err = clBuildProgram(prog, 1, &device.deviceID,
+					      options, NULL, NULL);
+		if (*err == CL_SUCCESS && status == CL_SUCCESS) {
+			*fromCache = true;
+			return prog;
+		}
+		// Stale or corrupt entry; rebuild from source and replace it
+		if (prog)
+			clReleaseProgram(prog);
+		remove(fileName.c_str());
+	}
+
+	cl_program prog = clCreateProgramWithSource(context, nSources, sources,
+						    NULL, err);
+	if (*err != CL_SUCCESS)
+		return NULL;
+	*err = clBuildProgram(prog, 1, &device.deviceID, options, NULL, NULL);
+	if (*err != CL_SUCCESS)
+		return prog;
+
+	if (!dir.empty() && GetProgramBinary(prog, &binary))
+		SaveBinary(dir, fileName, hash, binary);
+	return prog;
+}
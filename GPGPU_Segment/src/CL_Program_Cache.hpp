@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CL_PROGRAM_CACHE_HPP
+#define _CL_PROGRAM_CACHE_HPP
+
+#include "CL_Manager.hpp"
+#include <string>
+
+namespace OpenCL
+{
+/**=============================================================================
+ * \brief Builds a program, reusing the device binary of an identical build
+ *
+ * Binaries are kept on disk, keyed by a hash of the device name, device and
+ * driver versions, build options, and every source string; the generated
+ * #define block is simply the first source string. Any mismatch, unreadable
+ * or truncated cache entry, or binary the driver refuses falls back to a
+ * source build, whose binary then replaces the cache entry.
+ *
+ * The cache lives in $ELECTROMAG_CACHE_DIR, or in electromag/ under
+ * $XDG_CACHE_HOME or $HOME/.cache. Setting ELECTROMAG_CACHE_DIR to an empty
+ * string disables the cache.
+ *
+ * @param fromCache [out] Set to true if the program came from the cache
+ * @param err [out] Error code of the last OpenCL call
+ * @return The program, or NULL if none could be created. A program that
+ * failed to build is still returned, so that its build log can be queried;
+ * check 'err' for the outcome.
+ * ===========================================================================*/
+cl_program BuildProgramCached(cl_context context,
+			      const ClManager::clDeviceProp &device,
+			      cl_uint nSources, const char **sources,
+			      const char *options, bool *fromCache,
+			      cl_int *err);
+
+/// Directory holding cached binaries; empty if caching is disabled
+std::string GetProgramCacheDir();
+
+/// Creates 'path' and any missing parents
+bool MakeDirs(const std::string &path);
+
+} // namespace OpenCL
+
+#endif //_CL_PROGRAM_CACHE_HPP
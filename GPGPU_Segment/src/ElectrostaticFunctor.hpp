@@ -48,7 +48,46 @@ public:
         /// Regions of higher curvature will have shorter vectors
         bool useCurvature;
     };
+
+    /// Reports progress and throughput while the functor runs
+    unsigned long AuxFunctor()
+    {
+        return this->MonitorDevices(&m_pPerfData->progress);
+    }
+
+    /*
+     * A work unit is one field line. Its cost scales with the number of
+     * steps and charges, so that rates measured on one dataset carry over to
+     * another.
+     */
+    size_t GetWorkUnits()
+    {
+        return m_nLines;
+    }
+    double GetUnitCost()
+    {
+        return (double)(GetSteps() - 1) * m_pPointChargeData->GetSize();
+    }
+    double GetUnitFLOP()
+    {
+        return (double)(GetSteps() - 1) *
+            (m_pPointChargeData->GetSize() * (electroPartFieldFLOP + 3) + 13);
+    }
+
 protected:
+    /// Number of points on each field line, including the starting point
+    size_t GetSteps()
+    {
+        return m_pFieldLinesData->GetSize() / m_nLines;
+    }
+
+    /// Sets the overall performance for the bound dataset computed in 'time'
+    void SetPerformance(double time)
+    {
+        m_pPerfData->time = time;
+        m_pPerfData->performance = m_nLines * GetUnitFLOP() / time / 1E9;
+    }
+
     /** Number of devices compatible with functor requirements
      * This will also equal the number of functors */
     size_t m_nDevices;
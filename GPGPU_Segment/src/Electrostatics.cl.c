@@ -109,6 +109,14 @@ inline Vector3 PartField(pointCharge charge, Vector3 point)
                    / (sqrt(lenSq) * lenSq) );    // 4 FLOP (1 sqrt + 3 mul,div)
 }
 
+// KERNEL_UNROLL is defined externally; 0 unrolls the charge loops completely
+#ifndef KERNEL_UNROLL
+#define KERNEL_UNROLL 0
+#endif
+// The factor must be expanded before it reaches the pragma
+#define PRAGMA(x) _Pragma(#x)
+#define PRAGMA_UNROLL(n) PRAGMA(unroll n)
+
 // BLOCK_X_MT and BLOCK_Y_MT defined externally
 #define BLOCK_DIM_MT (BLOCK_X_MT * BLOCK_Y_MT)
 
@@ -129,22 +137,25 @@ typedef union kernelData_u
 
 }kernelData;
 
-// Computes the step lenght based on curvature
-// Stores field vector information in the first step
+// Same steps as CalcField_curvature, but the BLOCK_Y_MT work items of each
+// column split the charges among themselves, and sum their partial fields in
+// local memory. This keeps the device busy when there are few lines.
 __kernel void CalcField_MT_curvature(
     __global Tvec *x,
     __global Tvec *y,
     __global Tvec *z,               ///<[in,out] Pointer to z components
     ///[in] Pointer to the array of structures of point charges
-    __global pointCharge *Charges,
-    ///[in] Row pitch in bytes for the xy components
+    __global Tprec *Charges,
+    ///[in] Row pitch in elements for the xyz components
     const unsigned int linePitch,
     ///[in] Number of point charges
     const unsigned int p,
     ///[in] The index of the row that needs to be calcculated
-    const unsigned int fieldIndex,
+    const unsigned int fIndex,
     ///[in] The resolution to apply to the inndividual field vectors
-    const Tprec resolution
+    const Tprec resolution,
+    ///[in] Number of rows to calculate, starting with fIndex
+    const unsigned int nSteps
 )
 {
     unsigned int tx = get_local_id(0);
@@ -153,30 +164,24 @@ __kernel void CalcField_MT_curvature(
     
     // Using a unoin between all needed data types allows massive smem economy
     __local kernelData kData;
-
-    // base pointers that point to the operational row
-    unsigned int base = (fieldIndex - 1) * linePitch;
+    unsigned int fieldIndex = fIndex;
 
     // previous point ,used to calculate current point, and cumulative field
     // vector
-    Vector3 point, temp, prevVec;
+    Vector3 point, temp;
 
     if (!ty)
     {
         // Load starting point
-        unsigned int i = base + ti;
+        unsigned int i = (linePitch * (fieldIndex - 1))/vecSize + ti;
         point.x = x[i];
         point.y = y[i];
         point.z = z[i];
         // Place the point in shared memory for other threads to access
         kData.smPoint[tx] = point;
-        // Read the previous field vector
-        prevVec.x = x[ti];
-        prevVec.y = y[ti];
-        prevVec.z = z[ti];
     }
 
-    for (unsigned int bigStep = 0; bigStep < 2500; bigStep ++)
+    for (unsigned int bigStep = 0; bigStep < nSteps; bigStep ++)
     {
         // Number of iterations of main loop
         // Recalculating the number of steps here, allows a while loop to be
@@ -203,9 +208,12 @@ __kernel void CalcField_MT_curvature(
             steps--;
             // Load point charges from global memory
             // The unused charges must be padded until the next multiple of
-            // BLOCK_X
-            kData.charge[ty][tx] =
-                Charges[steps * BLOCK_DIM_MT + ty * BLOCK_X_MT + tx];
+            // BLOCK_DIM_MT
+            unsigned int ci = (steps * BLOCK_DIM_MT + ty * BLOCK_X_MT + tx)*4;
+            kData.charge[ty][tx].position.x = (Tvec)Charges[ci];
+            kData.charge[ty][tx].position.y = (Tvec)Charges[ci + 1];
+            kData.charge[ty][tx].position.z = (Tvec)Charges[ci + 2];
+            kData.charge[ty][tx].magnitude = (Tvec)Charges[ci + 3];
 
             // Wait for all loads to complete
             barrier(CLK_LOCAL_MEM_FENCE);
@@ -214,7 +222,11 @@ __kernel void CalcField_MT_curvature(
             // compared to when doing a partial unroll
             // While performance-wise there is no benefit in a complete unroll,
             // the saved register will enable a higher warp occupancy
+#if KERNEL_UNROLL
+            PRAGMA_UNROLL(KERNEL_UNROLL)
+#else
 #pragma unroll
+#endif
             for (unsigned int i = 0; i < BLOCK_X_MT; i++)
             {
                 temp = vec3Add( temp, PartField(kData.charge[ty][i], point) );
@@ -239,40 +251,19 @@ __kernel void CalcField_MT_curvature(
             {
                 temp = vec3Add(temp, kData.smTemp[tx][i] );
             }
-            // Calculate curvature
-            Tvec k = vec3LenSq(temp);//5 FLOPs
-            k = vec3Len( vec3Cross(vec3Sub(temp, prevVec), prevVec) )
-                    /(k*sqrt(k));
             // Finally, add the unit vector of the field divided by the
-            // resolution to the previous point to get the next point.
-            // We increment the curvature by one to prevent a zero curvature
-            // from generating #NaN or #Inf, though any positive constant should
-            // work
-            point = vec3Add(temp, vec3SetInvLen(temp, (k+1)*resolution));
-            // Since we need to write the results, we can increment the row in
-            // the base pointers now
-            base += linePitch;
-            unsigned int i = base + ti;
-            // The results must be written back as interleaved xy and separate z
-            // coordinates
+            // resolution to the previous point to get the next point
+            point = vec3Add(point, vec3SetInvLen(temp, (Tvec)resolution));
+            unsigned int i = (linePitch * fieldIndex)/vecSize + ti;
             x[i] = point.x;
             y[i] = point.y;
             z[i] = point.z;
-            kData.smPoint[tx] = point;
-
-            prevVec = temp;
-            // 45 total FLOPs in this step
         }
-    }
-    if (!ty)
-    {
-        // Finally, store the field vector globally
-        // Row 0 will not be overwritten, so it can be used as a buffer to store
-        // the unnormalized field vector. The unnormalized field vector is
-        // needed for curvature computation
-        x[ti] = temp.x;
-        y[ti] = temp.y;
-        z[ti] = temp.z;
+        // smPoint shares memory with the partials other columns still read
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (!ty)
+            kData.smPoint[tx] = point;
+        fieldIndex ++;
     }
 }//*/
 
@@ -292,7 +283,9 @@ __kernel void CalcField_curvature(
     ///[in] The index of the row that needs to be calcculated
     const unsigned int fIndex,
     ///[in] The resolution to apply to the inndividual field vectors
-    const Tprec resolution
+    const Tprec resolution,
+    ///[in] Number of rows to calculate, starting with fIndex
+    const unsigned int nSteps
     ///
     // const unsigned int biggies,
     ///
@@ -316,7 +309,7 @@ __kernel void CalcField_curvature(
     point.y = y[(linePitch * (fieldIndex - 1))/vecSize + ti];
     point.z = z[(linePitch * (fieldIndex - 1))/vecSize + ti];
 
-    for (unsigned int bigStep = 0; bigStep < KERNEL_STEPS - 1; bigStep ++)
+    for (unsigned int bigStep = 0; bigStep < nSteps; bigStep ++)
     {
         // Recalculating the number of steps here, allows a while loop to be
         // used rather than a for loop
@@ -346,7 +339,11 @@ __kernel void CalcField_curvature(
             // While performance-wise there is no benefit in a complete unroll,
             // the saved register will enable
             // a higher warp occupancy
+#if KERNEL_UNROLL
+            PRAGMA_UNROLL(KERNEL_UNROLL)
+#else
 #pragma unroll
+#endif
             for (unsigned int i = 0; i < BLOCK_X; i++)
             {
                 temp = vec3Add(temp, PartField(smCharge[i], point));
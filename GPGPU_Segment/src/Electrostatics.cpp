@@ -16,28 +16,100 @@
  *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "CL_Electrostatics.hpp"
+#include "Functor_Group.hpp"
 #include <iostream>
 
 using electro::pointCharge;
 using std::cout;
 using std::endl;
 
-void TestCL(Vector3<Array<float> > &fieldLines,
-	    Array<pointCharge<float> > &pointCharges, size_t n,
-	    float resolution, perfPacket &perfData, bool useCurvature,
-	    const char *preferred_platform_name = "")
+/*
+ * If 'hostFunctor' is given, it runs alongside the OpenCL devices, and the
+ * lines are balanced between them. 'useCurvature' is then ignored, as it is by
+ * the OpenCL kernels. Telemetry goes to 'metrics', if given.
+ * A non-zero 'memBudget' limits the device memory, in bytes, used for field
+ * lines on each OpenCL device. Clearing 'zeroCopy' forces the field lines
+ * through device buffers, even on devices sharing host memory. 'tuneMode' is a
+ * CLElectrosFunctor::TuneMode: 0 only uses stored kernel configurations, 1
+ * also tunes devices without one, and 2 retunes every device.
+ * Returns false if no functor could take the lines, for example when double
+ * precision is requested and no device supports it; the lines are then left
+ * untouched, for the caller to compute on the CPU.
+ */
+template <class T>
+static bool RunCL(CLElectrosFunctor<T> &clFunctor,
+		  Vector3<Array<T> > &fieldLines,
+		  Array<pointCharge<T> > &pointCharges, size_t n, T resolution,
+		  perfPacket &perfData, bool useCurvature,
+		  const char *preferred_platform_name,
+		  ElectrostaticFunctor<T> *hostFunctor, MetricsSink *metrics,
+		  size_t memBudget, bool zeroCopy, int tuneMode)
 {
-	CLElectrosFunctor<float>::BindDataParams dataParams = {
+	/*
+	 * The OpenCL kernels do not apply the curvature correction. Lines go
+	 * to whichever member pulls them, so the host functor must step them
+	 * the same way, or the result would depend on the scheduling.
+	 */
+	if (hostFunctor)
+		useCurvature = false;
+	typename CLElectrosFunctor<T>::BindDataParams dataParams = {
 		&fieldLines, &pointCharges, n,
 		resolution,  perfData,	    useCurvature
 	};
 
 	if (preferred_platform_name)
-		CLtest.SetPreferredPlatform(preferred_platform_name);
+		clFunctor.SetPreferredPlatform(preferred_platform_name);
+	clFunctor.SetMemoryBudget(memBudget);
+	clFunctor.SetZeroCopy(zeroCopy);
+	clFunctor.SetTuneMode(
+		(typename CLElectrosFunctor<T>::TuneMode)tuneMode);
+
+	ElectrosFunctorGroup<T> group;
+	AbstractFunctor *functor = &clFunctor;
+	if (hostFunctor) {
+		group.AddFunctor(&clFunctor);
+		group.AddFunctor(hostFunctor);
+		functor = &group;
+	}
+	functor->ClearMetricsSinks();
+	if (metrics)
+		functor->AddMetricsSink(metrics);
 
 	cout << "TestCL: Binding data" << endl;
-	CLtest.BindData((void *)&dataParams);
+	functor->BindData((void *)&dataParams);
+	if (functor->Fail()) {
+		cout << "TestCL: No device can take the data" << endl;
+		return false;
+	}
 	cout << "TestCL: Starting run" << endl;
-	CLtest.Run();
+	functor->Run();
 	cout << "TestCL: done" << endl;
+	return true;
+}
+
+bool TestCL(Vector3<Array<float> > &fieldLines,
+	    Array<pointCharge<float> > &pointCharges, size_t n,
+	    float resolution, perfPacket &perfData, bool useCurvature,
+	    const char *preferred_platform_name = "",
+	    ElectrostaticFunctor<float> *hostFunctor = NULL,
+	    MetricsSink *metrics = NULL, size_t memBudget = 0,
+	    bool zeroCopy = true, int tuneMode = 0)
+{
+	return RunCL(CLtest, fieldLines, pointCharges, n, resolution, perfData,
+		     useCurvature, preferred_platform_name, hostFunctor,
+		     metrics, memBudget, zeroCopy, tuneMode);
+}
+
+/// Devices without cl_khr_fp64 or cl_amd_fp64 are skipped
+bool TestCL(Vector3<Array<double> > &fieldLines,
+	    Array<pointCharge<double> > &pointCharges, size_t n,
+	    double resolution, perfPacket &perfData, bool useCurvature,
+	    const char *preferred_platform_name = "",
+	    ElectrostaticFunctor<double> *hostFunctor = NULL,
+	    MetricsSink *metrics = NULL, size_t memBudget = 0,
+	    bool zeroCopy = true, int tuneMode = 0)
+{
+	return RunCL(CLtestDouble, fieldLines, pointCharges, n, resolution,
+		     perfData, useCurvature, preferred_platform_name,
+		     hostFunctor, metrics, memBudget, zeroCopy, tuneMode);
 }
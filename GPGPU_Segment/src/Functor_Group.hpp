@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FUNCTOR_GROUP_HPP
+#define _FUNCTOR_GROUP_HPP
+
+#include "ElectrostaticFunctor.hpp"
+#include <X-Compat/HPC Timing.h>
+#include <vector>
+
+/**=============================================================================
+ * \ingroup DEVICE_FUNCTORS
+ * @{
+ * ===========================================================================*/
+/**
+ * \brief Runs several electrostatics functors on the same dataset
+ *
+ * The devices of all member functors are presented as devices of the group,
+ * so that the dynamic scheduler in AbstractFunctor balances the lines across
+ * back ends; for example, the host CPU functor alongside OpenCL GPUs.
+ * Members must support dynamic scheduling. Members that fail to allocate
+ * their resources are left out of the run.
+ */
+template <class T> class ElectrosFunctorGroup : public ElectrostaticFunctor<T> {
+public:
+	ElectrosFunctorGroup() : m_lastOpErrCode(0)
+	{
+		this->m_nDevices = 0;
+		this->m_dataBound = false;
+		this->m_resourcesAllocated = false;
+	}
+
+	/// Adds 'functor' to the group; the group does not take ownership
+	void AddFunctor(ElectrostaticFunctor<T> *functor)
+	{
+		m_members.push_back(functor);
+	}
+
+	void BindData(void *dataParameters)
+	{
+		typename ElectrostaticFunctor<T>::BindDataParams *params =
+			(typename ElectrostaticFunctor<T>::BindDataParams *)
+				dataParameters;
+		m_lastOpErrCode = 1;
+		for (size_t i = 0; i < m_members.size(); i++) {
+			m_members[i]->BindData(dataParameters);
+			if (!m_members[i]->Fail())
+				m_lastOpErrCode = 0;
+		}
+		if (m_lastOpErrCode)
+			return;
+
+		this->m_pFieldLinesData = params->pFieldLineData;
+		this->m_pPointChargeData = params->pPointChargeData;
+		this->m_nLines = params->nLines;
+		this->m_resolution = params->resolution;
+		this->m_useCurvature = params->useCurvature;
+		this->m_pPerfData = &params->perfData;
+		this->m_dataBound = true;
+	}
+
+	void AllocateResources()
+	{
+		m_ready.clear();
+		for (size_t i = 0; i < m_members.size(); i++) {
+			m_members[i]->AllocateResources();
+			if (!m_members[i]->Fail())
+				m_ready.push_back(m_members[i]);
+		}
+		m_lastOpErrCode = m_ready.empty() ? 1 : 0;
+		this->m_resourcesAllocated = !m_ready.empty();
+	}
+
+	void ReleaseResources()
+	{
+		for (size_t i = 0; i < m_members.size(); i++)
+			m_members[i]->ReleaseResources();
+		m_ready.clear();
+		this->m_resourcesAllocated = false;
+	}
+
+	/// Maps every device of every ready member to a device of the group
+	void GenerateParameterList(size_t *nDevices)
+	{
+		m_devices.clear();
+		for (size_t i = 0; i < m_ready.size(); i++) {
+			size_t nMemberDevices;
+			m_ready[i]->GenerateParameterList(&nMemberDevices);
+			for (size_t j = 0; j < nMemberDevices; j++) {
+				DeviceMap map = { m_ready[i], j };
+				m_devices.push_back(map);
+			}
+		}
+		this->m_nDevices = *nDevices = m_devices.size();
+		// The scheduler starts right after this
+		m_timer.start();
+	}
+
+	/// Members only split their data among their own devices
+	unsigned long MainFunctor(size_t functorIndex, size_t deviceIndex)
+	{
+		return 1;
+	}
+
+	/**
+	 * \brief Collects the timing of all members
+	 *
+	 * The members process parts of the dataset concurrently, so the
+	 * performance is based on the wall time of the whole run.
+	 */
+	void PostRun()
+	{
+		const double time = m_timer.tick();
+		for (size_t i = 0; i < m_ready.size(); i++)
+			m_ready[i]->PostRun();
+
+		this->SetPerformance(time);
+	}
+
+	bool Fail()
+	{
+		return (m_lastOpErrCode != 0);
+	}
+
+	bool FailOnFunctor(size_t functorIndex)
+	{
+		if (functorIndex >= m_devices.size())
+			return true;
+		const DeviceMap &map = m_devices[functorIndex];
+		return map.member->FailOnFunctor(map.memberDevice);
+	}
+
+	/*---------------------Dynamic scheduling overriders--------------------
+	 * Forwarded to the member owning the device. Every member must be able
+	 * to split the dataset.
+	 */
+	size_t GetWorkUnits()
+	{
+		for (size_t i = 0; i < m_ready.size(); i++) {
+			if (m_ready[i]->GetWorkUnits() != this->m_nLines)
+				return 0;
+		}
+		return this->m_nLines;
+	}
+
+	size_t GetWorkGranularity(size_t deviceIndex)
+	{
+		const DeviceMap &map = m_devices[deviceIndex];
+		return map.member->GetWorkGranularity(map.memberDevice);
+	}
+
+	size_t GetMaxBlockUnits(size_t deviceIndex)
+	{
+		const DeviceMap &map = m_devices[deviceIndex];
+		return map.member->GetMaxBlockUnits(map.memberDevice);
+	}
+
+	std::string GetDeviceKey(size_t deviceIndex)
+	{
+		const DeviceMap &map = m_devices[deviceIndex];
+		return map.member->GetDeviceKey(map.memberDevice);
+	}
+
+	double GetDeviceScore(size_t deviceIndex)
+	{
+		const DeviceMap &map = m_devices[deviceIndex];
+		return map.member->GetDeviceScore(map.memberDevice);
+	}
+
+	unsigned long BlockFunctor(size_t deviceIndex, size_t start,
+				   size_t count)
+	{
+		const DeviceMap &map = m_devices[deviceIndex];
+		return map.member->BlockFunctor(map.memberDevice, start, count);
+	}
+
+private:
+	/// Error code of the last global operation; 0 signals success
+	int m_lastOpErrCode;
+	/// All functors in the group
+	std::vector<ElectrostaticFunctor<T> *> m_members;
+	/// Members that have resources allocated for the current run
+	std::vector<ElectrostaticFunctor<T> *> m_ready;
+
+	/// Owner of each device of the group
+	struct DeviceMap {
+		ElectrostaticFunctor<T> *member;
+		size_t memberDevice;
+	};
+	std::vector<DeviceMap> m_devices;
+	/// Measures the wall time of the run
+	PerfTimer m_timer;
+};
+///@}
+
+#endif //_FUNCTOR_GROUP_HPP
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Functor_Metrics.hpp"
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+/// Width of the console progress bar
+#define PROGRESS_BAR_DOTS 60
+
+JsonMetricsSink::JsonMetricsSink(const char *fileName)
+	: m_file(NULL), m_ownsFile(false), m_run(0), m_inRun(false)
+{
+	if (!strcmp(fileName, "-")) {
+		m_file = stdout;
+	} else {
+		m_file = fopen(fileName, "w");
+		m_ownsFile = true;
+	}
+}
+
+JsonMetricsSink::~JsonMetricsSink()
+{
+	if (m_file && m_ownsFile)
+		fclose(m_file);
+}
+
+/// Writes 'str' as a JSON string
+static void WriteJsonString(FILE *file, const std::string &str)
+{
+	fputc('"', file);
+	for (size_t i = 0; i < str.size(); i++) {
+		const unsigned char c = str[i];
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+/// Writes the member "name":value, or "name":null if 'value' is not finite,
+/// which JSON has no numbers for
+static void WriteJsonNumber(FILE *file, const char *name, const char *format,
+			    const double value)
+{
+	fprintf(file, ",\"%s\":", name);
+	if (std::isfinite(value))
+		fprintf(file, format, value);
+	else
+		fputs("null", file);
+}
+
+void JsonMetricsSink::Report(const MetricsSample &sample)
+{
+	if (!m_file)
+		return;
+	if (!m_inRun) {
+		m_run++;
+		m_inRun = true;
+	}
+
+	fprintf(m_file, "{\"run\":%u", m_run);
+	WriteJsonNumber(m_file, "t", "%.3f", sample.elapsed);
+	fprintf(m_file, ",\"final\":%s", sample.final ? "true" : "false");
+	WriteJsonNumber(m_file, "progress", "%.4f", sample.progress);
+	fprintf(m_file, ",\"lines\":%lu,\"total\":%lu",
+		(unsigned long)sample.unitsDone,
+		(unsigned long)sample.totalUnits);
+	WriteJsonNumber(m_file, "lines_per_s", "%.1f", sample.unitsPerSec);
+	WriteJsonNumber(m_file, "gflops", "%.3f", sample.gflops);
+	fprintf(m_file, ",\"devices\":[");
+	for (size_t i = 0; i < sample.devices.size(); i++) {
+		const DeviceMetrics &dev = sample.devices[i];
+		fprintf(m_file, "%s{\"name\":", i ? "," : "");
+		WriteJsonString(m_file, dev.name);
+		WriteJsonNumber(m_file, "score", "%.3f", dev.score);
+		fprintf(m_file, ",\"lines\":%lu,\"blocks\":%lu",
+			(unsigned long)dev.unitsDone,
+			(unsigned long)dev.blocksDone);
+		WriteJsonNumber(m_file, "lines_per_s", "%.1f", dev.unitsPerSec);
+		WriteJsonNumber(m_file, "gflops", "%.3f", dev.gflops);
+		fprintf(m_file, ",\"failed\":%s}",
+			dev.failed ? "true" : "false");
+	}
+	fprintf(m_file, "]}\n");
+	// Keep the file useful to anyone tailing it during the run
+	fflush(m_file);
+
+	if (sample.final)
+		m_inRun = false;
+}
+
+void ConsoleProgressSink::Report(const MetricsSample &sample)
+{
+	if (m_dots < 0) {
+		std::cout << "[";
+		for (int i = 0; i < PROGRESS_BAR_DOTS - 2; i++)
+			std::cout << "_";
+		std::cout << "]" << std::endl;
+		m_dots = 0;
+	}
+
+	const int dots = (int)(sample.progress * PROGRESS_BAR_DOTS);
+	for (; m_dots < dots && m_dots < PROGRESS_BAR_DOTS; m_dots++)
+		std::cout << ".";
+
+	if (sample.final) {
+		std::cout << " Done" << std::endl;
+		// Ready for the next run
+		m_dots = -1;
+	}
+	// Flush to make sure progress indicator is displayed immediately
+	std::cout.flush();
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FUNCTOR_METRICS_HPP
+#define _FUNCTOR_METRICS_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**=============================================================================
+ * \ingroup DEVICE_FUNCTORS
+ * @{
+ * ===========================================================================*/
+/// State of one device, as seen by the auxiliary functor
+struct DeviceMetrics {
+	/// Device key, as returned by AbstractFunctor::GetDeviceKey()
+	std::string name;
+	/// Score the device was selected with; 0 if devices are not ranked
+	double score;
+	/// Work units (field lines) completed so far
+	size_t unitsDone;
+	/// Blocks completed so far
+	size_t blocksDone;
+	/// Throughput over the last interval, or over the run in a final sample
+	double unitsPerSec;
+	/// Performance over the same period as unitsPerSec
+	double gflops;
+	/// The device has failed, and receives no more work
+	bool failed;
+};
+
+/// Periodic snapshot of a running functor
+struct MetricsSample {
+	/// Seconds since the start of the run
+	double elapsed;
+	/// Work units in the run; 0 if the functor does not report them
+	size_t totalUnits;
+	/// Work units completed on all devices
+	size_t unitsDone;
+	/// Fraction of the run completed
+	double progress;
+	/// Combined throughput of all devices
+	double unitsPerSec;
+	/// Combined performance of all devices
+	double gflops;
+	/// Last sample of the run
+	bool final;
+	std::vector<DeviceMetrics> devices;
+};
+
+/**
+ * \brief Receives telemetry from AbstractFunctor::Run()
+ *
+ * Samples are delivered from the auxiliary functor's thread, never from the
+ * device threads, so sinks may take their time.
+ */
+class MetricsSink {
+public:
+	virtual ~MetricsSink(){};
+	virtual void Report(const MetricsSample &sample) = 0;
+};
+
+/**
+ * \brief Writes every sample as one line of JSON
+ *
+ * Rates and times that are not finite, as after a run of no duration, are
+ * written as null.
+ */
+class JsonMetricsSink : public MetricsSink {
+public:
+	/// Writes to 'fileName', or to stdout if 'fileName' is "-"
+	explicit JsonMetricsSink(const char *fileName);
+	~JsonMetricsSink();
+
+	/// True if the output could not be opened
+	bool Fail() const
+	{
+		return !m_file;
+	}
+	void Report(const MetricsSample &sample);
+
+private:
+	JsonMetricsSink(const JsonMetricsSink &);
+	JsonMetricsSink &operator=(const JsonMetricsSink &);
+
+	FILE *m_file;
+	bool m_ownsFile;
+	/// Counts runs, so that samples of consecutive runs can be told apart
+	unsigned int m_run;
+	bool m_inRun;
+};
+
+/**
+ * \brief Draws a progress bar on the console
+ */
+class ConsoleProgressSink : public MetricsSink {
+public:
+	ConsoleProgressSink() : m_dots(-1){};
+	void Report(const MetricsSample &sample);
+
+private:
+	/// Dots drawn so far; -1 before the bar is started
+	int m_dots;
+};
+///@}
+
+#endif //_FUNCTOR_METRICS_HPP
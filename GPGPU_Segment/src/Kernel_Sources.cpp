@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Kernel_Sources.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using std::cout;
+using std::endl;
+
+bool OpenCL::GetKernelSource(const char *name, std::string *source)
+{
+	const char *dir = getenv("ELECTROMAG_KERNEL_DIR");
+	if (dir && *dir) {
+		const std::string path = std::string(dir) + "/" + name;
+		std::ifstream reader(path.c_str(), std::ifstream::in |
+							   std::ifstream::binary);
+		if (!reader.good()) {
+			cout << "Cannot open kernel source " << path << endl;
+			return false;
+		}
+		std::ostringstream contents;
+		contents << reader.rdbuf();
+		*source = contents.str();
+		cout << " Using kernel source " << path << endl;
+		return true;
+	}
+
+	for (const EmbeddedKernel *kern = embeddedKernels; kern->name; kern++) {
+		if (!strcmp(kern->name, name)) {
+			source->assign(kern->source, kern->length);
+			return true;
+		}
+	}
+	cout << "No embedded kernel named " << name << endl;
+	return false;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _KERNEL_SOURCES_HPP
+#define _KERNEL_SOURCES_HPP
+
+#include <cstddef>
+#include <string>
+
+namespace OpenCL
+{
+/// Kernel source compiled into the library
+struct EmbeddedKernel {
+	/// File name of the source, without directories
+	const char *name;
+	/// NUL-terminated source text
+	const char *source;
+	size_t length;
+};
+
+/**
+ * \brief Kernel sources embedded at build time
+ *
+ * Generated from every kernel listed in GPGPU_Segment/CMakeLists.txt;
+ * terminated by an entry with a NULL name.
+ */
+extern const EmbeddedKernel embeddedKernels[];
+
+/**=============================================================================
+ * \brief Retrieves the source of the kernel file 'name'
+ *
+ * If $ELECTROMAG_KERNEL_DIR is set, the source is read from that directory,
+ * so kernels can be edited without rebuilding the library. Otherwise, the
+ * copy embedded at build time is used.
+ *
+ * @return false if the kernel could not be found
+ * ===========================================================================*/
+bool GetKernelSource(const char *name, std::string *source);
+
+} // namespace OpenCL
+
+#endif //_KERNEL_SOURCES_HPP
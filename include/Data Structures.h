@@ -203,19 +203,35 @@ public:
     std::string message;
     /// If a data transfer is involved, this represents the bandwidth in MB/s
     double bandwidth;
+    /// Device timestamps in seconds, for steps profiled by the device: when
+    /// the command was queued, submitted, started and ended. All 0 for steps
+    /// timed on the host
+    double queued, submitted, started, ended;
+    /// Estimated fraction of the device a kernel can keep busy; 0 if unknown
+    double occupancy;
     
     TimingInfo(const char* msg, const double time) :
     time(time),
     message(msg),
-    bandwidth(0)
+    bandwidth(0),
+    queued(0), submitted(0), started(0), ended(0),
+    occupancy(0)
     {};
     
     TimingInfo(const char* msg, const double time, size_t dataSize) :
     time(time),
-    message(msg)
+    message(msg),
+    queued(0), submitted(0), started(0), ended(0),
+    occupancy(0)
     {
         bandwidth = (((double)dataSize)/time)/(1024*1024);
     };
+
+    /// Time from queuing to the start of execution; 0 if not profiled
+    double Latency() const
+    {
+        return started - queued;
+    }
 };
 
 class perfPacket
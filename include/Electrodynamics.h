@@ -33,7 +33,6 @@ struct dynamicPointCharge
 };
 
 // Same as above, but in structure of arrays format
-/*
 template <class T>
 struct dynamicPointChargeSOA
 {
@@ -42,7 +41,6 @@ struct dynamicPointChargeSOA
     T* mass;
     T* charge;
 };
-*/
 
 
 }//namespace electro
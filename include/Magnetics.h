@@ -22,7 +22,7 @@
 
 namespace magnetic
 {
-#define magneto_k 1E-7;     // miu_0 / (4 * pi)
+#define magneto_k 1E-7      // miu_0 / (4 * pi)
 
 /**
  * \brief Returns the partial magnetic field generated by a moving point charge
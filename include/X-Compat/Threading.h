@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2010 - Alexandru Gagniuc - <mr.nuke.me@gmail.com>
+ * This file is part of ElectroMag.
+ *
+ * ElectroMag is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElectroMag is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with ElectroMag.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _THREADING_H
+#define _THREADING_H
+
+#include <cstddef>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include<windows.h>
+#elif defined(__unix__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace Threads
+{
+
+#if defined(_WIN32) || defined(_WIN64)
+
+inline size_t GetNumberOfProcessors()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+/// Pins the calling thread to logical processor 'index'
+inline bool SetCurrentThreadAffinity(size_t index)
+{
+    DWORD_PTR mask = ((DWORD_PTR)1) << (index % (sizeof(mask) * 8));
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+/// Thread names are only a debugging aid; not supported here
+inline void SetCurrentThreadName(const char *name)
+{
+    (void)name;
+}
+
+#elif defined(__unix__)
+
+/// Returns the number of logical processors the process may run on
+inline size_t GetNumberOfProcessors()
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (!sched_getaffinity(0, sizeof(allowed), &allowed) && CPU_COUNT(&allowed))
+        return CPU_COUNT(&allowed);
+#endif
+    long nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCPU < 1)
+        return 1;
+    return (size_t)nCPU;
+}
+
+/**
+ * \brief Pins the calling thread to the 'index'th processor it may run on
+ *
+ * The index is taken relative to the affinity mask the process was started
+ * with, so that pinning plays nicely with taskset and batch schedulers.
+ */
+inline bool SetCurrentThreadAffinity(size_t index)
+{
+#if defined(__linux__)
+    cpu_set_t allowed, cpuSet;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return false;
+    size_t nAllowed = CPU_COUNT(&allowed);
+    if (!nAllowed)
+        return false;
+    index %= nAllowed;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        if (index--)
+            continue;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        return !pthread_setaffinity_np(pthread_self(), sizeof(cpuSet),
+                                       &cpuSet);
+    }
+    return false;
+#else
+    (void)index;
+    return false;
+#endif
+}
+
+/// Names the calling thread, as seen by debuggers and 'top -H'
+inline void SetCurrentThreadName(const char *name)
+{
+#if defined(__linux__)
+    // Linux limits thread names to 15 characters plus the terminator
+    char shortName[16];
+    size_t i;
+    for (i = 0; i < sizeof(shortName) - 1 && name[i]; i++)
+        shortName[i] = name[i];
+    shortName[i] = 0;
+    pthread_setname_np(pthread_self(), shortName);
+#else
+    (void)name;
+#endif
+}
+
+#else
+#error Compilation platform not found or not supported. \
+        Define _WIN32 or __unix__ to select a platform.
+#endif
+
+}//namespace Threads
+
+#endif//_THREADING_H